@@ -0,0 +1,641 @@
+#include "batch.h"
+#include "jsonparse.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Longest row a field makes: time, quoted name and unit, value */
+#define BATCH_ROW_LEN 256
+
+/* Rows of one metric, or of every metric in the CSV format */
+struct segment {
+	char name[32];
+	char unit[32];
+	char *buf;
+	size_t len;
+	size_t cap;
+};
+
+/* Output of one chunk, held until its turn to be written */
+struct slot {
+	bool done;
+	struct segment *segs;
+	int nsegs;
+	int cap;
+	unsigned long frames;
+	unsigned long failed;
+	unsigned long rows;
+	int error;		/* Chunk could not be parsed at all */
+};
+
+/* One file being converted, shared by the workers and the writer */
+struct job {
+	struct batch *b;
+	const char *base;
+	size_t size;
+	long nchunks;
+	long next;		/* Next chunk for a worker to take */
+	long written;		/* Chunks written out */
+	bool abort;		/* Output failed, skip the rest */
+	struct slot *slots;
+	int nslots;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *_workerMain(void *arg);
+static void _parseChunk(struct job *job, long k, struct slot *slot,
+			struct jp_ctx *ctx, char **line, size_t *linecap);
+static size_t _boundary(const struct job *job, size_t at);
+static int _addRow(struct batch *b, struct slot *slot,
+		   const struct datafield *df);
+static struct segment *_segment(struct slot *slot, const char *name,
+				const char *unit);
+static char *_putField(char *dst, const char *s, size_t len);
+static void _writeSlot(struct batch *b, struct slot *slot);
+static struct batch_column *_column(struct batch *b,
+				    const struct segment *seg);
+static void _fileName(char *dst, const char *name);
+static int _writeAll(int fd, const void *buf, size_t len);
+
+int batch_open(struct batch *b, const char *out, int threads,
+	       size_t chunk)
+{
+	static const char header[] = "timemillis,name,value,unit\n";
+	size_t len;
+	struct stat st;
+
+	assert(b);
+	assert(out);
+
+	memset(b, 0, sizeof(*b));
+	b->fd = -1;
+	b->chunk = chunk ? chunk : BATCH_CHUNK_LEN;
+	b->threads = threads > 0 ? threads :
+		(int) sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (b->threads < 1)
+		b->threads = 1;
+
+	if (b->threads > BATCH_MAX_THREADS)
+		b->threads = BATCH_MAX_THREADS;
+
+	len = strlen(out);
+
+	if ((len > 0 && out[len - 1] == '/') ||
+	    (stat(out, &st) == 0 && S_ISDIR(st.st_mode))) {
+		while (len > 1 && out[len - 1] == '/')
+			--len;
+
+		if (len >= sizeof(b->dir)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		memcpy(b->dir, out, len);
+		b->dir[len] = '\0';
+		b->format = BATCH_COLUMNS;
+
+		if (mkdir(b->dir, 0755) < 0 && errno != EEXIST)
+			return -1;
+
+		b->columns = (struct batch_column*)
+			calloc(BATCH_MAX_METRICS, sizeof(*b->columns));
+
+		if (!b->columns)
+			return -1;
+
+		return 0;
+	}
+
+	b->format = BATCH_CSV;
+	b->fd = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (b->fd < 0)
+		return -1;
+
+	if (_writeAll(b->fd, header, sizeof(header) - 1) < 0) {
+		int err = errno;
+
+		close(b->fd);
+		b->fd = -1;
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int batch_convert(struct batch *b, const char *path)
+{
+	struct job job;
+	pthread_t threads[BATCH_MAX_THREADS];
+	int nthreads = 0;
+	struct stat st;
+	void *map = NULL;
+	int fd;
+	int err = 0;
+
+	assert(b);
+	assert(path);
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	if (st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (map == MAP_FAILED) {
+			err = errno;
+			close(fd);
+			errno = err;
+			return -1;
+		}
+
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+	}
+
+	/* The mapping holds the file open */
+	close(fd);
+
+	memset(&job, 0, sizeof(job));
+	job.b = b;
+	job.base = (const char*) map;
+	job.size = st.st_size;
+	job.nchunks = (job.size + b->chunk - 1) / b->chunk;
+	job.nslots = b->threads * BATCH_AHEAD;
+	job.slots = (struct slot*) calloc(job.nslots, sizeof(*job.slots));
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+
+	if (!job.slots)
+		err = ENOMEM;
+
+	for (int i = 0; !err && i < b->threads && i < job.nchunks; ++i) {
+		if ((err = pthread_create(&threads[i], NULL, _workerMain,
+					  &job)) == 0)
+			++nthreads;
+	}
+
+	/* Too few workers is no reason to stop as long as there is one */
+	if (nthreads > 0)
+		err = 0;
+
+	/* Write the chunks out in order as the workers finish them */
+	for (long k = 0; !err && k < job.nchunks; ++k) {
+		struct slot *slot = &job.slots[k % job.nslots];
+
+		pthread_mutex_lock(&job.lock);
+
+		while (!slot->done)
+			pthread_cond_wait(&job.cond, &job.lock);
+
+		pthread_mutex_unlock(&job.lock);
+
+		if (!b->error)
+			_writeSlot(b, slot);
+
+		pthread_mutex_lock(&job.lock);
+		slot->done = false;
+		++job.written;
+		job.abort = b->error != 0;
+		pthread_cond_broadcast(&job.cond);
+		pthread_mutex_unlock(&job.lock);
+	}
+
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (int i = 0; job.slots && i < job.nslots; ++i) {
+		for (int j = 0; j < job.slots[i].cap; ++j) {
+			free(job.slots[i].segs[j].buf);
+		}
+
+		free(job.slots[i].segs);
+	}
+
+	free(job.slots);
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.cond);
+
+	if (map)
+		munmap(map, st.st_size);
+
+	if (!err)
+		err = b->error;
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int batch_close(struct batch *b)
+{
+	int err;
+
+	assert(b);
+
+	err = b->error;
+
+	if (b->fd >= 0 && close(b->fd) < 0 && !err)
+		err = errno;
+
+	b->fd = -1;
+
+	for (int i = 0; i < b->ncolumns; ++i) {
+		if (close(b->columns[i].fd) < 0 && !err)
+			err = errno;
+	}
+
+	free(b->columns);
+	b->columns = NULL;
+	b->ncolumns = 0;
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+**********************************************************************
+***************** LOCAL FUNCTION IMPLEMENTATION **********************
+**********************************************************************
+*/
+
+/* Take chunks in order, staying no more than a slot per chunk ahead of
+ * the writer */
+static void *_workerMain(void *arg)
+{
+	struct job *job = (struct job*) arg;
+	struct jp_ctx *ctx = jp_ctx_new();
+	char *line = NULL;
+	size_t linecap = 0;
+
+	pthread_mutex_lock(&job->lock);
+
+	for (;;) {
+		while (job->next < job->nchunks &&
+		       job->next >= job->written + job->nslots)
+			pthread_cond_wait(&job->cond, &job->lock);
+
+		if (job->next >= job->nchunks)
+			break;
+
+		long k = job->next++;
+		struct slot *slot = &job->slots[k % job->nslots];
+		bool skip = job->abort || !ctx;
+
+		pthread_mutex_unlock(&job->lock);
+
+		if (!skip) {
+			_parseChunk(job, k, slot, ctx, &line, &linecap);
+		} else {
+			slot->nsegs = 0;
+			slot->frames = slot->failed = slot->rows = 0;
+			slot->error = ctx ? 0 : ENOMEM;
+		}
+
+		pthread_mutex_lock(&job->lock);
+		slot->done = true;
+		pthread_cond_broadcast(&job->cond);
+	}
+
+	pthread_mutex_unlock(&job->lock);
+	jp_ctx_free(ctx);
+	free(line);
+
+	return NULL;
+}
+
+/* Parse every line of chunk k into the rows of its slot. Lines are
+ * copied out of the read-only mapping to be NUL-terminated. */
+static void _parseChunk(struct job *job, long k, struct slot *slot,
+			struct jp_ctx *ctx, char **line, size_t *linecap)
+{
+	size_t at = _boundary(job, (size_t) k * job->b->chunk);
+	size_t end = _boundary(job, (size_t) (k + 1) * job->b->chunk);
+
+	for (int i = 0; i < slot->nsegs; ++i) {
+		slot->segs[i].len = 0;
+	}
+
+	slot->nsegs = 0;
+	slot->frames = slot->failed = slot->rows = 0;
+	slot->error = 0;
+
+	while (at < end) {
+		const char *p = job->base + at;
+		const char *eol = (const char*) memchr(p, '\n', end - at);
+		size_t len = eol ? (size_t) (eol - p) : end - at;
+
+		at += len + 1;
+
+		while (len > 0 && (p[len - 1] == '\r' || p[len - 1] == ' ' ||
+				   p[len - 1] == '\t'))
+			--len;
+
+		if (len == 0)
+			continue;
+
+		if (len + 1 > *linecap) {
+			char *grown = (char*) realloc(*line, len + 1);
+
+			if (!grown) {
+				++slot->failed;
+				continue;
+			}
+
+			*line = grown;
+			*linecap = len + 1;
+		}
+
+		memcpy(*line, p, len);
+		(*line)[len] = '\0';
+
+		if (jp_parse(ctx, *line) < 0) {
+			++slot->failed;
+			jp_clear(ctx);
+			continue;
+		}
+
+		struct datafield **df = jp_dump(ctx);
+		size_t nsensors = jp_num_sensors(ctx);
+
+		for (size_t i = 0; i < nsensors; ++i) {
+			int nf = jp_num_fields(ctx, i);
+
+			for (int j = 0; j < nf; ++j) {
+				if (_addRow(job->b, slot, &df[i][j]) == 0)
+					++slot->rows;
+			}
+		}
+
+		++slot->frames;
+		jp_clear(ctx);
+	}
+}
+
+/* Start of the first line at or after a position. Both chunks next to a
+ * boundary find the same one on their own. */
+static size_t _boundary(const struct job *job, size_t at)
+{
+	const char *eol;
+
+	if (at == 0 || at >= job->size)
+		return at == 0 ? 0 : job->size;
+
+	eol = (const char*) memchr(job->base + at - 1, '\n',
+				   job->size - at + 1);
+
+	return eol ? (size_t) (eol - job->base) + 1 : job->size;
+}
+
+static int _addRow(struct batch *b, struct slot *slot,
+		   const struct datafield *df)
+{
+	struct segment *seg = _segment(slot, b->format == BATCH_CSV ? "" :
+				       df->name, df->unit);
+	char *p;
+
+	if (!seg)
+		return -1;
+
+	if (seg->cap - seg->len < BATCH_ROW_LEN) {
+		size_t cap = seg->cap ? seg->cap * 2 : 64 * 1024;
+		char *grown = (char*) realloc(seg->buf, cap);
+
+		if (!grown)
+			return -1;
+
+		seg->buf = grown;
+		seg->cap = cap;
+	}
+
+	p = seg->buf + seg->len;
+	p += sprintf(p, "%lld,", df->timemillis);
+
+	if (b->format == BATCH_CSV) {
+		p = _putField(p, df->name, sizeof(df->name));
+		*p++ = ',';
+	}
+
+	p += sprintf(p, "%.15g", df->value);
+
+	if (b->format == BATCH_CSV) {
+		*p++ = ',';
+		p = _putField(p, df->unit, sizeof(df->unit));
+	}
+
+	*p++ = '\n';
+	seg->len = p - seg->buf;
+
+	return 0;
+}
+
+/* Rows of a metric in the slot, added if new. Buffers of segments used
+ * for earlier chunks are kept for reuse. */
+static struct segment *_segment(struct slot *slot, const char *name,
+				const char *unit)
+{
+	struct segment *seg;
+
+	for (int i = slot->nsegs - 1; i >= 0; --i) {
+		if (strncmp(slot->segs[i].name, name,
+			    sizeof(seg->name)) == 0)
+			return &slot->segs[i];
+	}
+
+	if (slot->nsegs == slot->cap) {
+		int cap = slot->cap ? slot->cap * 2 : 8;
+		struct segment *grown = (struct segment*)
+			realloc(slot->segs, cap * sizeof(*grown));
+
+		if (!grown)
+			return NULL;
+
+		memset(grown + slot->cap, 0,
+		       (cap - slot->cap) * sizeof(*grown));
+		slot->segs = grown;
+		slot->cap = cap;
+	}
+
+	seg = &slot->segs[slot->nsegs++];
+	strncpy(seg->name, name, sizeof(seg->name) - 1);
+	seg->name[sizeof(seg->name) - 1] = '\0';
+	strncpy(seg->unit, unit, sizeof(seg->unit) - 1);
+	seg->unit[sizeof(seg->unit) - 1] = '\0';
+	seg->len = 0;
+
+	return seg;
+}
+
+/* Write a CSV field of up to len bytes, quoted if it has to be */
+static char *_putField(char *dst, const char *s, size_t len)
+{
+	size_t n = strnlen(s, len);
+
+	if (strcspn(s, ",\"\r\n") >= n) {
+		memcpy(dst, s, n);
+		return dst + n;
+	}
+
+	*dst++ = '"';
+
+	for (size_t i = 0; i < n; ++i) {
+		if (s[i] == '"')
+			*dst++ = '"';
+
+		*dst++ = s[i];
+	}
+
+	*dst++ = '"';
+
+	return dst;
+}
+
+static void _writeSlot(struct batch *b, struct slot *slot)
+{
+	b->error = slot->error;
+
+	for (int i = 0; i < slot->nsegs && !b->error; ++i) {
+		const struct segment *seg = &slot->segs[i];
+		int fd = b->fd;
+
+		if (b->format == BATCH_COLUMNS) {
+			struct batch_column *col = _column(b, seg);
+
+			if (!col) {
+				b->error = errno;
+				return;
+			}
+
+			fd = col->fd;
+		}
+
+		if (_writeAll(fd, seg->buf, seg->len) < 0)
+			b->error = errno;
+	}
+
+	b->frames += slot->frames;
+	b->failed += slot->failed;
+	b->rows += slot->rows;
+}
+
+/* File of a metric in the columnar format, created with its header the
+ * first time the metric comes up. Metrics whose names make the same
+ * file name are told apart by a ~<n> suffix, as tsstore_path() does,
+ * and by the name in their header. */
+static struct batch_column *_column(struct batch *b,
+				    const struct segment *seg)
+{
+	struct batch_column *col;
+	char path[sizeof(b->dir) + sizeof(seg->name) + 16];
+	char file[sizeof(seg->name)];
+	char other[sizeof(seg->name)];
+	char label[sizeof(seg->name) + sizeof(seg->unit) + 4];
+	char header[BATCH_ROW_LEN];
+	char *p = header;
+	int alt = 0;
+
+	for (int i = 0; i < b->ncolumns; ++i) {
+		if (strcmp(b->columns[i].name, seg->name) == 0)
+			return &b->columns[i];
+	}
+
+	if (b->ncolumns >= BATCH_MAX_METRICS) {
+		errno = EMFILE;
+		return NULL;
+	}
+
+	_fileName(file, seg->name);
+
+	for (int i = 0; i < b->ncolumns; ++i) {
+		_fileName(other, b->columns[i].name);
+		alt += strcmp(file, other) == 0;
+	}
+
+	if (alt > 0)
+		snprintf(path, sizeof(path), "%s/%s~%d.csv", b->dir, file, alt);
+	else
+		snprintf(path, sizeof(path), "%s/%s.csv", b->dir, file);
+
+	col = &b->columns[b->ncolumns];
+	col->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (col->fd < 0)
+		return NULL;
+
+	strcpy(col->name, seg->name);
+	++b->ncolumns;
+
+	if (seg->unit[0])
+		snprintf(label, sizeof(label), "%s (%s)", seg->name, seg->unit);
+	else
+		snprintf(label, sizeof(label), "%s", seg->name);
+
+	p += sprintf(p, "timemillis,");
+	p = _putField(p, label, sizeof(label));
+	*p++ = '\n';
+
+	if (_writeAll(col->fd, header, p - header) < 0)
+		return NULL;
+
+	return col;
+}
+
+/* Names come from the data, keep them to one file in dir */
+static void _fileName(char *dst, const char *name)
+{
+	for (const char *s = name; *s; ++s) {
+		bool plain = (*s >= 'a' && *s <= 'z') ||
+			(*s >= 'A' && *s <= 'Z') ||
+			(*s >= '0' && *s <= '9') || *s == '-' || *s == '_' ||
+			(*s == '.' && s != name);
+
+		*dst++ = plain ? *s : '_';
+	}
+
+	*dst = '\0';
+}
+
+static int _writeAll(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char*) buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
@@ -0,0 +1,130 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* #ifdef __cplusplus */
+
+/* Bytes of input each worker takes at a time. The chunk is extended to
+ * the end of its last line. */
+#ifndef BATCH_CHUNK_LEN
+#define BATCH_CHUNK_LEN (4 * 1024 * 1024)
+#endif /* #ifndef BATCH_CHUNK_LEN */
+
+/* Chunks parsed per worker ahead of the one being written, which
+ * bounds the memory held by output waiting its turn */
+#ifndef BATCH_AHEAD
+#define BATCH_AHEAD 2
+#endif /* #ifndef BATCH_AHEAD */
+
+#ifndef BATCH_MAX_THREADS
+#define BATCH_MAX_THREADS 64
+#endif /* #ifndef BATCH_MAX_THREADS */
+
+/* Metrics written to separate files in the columnar format */
+#ifndef BATCH_MAX_METRICS
+#define BATCH_MAX_METRICS 256
+#endif /* #ifndef BATCH_MAX_METRICS */
+
+	enum batch_format {
+		BATCH_CSV = 0,	/* One file of time,name,value,unit rows */
+		BATCH_COLUMNS	/* A directory of one time,value file per
+				 * metric */
+	};
+
+/** Output of one metric in the columnar format */
+	struct batch_column {
+		char name[32];
+		int fd;
+	};
+
+/** Conversion of newline-delimited JSON files into CSV
+ *
+ * Each input is mapped into memory and split into chunks at line
+ * boundaries. A pool of workers parses the chunks with a parser context
+ * each, as the display parses frames, and formats their rows. The
+ * calling thread writes the rows out in the order of the input, so the
+ * output is the same for any number of workers.
+ *
+ * @param format Layout of the output
+ *
+ * @param fd Output file in the CSV format, -1 otherwise
+ *
+ * @param dir Output directory in the columnar format
+ *
+ * @param threads Number of workers
+ *
+ * @param chunk Bytes of input per chunk
+ *
+ * @param columns Files opened so far in the columnar format, one per
+ * metric name
+ *
+ * @param ncolumns Number of @p columns
+ *
+ * @param frames Frames converted
+ *
+ * @param failed Lines that did not parse, left out of the output
+ *
+ * @param rows Rows written
+ *
+ * @param error errno of the first write that failed, 0 if none did
+ */
+	struct batch {
+		enum batch_format format;
+		int fd;
+		char dir[256];
+		int threads;
+		size_t chunk;
+		struct batch_column *columns;
+		int ncolumns;
+		unsigned long frames;
+		unsigned long failed;
+		unsigned long rows;
+		int error;
+	};
+
+/** Create the output
+ *
+ * A path that names a directory, or ends in '/', is written in the
+ * columnar format and created if need be. Its files are named after
+ * their metrics, characters that do not belong in a file name
+ * replaced. Metrics whose names come out alike get a ~<n> suffix, in
+ * the order they come up; the header of each file names its metric.
+ * Any other path is a CSV file, replaced if it exists.
+ *
+ * @param out Output path
+ *
+ * @param threads Number of workers, 0 for one per online processor
+ *
+ * @param chunk Bytes of input per chunk, 0 for BATCH_CHUNK_LEN
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+	int batch_open(struct batch *b, const char *out, int threads,
+		       size_t chunk);
+
+/** Convert one file, appending its rows to the output
+ *
+ * @param path File of newline-delimited JSON frames
+ *
+ * @return 0 on success, -1 if the file could not be read or the output
+ * not written, with errno set
+ */
+	int batch_convert(struct batch *b, const char *path);
+
+/** Close the output
+ *
+ * @p frames, @p failed and @p rows stay readable.
+ *
+ * @return 0 on success, -1 if a write failed, with errno set
+ */
+	int batch_close(struct batch *b);
+
+#ifdef __cplusplus
+}
+#endif /* #ifdef __cplusplus */
+
+#endif /* #ifndef BATCH_H */
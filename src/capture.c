@@ -0,0 +1,626 @@
+#include "capture.h"
+
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static int _prepare(int fd, uint32_t magic);
+static int _recover(struct capture *c);
+static void _release(struct capture *c);
+static void *_writerMain(void *arg);
+static int _writeBatch(struct capture *c, const struct capture_batch *b);
+static int _writeAll(int fd, const void *buf, size_t len);
+static ssize_t _readAt(int fd, void *buf, size_t len, uint64_t off);
+static int _readHeader(int fd, uint64_t off, struct capture_record *rec);
+static int64_t _now();
+
+int capture_open(struct capture *c, const char *path, unsigned every)
+{
+	size_t plen;
+	char *idxpath;
+	unsigned nidx;
+	int err;
+
+	assert(c);
+	assert(path);
+
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+	c->idxfd = -1;
+	c->every = every ? every : CAPTURE_DEFAULT_EVERY;
+	c->last = INT64_MIN;
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+
+	plen = strlen(path);
+	idxpath = (char*) malloc(plen + sizeof(".idx"));
+
+	if (!idxpath) {
+		_release(c);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memcpy(idxpath, path, plen);
+	memcpy(idxpath + plen, ".idx", sizeof(".idx"));
+
+	c->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	c->idxfd = c->fd < 0 ? -1 :
+		open(idxpath, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	err = errno;
+	free(idxpath);
+
+	if (c->fd < 0 || c->idxfd < 0) {
+		_release(c);
+		errno = err;
+		return -1;
+	}
+
+	if (_prepare(c->fd, CAPTURE_MAGIC) < 0 ||
+	    _prepare(c->idxfd, CAPTURE_INDEX_MAGIC) < 0 || _recover(c) < 0) {
+		err = errno;
+		_release(c);
+		errno = err;
+		return -1;
+	}
+
+	/* A batch of the shortest records needs the most entries */
+	nidx = CAPTURE_BATCH_LEN /
+		(sizeof(struct capture_record) * c->every) + 1;
+
+	for (int i = 0; i < 2; ++i) {
+		struct capture_batch *b = &c->batches[i];
+
+		b->buf = (char*) malloc(CAPTURE_BATCH_LEN);
+		b->idx = (struct capture_index*) calloc(nidx, sizeof(*b->idx));
+
+		if (!b->buf || !b->idx) {
+			_release(c);
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	if ((err = pthread_create(&c->thread, NULL, _writerMain, c)) != 0) {
+		_release(c);
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int capture_write(struct capture *c, int source, const char *frame,
+		  size_t len)
+{
+	assert(c);
+	assert(frame);
+
+	struct capture_record rec = {
+		.len = (uint32_t) len,
+		.source = (uint32_t) source,
+		.time = _now()
+	};
+	size_t size = sizeof(rec) + len;
+	struct capture_batch *b;
+	int err;
+
+	pthread_mutex_lock(&c->lock);
+	b = &c->batches[c->active];
+
+	/* Hand a full batch to the writer if it is free, and go on
+	 * filling the other one */
+	if (!c->error && b->len + size > CAPTURE_BATCH_LEN && !c->writing) {
+		c->writing = true;
+		c->active ^= 1;
+		b = &c->batches[c->active];
+		pthread_cond_signal(&c->cond);
+	}
+
+	if (c->error || b->len + size > CAPTURE_BATCH_LEN) {
+		err = c->error ? c->error : ENOBUFS;
+		++c->dropped;
+		pthread_mutex_unlock(&c->lock);
+		errno = err;
+		return -1;
+	}
+
+	if (c->frames % c->every == 0) {
+		c->last = rec.time > c->last ? rec.time : c->last;
+		b->idx[b->nidx].time = c->last;
+		b->idx[b->nidx].offset = c->offset;
+		++b->nidx;
+	}
+
+	memcpy(b->buf + b->len, &rec, sizeof(rec));
+	memcpy(b->buf + b->len + sizeof(rec), frame, len);
+	b->len += size;
+	c->offset += size;
+	++c->frames;
+
+	pthread_mutex_unlock(&c->lock);
+
+	return 0;
+}
+
+int capture_close(struct capture *c)
+{
+	assert(c);
+
+	int err;
+
+	pthread_mutex_lock(&c->lock);
+	c->stop = true;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+
+	pthread_join(c->thread, NULL);
+
+	err = c->error;
+
+	if (!err && (fsync(c->fd) < 0 || fsync(c->idxfd) < 0))
+		err = errno;
+
+	_release(c);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int capture_reader_open(struct capture_reader *r, const char *path)
+{
+	struct capture_header hdr;
+	size_t plen;
+	char *idxpath;
+	int err;
+
+	assert(r);
+	assert(path);
+
+	memset(r, 0, sizeof(*r));
+	r->idxfd = -1;
+	r->offset = sizeof(hdr);
+	r->fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (r->fd < 0)
+		return -1;
+
+	if (_readAt(r->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    hdr.magic != CAPTURE_MAGIC || hdr.version != CAPTURE_VERSION) {
+		capture_reader_close(r);
+		errno = EINVAL;
+		return -1;
+	}
+
+	plen = strlen(path);
+	idxpath = (char*) malloc(plen + sizeof(".idx"));
+
+	if (!idxpath) {
+		capture_reader_close(r);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memcpy(idxpath, path, plen);
+	memcpy(idxpath + plen, ".idx", sizeof(".idx"));
+	r->idxfd = open(idxpath, O_RDONLY | O_CLOEXEC);
+	err = errno;
+	free(idxpath);
+
+	if (r->idxfd < 0 && err != ENOENT) {
+		capture_reader_close(r);
+		errno = err;
+		return -1;
+	}
+
+	/* Without a usable index, seeking reads the log from the start */
+	if (r->idxfd >= 0 &&
+	    (_readAt(r->idxfd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	     hdr.magic != CAPTURE_INDEX_MAGIC ||
+	     hdr.version != CAPTURE_VERSION)) {
+		close(r->idxfd);
+		r->idxfd = -1;
+	}
+
+	return 0;
+}
+
+void capture_reader_close(struct capture_reader *r)
+{
+	assert(r);
+
+	if (r->fd >= 0)
+		close(r->fd);
+
+	if (r->idxfd >= 0)
+		close(r->idxfd);
+
+	free(r->frame);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+	r->idxfd = -1;
+}
+
+int capture_seek(struct capture_reader *r, int64_t time)
+{
+	assert(r);
+
+	struct capture_record rec;
+	uint64_t off = sizeof(struct capture_header);
+	uint64_t lo = 0;
+	uint64_t hi = 0;
+	struct stat st;
+	int ret;
+
+	if (r->idxfd >= 0) {
+		if (fstat(r->idxfd, &st) < 0)
+			return -1;
+
+		hi = ((uint64_t) st.st_size - sizeof(struct capture_header)) /
+			sizeof(struct capture_index);
+	}
+
+	/* Newest entry before the time */
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		struct capture_index e;
+
+		if (_readAt(r->idxfd, &e, sizeof(e),
+			    sizeof(struct capture_header) + mid * sizeof(e)) !=
+		    sizeof(e))
+			return -1;
+
+		if (e.time < time) {
+			off = e.offset;
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	/* Then at most an entry's worth of records, headers only */
+	while ((ret = _readHeader(r->fd, off, &rec)) > 0 && rec.time < time) {
+		off += sizeof(rec) + rec.len;
+	}
+
+	if (ret < 0)
+		return -1;
+
+	r->offset = off;
+
+	return 0;
+}
+
+int capture_next(struct capture_reader *r, struct capture_record *rec,
+		 const char **frame)
+{
+	assert(r);
+	assert(rec);
+	assert(frame);
+
+	int ret = _readHeader(r->fd, r->offset, rec);
+	ssize_t n;
+
+	if (ret <= 0)
+		return ret;
+
+	if (rec->len + 1 > r->cap) {
+		char *buf = (char*) realloc(r->frame, rec->len + 1);
+
+		if (!buf) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		r->frame = buf;
+		r->cap = rec->len + 1;
+	}
+
+	n = _readAt(r->fd, r->frame, rec->len, r->offset + sizeof(*rec));
+
+	if (n < 0)
+		return -1;
+
+	/* Still being written, or cut off by a crash */
+	if ((size_t) n < rec->len)
+		return 0;
+
+	r->frame[rec->len] = '\0';
+	r->offset += sizeof(*rec) + rec->len;
+	*frame = r->frame;
+
+	return 1;
+}
+
+/*
+**********************************************************************
+***************** LOCAL FUNCTION IMPLEMENTATION **********************
+**********************************************************************
+*/
+
+/* Write the header to an empty file, or check the one it has */
+static int _prepare(int fd, uint32_t magic)
+{
+	struct capture_header hdr = { magic, CAPTURE_VERSION };
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+
+	/* Recovery cuts the log short, which needs a regular file */
+	if (!S_ISREG(st.st_mode)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (st.st_size == 0)
+		return _writeAll(fd, &hdr, sizeof(hdr)) == 0 ? 0 : -1;
+
+	if (_readAt(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    hdr.magic != magic || hdr.version != CAPTURE_VERSION) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Cut a record a crash left half written off the end of the log, and
+ * index the records after the newest entry that survived. Only the
+ * records after that entry are read. */
+static int _recover(struct capture *c)
+{
+	const uint64_t start = sizeof(struct capture_header);
+	struct capture_record rec;
+	struct capture_index e;
+	struct stat st;
+	uint64_t size;
+	uint64_t n;
+	uint64_t off = start;
+	uint64_t k = 0;
+	int ret;
+
+	if (fstat(c->fd, &st) < 0)
+		return -1;
+
+	size = st.st_size;
+
+	if (fstat(c->idxfd, &st) < 0)
+		return -1;
+
+	n = ((uint64_t) st.st_size - start) / sizeof(e);
+
+	/* Entries for records that never made it to the log */
+	for (; n > 0; --n) {
+		if (_readAt(c->idxfd, &e, sizeof(e), start + (n - 1) *
+			    sizeof(e)) != sizeof(e))
+			return -1;
+
+		if (e.offset >= start && e.offset < size)
+			break;
+	}
+
+	if (ftruncate(c->idxfd, start + n * sizeof(e)) < 0)
+		return -1;
+
+	if (n > 0) {
+		off = e.offset;
+		c->last = e.time;
+	}
+
+	while ((ret = _readHeader(c->fd, off, &rec)) > 0 &&
+	       off + sizeof(rec) + rec.len <= size) {
+		/* The record at the surviving entry is indexed already */
+		if (k % c->every == 0 && (k > 0 || n == 0)) {
+			c->last = rec.time > c->last ? rec.time : c->last;
+			e.time = c->last;
+			e.offset = off;
+
+			if (_writeAll(c->idxfd, &e, sizeof(e)) < 0)
+				return -1;
+		}
+
+		off += sizeof(rec) + rec.len;
+		++k;
+	}
+
+	if (ret < 0 && errno != EINVAL)
+		return -1;
+
+	if (off < size && ftruncate(c->fd, off) < 0)
+		return -1;
+
+	c->offset = off;
+
+	return 0;
+}
+
+static void _release(struct capture *c)
+{
+	for (int i = 0; i < 2; ++i) {
+		free(c->batches[i].buf);
+		free(c->batches[i].idx);
+		c->batches[i].buf = NULL;
+		c->batches[i].idx = NULL;
+	}
+
+	if (c->fd >= 0)
+		close(c->fd);
+
+	if (c->idxfd >= 0)
+		close(c->idxfd);
+
+	c->fd = -1;
+	c->idxfd = -1;
+
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->lock);
+}
+
+/* Write batches as they fill up, and what has gathered whenever
+ * CAPTURE_FLUSH_MS pass without one filling up */
+static void *_writerMain(void *arg)
+{
+	struct capture *c = (struct capture*) arg;
+	sigset_t mask;
+
+	/* Terminal and exit signals belong to the display thread */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGWINCH);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	pthread_mutex_lock(&c->lock);
+
+	for (;;) {
+		struct capture_batch *b = &c->batches[c->active];
+		struct timespec until;
+		int err;
+
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += CAPTURE_FLUSH_MS / 1000;
+		until.tv_nsec += (CAPTURE_FLUSH_MS % 1000) * 1000000L;
+
+		if (until.tv_nsec >= 1000000000L) {
+			++until.tv_sec;
+			until.tv_nsec -= 1000000000L;
+		}
+
+		/* A batch half full by the time the last one is written
+		 * goes out right away */
+		while (!c->writing && !c->stop &&
+		       b->len < CAPTURE_BATCH_LEN / 2) {
+			if (pthread_cond_timedwait(&c->cond, &c->lock,
+						   &until) == ETIMEDOUT)
+				break;
+		}
+
+		if (!c->writing && b->len > 0) {
+			c->writing = true;
+			c->active ^= 1;
+		}
+
+		if (!c->writing) {
+			if (c->stop)
+				break;
+
+			continue;
+		}
+
+		b = &c->batches[c->active ^ 1];
+		pthread_mutex_unlock(&c->lock);
+
+		err = _writeBatch(c, b);
+
+		pthread_mutex_lock(&c->lock);
+
+		if (err && !c->error)
+			c->error = err;
+
+		b->len = 0;
+		b->nidx = 0;
+		c->writing = false;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+
+	return NULL;
+}
+
+/* The records go out before the entries pointing at them. Returns 0
+ * or the errno of the failed write. */
+static int _writeBatch(struct capture *c, const struct capture_batch *b)
+{
+	if (_writeAll(c->fd, b->buf, b->len) < 0 ||
+	    _writeAll(c->idxfd, b->idx, b->nidx * sizeof(*b->idx)) < 0)
+		return errno;
+
+	return 0;
+}
+
+static int _writeAll(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char*) buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Read up to len bytes at an offset, fewer only at the end of the
+ * file */
+static ssize_t _readAt(int fd, void *buf, size_t len, uint64_t off)
+{
+	char *p = (char*) buf;
+	size_t got = 0;
+
+	while (got < len) {
+		ssize_t n = pread(fd, p + got, len - got, off + got);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		if (n == 0)
+			break;
+
+		got += n;
+	}
+
+	return got;
+}
+
+/* Returns 1 if a whole header is at the offset, 0 at the end of the
+ * log, -1 on error with errno set to EINVAL if the header is damaged */
+static int _readHeader(int fd, uint64_t off, struct capture_record *rec)
+{
+	ssize_t n = _readAt(fd, rec, sizeof(*rec), off);
+
+	if (n < 0)
+		return -1;
+
+	if ((size_t) n < sizeof(*rec))
+		return 0;
+
+	if (rec->len > CAPTURE_MAX_FRAME) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 1;
+}
+
+static int64_t _now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
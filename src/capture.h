@@ -0,0 +1,235 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* #ifdef __cplusplus */
+
+#define CAPTURE_MAGIC 0x454e5643 /* "ENVC" */
+#define CAPTURE_INDEX_MAGIC 0x454e5658 /* "ENVX" */
+#define CAPTURE_VERSION 1
+
+/* Bytes of records gathered before they are written. Two batches are
+ * kept, one filling while the other is written. */
+#ifndef CAPTURE_BATCH_LEN
+#define CAPTURE_BATCH_LEN (256 * 1024)
+#endif /* #ifndef CAPTURE_BATCH_LEN */
+
+/* Longest a batch waits for more records before it is written */
+#ifndef CAPTURE_FLUSH_MS
+#define CAPTURE_FLUSH_MS 1000
+#endif /* #ifndef CAPTURE_FLUSH_MS */
+
+/* Frames between entries of the time index */
+#ifndef CAPTURE_DEFAULT_EVERY
+#define CAPTURE_DEFAULT_EVERY 256
+#endif /* #ifndef CAPTURE_DEFAULT_EVERY */
+
+/* Longest frame a reader accepts, so a damaged length is not taken
+ * for a frame of gigabytes */
+#ifndef CAPTURE_MAX_FRAME
+#define CAPTURE_MAX_FRAME (1024 * 1024)
+#endif /* #ifndef CAPTURE_MAX_FRAME */
+
+/** Start of the capture log, and of its index */
+	struct capture_header {
+		uint32_t magic;
+		uint32_t version;
+	};
+
+/** Header of one frame in the capture log, followed by the frame
+ *
+ * @param len Length of the frame in bytes, without a newline
+ *
+ * @param source Position of the source the frame came from among the
+ * sources read
+ *
+ * @param time Time the frame was received, in microseconds since the
+ * epoch
+ */
+	struct capture_record {
+		uint32_t len;
+		uint32_t source;
+		int64_t time;
+	};
+
+/** Entry of the time index, kept in a file named after the log with
+ * ".idx" appended
+ *
+ * @param time Receive time of the frame, or of an earlier entry if the
+ * clock went back, so the entries stay in order
+ *
+ * @param offset Position of the frame's record in the log
+ */
+	struct capture_index {
+		int64_t time;
+		uint64_t offset;
+	};
+
+/** Records gathered for one write
+ *
+ * @param buf Records, CAPTURE_BATCH_LEN bytes
+ *
+ * @param len Bytes used in @p buf
+ *
+ * @param idx Index entries of records in @p buf
+ *
+ * @param nidx Entries used in @p idx
+ */
+	struct capture_batch {
+		char *buf;
+		size_t len;
+		struct capture_index *idx;
+		unsigned nidx;
+	};
+
+/** Append-only log of raw frames with a sparse time index
+ *
+ * Frames are copied into a batch in memory and written by a thread of
+ * the capture's own, so a slow disk never holds up the caller. A
+ * batch is written once it is full or has waited CAPTURE_FLUSH_MS.
+ * Should both batches be full while the disk catches up, further
+ * frames are dropped and counted rather than waited for.
+ *
+ * Every @p every frames an entry goes into the index, after the
+ * records it points to are written, so the index never points past
+ * the log. Seeking a long capture by time reads a few entries of the
+ * index and at most @p every records of the log.
+ *
+ * @param fd Log file
+ *
+ * @param idxfd Index file
+ *
+ * @param every Frames between index entries
+ *
+ * @param offset Size of the log once every gathered record is written
+ *
+ * @param last Time of the newest index entry
+ *
+ * @param frames Frames gathered
+ *
+ * @param dropped Frames dropped for want of room, or after a write
+ * failed
+ *
+ * @param error errno of the first failed write, 0 if none
+ *
+ * @param batches Batch filling and batch being written
+ *
+ * @param active Index of the batch filling
+ *
+ * @param writing True while the other batch is handed to the writer
+ *
+ * @param stop True once the writer should write what is left and end
+ */
+	struct capture {
+		int fd;
+		int idxfd;
+		unsigned every;
+		uint64_t offset;
+		int64_t last;
+		unsigned long frames;
+		unsigned long dropped;
+		int error;
+		struct capture_batch batches[2];
+		int active;
+		bool writing;
+		bool stop;
+		pthread_t thread;
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+	};
+
+/** Reader of a capture log
+ *
+ * @param fd Log file
+ *
+ * @param idxfd Index file, -1 if there is none
+ *
+ * @param offset Position of the next record
+ *
+ * @param frame Buffer of the last frame read
+ *
+ * @param cap Bytes allocated for @p frame
+ */
+	struct capture_reader {
+		int fd;
+		int idxfd;
+		uint64_t offset;
+		char *frame;
+		size_t cap;
+	};
+
+/** Open a capture log for appending and start its writer
+ *
+ * A new log and index are created if there are none. A record cut off
+ * by a crash is removed from the end of the log, and index entries
+ * missing after it are put back.
+ *
+ * @param every Frames between index entries, CAPTURE_DEFAULT_EVERY if
+ * 0
+ *
+ * @return 0 on success, -1 on failure with errno set. EINVAL means the
+ * file is not a capture log.
+ */
+	int capture_open(struct capture *c, const char *path, unsigned every);
+
+/** Queue a frame for the log, stamped with the current time
+ *
+ * Only copies the frame, never waits for the disk. May be called from
+ * several threads.
+ *
+ * @param source Position of the source the frame came from
+ *
+ * @return 0 on success, -1 if the frame was dropped, with errno set
+ * to ENOBUFS if no batch had room, or to the error of a failed write
+ */
+	int capture_write(struct capture *c, int source, const char *frame,
+			  size_t len);
+
+/** Write every queued frame, stop the writer and close the files
+ *
+ * @p frames and @p dropped stay readable afterwards.
+ *
+ * @return 0 if every frame was written, -1 with errno set otherwise
+ */
+	int capture_close(struct capture *c);
+
+/** Open a capture log for reading, from its first record */
+	int capture_reader_open(struct capture_reader *r, const char *path);
+
+	void capture_reader_close(struct capture_reader *r);
+
+/** Move the reader to the first record received at or after a time
+ *
+ * Only the index and the records after the nearest entry before @p time
+ * are read. Without an index the log is read from the start.
+ *
+ * @param time Microseconds since the epoch
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+	int capture_seek(struct capture_reader *r, int64_t time);
+
+/** Read the next record
+ *
+ * @param rec Receives the record header
+ *
+ * @param frame Receives the frame, NUL-terminated, valid until the
+ * next call
+ *
+ * @return 1 if a record was read, 0 at the end of the log, or -1 with
+ * errno set. EINVAL means the log is damaged at this point.
+ */
+	int capture_next(struct capture_reader *r, struct capture_record *rec,
+			 const char **frame);
+
+#ifdef __cplusplus
+}
+#endif /* #ifdef __cplusplus */
+
+#endif /* #ifndef CAPTURE_H */
@@ -1,4 +1,8 @@
 #include "data-ops.h"
+#include "framebuf.h"
+#include "dgram.h"
+#include "numfmt.h"
+#include "snapring.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -9,10 +13,77 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <limits.h>
+
+#ifndef DATA_OPS_DEFAULT_PRECISION
+#define DATA_OPS_DEFAULT_PRECISION 2
+#endif /* #ifndef DATA_OPS_DEFAULT_PRECISION */
+
+#ifndef DATA_OPS_MAX_PRECISIONS
+#define DATA_OPS_MAX_PRECISIONS 32
+#endif /* #ifndef DATA_OPS_MAX_PRECISIONS */
+
+#ifndef DATA_OPS_RETRY_MS
+#define DATA_OPS_RETRY_MS 10
+#endif /* #ifndef DATA_OPS_RETRY_MS */
+
+#ifndef DATA_OPS_INITIAL_MS
+#define DATA_OPS_INITIAL_MS 60000
+#endif /* #ifndef DATA_OPS_INITIAL_MS */
+
+#define DATA_OPS_LABEL_LEN 16
+
+/* What a followed file is watched for */
+#define DATA_OPS_FOLLOW_EVENTS (IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF)
+
+#if DATA_OPS_MAX_SOURCES > SNAPSHOT_MAX_SEGMENTS
+#error "Every source needs its own snapshot segment"
+#endif /* #if DATA_OPS_MAX_SOURCES > SNAPSHOT_MAX_SEGMENTS */
+
+/* Display precision configured for a metric name */
+struct precision {
+	char name[48];
+	int digits;
+};
+
+/* One input stream. Whoever runs _ingestStep() owns the framer and
+ * the parser context; the rest is only read by the display once
+ * loaded. */
+struct source_state {
+	int fd;
+	char label[DATA_OPS_LABEL_LEN];
+	struct framebuf fb;
+	struct dgrambuf db;	/* Used instead of fb if dgram */
+	struct jp_ctx *ctx;
+	struct snapshot last;	/* Newest frame, flattened */
+	bool pollable;		/* False for files epoll refuses */
+	bool dgram;		/* One frame per datagram */
+	bool readable;		/* Reported by the last epoll_wait() */
+	bool follow;		/* Regular file followed with inotify */
+	bool rotated;		/* Followed file was moved or deleted */
+	int ifd;		/* inotify descriptor if follow */
+	int wd;			/* Watch on the followed file */
+	const char *path;	/* Path the followed file is opened from */
+	bool updated;		/* last is newer than the metrics */
+	int base;		/* First metric loaded from last */
+	int loaded;		/* Number of metrics loaded from last */
+};
 
-#ifndef DISPLAY_DRIVER_INPUT_BUFFER_LEN
-#define DISPLAY_DRIVER_INPUT_BUFFER_LEN 4096
-#endif
+/* Where a metric is kept besides the metric list, -1 where it is not */
+struct tracking {
+	int series;
+	int sketch;
+	int rollup;
+	int column;
+};
 
 struct datafield errordf[] = {
 	{
@@ -20,123 +91,163 @@ struct datafield errordf[] = {
 	}
 };
 
-static int datafd = -1;
+static struct source_state _src[DATA_OPS_MAX_SOURCES];
+static int _nsrc = 0;
+static int _epfd = -1;
 
 static struct metric *_metrics;
+static int _metrics_cap = 0;
 static struct metric_form _mf;
 
-static void _allocateMetric(struct datafield **df);
-static void _loadMetric(struct datafield **df);
-
-struct datafield **pollData(struct datafield **df, uint32_t ms)
+static struct precision _precisions[DATA_OPS_MAX_PRECISIONS];
+static int _nprecisions = 0;
+static int _default_precision = DATA_OPS_DEFAULT_PRECISION;
+
+static bool _coalesce = false;
+static int _relayfd = -1;
+static struct shmsnap *_shm = NULL;
+static struct history *_history = NULL;
+static struct rollstats *_rstats = NULL;
+static struct sketchset *_sketches = NULL;
+static struct rollup *_rollup = NULL;
+static struct capture *_capture = NULL;
+static struct tsstore *_columns = NULL;
+static struct tracking *_tracking = NULL;	/* Parallel to _metrics */
+static const char *_sketchpath = NULL;
+static const char *_followpaths[DATA_OPS_MAX_SOURCES];
+static time_t _sketchsaved = 0;
+static time_t _columnsflushed = 0;
+static struct datastats _stats;
+
+/* Threaded ingest. Once the thread runs it alone calls _ingestStep(),
+ * and the display thread only sees snapshots. */
+static bool _threaded = false;
+static bool _ingest_running = false;
+static pthread_t _ingest_thread;
+static int _wakefd = -1;
+static int _stopfd = -1;
+static struct snapring _ring;
+static unsigned long _snap_skipped = 0;
+static int _snap_loaded[SNAPSHOT_MAX_SEGMENTS]; /* Fields per source */
+static int _snap_nsegments = 0;
+
+static int _openSources(const int *fds, const char *const *labels, int n);
+static void _closeSources();
+static int _ingestStep(int mstimeout, bool *stop);
+static int _readSource(struct source_state *s);
+static void _initialLoad();
+static bool _readsTerminal();
+static void _loadSources();
+static void _allocateMetric(int nfields);
+static void _loadField(int mi, const struct datafield *src,
+		       const char *label);
+static void _finishLoad(int mi);
+static void _loadSnapshot(const struct snapshot *snap);
+static char *_nextFrame(struct source_state *s, bool *failed);
+static char *_nextDatagram(struct source_state *s, bool *failed);
+static bool _buffered(struct source_state *s);
+static bool _unannounced();
+static void _relayFrame(char *frame);
+static void _captureFrame(struct source_state *s, const char *frame);
+static void _publishMetrics();
+static void _trackHistory(struct metric *m, int s);
+static int64_t _deviceTime(const struct metric *m);
+static void _saveSketches();
+static void _flushColumns();
+static int _startIngest();
+static void _stopIngest();
+static void *_ingestMain(void *arg);
+static bool _publishSnapshot(bool failed);
+static int _pollSnapshot(long mstimeout);
+static int _precisionOf(const char *name);
+static void _drainNewest(struct source_state *s);
+static unsigned long _skipFrames(struct source_state *s);
+static bool _readable(int pdfd);
+static int _startFollow(struct source_state *s, const char *path);
+static void _follow(struct source_state *s);
+static bool _reopen(struct source_state *s);
+
+void setCoalesce(bool enable)
 {
-	assert(!df);
-	assert(datafd >= 0);
-
-	struct timespec to = {
-		.tv_sec = 0,
-		.tv_nsec = ms * 1000000
-	};
-	struct pollfd pfd = {
-		.fd = datafd, /* open(openfile, O_RDWR), */
-		.events = POLLIN
-	};
-
-	int pollresult = ppoll(&pfd, 1, &to, 0);
+	_coalesce = enable;
+}
 
-	if (pollresult < 0) {
+void setThreaded(bool enable)
+{
+	_threaded = enable;
+}
 
-		/* Dirty hack to prevent poll errors on window
-		 * size changes */
-		if (errno == EINTR) {
-			return NULL;
-		}
+void setRelay(int fd)
+{
+	_relayfd = fd;
+}
 
-		perror("Critical Error polling file: ");
-		return (struct datafield**) &errordf;
-	}
+void setPublisher(struct shmsnap *shm)
+{
+	_shm = shm;
+}
 
-	if (pollresult == 0) {
-		return NULL;
-	}
+void setHistory(struct history *h)
+{
+	_history = h;
+}
 
-	return parseData(pfd.fd, df);
+void setStatistics(struct rollstats *st)
+{
+	_rstats = st;
 }
 
-struct datafield **initialDataTransaction(int pdfd,
-					  struct datafield **dfields)
+void setRollup(struct rollup *r)
 {
-	assert(!dfields);
-	assert(pdfd >= 0);
+	_rollup = r;
+}
 
-	datafd = pdfd;
+void setCapture(struct capture *c)
+{
+	_capture = c;
+}
 
-	struct pollfd pfd = {
-		.fd = pdfd, /* open(parsefile, O_RDWR), */
-		.events = POLLIN
-	};
+void setColumns(struct tsstore *ts)
+{
+	struct timespec now;
 
-	printf("Polling for environmental data...\n");
-	int pollresult = poll(&pfd, 1, 60000);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	_columns = ts;
+	_columnsflushed = now.tv_sec;
+}
 
-	if (pollresult < 0) {
-		perror("Error while reading initial data: ");
-		raise(SIGABRT);
-	}
+void setFollow(const char *const *paths, int n)
+{
+	memset(_followpaths, 0, sizeof(_followpaths));
 
-	if (pollresult == 0) {
-		fprintf(stderr, "Failed to get "
-			"initial data from stream\n");
-		raise(SIGABRT);
+	for (int i = 0; i < n && i < DATA_OPS_MAX_SOURCES; ++i) {
+		_followpaths[i] = paths ? paths[i] : NULL;
 	}
-
-	return parseData(pdfd, dfields);
 }
 
-
-struct datafield **parseData(int pdfd, struct datafield** df)
+void setSketches(struct sketchset *set, const char *path)
 {
-	char buff[DISPLAY_DRIVER_INPUT_BUFFER_LEN];
-	int i = 0;
-
-	while (i < DISPLAY_DRIVER_INPUT_BUFFER_LEN - 1) {
-		char c;
-
-		int readresult = read(pdfd, &c, 1);
-
-		if (readresult < 0) {
-			perror("Error reading file: ");
-			raise(SIGINT);
-		}
+	struct timespec now;
 
-		if (c == '\n' || c == '\r') {
-			break;
-		}
-
-		if (readresult == 0) {
-			struct pollfd pfd = {
-				.fd = pdfd,
-				.events = POLLIN
-			};
-
-			/* Keep polling if ran out of characters */
-			int pollresult = poll(&pfd, 1, 1000);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	_sketches = set;
+	_sketchpath = path;
+	_sketchsaved = now.tv_sec;
+}
 
-			if (pollresult  > 0) {
-				break;
-			}
+void getDataStats(struct datastats *st)
+{
+	assert(st);
 
-			continue;
-		}
+	*st = _stats;
+	st->skipped += _snap_skipped;
 
-		buff[i] = c;
-		++i;
+	for (int i = 0; i < _nsrc; ++i) {
+		st->oversized += _src[i].fb.oversized;
+		st->datagrams += _src[i].db.received;
+		st->truncated += _src[i].db.truncated;
+		st->dropped += _src[i].db.dropped;
 	}
-
-	buff[i] = '\0';
-
-	initializeData(buff);
-	return getDataDump(df);
 }
 
 bool isErrorDatafield(const struct datafield *df)
@@ -146,64 +257,154 @@ bool isErrorDatafield(const struct datafield *df)
 
 	return strcmp(df[0].name, errordf->name) == 0 &&
 		strcmp(df[0].unit, errordf->unit) == 0 &&
-		strcmp(df[0].value, errordf->value) == 0 &&
-		strcmp(df[0].time, errordf->time) == 0;
+		df[0].value == errordf->value &&
+		df[0].timemillis == errordf->timemillis;
 }
 
 int ncursesPollCB(long mstimeout)
 {
 	assert(_metrics);
 
-	struct datafield **df = NULL;
-
-	df = pollData(df, (uint32_t) mstimeout);
+	if (_ingest_running)
+		return _pollSnapshot(mstimeout);
 
-	if (!df)
-		return 1;
+	int updated = _ingestStep((int) mstimeout, NULL);
 
-	if (isErrorDatafield(df[0]))
+	if (updated < 0) {
+		perror("Critical Error reading data: ");
 		return -1;
+	}
 
-	_loadMetric(df);
+	/* The epoll descriptor the form sleeps on never wakes it for
+	 * the rest of an unpolled file, so ask to be called again */
+	if (updated == 0)
+		return _unannounced() ? 0 : 1;
 
-	clearData();
+	_loadSources();
 
 	return 0;
 }
 
-struct metric_form *ncursesCFG(int pdfd)
+unsigned long ncursesQuantiles(int metric, const double *q, int n,
+			       double *out)
+{
+	assert(_sketches);
+
+	int k = metric >= 0 && metric < _metrics_cap ?
+		_tracking[metric].sketch : -1;
+
+	sketchset_quantiles(_sketches, k, q, n, out);
+
+	return k >= 0 ? (unsigned long) sketchset_count(_sketches, k) : 0;
+}
+
+unsigned ncursesRollup(int metric, int tier, struct rollup_bucket *out,
+		       unsigned n)
 {
-	struct datafield **df = NULL;
+	assert(_rollup);
+
+	int s = metric >= 0 && metric < _metrics_cap ?
+		_tracking[metric].rollup : -1;
+
+	return s >= 0 ? rollup_last(_rollup, s, tier, out, n) : 0;
+}
 
-	df = initialDataTransaction(pdfd, df);
+struct metric_form *ncursesCFG(int pdfd)
+{
+	return ncursesCFGSources(&pdfd, NULL, 1);
+}
 
-	_allocateMetric(df);
+struct metric_form *ncursesCFGSources(const int *fds,
+				      const char *const *labels, int n)
+{
+	assert(fds);
+	assert(n > 0 && n <= DATA_OPS_MAX_SOURCES);
 
-	_loadMetric(df);
+	if (_openSources(fds, labels, n) < 0) {
+		perror("Critical Error setting up sources: ");
+		raise(SIGABRT);
+		return NULL;
+	}
 
-	clearData();
+	_initialLoad();
 
 	/* Set required cfg parameters */
 	_mf.wd.pages = 1;
 	_mf.metrics = _metrics;
 	_mf.polldata_cb = ncursesPollCB;
+	_mf.keys = !_readsTerminal();
+	_mf.stats = _rstats;
+	_mf.quantiles_cb = _sketches ? ncursesQuantiles : NULL;
+	_mf.rollup_cb = _rollup ? ncursesRollup : NULL;
+
+	/* Hand the sources to the ingest thread from here on */
+	if (_threaded && _startIngest() < 0) {
+		perror("Failed to start ingest thread, "
+		       "reading on the display thread: ");
+	}
+
+	/* The form sleeps on whichever says there is new data */
+	_mf.data_fd = _ingest_running ? _wakefd : _epfd;
 
 	return &_mf;
 }
 
+int ncursesSetPrecision(const char *name, int digits)
+{
+	if (digits < 0 || digits > NUMFMT_MAX_PRECISION)
+		return -1;
+
+	/* No name sets the precision of every other metric */
+	if (!name || name[0] == '\0') {
+		_default_precision = digits;
+		return 0;
+	}
+
+	for (int i = 0; i < _nprecisions; ++i) {
+		if (strcmp(_precisions[i].name, name) == 0) {
+			_precisions[i].digits = digits;
+			return 0;
+		}
+	}
+
+	if (_nprecisions >= DATA_OPS_MAX_PRECISIONS)
+		return -1;
+
+	strncpy(_precisions[_nprecisions].name, name,
+		sizeof(_precisions[0].name) - 1);
+	_precisions[_nprecisions].digits = digits;
+	++_nprecisions;
+
+	return 0;
+}
+
 void ncursesFreeMetric()
 {
 	struct borderwidth emptybw = {0};
 	struct windim emptywd = {0};
+
+	_stopIngest();
+
 	if (_metrics)
 		free(_metrics);
 
+	free(_tracking);
+
 	_metrics = NULL;
+	_tracking = NULL;
+	_metrics_cap = 0;
+
+	_closeSources();
 
 	_mf.metrics = NULL;
 	_mf.bw = emptybw;
 	_mf.wd = emptywd;
 	_mf.polldata_cb = NULL;
+	_mf.data_fd = -1;
+	_mf.keys = false;
+	_mf.stats = NULL;
+	_mf.quantiles_cb = NULL;
+	_mf.rollup_cb = NULL;
 }
 
 void ncursesEmergExit()
@@ -212,44 +413,1108 @@ void ncursesEmergExit()
 	ncursesFreeMetric();
 }
 
-void _allocateMetric(struct datafield **df)
+static int _openSources(const int *fds, const char *const *labels, int n)
+{
+	_closeSources();
+
+	_epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (_epfd < 0)
+		return -1;
+
+	for (int i = 0; i < n; ++i) {
+		struct source_state *s = &_src[i];
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = s
+		};
+
+		memset(s, 0, sizeof(*s));
+		s->fd = fds[i];
+
+		if (labels && labels[i])
+			strncpy(s->label, labels[i], sizeof(s->label) - 1);
+
+		++_nsrc;
+
+		/* Datagrams carry their own framing, so a datagram
+		 * without a newline is still a whole frame */
+		s->dgram = dgram_is_socket(s->fd);
+
+		if (s->dgram) {
+			if (dgram_init(&s->db, s->fd, FRAMEBUF_DEFAULT_LEN) < 0)
+				return -1;
+		} else if (framebuf_init(&s->fb, s->fd,
+					 FRAMEBUF_DEFAULT_LEN) < 0) {
+			return -1;
+		}
+
+		if (!(s->ctx = jp_ctx_new()))
+			return -1;
+
+		/* Regular files are always readable and epoll refuses
+		 * them, so they are read on every step instead */
+		s->pollable = true;
+
+		if (epoll_ctl(_epfd, EPOLL_CTL_ADD, s->fd, &ev) < 0) {
+			if (errno != EPERM)
+				return -1;
+
+			s->pollable = false;
+
+			if (_followpaths[i] && !s->dgram &&
+			    _startFollow(s, _followpaths[i]) < 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void _closeSources()
+{
+	for (int i = 0; i < _nsrc; ++i) {
+		struct source_state *s = &_src[i];
+
+		_stats.oversized += s->fb.oversized;
+		_stats.datagrams += s->db.received;
+		_stats.truncated += s->db.truncated;
+		_stats.dropped += s->db.dropped;
+
+		if (s->dgram)
+			dgram_free(&s->db);
+		else
+			framebuf_free(&s->fb);
+
+		if (s->follow)
+			close(s->ifd);
+
+		jp_ctx_free(s->ctx);
+		free(s->last.fields);
+		memset(s, 0, sizeof(*s));
+	}
+
+	_nsrc = 0;
+
+	if (_epfd >= 0)
+		close(_epfd);
+
+	_epfd = -1;
+}
+
+/* Wait up to mstimeout for input, then parse the next frame of every
+ * source that has one. Sources are independent, so one that is slow
+ * or silent never holds up the others. Returns the number of sources
+ * updated, or -1 on a read error. If stop is given it is set when
+ * _stopfd fires. */
+static int _ingestStep(int mstimeout, bool *stop)
+{
+	struct epoll_event ev[DATA_OPS_MAX_SOURCES + 1];
+	int updated = 0;
+	int nev;
+
+	/* Buffered frames and unpolled files need no wait */
+	if (_unannounced())
+		mstimeout = 0;
+
+	nev = epoll_wait(_epfd, ev, DATA_OPS_MAX_SOURCES + 1, mstimeout);
+
+	if (nev < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for (int i = 0; i < nev; ++i) {
+		struct source_state *s = (struct source_state*) ev[i].data.ptr;
+
+		if (!s) {
+			if (stop)
+				*stop = true;
+
+			continue;
+		}
+
+		s->readable = true;
+	}
+
+	for (int i = 0; i < _nsrc; ++i) {
+		struct source_state *s = &_src[i];
+		int ret;
+
+		if (!s->readable && !_buffered(s) &&
+		    (s->pollable || s->fb.eof))
+			continue;
+
+		if (s->follow && s->readable)
+			_follow(s);
+
+		s->readable = false;
+
+		if ((ret = _readSource(s)) < 0)
+			return -1;
+
+		updated += ret;
+	}
+
+	return updated;
+}
+
+/* Parse the next frame of one source into its last snapshot. Returns
+ * 1 if there was one, 0 if not, -1 on a read error. */
+static int _readSource(struct source_state *s)
+{
+	bool failed = false;
+	char *frame;
+
+	frame = s->dgram ? _nextDatagram(s, &failed) : _nextFrame(s, &failed);
+
+	/* Nothing wakes the caller up for unpolled files, so read on
+	 * until a whole frame is in. A rotated file is done once read to
+	 * its end, and its replacement is read on from there. */
+	while (!frame && !failed && !s->pollable) {
+		if (s->rotated && s->fb.eof) {
+			if (!_reopen(s))
+				break;
+		} else if (s->fb.eof) {
+			break;
+		}
+
+		frame = _nextFrame(s, &failed);
+	}
+
+	if (failed)
+		return -1;
+
+	if (!frame) {
+		/* Nothing more will come, stop waking up for it */
+		if (s->fb.eof && s->pollable) {
+			epoll_ctl(_epfd, EPOLL_CTL_DEL, s->fd, NULL);
+			s->pollable = false;
+		}
+
+		return 0;
+	}
+
+	++_stats.frames;
+
+	if (_relayfd >= 0)
+		_relayFrame(frame);
+
+	if (jp_parse(s->ctx, frame) < 0) {
+		fprintf(stderr, "In initializeData(): %s\n", jp_error(s->ctx));
+		raise(SIGABRT);
+		return -1;
+	}
+
+	struct datafield **df = jp_dump(s->ctx);
+	size_t nsensors = jp_num_sensors(s->ctx);
+	int n = 0;
+
+	for (size_t i = 0; i < nsensors; ++i) {
+		n += jp_num_fields(s->ctx, i);
+	}
+
+	if (snapshot_reserve(&s->last, n) < 0) {
+		perror("Critical Error allocating metrics: ");
+		raise(SIGABRT);
+		return -1;
+	}
+
+	s->last.nfields = 0;
+
+	for (size_t i = 0; i < nsensors; ++i) {
+		int nf = jp_num_fields(s->ctx, i);
+
+		memcpy(s->last.fields + s->last.nfields, df[i],
+		       nf * sizeof(struct datafield));
+		s->last.nfields += nf;
+	}
+
+	jp_clear(s->ctx);
+	s->updated = true;
+
+	return 1;
+}
+
+/* Wait for the first frame from any source. The others are filled in
+ * as their frames arrive. */
+static void _initialLoad()
+{
+	int waited = 0;
+
+	printf("Polling for environmental data...\n");
+
+	for (;;) {
+		int updated = _ingestStep(DATA_OPS_RETRY_MS * 10, NULL);
+		bool alive = false;
+
+		if (updated < 0) {
+			perror("Error while reading initial data: ");
+			raise(SIGABRT);
+			return;
+		}
+
+		if (updated > 0)
+			break;
+
+		for (int i = 0; i < _nsrc; ++i) {
+			alive = alive || !_src[i].fb.eof || _src[i].follow;
+		}
+
+		waited += DATA_OPS_RETRY_MS * 10;
+
+		if (!alive || waited >= DATA_OPS_INITIAL_MS) {
+			fprintf(stderr, "Failed to get "
+				"initial data from stream\n");
+			raise(SIGABRT);
+			return;
+		}
+	}
+
+	_loadSources();
+}
+
+/* True if a source reads the terminal on standard input, which then
+ * cannot be used for keys */
+static bool _readsTerminal()
+{
+	struct stat in;
+	struct stat st;
+
+	if (!isatty(STDIN_FILENO) || fstat(STDIN_FILENO, &in) < 0)
+		return false;
+
+	for (int i = 0; i < _nsrc; ++i) {
+		if (fstat(_src[i].fd, &st) == 0 &&
+		    st.st_dev == in.st_dev && st.st_ino == in.st_ino)
+			return true;
+	}
+
+	return false;
+}
+
+/* Load updated sources into the metric list. Only the updated ranges
+ * are touched unless a source changed its number of fields, which
+ * moves every metric after it. */
+static void _loadSources()
 {
-	assert(df);
-	assert(!_metrics);
+	const char *label;
+	bool reshaped = false;
+	int total = 0;
+	int mi = 0;
+
+	for (int i = 0; i < _nsrc; ++i) {
+		struct source_state *s = &_src[i];
+
+		if (s->updated && s->last.nfields != s->loaded)
+			reshaped = true;
+
+		total += s->last.nfields;
+	}
 
-	int nfields = 1; /* Start at 1 for the empty one at the end */
+	if (reshaped)
+		_allocateMetric(total);
 
-	for (size_t i = 0; i < numSensors(); ++i) {
-		for (int j = 0; j < numDataFields(i); ++j) {
-			++nfields;
+	for (int i = 0; i < _nsrc; ++i) {
+		struct source_state *s = &_src[i];
+
+		if (reshaped) {
+			s->base = mi;
+			s->loaded = s->last.nfields;
+		}
+
+		mi += s->loaded;
+
+		if (!reshaped && !s->updated)
+			continue;
+
+		label = _nsrc > 1 ? s->label : NULL;
+
+		for (int j = 0; j < s->loaded; ++j) {
+			_loadField(s->base + j, &s->last.fields[j], label);
 		}
+
+		s->updated = false;
 	}
 
-	_metrics = (struct metric*) malloc(nfields * sizeof(struct metric));
+	if (reshaped)
+		_finishLoad(total);
+
+	if (_rstats)
+		rollstats_update(_rstats);
+
+	_saveSketches();
+	_flushColumns();
+	_publishMetrics();
 }
 
-void _loadMetric(struct datafield **df)
+static void _allocateMetric(int nfields)
 {
-	assert(df);
+	/* Statistics follow the number of metrics, not the storage */
+	if (_rstats && rollstats_resize(_rstats, nfields) < 0) {
+		perror("Critical Error allocating statistics: ");
+		raise(SIGABRT);
+		return;
+	}
+
+	++nfields; /* Add 1 for the empty one at the end */
+
+	/* Keep the previous frame's storage unless it is too small */
+	if (nfields <= _metrics_cap)
+		return;
+
+	struct metric *m = (struct metric*) realloc(_metrics,
+						    nfields * sizeof(struct metric));
+	struct tracking *tr = m ? (struct tracking*)
+		realloc(_tracking, nfields * sizeof(struct tracking)) : NULL;
+
+	if (m)
+		_metrics = m;
 
+	if (tr)
+		_tracking = tr;
+
+	if (!m || !tr) {
+		perror("Critical Error allocating metrics: ");
+		raise(SIGABRT);
+		return;
+	}
+
+	/* New slots start out empty so _loadField() sees new names */
+	metric_make_empty_array(m + _metrics_cap, nfields - _metrics_cap);
+
+	for (int i = _metrics_cap; i < nfields; ++i) {
+		tr[i].series = -1;
+		tr[i].sketch = -1;
+		tr[i].rollup = -1;
+		tr[i].column = -1;
+	}
+
+	_metrics_cap = nfields;
+	_mf.metrics = _metrics;
+}
+
+/* Load a snapshot from the ingest thread the way _loadSources() loads
+ * the sources: only the segments of sources that sent a frame, unless
+ * one changed its number of fields and moved the metrics after it */
+static void _loadSnapshot(const struct snapshot *snap)
+{
+	bool reshaped = snap->nsegments != _snap_nsegments;
 	int mi = 0;
 
-	for (size_t i = 0; i < numSensors(); ++i) {
-		struct datafield *dfi = df[i];
+	for (int k = 0; k < snap->nsegments && !reshaped; ++k) {
+		reshaped = snap->segments[k] != _snap_loaded[k];
+	}
+
+	if (reshaped)
+		_allocateMetric(snap->nfields);
 
-		for (int j = 0; j < numDataFields(i); ++j) {
-			struct metric * addr = &_metrics[mi];
+	for (int k = 0; k < snap->nsegments; ++k) {
+		const char *label = _nsrc > 1 ? _src[k].label : NULL;
 
-			strcpy(addr->name, dfi[j].name);
-			strcpy(addr->value, dfi[j].value);
-			strcpy(addr->unit, dfi[j].unit);
+		_snap_loaded[k] = snap->segments[k];
 
-			addr->slot = -1;
-			addr->page = 0;
+		if (!reshaped && !snap->updated[k]) {
+			mi += snap->segments[k];
+			continue;
+		}
 
+		for (int j = 0; j < snap->segments[k]; ++j) {
+			_loadField(mi, &snap->fields[mi], label);
 			++mi;
 		}
 	}
 
-	metric_make_empty(&_metrics[mi]);
+	_snap_nsegments = snap->nsegments;
+
+	if (reshaped)
+		_finishLoad(snap->nfields);
+
+	if (_rstats)
+		rollstats_update(_rstats);
+
+	_saveSketches();
+	_flushColumns();
+	_publishMetrics();
+}
+
+/* Copy one field into a metric slot. With several sources the name
+ * is prefixed with the source label. */
+static void _loadField(int mi, const struct datafield *src,
+		       const char *label)
+{
+	struct metric * addr = &_metrics[mi];
+	struct tracking *tr = &_tracking[mi];
+	size_t ll = label ? strlen(label) : 0;
+
+	/* Only look up the precision when the name in this slot
+	 * changes */
+	if ((label && (strncmp(addr->name, label, ll) != 0 ||
+		       addr->name[ll] != ':')) ||
+	    strcmp(addr->name + (label ? ll + 1 : 0), src->name) != 0) {
+		if (label)
+			snprintf(addr->name, sizeof(addr->name), "%s:%s",
+				 label, src->name);
+		else
+			strcpy(addr->name, src->name);
+
+		addr->precision = _precisionOf(addr->name);
+		addr->ntrend = 0;
+		tr->series = _history ? history_find(_history, addr->name) : -1;
+		tr->sketch = _sketches ?
+			sketchset_find(_sketches, addr->name) : -1;
+		tr->rollup = _rollup ? rollup_find(_rollup, addr->name) : -1;
+		tr->column = _columns ? tsstore_find(_columns, addr->name) : -1;
+
+		if (_rstats)
+			rollstats_reset(_rstats, mi);
+
+		_mf.relayout = true;
+	}
+
+	if (strcmp(addr->unit, src->unit) != 0) {
+		strcpy(addr->unit, src->unit);
+		_mf.relayout = true;
+	}
+
+	if (addr->slot != -1 || addr->page != 0) {
+		addr->slot = -1;
+		addr->page = 0;
+		_mf.relayout = true;
+	}
+
+	/* Compare bit patterns so NaN counts as unchanged */
+	if (memcmp(&addr->value, &src->value, sizeof(addr->value)) != 0) {
+		addr->value = src->value;
+		addr->dirty = true;
+	}
+
+	addr->timemillis = src->timemillis;
+
+	if (_rstats)
+		_rstats->input[mi] = src->value;
+
+	if (tr->series >= 0)
+		_trackHistory(addr, tr->series);
+
+	if (tr->sketch >= 0)
+		sketchset_add(_sketches, tr->sketch, src->value);
+
+	if (tr->rollup >= 0)
+		rollup_add(_rollup, tr->rollup, _deviceTime(addr), src->value);
+
+	if (tr->column >= 0)
+		tsstore_add(_columns, tr->column, _deviceTime(addr),
+			     src->value);
+}
+
+static void _finishLoad(int mi)
+{
+	/* Fewer metrics than the last frame */
+	if (!metric_is_empty(&_metrics[mi]))
+		_mf.relayout = true;
+
+	metric_make_empty(&_metrics[mi]);
+}
+
+static int _precisionOf(const char *name)
+{
+	const char *bare = _nsrc > 1 ? strchr(name, ':') : NULL;
+
+	for (int i = 0; i < _nprecisions; ++i) {
+		if (strcmp(_precisions[i].name, name) == 0)
+			return _precisions[i].digits;
+	}
+
+	/* A setting for the bare name covers every source */
+	for (int i = 0; bare && i < _nprecisions; ++i) {
+		if (strcmp(_precisions[i].name, bare + 1) == 0)
+			return _precisions[i].digits;
+	}
+
+	return _default_precision;
+}
+
+/* Read what is already waiting on the descriptor, keeping only the
+ * newest complete frame. At most a buffer's worth is read per call so
+ * a fast sender or a long file cannot hold up the form; the next
+ * wakeup carries on. */
+static void _drainNewest(struct source_state *s)
+{
+	struct framebuf *fb = &s->fb;
+	size_t taken = 0;
+
+	_stats.skipped += _skipFrames(s);
+
+	while (taken < fb->cap - 1 && _readable(fb->fd)) {
+		ssize_t readresult = framebuf_fill(fb);
+
+		if (readresult <= 0)
+			break;
+
+		taken += readresult;
+		_stats.skipped += _skipFrames(s);
+	}
+}
+
+/* Skip buffered frames but the newest, recording the skipped ones
+ * first since the capture keeps every frame received */
+static unsigned long _skipFrames(struct source_state *s)
+{
+	struct framebuf *fb = &s->fb;
+	bool discarding = fb->discarding;
+	char *p = fb->buf + fb->head;
+	unsigned long skipped = framebuf_skip(fb);
+	char *end = fb->buf + fb->head;
+
+	if (!_capture || skipped == 0)
+		return skipped;
+
+	/* Every skipped line ends in a newline before the newest frame.
+	 * The first one is the rest of an oversized line if the framer
+	 * was discarding one. */
+	while (p < end) {
+		char *eol = (char*) memchr(p, '\n', end - p);
+		size_t len = eol - p;
+
+		if (len > 0 && p[len - 1] == '\r')
+			--len;
+
+		if (len > 0 && !discarding)
+			capture_write(_capture, (int) (s - _src), p, len);
+
+		discarding = false;
+		p = eol + 1;
+	}
+
+	return skipped;
+}
+
+static bool _readable(int pdfd)
+{
+	struct pollfd pfd = {
+		.fd = pdfd,
+		.events = POLLIN
+	};
+
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+/* Next frame to parse, reading once if nothing is buffered. Sets
+ * *failed if the descriptor returned an error. */
+static char *_nextFrame(struct source_state *s, bool *failed)
+{
+	struct framebuf *fb = &s->fb;
+
+	if (_coalesce)
+		_drainNewest(s);
+
+	char *frame = framebuf_next(fb, NULL);
+
+	/* Only go to the descriptor when nothing is buffered */
+	if (!frame) {
+		ssize_t readresult = framebuf_fill(fb);
+
+		if (readresult < 0) {
+			if (errno != EINTR && errno != EAGAIN)
+				*failed = true;
+
+			return NULL;
+		}
+
+		frame = framebuf_next(fb, NULL);
+	}
+
+	if (frame)
+		_captureFrame(s, frame);
+
+	return frame;
+}
+
+/* Next datagram to parse, receiving a batch if none is left. With
+ * coalescing only the newest of everything waiting is returned. */
+static char *_nextDatagram(struct source_state *s, bool *failed)
+{
+	struct dgrambuf *db = &s->db;
+	char *frame = dgram_next(db, NULL);
+
+	if (!frame) {
+		/* A connected UDP socket reports an unreachable peer
+		 * here, which only means nobody is sending yet */
+		if (dgram_fill(db) < 0) {
+			if (errno != EINTR && errno != EAGAIN &&
+			    errno != ECONNREFUSED)
+				*failed = true;
+
+			return NULL;
+		}
+
+		frame = dgram_next(db, NULL);
+	}
+
+	/* Coalesce within the batch at hand only. Another batch would
+	 * overwrite the frame before it is parsed, and may hold nothing
+	 * valid to replace it. */
+	while (_coalesce && frame) {
+		char *newer = dgram_next(db, NULL);
+
+		if (!newer)
+			break;
+
+		_captureFrame(s, frame);
+		++_stats.skipped;
+		frame = newer;
+	}
+
+	if (frame)
+		_captureFrame(s, frame);
+
+	return frame;
+}
+
+/* True if a frame is already received and waiting to be parsed */
+static bool _buffered(struct source_state *s)
+{
+	return s->dgram ? dgram_ready(&s->db) : framebuf_ready(&s->fb);
+}
+
+/* True if a source has input left that epoll will not report: frames
+ * already buffered, or a file epoll refused that is short of its end */
+static bool _unannounced()
+{
+	for (int i = 0; i < _nsrc; ++i) {
+		struct source_state *s = &_src[i];
+
+		if (_buffered(s) || (!s->pollable && !s->fb.eof))
+			return true;
+	}
+
+	return false;
+}
+
+/* Copy the metrics out for other processes. Only the display thread
+ * loads metrics, so this is the segment's one writer. */
+static void _publishMetrics()
+{
+	if (!_shm)
+		return;
+
+	struct shmsnap_metric *out = shmsnap_begin(_shm);
+	unsigned cap = shmsnap_capacity(_shm);
+	unsigned n = 0;
+
+	for (; n < cap && !metric_is_empty(&_metrics[n]); ++n) {
+		struct metric *m = &_metrics[n];
+
+		memcpy(out[n].name, m->name, sizeof(out[n].name));
+		memcpy(out[n].unit, m->unit, sizeof(out[n].unit));
+		out[n].precision = m->precision;
+		out[n].value = m->value;
+		out[n].timemillis = m->timemillis;
+	}
+
+	shmsnap_end(_shm, n);
+}
+
+/* Record a loaded value, then bring the trend and range drawn next to
+ * it up to date. Both come from the history without scanning it. */
+static void _trackHistory(struct metric *m, int s)
+{
+	double trend[METRIC_TREND_LEN];
+	double min;
+	double max;
+	int n;
+
+	history_append(_history, s, _deviceTime(m), m->value);
+
+	if (!history_range(_history, s, &min, &max))
+		return;
+
+	n = history_last(_history, s, trend, METRIC_TREND_LEN);
+
+	if (n == m->ntrend && min == m->min && max == m->max &&
+	    memcmp(trend, m->trend, n * sizeof(*trend)) == 0)
+		return;
+
+	memcpy(m->trend, trend, n * sizeof(*trend));
+	m->ntrend = n;
+	m->min = min;
+	m->max = max;
+	m->dirty = true;
+}
+
+/* Devices without a clock get the time the value arrived */
+static int64_t _deviceTime(const struct metric *m)
+{
+	struct timespec ts;
+
+	if (m->timemillis != 0)
+		return m->timemillis;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Save the sketches now and then, so a crash loses little of a long
+ * session */
+static void _saveSketches()
+{
+	struct timespec now;
+
+	if (!_sketches || !_sketchpath)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (now.tv_sec - _sketchsaved < DATA_OPS_SKETCH_SAVE_SEC)
+		return;
+
+	_sketchsaved = now.tv_sec;
+
+	if (sketchset_save(_sketches, _sketchpath) < 0)
+		perror("Failed to save quantile sketches: ");
+}
+
+/* Write the open blocks now and then, so a crash loses little of a
+ * slow metric. A failed write is kept in the store's error. */
+static void _flushColumns()
+{
+	struct timespec now;
+
+	if (!_columns)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (now.tv_sec - _columnsflushed < DATA_OPS_COLUMN_FLUSH_SEC)
+		return;
+
+	_columnsflushed = now.tv_sec;
+	tsstore_flush(_columns);
+}
+
+static void _relayFrame(char *frame)
+{
+	struct iovec iov[2] = {
+		{ .iov_base = frame, .iov_len = strlen(frame) },
+		{ .iov_base = "\n", .iov_len = 1 }
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = 2
+	};
+
+	/* The parser may rewrite the frame in place, so it goes out
+	 * before parsing */
+	if (sendmsg(_relayfd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0)
+		++_stats.relayed;
+}
+
+/* Record a frame as received, before the parser may rewrite it */
+static void _captureFrame(struct source_state *s, const char *frame)
+{
+	if (_capture)
+		capture_write(_capture, (int) (s - _src), frame, strlen(frame));
+}
+
+static int _startIngest()
+{
+	assert(!_ingest_running);
+	assert(_epfd >= 0);
+
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL
+	};
+
+	snapring_init(&_ring);
+
+	/* Snapshots go on from what _initialLoad() loaded */
+	for (int i = 0; i < _nsrc; ++i) {
+		_snap_loaded[i] = _src[i].loaded;
+	}
+
+	_snap_nsegments = _nsrc;
+
+	_wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	_stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if (_wakefd < 0 || _stopfd < 0 ||
+	    epoll_ctl(_epfd, EPOLL_CTL_ADD, _stopfd, &ev) < 0) {
+		_stopIngest();
+		return -1;
+	}
+
+	if ((errno = pthread_create(&_ingest_thread, NULL,
+				    _ingestMain, NULL)) != 0) {
+		_stopIngest();
+		return -1;
+	}
+
+	_ingest_running = true;
+
+	return 0;
+}
+
+static void _stopIngest()
+{
+	if (_ingest_running) {
+		uint64_t one = 1;
+
+		if (write(_stopfd, &one, sizeof(one)) < 0)
+			perror("Error stopping ingest thread: ");
+
+		/* Called from a signal handler on the ingest thread
+		 * itself when it aborts */
+		if (!pthread_equal(pthread_self(), _ingest_thread))
+			pthread_join(_ingest_thread, NULL);
+
+		_ingest_running = false;
+	}
+
+	if (_stopfd >= 0 && _epfd >= 0)
+		epoll_ctl(_epfd, EPOLL_CTL_DEL, _stopfd, NULL);
+
+	if (_wakefd >= 0)
+		close(_wakefd);
+
+	if (_stopfd >= 0)
+		close(_stopfd);
+
+	_wakefd = -1;
+	_stopfd = -1;
+
+	snapring_free(&_ring);
+}
+
+static void *_ingestMain(void *arg)
+{
+	bool pending = false;
+	bool stop = false;
+	sigset_t mask;
+
+	(void) arg;
+
+	/* Terminal and exit signals belong to the display thread */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGWINCH);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	while (!stop) {
+		int timeout = pending ? DATA_OPS_RETRY_MS : -1;
+		int updated = _ingestStep(timeout, &stop);
+
+		if (updated < 0) {
+			struct pollfd pfd = {
+				.fd = _stopfd,
+				.events = POLLIN
+			};
+
+			while (!_publishSnapshot(true)) {
+				if (poll(&pfd, 1, DATA_OPS_RETRY_MS) > 0)
+					return NULL;
+			}
+
+			return NULL;
+		}
+
+		if (updated > 0)
+			pending = true;
+
+		/* Keep the newest frames until the display frees a
+		 * slot for them */
+		if (pending && _publishSnapshot(false))
+			pending = false;
+	}
+
+	return NULL;
+}
+
+static bool _publishSnapshot(bool failed)
+{
+	struct snapshot *snap = snapring_claim(&_ring);
+	uint64_t one = 1;
+	int n = 0;
+
+	if (!snap)
+		return false;
+
+	for (int i = 0; i < _nsrc; ++i) {
+		n += _src[i].last.nfields;
+	}
+
+	if (failed || snapshot_reserve(snap, n) < 0) {
+		snap->nfields = -1;
+	} else {
+		snap->nfields = 0;
+		snap->nsegments = _nsrc;
+
+		for (int i = 0; i < _nsrc; ++i) {
+			struct snapshot *last = &_src[i].last;
+
+			memcpy(snap->fields + snap->nfields, last->fields,
+			       last->nfields * sizeof(struct datafield));
+			snap->nfields += last->nfields;
+			snap->segments[i] = last->nfields;
+			snap->updated[i] = _src[i].updated;
+			_src[i].updated = false;
+		}
+	}
+
+	snapring_publish(&_ring);
+
+	if (write(_wakefd, &one, sizeof(one)) < 0)
+		perror("Error waking display thread: ");
+
+	return true;
+}
+
+static int _pollSnapshot(long mstimeout)
+{
+	struct pollfd pfd = {
+		.fd = _wakefd,
+		.events = POLLIN
+	};
+	struct snapshot *snap;
+	uint64_t count;
+	int ret = 0;
+
+	int pollresult = poll(&pfd, 1, mstimeout);
+
+	if (pollresult < 0) {
+		if (errno == EINTR)
+			return 1;
+
+		perror("Critical Error polling ingest thread: ");
+		return -1;
+	}
+
+	if (pollresult == 0)
+		return 1;
+
+	if (read(_wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		perror("Critical Error reading ingest thread: ");
+		return -1;
+	}
+
+	snap = snapring_newest(&_ring, &_snap_skipped);
+
+	if (!snap)
+		return 1;
+
+	if (snap->nfields < 0)
+		ret = -1;
+	else
+		_loadSnapshot(snap);
+
+	snapring_release(&_ring);
+
+	return ret;
+}
+
+/* Watch a regular file for appends and itself being moved or deleted,
+ * and its directory for the next file being created under its path */
+static int _startFollow(struct source_state *s, const char *path)
+{
+	struct stat st;
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = s
+	};
+	char dir[PATH_MAX];
+	const char *slash = strrchr(path, '/');
+
+	if (fstat(s->fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return 0;
+
+	if (!slash)
+		strcpy(dir, ".");
+	else if (slash == path)
+		strcpy(dir, "/");
+	else
+		snprintf(dir, sizeof(dir), "%.*s", (int) (slash - path), path);
+
+	if ((s->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		return -1;
+
+	s->wd = inotify_add_watch(s->ifd, path, DATA_OPS_FOLLOW_EVENTS);
+
+	if (s->wd < 0 ||
+	    inotify_add_watch(s->ifd, dir, IN_CREATE | IN_MOVED_TO) < 0 ||
+	    epoll_ctl(_epfd, EPOLL_CTL_ADD, s->ifd, &ev) < 0) {
+		close(s->ifd);
+		return -1;
+	}
+
+	s->follow = true;
+	s->path = path;
+	s->fb.follow = true;
+
+	return 0;
+}
+
+/* Take in what inotify reports. Appends need nothing more than the
+ * read that follows, a truncated file is read again from its start,
+ * and a file moved or deleted away is reopened once read to its end.
+ * Files created in the directory only wake a rotated file up. */
+static void _follow(struct source_state *s)
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *iev;
+	bool modified = false;
+	ssize_t n;
+
+	while ((n = read(s->ifd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + n; p += sizeof(*iev) + iev->len) {
+			iev = (const struct inotify_event*) p;
+
+			if (iev->wd != s->wd)
+				continue;
+
+			modified = modified || (iev->mask & IN_MODIFY);
+
+			/* What was appended before the rename is only
+			 * known to be read once a read comes back empty
+			 * after it, so the end seen before does not count */
+			if (iev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+				s->rotated = true;
+				s->fb.eof = false;
+			}
+		}
+	}
+
+	if (modified && !s->rotated) {
+		struct stat st;
+		off_t at = lseek(s->fd, 0, SEEK_CUR);
+
+		if (at >= 0 && fstat(s->fd, &st) == 0 && st.st_size < at) {
+			lseek(s->fd, 0, SEEK_SET);
+			framebuf_reset(&s->fb);
+		}
+	}
+}
+
+/* Open the path of a rotated file again, in place of the old file.
+ * Returns false if nothing has been created under the path yet. */
+static bool _reopen(struct source_state *s)
+{
+	int fd = open(s->path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return false;
+
+	/* A moved file keeps its watch, a deleted one has lost it */
+	inotify_rm_watch(s->ifd, s->wd);
+	s->wd = inotify_add_watch(s->ifd, s->path, DATA_OPS_FOLLOW_EVENTS);
+
+	/* Keep the descriptor number, the caller owns it */
+	dup2(fd, s->fd);
+	close(fd);
+
+	framebuf_reset(&s->fb);
+	s->rotated = false;
+
+	return true;
 }
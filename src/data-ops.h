@@ -3,6 +3,13 @@
 
 #include "jsonparse.h"
 #include "display-driver.h"
+#include "shmsnap.h"
+#include "history.h"
+#include "rollstats.h"
+#include "sketch.h"
+#include "rollup.h"
+#include "capture.h"
+#include "tsstore.h"
 
 #include <stdint.h>
 
@@ -10,18 +17,210 @@
 extern "C" {
 #endif /* #ifdef __cplusplus */
 
-	extern struct datafield errordf[1];
+#ifndef DATA_OPS_MAX_SOURCES
+#define DATA_OPS_MAX_SOURCES 32
+#endif /* #ifndef DATA_OPS_MAX_SOURCES */
+
+/* Seconds between saves of the quantile sketches */
+#ifndef DATA_OPS_SKETCH_SAVE_SEC
+#define DATA_OPS_SKETCH_SAVE_SEC 300
+#endif /* #ifndef DATA_OPS_SKETCH_SAVE_SEC */
+
+/* Seconds between writes of the open blocks of the columnar store */
+#ifndef DATA_OPS_COLUMN_FLUSH_SEC
+#define DATA_OPS_COLUMN_FLUSH_SEC 600
+#endif /* #ifndef DATA_OPS_COLUMN_FLUSH_SEC */
 
-	struct datafield **pollData(struct datafield **df, uint32_t ms);
+	extern struct datafield errordf[1];
 
-	struct datafield **parseData(int pdfd, struct datafield** df);
+/** Counters kept by the data ingest path
+ *
+ * @param frames Frames handed to the parser
+ *
+ * @param skipped Frames dropped unparsed because a newer frame was
+ * already buffered (see setCoalesce()), or parsed on the ingest thread
+ * but replaced before the display got to them (see setThreaded())
+ *
+ * @param oversized Lines discarded for being too long to frame
+ *
+ * @param datagrams Datagrams received on datagram sockets, each one a
+ * frame
+ *
+ * @param truncated Datagrams discarded for being too long to frame
+ *
+ * @param dropped Datagrams the kernel dropped because a socket
+ * receive queue was full, where the kernel reports it
+ *
+ * @param relayed Frames sent on to the relay (see setRelay())
+ */
+	struct datastats {
+		unsigned long frames;
+		unsigned long skipped;
+		unsigned long oversized;
+		unsigned long datagrams;
+		unsigned long truncated;
+		unsigned long dropped;
+		unsigned long relayed;
+	};
 
 	bool isErrorDatafield(const struct datafield *df);
 
+	void setCoalesce(bool enable);
+
+	void setThreaded(bool enable);
+
+/** Send every frame read on to another socket as it arrives
+ *
+ * Each frame is sent as one datagram ending in a newline before it is
+ * parsed, so other displays can receive it. Frames skipped by
+ * coalescing are not sent. Sending never blocks; frames the socket
+ * has no room for are lost.
+ *
+ * @param fd Connected datagram socket, or -1 to stop relaying
+ */
+	void setRelay(int fd);
+
+/** Publish the metrics to a shared memory segment on every update
+ *
+ * @param shm Segment from shmsnap_create(), or NULL to stop
+ * publishing. Metrics beyond its capacity are left out.
+ */
+	void setPublisher(struct shmsnap *shm);
+
+/* The history, rollups, columns and sketches take each value as it is
+ * loaded into its metric, under the metric's name. Frames skipped by
+ * coalescing or by the ingest thread are never loaded, and a source
+ * that sent nothing new adds nothing, so each reading counts once.
+ * Metrics that come up once a sink has no series left go without. */
+
+/** Keep a history of every displayed metric
+ *
+ * Each value is appended to the metric's series, and the form shows a
+ * sparkline of the newest values and the range of the whole series
+ * next to it.
+ *
+ * @param h History from history_init(), or NULL for none. Must be set
+ * before the form is configured.
+ */
+	void setHistory(struct history *h);
+
+/** Keep rolling statistics of every displayed metric
+ *
+ * Every metric takes a sample on every update of the display, so the
+ * window counts updates. A source that sent nothing new in an update
+ * repeats its last values. The form shows the statistics on a page of
+ * their own.
+ *
+ * @param st Statistics from rollstats_init(), or NULL for none. Must
+ * be set before the form is configured.
+ */
+	void setStatistics(struct rollstats *st);
+
+/** Aggregate every displayed metric over seconds, minutes and hours
+ *
+ * Each value is counted at the device time of its frame, or at the
+ * time it arrived if the device sends none. The form can show the
+ * aggregates in place of the readings.
+ *
+ * @param r Rollup from rollup_init(), or NULL for none. Must be set
+ * before the form is configured.
+ */
+	void setRollup(struct rollup *r);
+
+/** Record every frame received in a capture log
+ *
+ * Frames are recorded as read, before they are parsed, including those
+ * skipped by coalescing. Recording only copies the frame; the capture
+ * writes it out on a thread of its own.
+ *
+ * @param c Capture from capture_open(), or NULL to stop recording
+ */
+	void setCapture(struct capture *c);
+
+/** Store every displayed metric in a columnar store
+ *
+ * Each value is appended to the metric's column at the device time of
+ * its frame, or at the time it arrived if the device sends none.
+ * Blocks are written out once full and every DATA_OPS_COLUMN_FLUSH_SEC
+ * seconds, on the display thread.
+ *
+ * @param ts Store from tsstore_open(), or NULL for none. Must be set
+ * before the form is configured.
+ */
+	void setColumns(struct tsstore *ts);
+
+/** Follow regular files as they grow, like tail -F
+ *
+ * Once a followed file is read to its end, inotify wakes the reader up
+ * when more is appended, rather than the file being left behind. A
+ * line is only taken once its newline is written, so a frame caught
+ * half written is never parsed. A file truncated in place is read again
+ * from its start. A file moved or deleted away, as log rotation does,
+ * is read to its end and the path is then opened again, waiting for
+ * the new file to be created if need be.
+ *
+ * @param paths Path each source was opened from, or NULL for sources
+ * not to follow. Sources that are not regular files are never
+ * followed. The paths must stay valid while the sources are read.
+ *
+ * @param n Number of paths. Must be set before the form is configured.
+ */
+	void setFollow(const char *const *paths, int n);
+
+/** Keep a quantile sketch of every displayed metric
+ *
+ * Each value is counted in the metric's sketch, and the form shows the
+ * quantiles on a page of their own.
+ *
+ * @param set Sketches from sketchset_init(), or NULL for none. Must be
+ * set before the form is configured.
+ *
+ * @param path File to save the sketches to every
+ * DATA_OPS_SKETCH_SAVE_SEC seconds, or NULL
+ */
+	void setSketches(struct sketchset *set, const char *path);
+
+	void getDataStats(struct datastats *st);
+
 	int ncursesPollCB(long mstimeout);
 
+/** Quantiles of a displayed metric, for the form's quantiles_cb
+ *
+ * @return Samples the quantiles cover, 0 if the metric has none
+ */
+	unsigned long ncursesQuantiles(int metric, const double *q, int n,
+				       double *out);
+
+/** Newest buckets of a displayed metric, for the form's rollup_cb
+ *
+ * @return Buckets copied, 0 if the metric has none
+ */
+	unsigned ncursesRollup(int metric, int tier, struct rollup_bucket *out,
+			       unsigned n);
+
 	struct metric_form *ncursesCFG(int pdfd);
 
+/** Set up the metric form for several input streams
+ *
+ * Every stream is watched through one epoll set and framed and parsed
+ * on its own, so a slow or silent stream does not hold up the
+ * others. Blocks until the first frame arrives from any stream.
+ *
+ * @param fds Descriptors to read frames from
+ *
+ * @param labels Short name for each stream. With more than one stream
+ * every metric name is prefixed with "<label>:". May be NULL.
+ *
+ * @param n Number of streams, at most DATA_OPS_MAX_SOURCES
+ *
+ * @return The configured form, ready for metric_form_init()
+ */
+	struct metric_form *ncursesCFGSources(const int *fds,
+					      const char *const *labels,
+					      int n);
+
+	int ncursesSetPrecision(const char *name, int digits);
+
 	void ncursesFreeMetric();
 
 	void ncursesEmergExit();
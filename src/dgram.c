@@ -0,0 +1,174 @@
+#define _GNU_SOURCE /* recvmmsg() */
+
+#include "dgram.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* Per-batch receive state, kept out of the header so it does not
+ * need _GNU_SOURCE */
+struct dgram_batch {
+	struct mmsghdr msgs[DGRAM_BATCH];
+	struct iovec iov[DGRAM_BATCH];
+	char ctl[DGRAM_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+};
+
+static void _count_drops(struct dgrambuf *db, struct msghdr *hdr);
+
+int dgram_init(struct dgrambuf *db, int fd, size_t len)
+{
+	int on = 1;
+
+	assert(db);
+
+	if (len == 0)
+		len = DGRAM_DEFAULT_LEN;
+
+	memset(db, 0, sizeof(*db));
+	db->fd = fd;
+	db->buf = (char*) malloc(len * DGRAM_BATCH);
+	db->msgs = (struct dgram_batch*) malloc(sizeof(*db->msgs));
+
+	if (!db->buf || !db->msgs) {
+		dgram_free(db);
+		return -1;
+	}
+
+	db->len = len;
+
+	/* Not every socket type supports it, so only best effort */
+#ifdef SO_RXQ_OVFL
+	setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+#else
+	(void) on;
+#endif /* #ifdef SO_RXQ_OVFL */
+
+	return 0;
+}
+
+void dgram_free(struct dgrambuf *db)
+{
+	assert(db);
+
+	free(db->buf);
+	free(db->msgs);
+	memset(db, 0, sizeof(*db));
+	db->fd = -1;
+}
+
+int dgram_fill(struct dgrambuf *db)
+{
+	assert(db);
+	assert(db->buf);
+
+	db->count = 0;
+	db->next = 0;
+
+	struct dgram_batch *b = db->msgs;
+
+	/* Keep the last byte of every buffer for the terminator */
+	for (int i = 0; i < DGRAM_BATCH; ++i) {
+		struct msghdr *hdr = &b->msgs[i].msg_hdr;
+
+		b->iov[i].iov_base = db->buf + i * db->len;
+		b->iov[i].iov_len = db->len - 1;
+
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->msg_iov = &b->iov[i];
+		hdr->msg_iovlen = 1;
+		hdr->msg_control = b->ctl[i];
+		hdr->msg_controllen = sizeof(b->ctl[i]);
+	}
+
+	int n = recvmmsg(db->fd, b->msgs, DGRAM_BATCH, MSG_DONTWAIT, NULL);
+
+	if (n < 0)
+		return -1;
+
+	db->count = n;
+	db->received += n;
+
+	for (int i = 0; i < n; ++i) {
+		_count_drops(db, &b->msgs[i].msg_hdr);
+	}
+
+	return n;
+}
+
+char *dgram_next(struct dgrambuf *db, size_t *len)
+{
+	assert(db);
+
+	while (db->next < db->count) {
+		struct mmsghdr *m = &db->msgs->msgs[db->next];
+		char *frame = db->buf + db->next * db->len;
+		size_t flen = m->msg_len;
+
+		++db->next;
+
+		if (m->msg_hdr.msg_flags & MSG_TRUNC) {
+			++db->truncated;
+			continue;
+		}
+
+		/* Line endings are optional on datagrams */
+		while (flen > 0 && (frame[flen - 1] == '\n' ||
+				    frame[flen - 1] == '\r'))
+			--flen;
+
+		if (flen == 0)
+			continue;
+
+		frame[flen] = '\0';
+
+		if (len)
+			*len = flen;
+
+		return frame;
+	}
+
+	return NULL;
+}
+
+bool dgram_ready(struct dgrambuf *db)
+{
+	assert(db);
+
+	/* Any left may still be empty or truncated, which is only
+	 * found out by dgram_next() */
+	return db->next < db->count;
+}
+
+bool dgram_is_socket(int fd)
+{
+	int type;
+	socklen_t len = sizeof(type);
+
+	return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 &&
+		type == SOCK_DGRAM;
+}
+
+/* The kernel reports its running total of drops on every datagram */
+static void _count_drops(struct dgrambuf *db, struct msghdr *hdr)
+{
+#ifdef SO_RXQ_OVFL
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(hdr); c;
+	     c = CMSG_NXTHDR(hdr, c)) {
+		uint32_t total;
+
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SO_RXQ_OVFL)
+			continue;
+
+		memcpy(&total, CMSG_DATA(c), sizeof(total));
+		db->dropped += total - db->kdrops;
+		db->kdrops = total;
+	}
+#else
+	(void) db;
+	(void) hdr;
+#endif /* #ifdef SO_RXQ_OVFL */
+}
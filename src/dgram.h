@@ -0,0 +1,117 @@
+#ifndef DGRAM_H
+#define DGRAM_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* #ifdef __cplusplus */
+
+#ifndef DGRAM_DEFAULT_LEN
+#define DGRAM_DEFAULT_LEN 4096
+#endif /* #ifndef DGRAM_DEFAULT_LEN */
+
+#ifndef DGRAM_BATCH
+#define DGRAM_BATCH 16
+#endif /* #ifndef DGRAM_BATCH */
+
+/** Batched datagram receiver for a single socket
+ *
+ * Every datagram is one frame. Up to DGRAM_BATCH datagrams are
+ * received with a single recvmmsg() into buffers allocated once, and
+ * handed out in place, NUL-terminated and without trailing line
+ * endings. Datagrams that did not fit a buffer are counted and
+ * dropped rather than parsed half.
+ *
+ * @param fd Socket the receiver reads from
+ *
+ * @param len Length of each datagram buffer
+ *
+ * @param buf Backing storage for DGRAM_BATCH buffers of @p len bytes
+ *
+ * @param msgs Receive headers, I/O vectors and control message space
+ * for the batch, allocated with @p buf
+ *
+ * @param count Number of datagrams in the current batch
+ *
+ * @param next Index of the next datagram to hand out
+ *
+ * @param received Number of datagrams received
+ *
+ * @param truncated Number of datagrams dropped for not fitting a
+ * buffer
+ *
+ * @param dropped Number of datagrams the kernel dropped because the
+ * socket receive queue was full
+ *
+ * @param kdrops Last drop counter reported by the kernel
+ */
+	struct dgrambuf {
+		int fd;
+		size_t len;
+		char *buf;
+		struct dgram_batch *msgs;
+		int count;
+		int next;
+		unsigned long received;
+		unsigned long truncated;
+		unsigned long dropped;
+		uint32_t kdrops;
+	};
+
+/** Allocate the receive buffers and attach them to a socket
+ *
+ * The kernel is asked to report receive queue overflows, which are
+ * counted in @ref dgrambuf.dropped where supported.
+ *
+ * @param db Receiver to initialize
+ *
+ * @param fd Datagram socket to read from
+ *
+ * @param len Length of each buffer, which is also the longest frame
+ * accepted. DGRAM_DEFAULT_LEN is used if 0.
+ *
+ * @return 0 on success, -1 if the buffers could not be allocated
+ */
+	int dgram_init(struct dgrambuf *db, int fd, size_t len);
+
+/** Release the buffers and detach from the socket */
+	void dgram_free(struct dgrambuf *db);
+
+/** Receive one batch of waiting datagrams without blocking
+ *
+ * Datagrams not yet handed out from the previous batch are dropped.
+ *
+ * @return Number of datagrams received, or -1 with errno set. EAGAIN
+ * means nothing was waiting.
+ */
+	int dgram_fill(struct dgrambuf *db);
+
+/** Return the next datagram of the current batch
+ *
+ * The frame stays valid until the next call to dgram_fill(). Empty
+ * and truncated datagrams are skipped.
+ *
+ * @param db Receiver to take the frame from
+ *
+ * @param len If not NULL, receives the length of the frame
+ *
+ * @return Pointer to the frame, or NULL if the batch is used up
+ */
+	char *dgram_next(struct dgrambuf *db, size_t *len);
+
+/** Checks if the current batch still holds a datagram */
+	bool dgram_ready(struct dgrambuf *db);
+
+/** Checks if a descriptor is a datagram socket, whose input should be
+ * framed by datagram rather than by line */
+	bool dgram_is_socket(int fd);
+
+#ifdef __cplusplus
+}
+#endif /* #ifdef __cplusplus */
+
+#endif /* #ifndef DGRAM_H */
@@ -1,4 +1,5 @@
 #include "display-driver.h"
+#include "numfmt.h"
 
 #include <form.h>
 #include <assert.h>
@@ -9,6 +10,13 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include <poll.h>
+#include <langinfo.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 #ifndef VM_VERSION
 #define VM_VERSION "Unknown"
@@ -20,30 +28,175 @@
 #define DISPLAY_MAX_ROWS 200
 #define DISPLAY_MIN_ROWS 23
 
+/* Columns of the window range shown after the sparkline */
+#define DISPLAY_RANGE_WIDTH 19
+
+#define DISPLAY_MAX_COLUMNS 6
+#define DISPLAY_TEXT_LEN 48
+
+/* Data poll timeout when the form has no descriptor to wait on */
+#define DISPLAY_POLL_MS 500
+
 /* Flags */
-#define METRIC_FLAG_WINRESIZE 0x01
 #define METRIC_FLAG_EXIT 0x02
 
-#define ARRAY_LEN(array) sizeof(array)/sizeof(array[0])
+/* Descriptors the form loop waits on */
+enum {
+	DISPLAY_FD_DATA = 0,
+	DISPLAY_FD_SIGNAL,
+	DISPLAY_FD_TIMER,
+	DISPLAY_FD_WAKE,
+	DISPLAY_FD_KEYS,
+	DISPLAY_FD_COUNT
+};
+
+#define ARRAY_LEN(array) (sizeof(array) / sizeof((array)[0]))
+
+/* What a column of the form shows */
+enum column_kind {
+	COLUMN_NAME,
+	COLUMN_VALUE,
+	COLUMN_UNIT,
+	COLUMN_TREND,
+	COLUMN_RANGE,
+	COLUMN_MEAN,
+	COLUMN_STDDEV,
+	COLUMN_MIN,
+	COLUMN_MAX,
+	COLUMN_EWMA,
+	COLUMN_P50,
+	COLUMN_P95,
+	COLUMN_P99,
+	COLUMN_SAMPLES
+};
+
+struct column {
+	enum column_kind kind;
+	int width;
+	int col;
+	const char *heading;
+};
+
+/* A set of columns the form can show, switched with 's'. Views of
+ * statistics or quantiles are only offered if the form has them. */
+struct view {
+	const struct column *columns;
+	int ncolumns;
+	bool stats;
+	bool quantiles;
+};
+
+static const struct column _reading_columns[] = {
+	{ COLUMN_NAME, 22, 1, NULL },
+	{ COLUMN_VALUE, 12, 24, NULL },
+	{ COLUMN_UNIT, 8, 37, NULL },
+	{ COLUMN_TREND, METRIC_TREND_LEN, 46, NULL },
+	{ COLUMN_RANGE, DISPLAY_RANGE_WIDTH, 55, NULL }
+};
+
+static const struct column _stats_columns[] = {
+	{ COLUMN_NAME, 18, 1, NULL },
+	{ COLUMN_MEAN, 10, 20, "mean" },
+	{ COLUMN_STDDEV, 9, 31, "sd" },
+	{ COLUMN_MIN, 10, 41, "min" },
+	{ COLUMN_MAX, 10, 52, "max" },
+	{ COLUMN_EWMA, 10, 63, "ewma" }
+};
+
+static const struct column _quantile_columns[] = {
+	{ COLUMN_NAME, 18, 1, NULL },
+	{ COLUMN_P50, 10, 20, "p50" },
+	{ COLUMN_P95, 10, 31, "p95" },
+	{ COLUMN_P99, 10, 42, "p99" },
+	{ COLUMN_SAMPLES, 12, 53, "samples" }
+};
+
+/* Quantiles of the COLUMN_P50 to COLUMN_P99 columns, in order */
+static const double _quantiles[] = { 0.5, 0.95, 0.99 };
+
+static const struct view _views[] = {
+	{ _reading_columns, ARRAY_LEN(_reading_columns), false, false },
+	{ _stats_columns, ARRAY_LEN(_stats_columns), true, false },
+	{ _quantile_columns, ARRAY_LEN(_quantile_columns), false, true }
+};
+
+static int _view = 0;
+
+/* Rollup tier the readings show the means of, switched with 'r', or
+ * -1 for the instantaneous values */
+static int _tier = -1;
+static const char *const _tier_headings[ROLLUP_TIERS] = {
+	"1 s mean", "1 min mean", "1 h mean"
+};
 
 static uint8_t _metric_flags = 0;
 static FIELD** fields = NULL;
-static FIELD** names = NULL;
-static FIELD** values = NULL;
-static FIELD** units = NULL;
+static FIELD** _cells = NULL;	/* DISPLAY_MAX_COLUMNS per slot */
 static FORM* form = NULL;
 static WINDOW* win_form = NULL;
 static WINDOW* win_main = NULL;
-static uint8_t ignore_poll_error = 0;
 static char _last_update_str[32] = {'\0'};
+static char _clock_str[16] = {'\0'};
+
+/* Signals, the clock tick and exit requests arrive as descriptors so
+ * the loop can block on all of them and the data at once */
+static int _sigfd = -1;
+static int _timerfd = -1;
+static int _wakefd = -1;
+static bool _keys = false;
+static sigset_t _oldmask;
+
+/* Sparkline levels, lowest first. Block elements need a UTF-8
+ * terminal, anything else gets plain characters. */
+static const char *const _ramp_utf8[] = {
+	"\u2581", "\u2582", "\u2583", "\u2584",
+	"\u2585", "\u2586", "\u2587", "\u2588"
+};
+static const char *const _ramp_ascii[] = {
+	"_", ".", "-", "~", "=", "+", "*", "#"
+};
+static const char *const *_ramp = _ramp_ascii;
+
+/* Value last written to each value field, so an unchanged value is
+ * not formatted again, and the text of the other columns */
+struct shownvalue {
+	double value;
+	int precision;
+	bool valid;
+	char text[DISPLAY_MAX_COLUMNS][DISPLAY_TEXT_LEN];
+};
+
+static struct shownvalue *shown = NULL;
+
+/* Index of the metric shown in each field slot, -1 if none */
+static int *slotmap = NULL;
 
 /* Local function definitions */
-static void _update_fields(struct metric_form *mf);
+static int _update_fields(struct metric_form *mf);
+static void _layout_fields(struct metric_form *mf);
+static int _set_fields(struct metric_form *mf, int paddr,
+		       const struct metric *met, bool relayout);
+static int _set_value_field(FIELD *field, struct shownvalue *sv,
+			    const struct metric *met);
+static void _format_column(char *buf, const struct column *col,
+			   const struct metric_form *mf,
+			   const struct metric *met, int mi,
+			   const double *quantiles);
+static bool _view_available(const struct metric_form *mf, int view);
+static bool _rolled_metric(const struct metric_form *mf, int mi,
+			   const struct metric *met, struct metric *out);
+static void _format_trend(char *buf, const struct metric *met);
+static void _format_range(char *buf, size_t len, const struct metric *met);
 static int _assign_form_to_win(struct metric_form *mf);
 static void _allocate_fields(struct metric_form *mf);
 static void _define_win_size(struct metric_form *mf);
 static void _resize_window(struct metric_form *mf);
-static void _handle_winch(int sig);
+static int _open_events(struct metric_form *mf);
+static void _close_events();
+static void _read_signals(struct metric_form *mf);
+static void _read_keys(struct metric_form *mf);
+static void _drain(int fd);
+static void _clock_time();
 static void _free_fields();
 static unsigned int _fields_per_page(struct metric_form *mf);
 static void _form_setup_window();
@@ -61,36 +214,52 @@ int metric_form_init(struct metric_form *mf)
 {
 	assert(mf);
 
-	signal(SIGWINCH, _handle_winch);
+	/* Frames may already be waiting where data_fd does not announce
+	 * them, such as the rest of a file, so poll once before sleeping */
+	bool pending = true;
+
+	_view = 0;
+	_tier = -1;
+
+	/* The locale must be set by the program for this to pick up
+	 * a UTF-8 terminal */
+	_ramp = strcmp(nl_langinfo(CODESET), "UTF-8") == 0
+		? _ramp_utf8 : _ramp_ascii;
 
 	initscr();
 
+	if (_open_events(mf) < 0) {
+		perror("Critical Error setting up form events: ");
+		_form_exit();
+		return 1;
+	}
+
 	_define_win_size(mf);
 
 	assert(win_main);
 	assert(win_form);
 
 	_allocate_fields(mf);
+	mf->relayout = true;
 	_update_fields(mf);
 	form = new_form(fields);
 	assert(form);
 
 	if (_assign_form_to_win(mf) != 0) {
+		_form_exit();
 		return 1;
 	}
 
 	_form_setup_window();
 
 	post_form(form);
+	_clock_time();
 	_metric_form_refresh(mf);
 
 	for (;;) {
-		int ret;
-
-		if (_metric_flags & METRIC_FLAG_WINRESIZE) {
-			_resize_window(mf);
-			_metric_flags &= ~METRIC_FLAG_WINRESIZE;
-		}
+		struct pollfd pfd[DISPLAY_FD_COUNT];
+		int timeout = pending || mf->data_fd < 0 ? 0 : -1;
+		int ret = 1;
 
 		/* Exit if receive signal */
 		if (_metric_flags & METRIC_FLAG_EXIT) {
@@ -98,15 +267,59 @@ int metric_form_init(struct metric_form *mf)
 			return 0;
 		}
 
-		ret = mf->polldata_cb(500); /* 500 ms timout on user poll */
+		/* Negative descriptors are ignored by poll() */
+		pfd[DISPLAY_FD_DATA].fd = mf->data_fd;
+		pfd[DISPLAY_FD_SIGNAL].fd = _sigfd;
+		pfd[DISPLAY_FD_TIMER].fd = _timerfd;
+		pfd[DISPLAY_FD_WAKE].fd = _wakefd;
+		pfd[DISPLAY_FD_KEYS].fd = _keys ? STDIN_FILENO : -1;
+
+		for (int i = 0; i < DISPLAY_FD_COUNT; ++i) {
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+
+		/* Sleep until something happens */
+		if (poll(pfd, DISPLAY_FD_COUNT, timeout) < 0 && errno != EINTR) {
+			perror("Critical Error waiting for form events: ");
+			_form_exit();
+			return 1;
+		}
+
+		if (pfd[DISPLAY_FD_SIGNAL].revents & POLLIN)
+			_read_signals(mf);
+
+		if (pfd[DISPLAY_FD_WAKE].revents & POLLIN)
+			_drain(_wakefd);
+
+		if (pfd[DISPLAY_FD_KEYS].revents & POLLIN)
+			_read_keys(mf);
+
+		if (pfd[DISPLAY_FD_TIMER].revents & POLLIN) {
+			_drain(_timerfd);
+			_clock_time();
+			_metric_form_refresh(mf);
+		}
+
+		if (_metric_flags & METRIC_FLAG_EXIT)
+			continue;
+
+		/* Keep reading without sleeping while frames come in,
+		 * so buffered frames are not left waiting */
+		if (mf->data_fd < 0)
+			ret = mf->polldata_cb(pending ? 0 : DISPLAY_POLL_MS);
+		else if (pending || pfd[DISPLAY_FD_DATA].revents)
+			ret = mf->polldata_cb(0);
 
 		if (ret < 0) {
 			_form_exit();
 			return 1;
 		}
 
-		if (ret == 0) {
-			_update_fields(mf);
+		pending = ret == 0;
+
+		/* Nothing to redraw if the frame changed nothing */
+		if (ret == 0 && _update_fields(mf) > 0) {
 			_metric_form_refresh(mf);
 		}
 	}
@@ -124,7 +337,13 @@ unsigned int metric_form_width(struct metric_form *mf)
 
 void metric_form_exit()
 {
+	uint64_t one = 1;
+
 	_metric_flags |= METRIC_FLAG_EXIT;
+
+	/* Wake the form loop. Safe to call from a signal handler. */
+	if (_wakefd >= 0 && write(_wakefd, &one, sizeof(one)) < 0)
+		return;
 }
 
 bool metric_is_empty(const struct metric *met)
@@ -132,7 +351,6 @@ bool metric_is_empty(const struct metric *met)
 	assert(met);
 
 	return strlen(met->name) == 0 &&
-		strlen(met->value) == 0 &&
 		strlen(met->unit) == 0 &&
 		met->page == 0 &&
 		met->slot == 0;
@@ -152,8 +370,14 @@ void metric_make_empty(struct metric *met)
 	assert(met);
 
 	met->name[0] = '\0';
-	met->value[0] = '\0';
 	met->unit[0] = '\0';
+	met->value = 0.0;
+	met->timemillis = 0;
+	met->ntrend = 0;
+	met->min = 0.0;
+	met->max = 0.0;
+	met->precision = 0;
+	met->dirty = false;
 	met->page = 0;
 	met->slot = 0;
 }
@@ -190,77 +414,332 @@ static void _last_updated_time()
 	_last_update_str[ARRAY_LEN(_last_update_str) - 1] = '\0';
 }
 
-static void _update_fields(struct metric_form *mf)
+static void _layout_fields(struct metric_form *mf)
 {
-	assert(mf->metrics);
+	int pfields = _fields_per_page(mf);
 
-	for (int i = 0; i < mf->wd.pages; ++i) {
-		int pfields = _fields_per_page(mf);
-		struct metric ms[pfields];
-		struct metric mauto[pfields];
-		int ai = 0;
+	for (int k = 0; k < pfields * mf->wd.pages; ++k) {
+		slotmap[k] = -1;
+	}
 
-		metric_make_empty_array(ms, pfields);
-		metric_make_empty_array(mauto, pfields);
+	for (int i = 0; i < mf->wd.pages; ++i) {
+		int *pmap = slotmap + i * pfields;
+		int next = 0;
 
-		/* Need to sort out the minuses */
+		/* Metrics with a fixed slot claim it first */
 		for (int j = 0; !metric_is_empty(&mf->metrics[j]); ++j) {
-			if (mf->metrics[j].page != i)
+			int addr = mf->metrics[j].slot;
+
+			if (mf->metrics[j].page != i || addr < 0)
 				continue;
 
-			if (mf->metrics[j].slot < 0 &&
-			    ai < pfields) {
-				mauto[ai] = mf->metrics[j];
-				++ai;
-			} else {
-				int addr = mf->metrics[j].slot;
+			if (addr >= pfields || pmap[addr] >= 0)
+				continue;
 
-				if (addr >= pfields) {
-					continue;
-				}
+			pmap[addr] = j;
+		}
 
-				if (!metric_is_empty(&ms[addr])) {
-					continue;
-				}
+		/* Sort minuses into empty slots */
+		for (int j = 0; !metric_is_empty(&mf->metrics[j]); ++j) {
+			if (mf->metrics[j].page != i ||
+			    mf->metrics[j].slot >= 0)
+				continue;
 
-				ms[addr] = mf->metrics[j];
-			}
+			while (next < pfields && pmap[next] >= 0)
+				++next;
+
+			if (next >= pfields)
+				break;
+
+			pmap[next] = j;
 		}
+	}
+}
 
-		/* Sort minuses into empty slots */
-		for (int j = 0; j < ai; ++j) {
-			for (int k = 0; k < pfields; ++k) {
-				if (metric_is_empty(&ms[k])) {
-					ms[k] = mauto[j];
+static int _update_fields(struct metric_form *mf)
+{
+	assert(mf->metrics);
 
-					break;
-				}
-			}
+	struct metric empty;
+	int nslots = _fields_per_page(mf) * mf->wd.pages;
+	bool live = _views[_view].stats || _views[_view].quantiles ||
+		_tier >= 0;
+	int changed = 0;
+
+	metric_make_empty(&empty);
+
+	if (mf->relayout) {
+		_layout_fields(mf);
+
+		/* Every slot may now show a different metric */
+		for (int k = 0; k < nslots; ++k) {
+			const struct metric *met = slotmap[k] >= 0
+				? &mf->metrics[slotmap[k]] : &empty;
+
+			_set_fields(mf, k, met, true);
 		}
 
-		/* Write all fields on this page */
-		for (int j = 0; j < pfields; ++j) {
-			int paddr = j + i * pfields;
+		changed = nslots;
+		mf->relayout = false;
+	} else {
+		/* Only values that changed since the last frame, or
+		 * every statistic since they move with every frame */
+		for (int k = 0; k < nslots; ++k) {
+			if (slotmap[k] < 0 ||
+			    (!live && !mf->metrics[slotmap[k]].dirty))
+				continue;
 
-			set_field_buffer(names[paddr], 0, ms[j].name);
-			set_field_buffer(values[paddr], 0, ms[j].value);
-			set_field_buffer(units[paddr], 0, ms[j].unit);
+			changed += _set_fields(mf, k,
+					       &mf->metrics[slotmap[k]], false);
 		}
 	}
 
+	for (int j = 0; !metric_is_empty(&mf->metrics[j]); ++j) {
+		mf->metrics[j].dirty = false;
+	}
+
 	/* Update the last updated time string */
-	_last_updated_time();
+	if (changed)
+		_last_updated_time();
+
+	return changed;
+}
+
+/* Write every column of a slot. Names and units only change with the
+ * layout; the rest is only written if its text changed. */
+static int _set_fields(struct metric_form *mf, int paddr,
+		       const struct metric *met, bool relayout)
+{
+	const struct view *v = &_views[_view];
+	struct shownvalue *sv = &shown[paddr];
+	FIELD **cells = _cells + paddr * DISPLAY_MAX_COLUMNS;
+	char buf[DISPLAY_TEXT_LEN];
+	double quantiles[ARRAY_LEN(_quantiles) + 1];
+	struct metric rolled;
+	int changed = 0;
+
+	if (_tier >= 0 && !v->stats && !v->quantiles &&
+	    !metric_is_empty(met) &&
+	    _rolled_metric(mf, slotmap[paddr], met, &rolled))
+		met = &rolled;
+
+	/* All quantiles of a metric come from one pass, followed by the
+	 * number of samples they cover */
+	if (v->quantiles && !metric_is_empty(met))
+		quantiles[ARRAY_LEN(_quantiles)] = (double)
+			mf->quantiles_cb(slotmap[paddr], _quantiles,
+					 ARRAY_LEN(_quantiles), quantiles);
+
+	for (int c = 0; c < v->ncolumns; ++c) {
+		switch (v->columns[c].kind) {
+		case COLUMN_NAME:
+			if (relayout)
+				set_field_buffer(cells[c], 0, met->name);
+
+			break;
+		case COLUMN_UNIT:
+			if (relayout)
+				set_field_buffer(cells[c], 0, met->unit);
+
+			break;
+		case COLUMN_VALUE:
+			changed |= _set_value_field(cells[c], sv, met);
+			break;
+		default:
+			buf[0] = '\0';
+
+			if (!metric_is_empty(met))
+				_format_column(buf, &v->columns[c], mf, met,
+					       slotmap[paddr],
+					       v->quantiles ? quantiles : NULL);
+
+			if (strcmp(buf, sv->text[c]) == 0)
+				break;
+
+			set_field_buffer(cells[c], 0, buf);
+			strcpy(sv->text[c], buf);
+			changed = 1;
+			break;
+		}
+	}
+
+	return changed;
+}
+
+static int _set_value_field(FIELD *field, struct shownvalue *sv,
+			    const struct metric *met)
+{
+	char buf[36];
+
+	if (metric_is_empty(met)) {
+		if (!sv->valid)
+			return 0;
+
+		set_field_buffer(field, 0, "");
+		sv->valid = false;
+		return 1;
+	}
+
+	/* Compare bit patterns so NaN counts as unchanged */
+	if (sv->valid && sv->precision == met->precision &&
+	    memcmp(&sv->value, &met->value, sizeof(sv->value)) == 0)
+		return 0;
+
+	numfmt_fixed(buf, sizeof(buf), met->value, met->precision);
+	set_field_buffer(field, 0, buf);
+
+	sv->value = met->value;
+	sv->precision = met->precision;
+	sv->valid = true;
+
+	return 1;
+}
+
+/* Text of a column other than the name, unit and value */
+static void _format_column(char *buf, const struct column *col,
+			   const struct metric_form *mf,
+			   const struct metric *met, int mi,
+			   const double *quantiles)
+{
+	const struct rollstats *st = mf->stats;
+	double v;
+
+	switch (col->kind) {
+	case COLUMN_TREND:
+		if (met->ntrend > 0)
+			_format_trend(buf, met);
+
+		return;
+	case COLUMN_RANGE:
+		if (met->ntrend > 0)
+			_format_range(buf, col->width + 1, met);
+
+		return;
+	case COLUMN_MEAN:
+		v = st ? rollstats_mean(st, mi) : NAN;
+		break;
+	case COLUMN_STDDEV:
+		v = st ? rollstats_stddev(st, mi) : NAN;
+		break;
+	case COLUMN_MIN:
+		v = st ? rollstats_min(st, mi) : NAN;
+		break;
+	case COLUMN_MAX:
+		v = st ? rollstats_max(st, mi) : NAN;
+		break;
+	case COLUMN_EWMA:
+		v = st ? rollstats_ewma(st, mi) : NAN;
+		break;
+	case COLUMN_P50:
+	case COLUMN_P95:
+	case COLUMN_P99:
+		v = quantiles && quantiles[ARRAY_LEN(_quantiles)] > 0
+			? quantiles[col->kind - COLUMN_P50] : NAN;
+		break;
+	case COLUMN_SAMPLES:
+		if (quantiles && quantiles[ARRAY_LEN(_quantiles)] > 0)
+			numfmt_fixed(buf, DISPLAY_TEXT_LEN,
+				     quantiles[ARRAY_LEN(_quantiles)], 0);
+
+		return;
+	default:
+		return;
+	}
+
+	/* No statistics yet */
+	if (v != v)
+		return;
+
+	/* Drop the decimals rather than cut the number off */
+	if (numfmt_fixed(buf, DISPLAY_TEXT_LEN, v, met->precision) >
+	    col->width)
+		numfmt_fixed(buf, DISPLAY_TEXT_LEN, v, 0);
+}
+
+/* One level per value, scaled to the window range so the line shows
+ * where the recent values sit in it */
+static void _format_trend(char *buf, const struct metric *met)
+{
+	int levels = (int) ARRAY_LEN(_ramp_ascii);
+	double span = met->max - met->min;
+
+	buf[0] = '\0';
+
+	for (int i = 0; i < met->ntrend && i < METRIC_TREND_LEN; ++i) {
+		int level = levels / 2 - 1;
+
+		if (span > 0.0) {
+			level = (int) ((met->trend[i] - met->min) / span *
+				       levels);
+			level = level < 0 ? 0 : level;
+			level = level >= levels ? levels - 1 : level;
+		}
+
+		strcat(buf, _ramp[level]);
+	}
+}
+
+/* A metric as the shown rollup tier has it: the mean of the newest
+ * bucket as the value, the means of the newest buckets as the trend
+ * and their extremes as the range */
+static bool _rolled_metric(const struct metric_form *mf, int mi,
+			   const struct metric *met, struct metric *out)
+{
+	struct rollup_bucket b[METRIC_TREND_LEN];
+	unsigned n = mf->rollup_cb(mi, _tier, b, METRIC_TREND_LEN);
+
+	if (n == 0)
+		return false;
+
+	*out = *met;
+	out->min = b[0].min;
+	out->max = b[0].max;
+
+	for (unsigned i = 0; i < n; ++i) {
+		out->trend[i] = b[i].sum / b[i].count;
+		out->min = b[i].min < out->min ? b[i].min : out->min;
+		out->max = b[i].max > out->max ? b[i].max : out->max;
+	}
+
+	out->ntrend = n;
+	out->value = out->trend[n - 1];
+
+	return true;
+}
+
+/* "<min>..<max>", dropping the decimals if that does not fit */
+static void _format_range(char *buf, size_t len, const struct metric *met)
+{
+	char lo[24];
+	char hi[24];
+	int prec = met->precision;
+
+	for (;;) {
+		numfmt_fixed(lo, sizeof(lo), met->min, prec);
+		numfmt_fixed(hi, sizeof(hi), met->max, prec);
+
+		if (prec == 0 || strlen(lo) + strlen(hi) + 2 <= len - 1)
+			break;
+
+		prec = 0;
+	}
+
+	snprintf(buf, len, "%s..%s", lo, hi);
 }
 
 void _allocate_fields(struct metric_form *mf)
 {
+	const struct view *v = &_views[_view];
 	int nfields = _fields_per_page(mf);
 	int npages = mf->wd.pages;
 
-	names = (FIELD**) malloc(nfields * npages * sizeof(FIELD*));
-	values = (FIELD**) malloc(nfields * npages * sizeof(FIELD*));
-	units = (FIELD**) malloc(nfields * npages * sizeof(FIELD*));
-	fields = (FIELD**) malloc((nfields * npages * 3 + 1) * sizeof(FIELD*));
+	_cells = (FIELD**) calloc(nfields * npages * DISPLAY_MAX_COLUMNS,
+				  sizeof(FIELD*));
+	fields = (FIELD**) malloc((nfields * npages * v->ncolumns + 1) *
+				  sizeof(FIELD*));
+	shown = (struct shownvalue*) calloc(nfields * npages,
+					    sizeof(struct shownvalue));
+	slotmap = (int*) malloc(nfields * npages * sizeof(int));
 
 	int fieldsctr = 0;
 	int pagesctr = 0;
@@ -268,24 +747,27 @@ void _allocate_fields(struct metric_form *mf)
 	for (int i = 0; i < nfields * npages; ++i) {
 		int row_coord = (i - (pagesctr * nfields)) * 2;
 		bool newpage = pagesctr && (! i % nfields);
+		FIELD **cells = _cells + i * DISPLAY_MAX_COLUMNS;
 
-		names[i] = new_field(1, 15, row_coord, 2, 0, 0);
-		values[i] = new_field(1, 15, row_coord, 17, 0, 0);
-		units[i] = new_field(1, 10, row_coord, 34, 0, 0);
+		for (int c = 0; c < v->ncolumns; ++c) {
+			const struct column *col = &v->columns[c];
 
-		field_opts_off(names[i], O_ACTIVE);
-		field_opts_off(values[i], O_ACTIVE);
-		field_opts_off(units[i], O_ACTIVE);
+			cells[c] = new_field(1, col->width, row_coord,
+					     col->col, 0, 0);
+			field_opts_off(cells[c], O_ACTIVE);
 
-		/* Signal start of new page on names only if
-		   appropriate */
-		set_new_page(names[i], newpage);
+			if (col->kind != COLUMN_NAME &&
+			    col->kind != COLUMN_UNIT &&
+			    col->kind != COLUMN_TREND &&
+			    col->kind != COLUMN_RANGE)
+				set_field_just(cells[c], JUSTIFY_RIGHT);
 
-		set_field_just(values[i], JUSTIFY_RIGHT);
+			fields[fieldsctr] = cells[c]; fieldsctr++;
+		}
 
-		fields[fieldsctr] = names[i]; fieldsctr++;
-		fields[fieldsctr] = values[i]; fieldsctr++;
-		fields[fieldsctr] = units[i]; fieldsctr++;
+		/* Signal start of new page on names only if
+		   appropriate */
+		set_new_page(cells[0], newpage);
 
 		if (! (i + 1) % nfields)
 			++pagesctr;
@@ -302,6 +784,18 @@ static void _form_setup_window()
 	box(win_main, 0, 0);
 	box(win_form, 0, 0);
 
+	/* Column headings go in the border, over the right edge of
+	 * their column */
+	for (int c = 0; c < _views[_view].ncolumns; ++c) {
+		const struct column *col = &_views[_view].columns[c];
+		const char *heading = col->kind == COLUMN_VALUE && _tier >= 0
+			? _tier_headings[_tier] : col->heading;
+
+		if (heading)
+			mvwprintw(win_form, 0, col->col + 1 + col->width -
+				  (int) strlen(heading), "%s", heading);
+	}
+
 	/* Title Header */
 	mvwprintw(win_main, 1, 2, "Environmental Data Display Program,"
 		  " Version: %s",
@@ -326,6 +820,7 @@ static void _resize_window(struct metric_form *mf)
 	/* Adjust form overflow */
 	_allocate_fields(mf);
 	assert(fields);
+	mf->relayout = true;
 	_update_fields(mf);
 
 	form = new_form(fields);
@@ -354,21 +849,22 @@ static void _free_fields()
 		}
 	}
 
-	free(names);
-	free(values);
-	free(units);
+	free(_cells);
 	free(fields);
+	free(shown);
+	free(slotmap);
 
-	names = NULL;
-	values = NULL;
-	units = NULL;
+	_cells = NULL;
 	fields = NULL;
+	shown = NULL;
+	slotmap = NULL;
 }
 
 static void _form_exit()
 {
 	_free_fields();
 	endwin();
+	_close_events();
 }
 
 void _define_win_size(struct metric_form *mf)
@@ -418,19 +914,165 @@ static int _assign_form_to_win(struct metric_form *mf)
 	return 0;
 }
 
-static void _handle_winch(int sig)
+static int _open_events(struct metric_form *mf)
+{
+	struct timespec now;
+	struct itimerspec tick = {
+		.it_interval = { .tv_sec = 1, .tv_nsec = 0 }
+	};
+	sigset_t mask;
+
+	/* Handled through _sigfd while the form runs. Threads started
+	 * from here on inherit the mask. */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGWINCH);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+
+	if (pthread_sigmask(SIG_BLOCK, &mask, &_oldmask) != 0)
+		return -1;
+
+	_sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	_timerfd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+	_wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if (_sigfd < 0 || _timerfd < 0 || _wakefd < 0)
+		return -1;
+
+	/* Tick on whole seconds for the clock */
+	clock_gettime(CLOCK_REALTIME, &now);
+	tick.it_value.tv_sec = now.tv_sec + 1;
+
+	if (timerfd_settime(_timerfd, TFD_TIMER_ABSTIME, &tick, NULL) < 0)
+		return -1;
+
+	/* Only take keys from a terminal that is not also the data */
+	_keys = mf->keys && isatty(STDIN_FILENO);
+
+	if (_keys) {
+		cbreak();
+		noecho();
+		nodelay(stdscr, TRUE);
+		keypad(stdscr, TRUE);
+	}
+
+	return 0;
+}
+
+static void _close_events()
+{
+	if (_sigfd >= 0)
+		close(_sigfd);
+
+	if (_timerfd >= 0)
+		close(_timerfd);
+
+	if (_wakefd >= 0)
+		close(_wakefd);
+
+	_sigfd = -1;
+	_timerfd = -1;
+	_wakefd = -1;
+	_keys = false;
+
+	pthread_sigmask(SIG_SETMASK, &_oldmask, NULL);
+}
+
+static void _read_signals(struct metric_form *mf)
 {
-	assert(sig == SIGWINCH);
-	ignore_poll_error = 1;
-	_metric_flags |= METRIC_FLAG_WINRESIZE;
+	struct signalfd_siginfo si;
+
+	while (read(_sigfd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo == SIGWINCH)
+			_resize_window(mf);
+		else
+			_metric_flags |= METRIC_FLAG_EXIT;
+	}
+}
+
+static void _read_keys(struct metric_form *mf)
+{
+	int key;
+	int next;
+
+	while ((key = getch()) != ERR) {
+		switch (key) {
+		case 'q':
+		case 'Q':
+			_metric_flags |= METRIC_FLAG_EXIT;
+			return;
+		case 12: /* Ctrl-L */
+			clearok(curscr, TRUE);
+			_metric_form_refresh(mf);
+			break;
+		case 's':
+		case 'S':
+			/* Switch to the next view there is data for */
+			next = _view;
+
+			do {
+				next = (next + 1) % ARRAY_LEN(_views);
+			} while (!_view_available(mf, next));
+
+			if (next == _view)
+				break;
+
+			_view = next;
+			_resize_window(mf);
+			break;
+		case 'r':
+		case 'R':
+			/* Step the readings through the rollup tiers */
+			if (!mf->rollup_cb || _views[_view].stats ||
+			    _views[_view].quantiles)
+				break;
+
+			_tier = _tier + 1 < ROLLUP_TIERS ? _tier + 1 : -1;
+			_resize_window(mf);
+			break;
+		default:
+			/* Anything else is up to the data side */
+			if (mf->key_cb && mf->key_cb(key) > 0 &&
+			    _update_fields(mf) > 0)
+				_metric_form_refresh(mf);
+			break;
+		}
+	}
+}
+
+static bool _view_available(const struct metric_form *mf, int view)
+{
+	return (!_views[view].stats || mf->stats) &&
+		(!_views[view].quantiles || mf->quantiles_cb);
+}
+
+static void _drain(int fd)
+{
+	uint64_t count;
+
+	while (read(fd, &count, sizeof(count)) > 0)
+		continue;
+}
+
+static void _clock_time()
+{
+	struct tm timstruct;
+	time_t curtime = time(NULL);
+
+	localtime_r(&curtime, &timstruct);
+	strftime(_clock_str, sizeof(_clock_str), "%H:%M:%S", &timstruct);
 }
 
 static void _metric_form_refresh(struct metric_form *mf)
 {
 	/* Print current time to bottom of screen */
-	if (win_main)
+	if (win_main) {
 		mvwprintw(win_main, mf->wd.rows - 2, 2,
 			  "Last update: %s", _last_update_str);
+		mvwprintw(win_main, mf->wd.rows - 2,
+			  mf->wd.cols - 2 - (int) strlen(_clock_str),
+			  "%s", _clock_str);
+	}
 
 	/* Refresh ncurses and all windows */
 	refresh();
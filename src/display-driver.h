@@ -1,12 +1,21 @@
 #ifndef DISPLAY_DRIVER_H
 #define DISPLAY_DRIVER_H
 
+#include "rollstats.h"
+#include "rollup.h"
+
 #include <stdlib.h>
 #include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif /* #ifdef __cplusplus */
+
+/* Number of recent values drawn as a sparkline next to each metric */
+#ifndef METRIC_TREND_LEN
+#define METRIC_TREND_LEN 8
+#endif /* #ifndef METRIC_TREND_LEN */
+
 	struct borderwidth {
 		int top;
 		int left;
@@ -26,6 +35,32 @@ extern "C" {
  * intended to be passed to the update routine as an array. A zero-ed
  * out metric will describe the end of the array.
  *
+ * @param name Name of the metric, prefixed with "<source>:" when
+ * several sources are displayed
+ *
+ * @param value Numeric value of the metric. It is only turned into
+ * text when the metric is displayed.
+ *
+ * @param timemillis Device time stamp of the value in milliseconds
+ *
+ * @param precision Number of decimal places the value is displayed
+ * with
+ *
+ * @param trend The newest values, oldest first, drawn as a sparkline
+ *
+ * @param ntrend Number of values in @p trend, 0 if the metric has no
+ * history
+ *
+ * @param min Smallest value in the metric's history, if @p ntrend is
+ * not 0
+ *
+ * @param max Largest value in the metric's history, if @p ntrend is
+ * not 0
+ *
+ * @param dirty Set when the value, trend or range differs from the
+ * last frame. The form driver only redraws dirty values and clears
+ * the flag once the value is on screen.
+ *
  * @param page The form page the metric will rest on, zero-indexed
  *
  * @param slot The zero-indexed metric slot on the page, vertically
@@ -35,9 +70,16 @@ extern "C" {
  * not be displayed.
  */
 	struct metric {
-		char name[36];
-		char value[36];
+		char name[48];
 		char unit[36];
+		double value;
+		long long timemillis;
+		double trend[METRIC_TREND_LEN];
+		int ntrend;
+		double min;
+		double max;
+		int precision;
+		bool dirty;
 		int page;
 		int slot;
 	};
@@ -65,22 +107,71 @@ extern "C" {
  * @param metrics Array of @ref metric objects terminated will a
  * zeroed-out struct.
  *
+ * @param relayout Set when metrics were added or removed, or a name,
+ * unit, page or slot changed. The form driver then rewrites every
+ * field instead of only the dirty values.
+ *
  * @param polldata_cb Function to be called on each loop of the form
  * driver. The argument (long) represents a timeout in
  * milliseconds. The callback should return -1 on failure, 0 if data
- * was updated, and 1 if function timed out.
+ * was updated, and 1 if function timed out. After a return of 0 it
+ * is called again right away, so it only returns 1 once nothing is
+ * left to read.
+ *
+ * @param data_fd Descriptor that becomes readable when polldata_cb
+ * has data. The form driver sleeps on it along with signals and
+ * keyboard input, and calls polldata_cb with a timeout of 0 once it
+ * is readable. If -1, polldata_cb is called with a timeout on every
+ * loop instead.
+ *
+ * @param keys Read keys from the terminal on standard input. Must be
+ * false if standard input carries the data.
+ *
+ * @param key_cb Optional function called with keys the form driver
+ * does not handle itself. It should return 1 if the metrics changed
+ * and must be redrawn, 0 otherwise.
+ *
+ * @param stats Optional rolling statistics, one column per entry of
+ * @p metrics. With them 's' switches between the readings and a page
+ * of statistics.
+ *
+ * @param quantiles_cb Optional function estimating quantiles of the
+ * metric at an index of @p metrics. It fills in one estimate per
+ * quantile, given in ascending order, and returns the number of
+ * samples they cover, 0 if none. With it 's' also offers a page of
+ * quantiles.
+ *
+ * @param rollup_cb Optional function copying the newest buckets of a
+ * tier of rollups (see rollup_last()) of the metric at an index of
+ * @p metrics, returning how many it copied. With it 'r' switches the
+ * readings between the instantaneous values and the mean of each tier,
+ * with the sparkline and range following the tier's buckets.
  */
 	struct metric_form {
 		struct borderwidth bw;
 		struct windim wd;
 		struct metric *metrics;
+		bool relayout;
 		int (*polldata_cb)(long);
+		int data_fd;
+		bool keys;
+		int (*key_cb)(int);
+		const struct rollstats *stats;
+		unsigned long (*quantiles_cb)(int, const double *, int,
+					      double *);
+		unsigned (*rollup_cb)(int, int, struct rollup_bucket *,
+				      unsigned);
 	};
 
 /** Initialize metric form and run the form on the current terminal
  *
  * The @ref metric_form structure will be initialized and the form
- * loop will run, blocking other activites.
+ * loop will run, blocking other activites. SIGWINCH, SIGINT and
+ * SIGTERM are blocked while the form runs and handled by the loop
+ * itself: a resize redraws the form and the others end it. 'q' also
+ * ends it when keys are enabled, 's' switches to the statistics and
+ * quantile pages if there are statistics and quantiles, and 'r' to the
+ * rollups if there are rollups.
  *
  * @param mf A metric_form object with form configuration. An initial
  * set of values must be supplied in the metrics member of the
@@ -136,7 +227,10 @@ extern "C" {
  */
 	void metric_make_empty(struct metric *met);
 
-/** Sets the exit flag in the metric form driver */
+/** Sets the exit flag in the metric form driver and wakes it up
+ *
+ * Safe to call from a signal handler or another thread.
+ */
 	void metric_form_exit();
 
 /** Kill form immediately without returning to the main form loop */
@@ -0,0 +1,279 @@
+/* Query the columns written by env-display -C
+ *
+ * Without -m prints a summary of every metric in the directory: its
+ * samples, time range and value range, and the bytes each sample
+ * takes in the blocks read. With -m prints the samples of the named
+ * metrics as CSV. -s and -e limit either to a range of device time.
+ * Blocks outside the range, and the columns of other metrics, are
+ * never decompressed.
+ */
+
+#include "tsstore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#ifndef QUERY_MAX_METRICS
+#define QUERY_MAX_METRICS 64
+#endif /* #ifndef QUERY_MAX_METRICS */
+
+extern char* optarg;
+extern int optind;
+
+static const char *metrics[QUERY_MAX_METRICS];
+static int nmetrics = 0;
+static int64_t from = INT64_MIN;
+static int64_t to = INT64_MAX;
+static int64_t times[TSSTORE_BLOCK_SAMPLES];
+static double values[TSSTORE_BLOCK_SAMPLES];
+
+static void _usage(const char *argv0)
+{
+	printf("Usage:\n"
+	       "%1$s [-s <from>] [-e <to>] <directory>\n"
+	       "%1$s -m <metric> [-m <metric> ...] [-s <from>] [-e <to>] "
+	       "<directory>\n"
+	       "%1$s -h\n"
+	       "\n"
+	       "Summarizes the metrics stored in a directory by env-display -C,\n"
+	       "or prints the samples of the metrics named with -m as CSV.\n"
+	       "\n"
+	       "Options:\n"
+	       "-m <metric>	A metric to print the samples of. May be given\n"
+	       "		more than once\n"
+	       "-s <from>	Earliest device time to include, in milliseconds\n"
+	       "-e <to>		Latest device time to include, in milliseconds\n"
+	       "-h		Print usage message, then exit\n",
+	       argv0);
+}
+
+static int _parseTime(const char *arg, int64_t *t)
+{
+	char *end;
+
+	errno = 0;
+	*t = strtoll(arg, &end, 10);
+
+	return end == arg || *end != '\0' || errno ? -1 : 0;
+}
+
+/* Summary of one column within the range. Blocks wholly inside it are
+ * summed up from their headers alone. */
+static int _summarize(const char *path)
+{
+	struct tsstore_reader r;
+	unsigned long long count = 0;
+	unsigned long long bytes = 0;
+	unsigned long blocks = 0;
+	int64_t tmin = INT64_MAX;
+	int64_t tmax = INT64_MIN;
+	double vmin = INFINITY;
+	double vmax = -INFINITY;
+	int ret;
+
+	if (tsstore_reader_open(&r, path) < 0)
+		return -1;
+
+	while ((ret = tsstore_reader_next(&r, from, to)) > 0) {
+		const struct tsstore_block *b = &r.hdr;
+
+		++blocks;
+		bytes += sizeof(*b) + b->len;
+
+		if (b->tmin >= from && b->tmax <= to) {
+			count += b->count;
+			tmin = b->tmin < tmin ? b->tmin : tmin;
+			tmax = b->tmax > tmax ? b->tmax : tmax;
+			vmin = b->vmin < vmin ? b->vmin : vmin;
+			vmax = b->vmax > vmax ? b->vmax : vmax;
+			continue;
+		}
+
+		int n = tsstore_reader_decode(&r, times, values);
+
+		if (n < 0) {
+			ret = -1;
+			break;
+		}
+
+		for (int i = 0; i < n; ++i) {
+			if (times[i] < from || times[i] > to)
+				continue;
+
+			++count;
+			tmin = times[i] < tmin ? times[i] : tmin;
+			tmax = times[i] > tmax ? times[i] : tmax;
+			vmin = values[i] < vmin ? values[i] : vmin;
+			vmax = values[i] > vmax ? values[i] : vmax;
+		}
+	}
+
+	if (ret == 0 && count > 0) {
+		printf("%-32s %12llu %8lu %8.2f %14lld %14lld %12.10g "
+		       "%12.10g\n", r.name, count, blocks,
+		       (double) bytes / count, (long long) tmin,
+		       (long long) tmax, vmin, vmax);
+	}
+
+	tsstore_reader_close(&r);
+
+	return ret;
+}
+
+static int _print(const char *path)
+{
+	struct tsstore_reader r;
+	int ret;
+
+	if (tsstore_reader_open(&r, path) < 0)
+		return -1;
+
+	while ((ret = tsstore_reader_next(&r, from, to)) > 0) {
+		int n = tsstore_reader_decode(&r, times, values);
+
+		if (n < 0) {
+			ret = -1;
+			break;
+		}
+
+		for (int i = 0; i < n; ++i) {
+			if (times[i] >= from && times[i] <= to)
+				printf("%lld,%s,%.15g\n", (long long) times[i],
+				       r.name, values[i]);
+		}
+	}
+
+	tsstore_reader_close(&r);
+
+	return ret;
+}
+
+/* Path of the column holding a metric, looked up by the name in its
+ * header since several metrics may share a file name */
+static int _find(const char *dir, const char *name, char *path,
+		 size_t len)
+{
+	struct tsstore_reader r;
+
+	for (int alt = 0; alt <= TSSTORE_MAX_ALT; ++alt) {
+		if (tsstore_path(path, len, dir, name, alt) < 0) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		if (tsstore_reader_open(&r, path) < 0)
+			return -1;
+
+		bool same = strncmp(r.name, name, sizeof(r.name) - 1) == 0;
+
+		tsstore_reader_close(&r);
+
+		if (same)
+			return 0;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+int main(int argc, char* const argv[])
+{
+	char path[1024];
+	const char *dir;
+	int ret = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "m:s:e:h")) != -1) {
+		switch (c) {
+		case 'm':
+			if (nmetrics >= QUERY_MAX_METRICS) {
+				fprintf(stderr, "Error: "
+					"At most %d metrics are supported\n",
+					QUERY_MAX_METRICS);
+				return 1;
+			}
+
+			metrics[nmetrics++] = optarg;
+			break;
+
+		case 's':
+		case 'e':
+			if (_parseTime(optarg, c == 's' ? &from : &to) < 0) {
+				fprintf(stderr, "Error: "
+					"Invalid time %s\n", optarg);
+				return 1;
+			}
+
+			break;
+
+		case 'h':
+			_usage(argv[0]);
+			return 0;
+
+		default:
+			_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		_usage(argv[0]);
+		return 1;
+	}
+
+	dir = argv[optind];
+
+	if (nmetrics > 0) {
+		printf("timemillis,name,value\n");
+
+		for (int i = 0; i < nmetrics; ++i) {
+			if (_find(dir, metrics[i], path, sizeof(path)) == 0 &&
+			    _print(path) == 0)
+				continue;
+
+			fprintf(stderr, "Failed to read %s: %s\n", metrics[i],
+				strerror(errno));
+			ret = 1;
+		}
+
+		return ret;
+	}
+
+	DIR *d = opendir(dir);
+	struct dirent *e;
+
+	if (!d) {
+		fprintf(stderr, "Failed to open %s: %s\n", dir,
+			strerror(errno));
+		return 1;
+	}
+
+	printf("%-32s %12s %8s %8s %14s %14s %12s %12s\n", "metric",
+	       "samples", "blocks", "B/sample", "first", "last", "min",
+	       "max");
+
+	while ((e = readdir(d))) {
+		size_t n = strlen(e->d_name);
+
+		if (n < 4 || strcmp(e->d_name + n - 3, ".ts") != 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+
+		if (_summarize(path) == 0)
+			continue;
+
+		fprintf(stderr, "Failed to read %s: %s\n", path,
+			strerror(errno));
+		ret = 1;
+	}
+
+	closedir(d);
+
+	return ret;
+}
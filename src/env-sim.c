@@ -0,0 +1,678 @@
+/* Simulated Kitty Comfort sensor feed for load testing
+ *
+ * Emits frames in either format initializeData() reads: a "data" array
+ * of one sensor, or an "output" array of several sensors with a "data"
+ * array each. Values wander from realistic starting points and the
+ * device time advances with the frame rate, give or take the jitter.
+ * Every value comes from a generator seeded with -s, so the same
+ * options always give the same frames, whatever the transport.
+ *
+ * Frames go to stdout, to TCP clients, to UDP peers that say hello, to
+ * a multicast group or to a pseudo-terminal, so that every source
+ * env-display reads can be driven at thousands of frames per second.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <termios.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifndef SIM_MAX_SENSORS
+#define SIM_MAX_SENSORS 64
+#endif /* #ifndef SIM_MAX_SENSORS */
+
+#ifndef SIM_MAX_METRICS
+#define SIM_MAX_METRICS 256
+#endif /* #ifndef SIM_MAX_METRICS */
+
+/* TCP clients or UDP peers served at once */
+#ifndef SIM_MAX_PEERS
+#define SIM_MAX_PEERS 32
+#endif /* #ifndef SIM_MAX_PEERS */
+
+/* Longest frame: up to 128 bytes a field and 64 a sensor */
+#define SIM_FRAME_LEN (SIM_MAX_SENSORS * (SIM_MAX_METRICS * 128 + 64) + \
+		       256)
+
+enum sim_output {
+	SIM_STDOUT = 0,
+	SIM_TCP,
+	SIM_UDP,
+	SIM_MCAST,
+	SIM_PTY
+};
+
+/* A reading of the Kitty Comfort, where it starts and how far it moves
+ * between frames */
+struct reading {
+	const char *name;
+	const char *unit;
+	double start;
+	double step;
+	int digits;
+};
+
+static const struct reading readings[] = {
+	{ "ammonia", "counts", 423, 3, 0 },
+	{ "temp", "degC", 23.18, 0.02, 2 },
+	{ "pressure", "pa", 99492.27, 1.5, 2 },
+	{ "altitude", "m", 153.69, 0.1, 2 },
+	{ "rh", "%", 43.76, 0.05, 2 },
+	{ "CO2", "ppm", 410, 2, 0 },
+	{ "TVOC", "ppb", 12, 1, 0 },
+	{ "gas", "ohm", 12946861, 5000, 0 },
+	{ "PM1.0 Std", "ug/m^3", 1, 1, 0 },
+	{ "PM2.5 Std", "ug/m^3", 2, 1, 0 },
+	{ "pm10_std", "ug/m^3", 2, 1, 0 },
+	{ "NP > 0.3um", "num/0.1L", 510, 20, 0 },
+	{ "V Batt", "V", 3.7, 0.005, 2 }
+};
+
+#define SIM_READINGS ((int) (sizeof(readings) / sizeof(readings[0])))
+
+static const char *sensornames[] = {
+	"bme680", "ccs811", "pms5003", "sht31", "scd30"
+};
+
+#define SIM_SENSOR_NAMES \
+	((int) (sizeof(sensornames) / sizeof(sensornames[0])))
+
+extern char* optarg;
+
+static enum sim_output output = SIM_STDOUT;
+static const char *target = NULL;
+static double rate = 10;
+static int nsensors = 0;
+static int nmetrics = 5;
+static double jitter = 0;
+static unsigned long limit = 0;
+static uint64_t seed = 1;
+
+static uint64_t state;
+static double values[SIM_MAX_SENSORS][SIM_MAX_METRICS];
+static int peers[SIM_MAX_PEERS];
+static struct sockaddr_storage peeraddrs[SIM_MAX_PEERS];
+static socklen_t peerlens[SIM_MAX_PEERS];
+static int npeers = 0;
+static volatile sig_atomic_t stop = 0;
+
+static void _usage(const char *argv0)
+{
+	printf("Usage:\n"
+	       "%1$s [-o <output>] [-r <rate>] [-n <sensors>] [-k <metrics>]\n"
+	       "	[-j <jitter>] [-c <frames>] [-s <seed>]\n"
+	       "%1$s -h\n"
+	       "\n"
+	       "Sends simulated Kitty Comfort frames for env-display to read. With\n"
+	       "no sensors the frames hold one \"data\" array, otherwise an \"output\"\n"
+	       "array of that many sensors. The same options always give the same\n"
+	       "frames.\n"
+	       "\n"
+	       "Outputs:\n"
+	       "-		Write to stdout (default), for env-display reading\n"
+	       "		stdin, or to a file for -f and -r\n"
+	       "tcp:<port>	Serve every client connecting to this port, for -t.\n"
+	       "		Waits for the first client\n"
+	       "udp:<port>	Send datagrams to every peer that sends one to this\n"
+	       "		port, for -u. Waits for the first peer\n"
+	       "mcast:<group>:<port>\n"
+	       "		Send datagrams to a multicast group, for -m\n"
+	       "pty		Write to a pseudo-terminal, for -s. Its path is\n"
+	       "		printed, and frames start once it is opened\n"
+	       "\n"
+	       "Options:\n"
+	       "-o <output>	Where to send the frames\n"
+	       "-r <rate>	Frames per second, or 0 for as fast as the output\n"
+	       "		takes them (default: 10)\n"
+	       "-n <sensors>	Sensors per frame, 0 for the single sensor format\n"
+	       "		(default: 0, at most %2$d)\n"
+	       "-k <metrics>	Metrics per sensor (default: 5, at most %3$d)\n"
+	       "-j <jitter>	Largest deviation from the frame interval, as a\n"
+	       "		fraction of it (default: 0)\n"
+	       "-c <frames>	Frames to send, or 0 to send until interrupted\n"
+	       "		(default: 0)\n"
+	       "-s <seed>	Seed of the values (default: 1)\n"
+	       "-h		Print usage message, then exit\n",
+	       argv0, SIM_MAX_SENSORS, SIM_MAX_METRICS);
+}
+
+static void _signalHandler(int sig)
+{
+	(void) sig;
+	stop = 1;
+}
+
+/* splitmix64, so the frames do not depend on the C library */
+static uint64_t _next()
+{
+	uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+	return z ^ (z >> 31);
+}
+
+/* Uniform in [-1, 1) */
+static double _uniform()
+{
+	return (double) (_next() >> 11) / (double) (1ULL << 52) - 1;
+}
+
+static int64_t _now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char *_putReading(char *p, int s, int m, int64_t timemillis)
+{
+	const struct reading *rd = &readings[m % SIM_READINGS];
+	double *v = &values[s][m];
+
+	*v += rd->step * _uniform();
+
+	/* Counts and concentrations never go negative */
+	if (*v < 0)
+		*v = -*v;
+
+	if (m < SIM_READINGS)
+		p += sprintf(p, "{\"name\": \"%s\", ", rd->name);
+	else
+		p += sprintf(p, "{\"name\": \"%s %d\", ", rd->name,
+			     m / SIM_READINGS);
+
+	return p + sprintf(p, "\"value\": %.*f, \"timemillis\": %lld, "
+			   "\"unit\": \"%s\"}", rd->digits, *v,
+			   (long long) timemillis + m, rd->unit);
+}
+
+/* Build the next frame, sent at a device time */
+static size_t _frame(char *buf, int64_t timemillis)
+{
+	char *p = buf;
+
+	p += sprintf(p, "{\"status\": {\"isWarmedUp\": true, \"CCS811\": "
+		     "\"ok\", \"localIP\": \"192.168.1.211\", \"sentmillis\": "
+		     "%lld}, ", (long long) timemillis);
+
+	if (nsensors == 0) {
+		p += sprintf(p, "\"data\": [");
+
+		for (int m = 0; m < nmetrics; ++m) {
+			p += sprintf(p, m ? ", " : "");
+			p = _putReading(p, 0, m, timemillis);
+		}
+
+		p += sprintf(p, "]}\n");
+
+		return p - buf;
+	}
+
+	p += sprintf(p, "\"output\": [");
+
+	for (int s = 0; s < nsensors; ++s) {
+		if (s < SIM_SENSOR_NAMES)
+			p += sprintf(p, "%s{\"sensor\": \"%s\", \"data\": [",
+				     s ? ", " : "", sensornames[s]);
+		else
+			p += sprintf(p, "%s{\"sensor\": \"%s-%d\", "
+				     "\"data\": [", s ? ", " : "",
+				     sensornames[s % SIM_SENSOR_NAMES],
+				     s / SIM_SENSOR_NAMES);
+
+		for (int m = 0; m < nmetrics; ++m) {
+			p += sprintf(p, m ? ", " : "");
+			p = _putReading(p, s, m, timemillis);
+		}
+
+		p += sprintf(p, "]}");
+	}
+
+	p += sprintf(p, "]}\n");
+
+	return p - buf;
+}
+
+static int _writeAll(int fd, const char *p, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0) {
+			if (errno == EINTR && !stop)
+				continue;
+
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Socket bound to a port, or connected to a group, of the target */
+static int _socket(const char *host, const char *port, int socktype,
+		   bool connected)
+{
+	struct addrinfo hints = {
+		.ai_flags = host ? 0 : AI_PASSIVE,
+		.ai_socktype = socktype
+	};
+	struct addrinfo *ai;
+	struct addrinfo *it;
+	int one = 1;
+	int fd = -1;
+	int err;
+
+	if ((err = getaddrinfo(host, port, &hints, &ai)) != 0) {
+		fprintf(stderr, "Failed to look up %s:%s: %s\n",
+			host ? host : "*", port, gai_strerror(err));
+		return -1;
+	}
+
+	for (it = ai; it; it = it->ai_next) {
+		if ((fd = socket(it->ai_family, it->ai_socktype,
+				 it->ai_protocol)) < 0)
+			continue;
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		if (connected ?
+		    connect(fd, it->ai_addr, it->ai_addrlen) == 0 :
+		    bind(fd, it->ai_addr, it->ai_addrlen) == 0)
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(ai);
+
+	return fd;
+}
+
+/* Take TCP clients or UDP peers waiting to join, blocking for the
+ * first one */
+static void _admit(int fd)
+{
+	char buf[64];
+
+	while (npeers < SIM_MAX_PEERS && !stop) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+		if (poll(&pfd, 1, npeers == 0 ? -1 : 0) <= 0)
+			return;
+
+		/* Frames are written whole, holding the simulator back
+		 * rather than dropping them */
+		if (output == SIM_TCP) {
+			int c = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+
+			if (c < 0)
+				return;
+
+			peers[npeers++] = c;
+			continue;
+		}
+
+		struct sockaddr_storage from;
+		socklen_t len = sizeof(from);
+		bool known = false;
+
+		if (recvfrom(fd, buf, sizeof(buf), 0,
+			     (struct sockaddr*) &from, &len) < 0)
+			return;
+
+		for (int i = 0; i < npeers && !known; ++i) {
+			known = peerlens[i] == len &&
+				memcmp(&peeraddrs[i], &from, len) == 0;
+		}
+
+		if (!known) {
+			peeraddrs[npeers] = from;
+			peerlens[npeers++] = len;
+		}
+	}
+}
+
+/* Open the output, waiting for its first reader where it has one */
+static int _open()
+{
+	char host[256];
+	const char *port;
+	int fd = -1;
+
+	switch (output) {
+	case SIM_STDOUT:
+		return STDOUT_FILENO;
+
+	case SIM_TCP:
+		if ((fd = _socket(NULL, target, SOCK_STREAM, false)) < 0 ||
+		    listen(fd, SIM_MAX_PEERS) < 0)
+			break;
+
+		fprintf(stderr, "Waiting for a client on TCP port %s\n",
+			target);
+		_admit(fd);
+		return fd;
+
+	case SIM_UDP:
+		if ((fd = _socket(NULL, target, SOCK_DGRAM, false)) < 0)
+			break;
+
+		fprintf(stderr, "Waiting for a peer on UDP port %s\n", target);
+		_admit(fd);
+		return fd;
+
+	case SIM_MCAST:
+		port = strrchr(target, ':');
+
+		if (!port || (size_t) (port - target) >= sizeof(host)) {
+			errno = EINVAL;
+			break;
+		}
+
+		memcpy(host, target, port - target);
+		host[port - target] = '\0';
+		return _socket(host, port + 1, SOCK_DGRAM, true);
+
+	case SIM_PTY: {
+		struct termios ts;
+		struct pollfd pfd;
+		int slave;
+
+		if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+		    grantpt(fd) < 0 || unlockpt(fd) < 0)
+			break;
+
+		/* Raw, so frames are not echoed back or mangled before
+		 * the reader sets the terminal up */
+		if ((slave = open(ptsname(fd), O_RDWR | O_NOCTTY)) < 0)
+			break;
+
+		tcgetattr(slave, &ts);
+		cfmakeraw(&ts);
+		tcsetattr(slave, TCSANOW, &ts);
+		close(slave);
+
+		printf("%s\n", ptsname(fd));
+		fflush(stdout);
+
+		/* The master hangs up until the slave is opened */
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+
+		while (!stop && poll(&pfd, 1, -1) >= 0 &&
+		       (pfd.revents & POLLHUP))
+			usleep(10000);
+
+		return fd;
+	}
+	}
+
+	if (fd >= 0)
+		close(fd);
+
+	return -1;
+}
+
+/* Send a frame to every reader. Readers that went away are dropped;
+ * losing the only one ends the stream. */
+static int _send(int fd, const char *frame, size_t len)
+{
+	switch (output) {
+	case SIM_STDOUT:
+	case SIM_PTY:
+		return _writeAll(fd, frame, len);
+
+	case SIM_MCAST:
+		return send(fd, frame, len, 0) < 0 ? -1 : 0;
+
+	case SIM_TCP:
+	case SIM_UDP:
+		_admit(fd);
+
+		for (int i = 0; i < npeers; ++i) {
+			bool gone = output == SIM_TCP ?
+				send(peers[i], frame, len, MSG_NOSIGNAL) !=
+				(ssize_t) len :
+				sendto(fd, frame, len, 0,
+				       (struct sockaddr*) &peeraddrs[i],
+				       peerlens[i]) < 0;
+
+			if (!gone)
+				continue;
+
+			if (output == SIM_TCP)
+				close(peers[i]);
+
+			--npeers;
+			peers[i] = peers[npeers];
+			peeraddrs[i] = peeraddrs[npeers];
+			peerlens[i] = peerlens[npeers];
+			--i;
+		}
+
+		return npeers > 0 ? 0 : -1;
+	}
+
+	return -1;
+}
+
+static void _parseOptions(int argc, char* const argv[])
+{
+	char *end;
+	int c;
+
+	while ((c = getopt(argc, argv, "o:r:n:k:j:c:s:h")) != -1) {
+		switch (c) {
+		case 'o':
+			if (strcmp(optarg, "-") == 0) {
+				output = SIM_STDOUT;
+			} else if (strncmp(optarg, "tcp:", 4) == 0) {
+				output = SIM_TCP;
+				target = optarg + 4;
+			} else if (strncmp(optarg, "udp:", 4) == 0) {
+				output = SIM_UDP;
+				target = optarg + 4;
+			} else if (strncmp(optarg, "mcast:", 6) == 0) {
+				output = SIM_MCAST;
+				target = optarg + 6;
+			} else if (strcmp(optarg, "pty") == 0) {
+				output = SIM_PTY;
+			} else {
+				fprintf(stderr, "Error: "
+					"Invalid output %s\n", optarg);
+				exit(1);
+			}
+
+			break;
+
+		case 'r':
+			rate = strtod(optarg, &end);
+
+			if (end == optarg || *end != '\0' || !(rate >= 0)) {
+				fprintf(stderr, "Error: "
+					"Invalid rate %s\n", optarg);
+				exit(1);
+			}
+
+			break;
+
+		case 'n':
+			nsensors = strtol(optarg, &end, 10);
+
+			if (end == optarg || *end != '\0' || nsensors < 0 ||
+			    nsensors > SIM_MAX_SENSORS) {
+				fprintf(stderr, "Error: "
+					"Invalid sensors %s\n", optarg);
+				exit(1);
+			}
+
+			break;
+
+		case 'k':
+			nmetrics = strtol(optarg, &end, 10);
+
+			if (end == optarg || *end != '\0' || nmetrics < 1 ||
+			    nmetrics > SIM_MAX_METRICS) {
+				fprintf(stderr, "Error: "
+					"Invalid metrics %s\n", optarg);
+				exit(1);
+			}
+
+			break;
+
+		case 'j':
+			jitter = strtod(optarg, &end);
+
+			if (end == optarg || *end != '\0' ||
+			    !(jitter >= 0 && jitter <= 1)) {
+				fprintf(stderr, "Error: "
+					"Invalid jitter %s\n", optarg);
+				exit(1);
+			}
+
+			break;
+
+		case 'c':
+			limit = strtoul(optarg, &end, 10);
+
+			if (end == optarg || *end != '\0') {
+				fprintf(stderr, "Error: "
+					"Invalid frame count %s\n", optarg);
+				exit(1);
+			}
+
+			break;
+
+		case 's':
+			seed = strtoull(optarg, &end, 0);
+
+			if (end == optarg || *end != '\0') {
+				fprintf(stderr, "Error: "
+					"Invalid seed %s\n", optarg);
+				exit(1);
+			}
+
+			break;
+
+		case 'h':
+			_usage(argv[0]);
+			exit(0);
+
+		default:
+			_usage(argv[0]);
+			exit(1);
+		}
+	}
+}
+
+int main(int argc, char* const argv[])
+{
+	static char frame[SIM_FRAME_LEN];
+	struct sigaction sa;
+	int64_t interval;
+	int64_t start;
+	int64_t maxlate = 0;
+	unsigned long k;
+	double took;
+	int fd;
+
+	_parseOptions(argc, argv);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _signalHandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	state = seed;
+
+	for (int s = 0; s < (nsensors ? nsensors : 1); ++s) {
+		for (int m = 0; m < nmetrics; ++m) {
+			values[s][m] = readings[m % SIM_READINGS].start;
+		}
+	}
+
+	if ((fd = _open()) < 0) {
+		fprintf(stderr, "Failed to open output: %s\n",
+			strerror(errno));
+		return 1;
+	}
+
+	interval = rate > 0 ? (int64_t) (1e9 / rate) : 0;
+	start = _now();
+
+	for (k = 0; !stop && (limit == 0 || k < limit); ++k) {
+		/* Device time follows the schedule, never the clock, so
+		 * the frames do not depend on how fast they go out */
+		int64_t due = (int64_t) k * (interval ? interval : 1000000);
+		size_t len;
+
+		if (k > 0 && jitter > 0)
+			due += (int64_t) (jitter * _uniform() *
+					  (interval ? interval : 1000000));
+
+		len = _frame(frame, 1000 + due / 1000000);
+
+		if (interval) {
+			int64_t late = _now() - (start + due);
+
+			if (late < 0) {
+				struct timespec ts = {
+					.tv_sec = -late / 1000000000,
+					.tv_nsec = -late % 1000000000
+				};
+
+				nanosleep(&ts, NULL);
+			} else if (late > maxlate) {
+				maxlate = late;
+			}
+		}
+
+		if (_send(fd, frame, len) < 0) {
+			if (!stop)
+				fprintf(stderr, "Output closed: %s\n",
+					npeers == 0 && output != SIM_STDOUT &&
+					output != SIM_PTY &&
+					output != SIM_MCAST ?
+					"no readers left" : strerror(errno));
+			break;
+		}
+	}
+
+	took = (_now() - start) / 1e9;
+	fprintf(stderr, "Sent %lu frames in %.3f s, %.0f frames/s, late by "
+		"%.3f s at most\n", k, took, took > 0 ? k / took : 0.0,
+		maxlate / 1e9);
+
+	for (int i = 0; output == SIM_TCP && i < npeers; ++i) {
+		close(peers[i]);
+	}
+
+	if (fd != STDOUT_FILENO)
+		close(fd);
+
+	return 0;
+}
@@ -0,0 +1,259 @@
+#include "framebuf.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+
+static char *_find_eol(struct framebuf *fb);
+static char *_rfind_eol(char *start, char *end);
+static size_t _line_len(const char *start, const char *eol);
+static void _compact(struct framebuf *fb);
+
+int framebuf_init(struct framebuf *fb, int fd, size_t cap)
+{
+	assert(fb);
+
+	if (cap == 0)
+		cap = FRAMEBUF_DEFAULT_LEN;
+
+	/* Need room for at least one byte plus the terminator */
+	assert(cap >= 2);
+
+	memset(fb, 0, sizeof(*fb));
+	fb->fd = fd;
+	fb->buf = (char*) malloc(cap);
+
+	if (!fb->buf)
+		return -1;
+
+	fb->cap = cap;
+
+	return 0;
+}
+
+void framebuf_free(struct framebuf *fb)
+{
+	assert(fb);
+
+	free(fb->buf);
+	memset(fb, 0, sizeof(*fb));
+	fb->fd = -1;
+}
+
+ssize_t framebuf_fill(struct framebuf *fb)
+{
+	assert(fb);
+	assert(fb->buf);
+
+	_compact(fb);
+
+	/* Buffer is full without a line ending, so the line can never
+	 * be framed. Drop it and skip ahead to the next newline. */
+	if (fb->tail == fb->cap - 1) {
+		fb->head = fb->scan = fb->tail = 0;
+		fb->discarding = true;
+		++fb->oversized;
+	}
+
+	/* Keep the last byte free to terminate a trailing frame */
+	ssize_t readresult = read(fb->fd, fb->buf + fb->tail,
+				  fb->cap - fb->tail - 1);
+
+	if (readresult > 0) {
+		fb->tail += readresult;
+		fb->eof = false;
+	} else if (readresult == 0) {
+		fb->eof = true;
+	}
+
+	return readresult;
+}
+
+char *framebuf_next(struct framebuf *fb, size_t *len)
+{
+	assert(fb);
+
+	for (;;) {
+		char *eol = _find_eol(fb);
+		char *frame = fb->buf + fb->head;
+		size_t flen;
+
+		if (!eol) {
+			if (fb->discarding) {
+				fb->head = fb->scan = fb->tail;
+				return NULL;
+			}
+
+			/* Hand out the unterminated remainder at EOF */
+			if (!fb->eof || fb->follow || fb->head == fb->tail)
+				return NULL;
+
+			flen = fb->tail - fb->head;
+			fb->head = fb->scan = fb->tail;
+		} else {
+			flen = eol - frame;
+			fb->head = fb->scan = eol - fb->buf + 1;
+
+			if (fb->discarding) {
+				fb->discarding = false;
+				continue;
+			}
+		}
+
+		/* Accept CRLF line endings from serial devices */
+		if (flen > 0 && frame[flen - 1] == '\r')
+			--flen;
+
+		if (flen == 0)
+			continue;
+
+		frame[flen] = '\0';
+		++fb->frames;
+
+		if (len)
+			*len = flen;
+
+		return frame;
+	}
+}
+
+unsigned long framebuf_skip(struct framebuf *fb)
+{
+	assert(fb);
+
+	unsigned long skipped = 0;
+	char *start;
+	char *end;
+	char *last;
+	char *newest = NULL;
+
+	/* Finish dropping an oversized line first */
+	if (fb->discarding) {
+		char *eol = _find_eol(fb);
+
+		if (!eol)
+			return 0;
+
+		fb->head = fb->scan = eol - fb->buf + 1;
+		fb->discarding = false;
+	}
+
+	start = fb->buf + fb->head;
+	end = fb->buf + fb->tail;
+	last = _rfind_eol(start, end);
+
+	if (!last)
+		return 0;
+
+	if (fb->eof && !fb->follow && _line_len(last + 1, end) > 0) {
+		/* Unterminated remainder at EOF is the newest frame */
+		newest = last + 1;
+	} else {
+		/* Walk back over blank lines to the newest frame */
+		for (;;) {
+			char *prev = _rfind_eol(start, last);
+			char *ls = prev ? prev + 1 : start;
+
+			if (_line_len(ls, last) > 0) {
+				newest = ls;
+				break;
+			}
+
+			if (!prev)
+				break;
+
+			last = prev;
+		}
+	}
+
+	/* Nothing but blank lines */
+	if (!newest) {
+		fb->head = fb->scan = last - fb->buf + 1;
+		return 0;
+	}
+
+	/* Count the frames in front of the newest one */
+	for (char *p = start; p < newest; ) {
+		char *eol = (char*) memchr(p, '\n', newest - p);
+
+		if (_line_len(p, eol) > 0)
+			++skipped;
+
+		p = eol + 1;
+	}
+
+	fb->head = fb->scan = newest - fb->buf;
+
+	return skipped;
+}
+
+void framebuf_reset(struct framebuf *fb)
+{
+	assert(fb);
+
+	fb->head = fb->scan = fb->tail = 0;
+	fb->discarding = false;
+	fb->eof = false;
+}
+
+bool framebuf_ready(struct framebuf *fb)
+{
+	assert(fb);
+
+	if (_find_eol(fb))
+		return true;
+
+	return fb->eof && !fb->follow && !fb->discarding &&
+		fb->head != fb->tail;
+}
+
+/*
+**********************************************************************
+***************** LOCAL FUNCTION IMPLEMENTATION **********************
+**********************************************************************
+*/
+
+static char *_find_eol(struct framebuf *fb)
+{
+	char *eol = (char*) memchr(fb->buf + fb->scan, '\n',
+				   fb->tail - fb->scan);
+
+	/* Nothing before tail needs to be searched again */
+	if (!eol)
+		fb->scan = fb->tail;
+
+	return eol;
+}
+
+static char *_rfind_eol(char *start, char *end)
+{
+	while (end > start) {
+		if (*--end == '\n')
+			return end;
+	}
+
+	return NULL;
+}
+
+/* Length of a line without its CR, as framebuf_next() would see it */
+static size_t _line_len(const char *start, const char *eol)
+{
+	size_t len = eol - start;
+
+	if (len > 0 && start[len - 1] == '\r')
+		--len;
+
+	return len;
+}
+
+static void _compact(struct framebuf *fb)
+{
+	if (fb->head == 0)
+		return;
+
+	memmove(fb->buf, fb->buf + fb->head, fb->tail - fb->head);
+	fb->tail -= fb->head;
+	fb->scan -= fb->head;
+	fb->head = 0;
+}
@@ -0,0 +1,131 @@
+#ifndef FRAMEBUF_H
+#define FRAMEBUF_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* #ifdef __cplusplus */
+
+#ifndef FRAMEBUF_DEFAULT_LEN
+#define FRAMEBUF_DEFAULT_LEN 16384
+#endif /* #ifndef FRAMEBUF_DEFAULT_LEN */
+
+/** Buffered newline framer for a single descriptor
+ *
+ * Input is read in large chunks into a persistent buffer and handed
+ * out as complete newline-delimited frames. Frames are returned in
+ * place, NUL-terminated, without being copied. A partial line is
+ * kept in the buffer until the rest of it arrives. A line longer
+ * than the buffer is discarded up to the next newline so the framer
+ * resynchronizes on the following frame.
+ *
+ * @param fd Descriptor the framer reads from
+ *
+ * @param buf Backing storage of @p cap bytes
+ *
+ * @param head Offset of the first byte not yet handed out
+ *
+ * @param scan Offset up to which the buffer has been searched for a
+ * line ending
+ *
+ * @param tail Offset one past the last valid byte
+ *
+ * @param discarding True while skipping the rest of an oversized
+ * line
+ *
+ * @param eof True once read() has returned 0
+ *
+ * @param follow True if more may be appended after the end of file, so
+ * an unterminated line there is kept until its newline arrives
+ *
+ * @param frames Number of frames handed out
+ *
+ * @param oversized Number of lines discarded for not fitting in the
+ * buffer
+ */
+	struct framebuf {
+		int fd;
+		char *buf;
+		size_t cap;
+		size_t head;
+		size_t scan;
+		size_t tail;
+		bool discarding;
+		bool eof;
+		bool follow;
+		unsigned long frames;
+		unsigned long oversized;
+	};
+
+/** Allocate the framer buffer and attach it to a descriptor
+ *
+ * @param fb Framer to initialize
+ *
+ * @param fd Descriptor to read from
+ *
+ * @param cap Buffer length in bytes, which is also the longest frame
+ * accepted. FRAMEBUF_DEFAULT_LEN is used if 0.
+ *
+ * @return 0 on success, -1 if the buffer could not be allocated
+ */
+	int framebuf_init(struct framebuf *fb, int fd, size_t cap);
+
+/** Release the framer buffer and detach it from its descriptor */
+	void framebuf_free(struct framebuf *fb);
+
+/** Read once from the descriptor into the free end of the buffer
+ *
+ * Buffered bytes already handed out are compacted away first. At
+ * most one read() is issued.
+ *
+ * @return Number of bytes read, 0 on end of file, or -1 on error
+ * with errno set
+ */
+	ssize_t framebuf_fill(struct framebuf *fb);
+
+/** Return the next complete frame from the buffer
+ *
+ * The frame is NUL-terminated in place and stays valid until the
+ * next call to framebuf_fill(). Empty lines are skipped. Once end of
+ * file has been reached a trailing line without a newline is
+ * returned as the last frame, unless @p follow is set.
+ *
+ * @param fb Framer to take the frame from
+ *
+ * @param len If not NULL, receives the length of the frame
+ *
+ * @return Pointer to the frame, or NULL if no complete frame is
+ * buffered
+ */
+	char *framebuf_next(struct framebuf *fb, size_t *len);
+
+/** Discard every buffered frame except the newest
+ *
+ * After this call framebuf_next() returns the newest complete frame
+ * in the buffer, if any. A partial line after it is kept.
+ *
+ * @param fb Framer to skip frames in
+ *
+ * @return Number of frames discarded
+ */
+	unsigned long framebuf_skip(struct framebuf *fb);
+
+/** Drop everything buffered, for a descriptor that was moved back to
+ * the start of its file or now reads another one */
+	void framebuf_reset(struct framebuf *fb);
+
+/** Checks if a complete frame is already buffered
+ *
+ * @return True if framebuf_next() would return a frame without
+ * reading from the descriptor
+ */
+	bool framebuf_ready(struct framebuf *fb);
+
+#ifdef __cplusplus
+}
+#endif /* #ifdef __cplusplus */
+
+#endif /* #ifndef FRAMEBUF_H */
@@ -0,0 +1,318 @@
+#include "history.h"
+
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Bytes one retained sample costs: time, value and a slot in each
+ * window queue */
+#define HISTORY_SAMPLE_BYTES (sizeof(int64_t) + sizeof(double) + \
+			      2 * sizeof(uint64_t))
+
+static size_t _storedSize(unsigned nseries, unsigned len);
+static void _layout(struct history *h);
+static void _rebuild(struct history *h, int s);
+static void _push(const struct history *h, int s, uint64_t seq);
+static double _value(const struct history *h, int s, uint64_t seq);
+
+int history_init(struct history *h, size_t budget, unsigned nseries,
+		 const char *path)
+{
+	size_t fixed;
+	size_t len;
+	void *base;
+
+	assert(h);
+
+	if (budget == 0)
+		budget = HISTORY_DEFAULT_BUDGET;
+
+	if (nseries == 0)
+		nseries = HISTORY_DEFAULT_SERIES;
+
+	memset(h, 0, sizeof(*h));
+
+	fixed = sizeof(struct history_header) +
+		nseries * (sizeof(struct history_series) +
+			   sizeof(struct history_window));
+	len = budget > fixed ?
+		(budget - fixed) / (nseries * HISTORY_SAMPLE_BYTES) : 0;
+
+	if (len == 0 || len > UINT32_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	h->nseries = nseries;
+	h->len = (unsigned) len;
+	h->size = _storedSize(nseries, h->len);
+
+	/* Only the samples go in the file. The window queues are
+	 * rebuilt from them, so they live in memory either way. */
+	h->win = (struct history_window*) calloc(nseries, sizeof(*h->win));
+	h->minq = (uint64_t*) malloc(nseries * len * sizeof(uint64_t));
+	h->maxq = (uint64_t*) malloc(nseries * len * sizeof(uint64_t));
+
+	if (!h->win || !h->minq || !h->maxq) {
+		history_free(h);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (path) {
+		int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		struct stat st;
+		int err;
+
+		if (fd < 0 || fstat(fd, &st) < 0 ||
+		    ((size_t) st.st_size != h->size &&
+		     ftruncate(fd, h->size) < 0)) {
+			err = errno;
+
+			if (fd >= 0)
+				close(fd);
+
+			history_free(h);
+			errno = err;
+			return -1;
+		}
+
+		base = mmap(NULL, h->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    fd, 0);
+		err = errno;
+		close(fd);
+
+		if (base == MAP_FAILED) {
+			history_free(h);
+			errno = err;
+			return -1;
+		}
+
+		h->mapped = true;
+	} else {
+		base = calloc(1, h->size);
+
+		if (!base) {
+			history_free(h);
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	h->hdr = (struct history_header*) base;
+	_layout(h);
+
+	/* Keep the samples only if the file has the same shape */
+	if (h->hdr->magic != HISTORY_MAGIC ||
+	    h->hdr->version != HISTORY_VERSION ||
+	    h->hdr->nseries != nseries || h->hdr->len != h->len) {
+		memset(base, 0, h->size);
+		h->hdr->magic = HISTORY_MAGIC;
+		h->hdr->version = HISTORY_VERSION;
+		h->hdr->nseries = nseries;
+		h->hdr->len = h->len;
+	}
+
+	for (unsigned i = 0; i < nseries; ++i) {
+		h->series[i].name[sizeof(h->series[i].name) - 1] = '\0';
+		_rebuild(h, i);
+	}
+
+	return 0;
+}
+
+void history_free(struct history *h)
+{
+	assert(h);
+
+	if (h->hdr && h->mapped)
+		munmap(h->hdr, h->size);
+	else
+		free(h->hdr);
+
+	free(h->win);
+	free(h->minq);
+	free(h->maxq);
+	memset(h, 0, sizeof(*h));
+}
+
+int history_find(struct history *h, const char *name)
+{
+	int freeslot = -1;
+
+	assert(h);
+	assert(name);
+
+	for (unsigned i = 0; i < h->nseries; ++i) {
+		if (h->series[i].name[0] == '\0') {
+			if (freeslot < 0)
+				freeslot = i;
+
+			continue;
+		}
+
+		if (strncmp(h->series[i].name, name,
+			    sizeof(h->series[i].name)) == 0)
+			return i;
+	}
+
+	if (freeslot >= 0) {
+		struct history_series *hs = &h->series[freeslot];
+
+		strncpy(hs->name, name, sizeof(hs->name) - 1);
+		hs->total = 0;
+		memset(&h->win[freeslot], 0, sizeof(h->win[freeslot]));
+	}
+
+	return freeslot;
+}
+
+void history_append(struct history *h, int s, int64_t timemillis,
+		    double value)
+{
+	assert(h);
+	assert(s >= 0 && (unsigned) s < h->nseries);
+
+	if (value != value)
+		return;
+
+	struct history_series *hs = &h->series[s];
+	struct history_window *w = &h->win[s];
+	uint64_t *minq = h->minq + (size_t) s * h->len;
+	uint64_t *maxq = h->maxq + (size_t) s * h->len;
+	uint64_t seq = hs->total;
+	size_t at = (size_t) s * h->len + seq % h->len;
+
+	/* The sample about to be overwritten leaves the window */
+	if (seq >= h->len) {
+		if (w->mincount && minq[w->minhead] == seq - h->len) {
+			w->minhead = (w->minhead + 1) % h->len;
+			--w->mincount;
+		}
+
+		if (w->maxcount && maxq[w->maxhead] == seq - h->len) {
+			w->maxhead = (w->maxhead + 1) % h->len;
+			--w->maxcount;
+		}
+	}
+
+	h->times[at] = timemillis;
+	h->values[at] = value;
+	_push(h, s, seq);
+	hs->total = seq + 1;
+}
+
+unsigned history_count(const struct history *h, int s)
+{
+	assert(h);
+	assert(s >= 0 && (unsigned) s < h->nseries);
+
+	uint64_t total = h->series[s].total;
+
+	return total < h->len ? (unsigned) total : h->len;
+}
+
+bool history_range(const struct history *h, int s, double *min,
+		   double *max)
+{
+	assert(h);
+	assert(s >= 0 && (unsigned) s < h->nseries);
+
+	const struct history_window *w = &h->win[s];
+
+	if (w->mincount == 0)
+		return false;
+
+	if (min)
+		*min = _value(h, s, h->minq[(size_t) s * h->len + w->minhead]);
+
+	if (max)
+		*max = _value(h, s, h->maxq[(size_t) s * h->len + w->maxhead]);
+
+	return true;
+}
+
+unsigned history_last(const struct history *h, int s, double *out,
+		      unsigned n)
+{
+	assert(h);
+	assert(out || n == 0);
+
+	uint64_t total = h->series[s].total;
+	unsigned count = history_count(h, s);
+
+	if (n > count)
+		n = count;
+
+	for (unsigned i = 0; i < n; ++i) {
+		out[i] = _value(h, s, total - n + i);
+	}
+
+	return n;
+}
+
+static size_t _storedSize(unsigned nseries, unsigned len)
+{
+	return sizeof(struct history_header) +
+		nseries * sizeof(struct history_series) +
+		(size_t) nseries * len * (sizeof(int64_t) + sizeof(double));
+}
+
+/* Point the arrays into the storage. The time stamps follow the
+ * series table and keep their 8 byte alignment. */
+static void _layout(struct history *h)
+{
+	char *p = (char*) h->hdr + sizeof(struct history_header);
+
+	h->series = (struct history_series*) p;
+	p += h->nseries * sizeof(struct history_series);
+	h->times = (int64_t*) p;
+	p += (size_t) h->nseries * h->len * sizeof(int64_t);
+	h->values = (double*) p;
+}
+
+/* Refill the window queues of a series from its retained samples */
+static void _rebuild(struct history *h, int s)
+{
+	uint64_t total = h->series[s].total;
+	uint64_t first = total - history_count(h, s);
+
+	memset(&h->win[s], 0, sizeof(h->win[s]));
+
+	for (uint64_t seq = first; seq < total; ++seq) {
+		_push(h, s, seq);
+	}
+}
+
+/* Add a sample to the back of both queues, first dropping every
+ * sample it outlives and beats */
+static void _push(const struct history *h, int s, uint64_t seq)
+{
+	struct history_window *w = &h->win[s];
+	uint64_t *minq = h->minq + (size_t) s * h->len;
+	uint64_t *maxq = h->maxq + (size_t) s * h->len;
+	double v = _value(h, s, seq);
+
+	while (w->mincount &&
+	       _value(h, s, minq[(w->minhead + w->mincount - 1) % h->len]) >= v)
+		--w->mincount;
+
+	minq[(w->minhead + w->mincount) % h->len] = seq;
+	++w->mincount;
+
+	while (w->maxcount &&
+	       _value(h, s, maxq[(w->maxhead + w->maxcount - 1) % h->len]) <= v)
+		--w->maxcount;
+
+	maxq[(w->maxhead + w->maxcount) % h->len] = seq;
+	++w->maxcount;
+}
+
+static double _value(const struct history *h, int s, uint64_t seq)
+{
+	return h->values[(size_t) s * h->len + seq % h->len];
+}
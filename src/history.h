@@ -0,0 +1,161 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* #ifdef __cplusplus */
+
+#define HISTORY_MAGIC 0x454e5648 /* "ENVH" */
+#define HISTORY_VERSION 1
+
+#ifndef HISTORY_DEFAULT_BUDGET
+#define HISTORY_DEFAULT_BUDGET (1024 * 1024)
+#endif /* #ifndef HISTORY_DEFAULT_BUDGET */
+
+#ifndef HISTORY_DEFAULT_SERIES
+#define HISTORY_DEFAULT_SERIES 64
+#endif /* #ifndef HISTORY_DEFAULT_SERIES */
+
+/** Start of the history storage, and of the history file */
+	struct history_header {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t nseries;
+		uint32_t len;
+	};
+
+/** Identity and fill level of one series
+ *
+ * @param name Metric name the series belongs to, empty if unused
+ *
+ * @param total Number of samples ever appended. The newest sample is
+ * at (total - 1) % len.
+ */
+	struct history_series {
+		char name[48];
+		uint64_t total;
+	};
+
+/** Window extremes of one series, as monotonic queues of sample
+ * numbers. Front of the min queue is the smallest retained sample,
+ * front of the max queue the largest. */
+	struct history_window {
+		uint32_t minhead;
+		uint32_t mincount;
+		uint32_t maxhead;
+		uint32_t maxcount;
+	};
+
+/** Fixed-size store of recent samples for a set of metrics
+ *
+ * Every series is a ring of @p len samples. Time stamps and values
+ * are kept in separate contiguous arrays, series after series, so
+ * one series' values are adjacent in memory. The whole store fits a
+ * byte budget given up front and never grows. It may be backed by a
+ * file, which keeps the samples across restarts.
+ *
+ * The smallest and largest retained sample of each series are kept
+ * up to date on every append in amortized constant time, without
+ * scanning the ring.
+ *
+ * @param hdr Header at the start of the storage
+ *
+ * @param series Per-series identity, @p nseries of them
+ *
+ * @param times Device time stamps in milliseconds, @p len per series
+ *
+ * @param values Sample values, @p len per series
+ *
+ * @param win Window extremes per series
+ *
+ * @param minq Min queues, @p len sample numbers per series
+ *
+ * @param maxq Max queues, @p len sample numbers per series
+ *
+ * @param nseries Number of series
+ *
+ * @param len Samples kept per series
+ *
+ * @param size Bytes of storage behind @p hdr
+ *
+ * @param mapped True if the storage is a mapped file
+ */
+	struct history {
+		struct history_header *hdr;
+		struct history_series *series;
+		int64_t *times;
+		double *values;
+		struct history_window *win;
+		uint64_t *minq;
+		uint64_t *maxq;
+		unsigned nseries;
+		unsigned len;
+		size_t size;
+		bool mapped;
+	};
+
+/** Set up a history within a byte budget
+ *
+ * The budget is shared by the samples and the window queues of every
+ * series, and decides how many samples each series keeps. A file that
+ * holds a history of the same shape is picked up where it left off;
+ * anything else in it is replaced.
+ *
+ * @param h History to initialize
+ *
+ * @param budget Bytes to use, HISTORY_DEFAULT_BUDGET if 0
+ *
+ * @param nseries Most metrics tracked, HISTORY_DEFAULT_SERIES if 0
+ *
+ * @param path File to keep the samples in, NULL to keep them in memory
+ *
+ * @return 0 on success, -1 on failure with errno set. EINVAL means
+ * the budget does not leave room for even one sample per series.
+ */
+	int history_init(struct history *h, size_t budget, unsigned nseries,
+			 const char *path);
+
+/** Release the storage, writing it out if file backed */
+	void history_free(struct history *h);
+
+/** Find the series of a metric, claiming a free one if it has none
+ *
+ * @return Index of the series, or -1 if every series is taken
+ */
+	int history_find(struct history *h, const char *name);
+
+/** Append a sample to a series, replacing its oldest once full
+ *
+ * NaN samples are not kept, since they have no place in a range.
+ */
+	void history_append(struct history *h, int s, int64_t timemillis,
+			    double value);
+
+/** Number of samples retained in a series */
+	unsigned history_count(const struct history *h, int s);
+
+/** Smallest and largest retained sample of a series
+ *
+ * @return False if the series is empty
+ */
+	bool history_range(const struct history *h, int s, double *min,
+			   double *max);
+
+/** Copy the newest samples of a series, oldest first
+ *
+ * @param out Receives up to @p n values
+ *
+ * @return Number of values copied
+ */
+	unsigned history_last(const struct history *h, int s, double *out,
+			      unsigned n);
+
+#ifdef __cplusplus
+}
+#endif /* #ifdef __cplusplus */
+
+#endif /* #ifndef HISTORY_H */
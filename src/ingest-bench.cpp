@@ -0,0 +1,492 @@
+// Cost per frame of the ingest path
+//
+// Times the parser on small, medium and large frames with either
+// backend, getDataDump(), clearData(), isErrorDatafield(), and frames
+// read from a pipe through the form's poll callback, which frames,
+// parses and loads them into the metrics as the display does. Each
+// case is run until it has taken long enough to time, a few times
+// over, and the median is reported as ns/frame, heap allocations/frame
+// and frames/s.
+//
+// Allocations are counted through operator new, which covers the
+// parser and jsoncpp. The C side only allocates when a frame grows.
+//
+// -j prints one JSON object per case instead of a table, -o saves
+// the same to a file, and -b compares against such a file, failing if
+// any case got slower by more than -t percent or allocates more.
+
+#include "jsonparse.h"
+#include "data-ops.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <csignal>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <thread>
+#include <new>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifndef BENCH_RUNS
+#define BENCH_RUNS 5
+#endif // #ifndef BENCH_RUNS
+
+// Count heap allocations made through operator new
+static size_t newcount = 0;
+
+void* operator new(std::size_t n)
+{
+  void* p = malloc(n ? n : 1);
+
+  ++newcount;
+
+  if (!p)
+    throw std::bad_alloc();
+
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+  free(p);
+}
+
+struct result {
+  std::string name;
+  double ns;
+  double allocs;
+  double fps;
+};
+
+// Part of a frame's work that is timed on its own
+struct section {
+  double ns;
+  size_t allocs;
+};
+
+static double mintime = 0.2;
+static volatile size_t sink = 0;
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// A frame like the sensors send: one "data" array, or an "output" array
+// of several sensors. The largest used stays within FRAMEBUF_DEFAULT_LEN
+// so the display takes it in whole.
+static std::string makeFrame(int sensors, int fields)
+{
+  static const char* names[] = { "ammonia", "temp", "pressure",
+                                 "altitude", "rh", "CO2", "TVOC", "gas" };
+  static const char* units[] = { "counts", "degC", "pa", "m", "%",
+                                 "ppm", "ppb", "ohm" };
+  std::string f = "{\"status\": {\"isWarmedUp\": true, \"CCS811\": \"ok\", "
+    "\"localIP\": \"192.168.1.211\", \"sentmillis\": 1602543}, ";
+  char buf[160];
+
+  f += sensors ? "\"output\": [" : "\"data\": [";
+
+  for (int s = 0; s < (sensors ? sensors : 1); ++s) {
+    if (sensors) {
+      snprintf(buf, sizeof(buf), "%s{\"sensor\": \"sensor%d\", \"data\": [",
+               s ? ", " : "", s);
+      f += buf;
+    }
+
+    for (int i = 0; i < fields; ++i) {
+      snprintf(buf, sizeof(buf), "%s{\"name\": \"%s%d\", \"value\": %.2f, "
+               "\"timemillis\": %d, \"unit\": \"%s\"}", i ? ", " : "",
+               names[i % 8], i / 8, 20 + i * 1.37 + s, 1602546 + i,
+               units[i % 8]);
+      f += buf;
+    }
+
+    if (sensors)
+      f += "]}";
+  }
+
+  return f + "]}";
+}
+
+// Run one frame's worth of work n times, doubling n until it takes
+// long enough, then report the median of BENCH_RUNS runs. If @p timed
+// is given the frame adds the time and allocations of the part of
+// interest to it, and only those are reported.
+template <typename F> static result measure(const std::string& name,
+                                            F&& frame, section* timed = NULL)
+{
+  std::vector<double> ns;
+  size_t n = 1;
+  size_t allocs;
+  double start;
+  double took;
+
+  // Warm up, sizing any storage reused across frames
+  for (int i = 0; i < 16; ++i) {
+    frame();
+  }
+
+  for (;;) {
+    start = now();
+
+    for (size_t i = 0; i < n; ++i) {
+      frame();
+    }
+
+    took = now() - start;
+
+    if (took >= mintime * 1e9 / BENCH_RUNS)
+      break;
+
+    n *= 2;
+  }
+
+  allocs = newcount;
+
+  if (timed)
+    timed->allocs = 0;
+
+  // Time is taken per run, allocations over every run
+  for (int r = 0; r < BENCH_RUNS; ++r) {
+    if (timed)
+      timed->ns = 0;
+
+    start = now();
+
+    for (size_t i = 0; i < n; ++i) {
+      frame();
+    }
+
+    ns.push_back((timed ? timed->ns : now() - start) / n);
+  }
+
+  allocs = timed ? timed->allocs : newcount - allocs;
+  std::sort(ns.begin(), ns.end());
+
+  return { name, ns[BENCH_RUNS / 2], (double) allocs / (n * BENCH_RUNS),
+           1e9 / ns[BENCH_RUNS / 2] };
+}
+
+// Frames written to a pipe by another thread and taken in by the poll
+// callback, which runs the display's whole ingest path
+static result measurePipe(const std::string& name, const std::string& frame)
+{
+  std::string line = frame + "\n";
+  struct datastats st;
+  unsigned long first;
+  unsigned long frames = 0;
+  int p[2];
+
+  if (pipe(p) < 0) {
+    perror("Failed to open pipe: ");
+    exit(1);
+  }
+
+  std::thread writer([&]() {
+    while (write(p[1], line.data(), line.size()) == (ssize_t) line.size())
+      ;
+  });
+
+  // Keep the form's greeting out of the results
+  int out = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+
+  fflush(stdout);
+  dup2(null, STDOUT_FILENO);
+  close(null);
+
+  struct metric_form* mf = ncursesCFG(p[0]);
+
+  fflush(stdout);
+  dup2(out, STDOUT_FILENO);
+  close(out);
+
+  if (!mf) {
+    fprintf(stderr, "Failed to set up the form\n");
+    exit(1);
+  }
+
+  getDataStats(&st);
+  first = st.frames;
+
+  result r = measure(name, [&]() {
+    // One frame per call, however many the poll took in
+    while (frames == 0) {
+      if (ncursesPollCB(1000) < 0)
+        exit(1);
+
+      getDataStats(&st);
+      frames = st.frames - first;
+      first = st.frames;
+    }
+
+    --frames;
+  });
+
+  ncursesFreeMetric();
+  close(p[0]);
+  writer.join();
+  close(p[1]);
+
+  return r;
+}
+
+static std::vector<result> runAll(const char* only)
+{
+  static const struct {
+    const char* name;
+    int sensors;
+    int fields;
+  } sizes[] = {
+    { "small", 0, 5 },
+    { "medium", 3, 8 },
+    { "large", 8, 16 }
+  };
+  static const struct {
+    const char* name;
+    enum jp_backend backend;
+  } backends[] = {
+    { "jsoncpp", JP_BACKEND_JSONCPP },
+    { "insitu", JP_BACKEND_INSITU }
+  };
+  std::vector<result> out;
+  std::string large = makeFrame(8, 16);
+  auto wanted = [only](const std::string& name) {
+    return !only || name.find(only) != std::string::npos;
+  };
+
+  for (auto& s : sizes) {
+    std::string f = makeFrame(s.sensors, s.fields);
+
+    for (auto& b : backends) {
+      std::string name = std::string("initializeData/") + s.name + "/" +
+        b.name;
+
+      if (!wanted(name))
+        continue;
+
+      out.push_back(measure(name, [&]() {
+        initializeDataWith(f.c_str(), b.backend);
+        clearData();
+      }));
+    }
+  }
+
+  initializeDataWith(large.c_str(), JP_BACKEND_DEFAULT);
+
+  struct datafield** df = NULL;
+
+  if (wanted("getDataDump/large")) {
+    out.push_back(measure("getDataDump/large", [&]() {
+      df = getDataDump(df);
+      sink += (size_t) df;
+    }));
+  }
+
+  df = getDataDump(df);
+
+  if (wanted("isErrorDatafield")) {
+    out.push_back(measure("isErrorDatafield", [&]() {
+      sink += isErrorDatafield(df[0]);
+    }));
+  }
+
+  // Filling the parser again is left out of the time of clearData()
+  if (wanted("clearData/large")) {
+    section timed = { 0, 0 };
+
+    out.push_back(measure("clearData/large", [&]() {
+      initializeDataWith(large.c_str(), JP_BACKEND_DEFAULT);
+
+      size_t allocs = newcount;
+      double start = now();
+
+      clearData();
+      timed.ns += now() - start;
+      timed.allocs += newcount - allocs;
+    }, &timed));
+  }
+
+  clearData();
+
+  for (auto& s : sizes) {
+    std::string name = std::string("pipe/") + s.name;
+
+    if (wanted(name))
+      out.push_back(measurePipe(name, makeFrame(s.sensors, s.fields)));
+  }
+
+  return out;
+}
+
+static void printJson(FILE* f, const result& r)
+{
+  fprintf(f, "{\"case\": \"%s\", \"ns_per_frame\": %.1f, "
+          "\"allocs_per_frame\": %.3f, \"frames_per_sec\": %.0f}\n",
+          r.name.c_str(), r.ns, r.allocs, r.fps);
+}
+
+static std::map<std::string, result> loadBaseline(const char* path)
+{
+  std::map<std::string, result> base;
+  FILE* f = fopen(path, "r");
+  char line[512];
+  char name[128];
+  result r;
+
+  if (!f) {
+    fprintf(stderr, "Failed to open baseline %s: %s\n", path,
+            strerror(errno));
+    exit(1);
+  }
+
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "{\"case\": \"%127[^\"]\", \"ns_per_frame\": %lf, "
+               "\"allocs_per_frame\": %lf, \"frames_per_sec\": %lf}",
+               name, &r.ns, &r.allocs, &r.fps) != 4)
+      continue;
+
+    r.name = name;
+    base[name] = r;
+  }
+
+  fclose(f);
+
+  return base;
+}
+
+static void usage(const char* argv0)
+{
+  printf("Usage:\n"
+         "%1$s [-j] [-o <file>] [-b <file> [-t <percent>]] [-m <ms>] "
+         "[-c <case>]\n"
+         "%1$s -h\n"
+         "\n"
+         "Options:\n"
+         "-j		Print one JSON object per case instead of a table\n"
+         "-o <file>	Save the results to this file as JSON, for -b\n"
+         "-b <file>	Compare with results saved with -o, failing if a\n"
+         "		case got slower or allocates more\n"
+         "-t <percent>	Slowdown -b tolerates (default: 10)\n"
+         "-m <ms>		Time each case takes at least (default: 200)\n"
+         "-c <case>	Only run the cases whose name contains this\n"
+         "-h		Print usage message, then exit\n", argv0);
+}
+
+int main(int argc, char* const argv[])
+{
+  std::map<std::string, result> base;
+  const char* savepath = NULL;
+  const char* basepath = NULL;
+  const char* only = NULL;
+  double tolerance = 10;
+  bool json = false;
+  int ret = 0;
+  int c;
+
+  while ((c = getopt(argc, argv, "jo:b:t:m:c:h")) != -1) {
+    switch (c) {
+    case 'j':
+      json = true;
+      break;
+    case 'o':
+      savepath = optarg;
+      break;
+    case 'b':
+      basepath = optarg;
+      break;
+    case 't':
+      tolerance = atof(optarg);
+      break;
+    case 'm':
+      mintime = atof(optarg) / 1000;
+      break;
+    case 'c':
+      only = optarg;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (basepath)
+    base = loadBaseline(basepath);
+
+  // The pipe writers stop once their reader is closed
+  signal(SIGPIPE, SIG_IGN);
+
+  std::vector<result> results = runAll(only);
+
+  if (!json) {
+    printf("%-32s %12s %12s %12s", "case", "ns/frame", "allocs/frame",
+           "frames/s");
+    printf(basepath ? " %12s %8s\n" : "\n", "baseline", "change");
+  }
+
+  for (auto& r : results) {
+    auto b = base.find(r.name);
+    bool slower = false;
+    bool allocs = false;
+
+    if (b != base.end()) {
+      slower = r.ns > b->second.ns * (1 + tolerance / 100);
+      // Storage that grows now and then allocates a fraction per frame
+      allocs = r.allocs > b->second.allocs + 0.5;
+      ret |= slower || allocs;
+    }
+
+    if (json) {
+      printJson(stdout, r);
+      continue;
+    }
+
+    printf("%-32s %12.1f %12.3f %12.0f", r.name.c_str(), r.ns, r.allocs,
+           r.fps);
+
+    if (b == base.end()) {
+      printf("\n");
+      continue;
+    }
+
+    printf(" %12.1f %+7.1f%%%s%s\n", b->second.ns,
+           (r.ns / b->second.ns - 1) * 100, slower ? " SLOWER" : "",
+           allocs ? " MORE ALLOCS" : "");
+  }
+
+  if (savepath) {
+    FILE* f = fopen(savepath, "w");
+
+    if (!f) {
+      fprintf(stderr, "Failed to save %s: %s\n", savepath, strerror(errno));
+      return 1;
+    }
+
+    for (auto& r : results) {
+      printJson(f, r);
+    }
+
+    fclose(f);
+  }
+
+  return ret;
+}
@@ -7,147 +7,788 @@
 #include <cstdio>
 #include <csignal>
 #include <cassert>
+#include <cctype>
+#include <cstdlib>
 
 #include <iostream>
 #include <vector>
 #include <string>
 #include <sstream>
+#include <new>
 
-struct datafield** _df = NULL;
-
+// Parsed records for one sensor. Storage is kept across frames and
+// only grows when a frame carries more fields than any before it.
 class mrparser {
 public:
-  std::vector<std::string> names;
-  std::vector<std::string> values;
-  std::vector<std::string> units;
-  std::vector<std::string> millis;
+  std::vector<struct datafield> fields;
+  size_t count = 0;
+  size_t* allocations = NULL;
+
+  struct datafield& next()
+  {
+    if (count == fields.size()) {
+      if (fields.size() == fields.capacity())
+	++*allocations;
+
+      fields.emplace_back();
+    }
+
+    struct datafield& df = fields[count++];
+
+    memset(&df, 0, sizeof(df));
+
+    return df;
+  }
+};
+
+// Pool of sensor records plus the pointer array handed out by
+// getDataDump(). clear() only forgets the contents.
+class parsedlist {
+public:
+  std::vector<mrparser> sensors;
+  std::vector<struct datafield*> dump;
+  size_t count = 0;
+
+  // Number of times record storage had to grow
+  size_t allocations = 0;
+
+  mrparser& next()
+  {
+    if (count == sensors.size()) {
+      if (sensors.size() == sensors.capacity())
+	++allocations;
+
+      sensors.emplace_back();
+    }
+
+    mrparser& parsed = sensors[count++];
+
+    parsed.count = 0;
+    parsed.allocations = &allocations;
+
+    return parsed;
+  }
+
+  mrparser& operator[](size_t i) { return sensors[i]; }
+
+  size_t size() const { return count; }
+
+  void clear() { count = 0; }
+};
+
+// Everything one stream's parses touch. Contexts share nothing, so
+// each can be used from its own thread without locking.
+struct jp_ctx {
+  parsedlist values;
+  std::string error;
 };
 
-typedef std::vector<mrparser> parsedlist;
+// Context behind the initializeData() family
+static struct jp_ctx defaultctx;
+
+// Copy a string into a fixed record member, always terminated
+static void copyText(char* dst, size_t len, const std::string& src)
+{
+  size_t n = src.size() < len - 1 ? src.size() : len - 1;
+
+  memcpy(dst, src.data(), n);
+  dst[n] = '\0';
+}
+
+// Integer time stamp, 0 if missing or not a number
+static long long asMillis(const Json::Value& v)
+{
+  if (v.isIntegral())
+    return v.asInt64();
 
-static parsedlist parsedvalues;
+  if (v.isNumeric())
+    return (long long) v.asDouble();
+
+  return 0;
+}
 
 static void loadData(const Json::Value& ds, mrparser& parsed)
 {
   for (unsigned int i = 0; i < ds["data"].size(); ++i) {
     const Json::Value& thisdata = ds["data"][i];
-    char thisbuf[32];
+    struct datafield& df = parsed.next();
 
-    // Round values to a precision of 2
-    snprintf(thisbuf, 32, "%.2f", thisdata["value"].asDouble());
+    // Values stay numeric, the display formats them
+    df.value = thisdata["value"].asDouble();
+    df.timemillis = asMillis(thisdata["timemillis"]);
 
-    // Load parsed parameters into storage vectors
-    parsed.names.push_back(thisdata["name"].asString());
-    parsed.values.push_back(thisbuf);
-    parsed.units.push_back(thisdata["unit"].asString());
-    parsed.millis.push_back(thisdata["timemillis"].asString());
+    // Load parsed parameters into the record
+    copyText(df.name, sizeof(df.name), thisdata["name"].asString());
+    copyText(df.unit, sizeof(df.unit), thisdata["unit"].asString());
   }
 }
 
-void initializeData(const char* data)
+// Bounded output for decoded strings, truncating like copyText()
+class textsink {
+public:
+  textsink(char* b, size_t c) : buf(b), cap(c), len(0) { buf[0] = '\0'; }
+
+  void put(const char* s, size_t n)
+  {
+    if (n > cap - 1 - len)
+      n = cap - 1 - len;
+
+    memcpy(buf + len, s, n);
+    len += n;
+    buf[len] = '\0';
+  }
+
+  void put(char c) { put(&c, 1); }
+
+  void put(const char* s) { put(s, strlen(s)); }
+
+  const char* str() const { return buf; }
+
+private:
+  char* buf;
+  size_t cap;
+  size_t len;
+};
+
+// In-situ pull parser. Walks the frame buffer in place without
+// building a tree and only decodes the keys loadData() uses, writing
+// them straight into the parsed records. Everything else is skipped.
+class insituparser {
+public:
+  explicit insituparser(const char* data) : start(data), p(data) {}
+
+  bool parse(parsedlist& out);
+
+  size_t offset() const { return p - start; }
+
+  bool known() const { return format; }
+
+private:
+  const char* start;
+  const char* p;
+  bool format = false;
+
+  void ws();
+  bool consume(char c);
+  bool literal(const char* lit);
+  bool string(textsink* out);
+  bool number(double* out, textsink* text);
+  bool millis(long long& out);
+  bool scalar(textsink& out);
+  bool skip();
+  bool loadSensor(mrparser& parsed);
+  bool loadArray(mrparser& parsed);
+  bool loadField(mrparser& parsed);
+
+  template <typename F> bool object(F&& member);
+  template <typename F> bool array(F&& element);
+};
+
+void insituparser::ws()
+{
+  for (;;) {
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+      ++p;
+
+    // jsoncpp accepts comments by default, so skip them too
+    if (p[0] == '/' && p[1] == '/') {
+      while (*p != '\0' && *p != '\n')
+	++p;
+    } else if (p[0] == '/' && p[1] == '*') {
+      const char* end = strstr(p + 2, "*/");
+
+      p = end ? end + 2 : p + strlen(p);
+    } else {
+      return;
+    }
+  }
+}
+
+bool insituparser::consume(char c)
+{
+  ws();
+
+  if (*p != c)
+    return false;
+
+  ++p;
+  return true;
+}
+
+bool insituparser::literal(const char* lit)
+{
+  size_t n = strlen(lit);
+
+  if (strncmp(p, lit, n) != 0)
+    return false;
+
+  p += n;
+  return true;
+}
+
+template <typename F> bool insituparser::object(F&& member)
+{
+  char keybuf[32];
+
+  if (!consume('{'))
+    return false;
+
+  if (consume('}'))
+    return true;
+
+  do {
+    textsink key(keybuf, sizeof(keybuf));
+
+    if (!string(&key) || !consume(':'))
+      return false;
+
+    ws();
+
+    if (!member(key.str()))
+      return false;
+  } while (consume(','));
+
+  return consume('}');
+}
+
+template <typename F> bool insituparser::array(F&& element)
+{
+  if (!consume('['))
+    return false;
+
+  if (consume(']'))
+    return true;
+
+  do {
+    ws();
+
+    if (!element())
+      return false;
+  } while (consume(','));
+
+  return consume(']');
+}
+
+static void appendUtf8(textsink& out, unsigned long cp)
+{
+  char u[4];
+  size_t n;
+
+  if (cp < 0x80) {
+    u[0] = (char) cp;
+    n = 1;
+  } else if (cp < 0x800) {
+    u[0] = (char) (0xC0 | (cp >> 6));
+    u[1] = (char) (0x80 | (cp & 0x3F));
+    n = 2;
+  } else if (cp < 0x10000) {
+    u[0] = (char) (0xE0 | (cp >> 12));
+    u[1] = (char) (0x80 | ((cp >> 6) & 0x3F));
+    u[2] = (char) (0x80 | (cp & 0x3F));
+    n = 3;
+  } else {
+    u[0] = (char) (0xF0 | (cp >> 18));
+    u[1] = (char) (0x80 | ((cp >> 12) & 0x3F));
+    u[2] = (char) (0x80 | ((cp >> 6) & 0x3F));
+    u[3] = (char) (0x80 | (cp & 0x3F));
+    n = 4;
+  }
+
+  out.put(u, n);
+}
+
+static bool hex4(const char* h, unsigned long& cp)
+{
+  cp = 0;
+
+  for (int i = 0; i < 4; ++i) {
+    char c = h[i];
+
+    cp <<= 4;
+
+    if (c >= '0' && c <= '9')
+      cp |= c - '0';
+    else if (c >= 'a' && c <= 'f')
+      cp |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      cp |= c - 'A' + 10;
+    else
+      return false;
+  }
+
+  return true;
+}
+
+bool insituparser::string(textsink* out)
+{
+  ws();
+
+  if (*p != '"')
+    return false;
+
+  ++p;
+
+  for (;;) {
+    const char* run = p;
+
+    while (*p != '"' && *p != '\\' && *p != '\0')
+      ++p;
+
+    if (out)
+      out->put(run, p - run);
+
+    if (*p == '"') {
+      ++p;
+      return true;
+    }
+
+    if (*p == '\0')
+      return false;
+
+    // Escape sequence
+    char c = p[1];
+    char e;
+
+    p += 2;
+
+    switch (c) {
+    case '"': e = '"'; break;
+    case '\\': e = '\\'; break;
+    case '/': e = '/'; break;
+    case 'b': e = '\b'; break;
+    case 'f': e = '\f'; break;
+    case 'n': e = '\n'; break;
+    case 'r': e = '\r'; break;
+    case 't': e = '\t'; break;
+    case 'u': {
+      unsigned long cp;
+      unsigned long lo;
+
+      if (!hex4(p, cp))
+	return false;
+
+      p += 4;
+
+      // Surrogate pair
+      if (cp >= 0xD800 && cp <= 0xDBFF) {
+	if (p[0] != '\\' || p[1] != 'u' || !hex4(p + 2, lo) ||
+	    lo < 0xDC00 || lo > 0xDFFF)
+	  return false;
+
+	cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+	p += 6;
+      }
+
+      if (out)
+	appendUtf8(*out, cp);
+
+      continue;
+    }
+    default:
+      return false;
+    }
+
+    if (out)
+      out->put(e);
+  }
+}
+
+bool insituparser::number(double* out, textsink* text)
+{
+  const char* b;
+
+  ws();
+  b = p;
+
+  if (*p == '-')
+    ++p;
+
+  if (!isdigit((unsigned char) *p))
+    return false;
+
+  while (isdigit((unsigned char) *p))
+    ++p;
+
+  if (*p == '.') {
+    ++p;
+
+    if (!isdigit((unsigned char) *p))
+      return false;
+
+    while (isdigit((unsigned char) *p))
+      ++p;
+  }
+
+  if (*p == 'e' || *p == 'E') {
+    ++p;
+
+    if (*p == '+' || *p == '-')
+      ++p;
+
+    if (!isdigit((unsigned char) *p))
+      return false;
+
+    while (isdigit((unsigned char) *p))
+      ++p;
+  }
+
+  if (out)
+    *out = strtod(b, NULL);
+
+  if (text)
+    text->put(b, p - b);
+
+  return true;
+}
+
+// Same conversion as asMillis() for the jsoncpp backend
+bool insituparser::millis(long long& out)
+{
+  const char* b;
+  double d;
+
+  ws();
+  out = 0;
+
+  if (*p != '-' && !isdigit((unsigned char) *p))
+    return skip();
+
+  b = p;
+
+  if (!number(&d, NULL))
+    return false;
+
+  // Integers keep full precision, anything else is truncated
+  for (const char* c = b; c < p; ++c) {
+    if (*c == '.' || *c == 'e' || *c == 'E') {
+      out = (long long) d;
+      return true;
+    }
+  }
+
+  out = strtoll(b, NULL, 10);
+
+  return true;
+}
+
+// Same conversions as Json::Value::asString() for the scalar types
+bool insituparser::scalar(textsink& out)
+{
+  ws();
+
+  switch (*p) {
+  case '"':
+    return string(&out);
+  case 't':
+    out.put("true");
+    return literal("true");
+  case 'f':
+    out.put("false");
+    return literal("false");
+  case 'n':
+    return literal("null");
+  default:
+    return number(NULL, &out);
+  }
+}
+
+bool insituparser::skip()
+{
+  ws();
+
+  switch (*p) {
+  case '"':
+    return string(NULL);
+  case '{':
+    return object([this](const char*) { return skip(); });
+  case '[':
+    return array([this]() { return skip(); });
+  case 't':
+    return literal("true");
+  case 'f':
+    return literal("false");
+  case 'n':
+    return literal("null");
+  default:
+    return number(NULL, NULL);
+  }
+}
+
+bool insituparser::loadField(mrparser& parsed)
+{
+  struct datafield& df = parsed.next();
+
+  // Repeated members replace earlier ones, as in jsoncpp
+  return object([&](const char* key) {
+    if (strcmp(key, "name") == 0) {
+      textsink name(df.name, sizeof(df.name));
+      return scalar(name);
+    }
+
+    if (strcmp(key, "unit") == 0) {
+      textsink unit(df.unit, sizeof(df.unit));
+      return scalar(unit);
+    }
+
+    if (strcmp(key, "timemillis") == 0)
+      return millis(df.timemillis);
+
+    if (strcmp(key, "value") == 0) {
+      if (literal("null")) {
+	df.value = 0.0;
+	return true;
+      }
+
+      if (literal("true")) {
+	df.value = 1.0;
+	return true;
+      }
+
+      if (literal("false")) {
+	df.value = 0.0;
+	return true;
+      }
+
+      return number(&df.value, NULL);
+    }
+
+    return skip();
+  });
+}
+
+bool insituparser::loadArray(mrparser& parsed)
+{
+  return array([&]() { return loadField(parsed); });
+}
+
+// One element of the "output" array, only its "data" member matters
+bool insituparser::loadSensor(mrparser& parsed)
+{
+  if (literal("null"))
+    return true;
+
+  return object([&](const char* key) {
+    if (strcmp(key, "data") == 0 && *p == '[') {
+      parsed.count = 0;
+      return loadArray(parsed);
+    }
+
+    return skip();
+  });
+}
+
+bool insituparser::parse(parsedlist& out)
+{
+  bool havedata = false;
+  bool haveoutput = false;
+
+  // "data" is preferred over "output" whichever comes first
+  bool ok = object([&](const char* key) {
+    if (strcmp(key, "data") == 0 && *p == '[') {
+      out.clear();
+      havedata = true;
+      return loadArray(out.next());
+    }
+
+    if (strcmp(key, "output") == 0 && *p == '[' && !havedata) {
+      out.clear();
+      haveoutput = true;
+      return array([&]() { return loadSensor(out.next()); });
+    }
+
+    return skip();
+  });
+
+  format = havedata || haveoutput;
+
+  return ok;
+}
+
+static bool insituParse(struct jp_ctx& ctx, const char* data)
+{
+  insituparser parser(data);
+  parsedlist& values = ctx.values;
+
+  if (!parser.parse(values)) {
+    std::ostringstream msg;
+
+    msg << "Failed in-situ parse at offset " << parser.offset() << '\n'
+	<< "Data is: " << data;
+    ctx.error = msg.str();
+    values.clear();
+    return false;
+  }
+
+  if (!parser.known()) {
+    ctx.error = "Unknown data format";
+    values.clear();
+    return false;
+  }
+
+  return true;
+}
+
+static bool jsoncppParse(struct jp_ctx& ctx, const char* data)
 {
   std::stringstream dstr(data);
   Json::Value ds;
+  parsedlist& values = ctx.values;
+
+  values.clear();
 
   try {
     std::istream& blah = dstr;
     blah >> ds;
   }
   catch (std::exception& e) {
-    std::cerr << "In initializeData(): Failed Json parse with: "
-	      << e.what() << '\n'
-	      << "Data is: " << data << '\n';
-    raise(SIGABRT);
+    ctx.error = std::string("Failed Json parse with: ") + e.what() +
+      "\nData is: " + data;
+    return false;
   }
 
-  // Determine data format and allocate parsedvalues as required
+  // Determine data format and fill the context as required
   if (ds.isMember("data") && ds["data"].isArray()) {
 
-    parsedvalues = parsedlist(1);
-    loadData(ds, parsedvalues[0]);
+    loadData(ds, values.next());
 
   } else if (ds.isMember("output") && ds["output"].isArray()) {
 
     Json::Value& o = ds["output"];
 
-    parsedvalues = parsedlist(o.size());
-
     for (unsigned int i = 0; i < o.size(); ++i) {
-      loadData(o[i], parsedvalues[i]);
+      loadData(o[i], values.next());
     }
 
   } else {
 
-    std::cerr << "In initializeData(): Unknown data format\n";
-    raise(SIGABRT);
+    ctx.error = "Unknown data format";
+    values.clear();
+    return false;
 
   }
 
+  return true;
 }
 
-int numDataFields(size_t i)
+struct jp_ctx* jp_ctx_new()
 {
-  return parsedvalues[i].names.size();
+  return new (std::nothrow) jp_ctx;
 }
 
-size_t numSensors()
+void jp_ctx_free(struct jp_ctx* ctx)
 {
-  return parsedvalues.size();
+  delete ctx;
 }
 
-void clearData()
+int jp_parse(struct jp_ctx* ctx, const char* data)
 {
-  // Keep clearing array until NULL is reached
-  if (_df) {
+  return jp_parse_with(ctx, data, JP_BACKEND_DEFAULT);
+}
 
-    for (size_t i = 0; i < numSensors(); ++i) {
+int jp_parse_with(struct jp_ctx* ctx, const char* data,
+		  enum jp_backend backend)
+{
+  bool ok;
+
+  assert(ctx);
+
+  switch (backend) {
+  case JP_BACKEND_INSITU:
+    ok = insituParse(*ctx, data);
+    break;
+  case JP_BACKEND_JSONCPP:
+  default:
+    ok = jsoncppParse(*ctx, data);
+    break;
+  }
 
-      if (_df[i]) {
+  if (!ok)
+    return -1;
 
-	free(_df[i]);
+  ctx->error.clear();
 
-      }
+  return 0;
+}
 
-    }
+const char* jp_error(const struct jp_ctx* ctx)
+{
+  return ctx->error.c_str();
+}
 
-    free(_df);
-  }
+int jp_num_fields(const struct jp_ctx* ctx, size_t i)
+{
+  return ctx->values.sensors[i].count;
+}
+
+size_t jp_num_sensors(const struct jp_ctx* ctx)
+{
+  return ctx->values.size();
+}
 
-  _df = NULL;
+size_t jp_allocations(const struct jp_ctx* ctx)
+{
+  return ctx->values.allocations;
+}
 
-  parsedvalues.clear();
+void jp_clear(struct jp_ctx* ctx)
+{
+  // Storage is kept for the next frame
+  ctx->values.clear();
 }
 
-struct datafield** getDataDump(struct datafield** df)
+struct datafield** jp_dump(struct jp_ctx* ctx)
 {
-  if (_df) {
-    df = _df;
+  parsedlist& values = ctx->values;
+  std::vector<struct datafield*>& dump = values.dump;
 
-    return df;
+  if (dump.capacity() < values.size())
+    ++values.allocations;
+
+  dump.resize(values.size());
+
+  for (size_t i = 0; i < values.size(); ++i) {
+    dump[i] = values[i].fields.data();
   }
 
-  _df = (struct datafield**) malloc(numSensors() * sizeof(struct datafield*));
+  return dump.data();
+}
 
-  assert(_df);
+void initializeData(const char* data)
+{
+  initializeDataWith(data, JP_BACKEND_DEFAULT);
+}
 
-  for (size_t i = 0; i < numSensors(); ++i) {
-    struct datafield *dfi;
+void initializeDataWith(const char* data, enum jp_backend backend)
+{
+  if (jp_parse_with(&defaultctx, data, backend) < 0) {
+    std::cerr << "In initializeData(): " << jp_error(&defaultctx) << '\n';
+    raise(SIGABRT);
+  }
+}
 
-    _df[i] = (struct datafield*) malloc(numDataFields(i) * sizeof(struct datafield));
+int numDataFields(size_t i)
+{
+  return jp_num_fields(&defaultctx, i);
+}
 
-    assert(_df[i]);
+size_t numSensors()
+{
+  return jp_num_sensors(&defaultctx);
+}
 
-    dfi = _df[i];
+size_t numAllocations()
+{
+  return jp_allocations(&defaultctx);
+}
 
-    for (int j = 0; j < numDataFields(i); ++j) {
-      strncpy(dfi[j].name, parsedvalues[i].names[j].c_str(), 32);
-      strncpy(dfi[j].value, parsedvalues[i].values[j].c_str(), 32);
-      strncpy(dfi[j].time, parsedvalues[i].millis[j].c_str(), 32);
-      strncpy(dfi[j].unit, parsedvalues[i].units[j].c_str(), 32);
-    }
-  }
+void clearData()
+{
+  jp_clear(&defaultctx);
+}
 
-  df = _df;
+struct datafield** getDataDump(struct datafield** df)
+{
+  df = jp_dump(&defaultctx);
 
   return df;
 }
@@ -9,17 +9,90 @@ extern "C" {
 
 	struct datafield {
 		char name[32];
-		char value[32];
-		char time[32];
 		char unit[32];
+		double value;
+		long long timemillis;
 	};
 
+	enum jp_backend {
+		JP_BACKEND_JSONCPP = 0,
+		JP_BACKEND_INSITU
+	};
+
+#ifdef JSONPARSE_INSITU
+#define JP_BACKEND_DEFAULT JP_BACKEND_INSITU
+#else
+#define JP_BACKEND_DEFAULT JP_BACKEND_JSONCPP
+#endif /* #ifdef JSONPARSE_INSITU */
+
+/** Parser state for one stream
+ *
+ * Holds the records of the last parsed frame along with the storage
+ * reused for the next one. Contexts are independent of each other, so
+ * separate streams or threads can each parse into their own without
+ * locking. A single context must not be used from two threads at
+ * once.
+ */
+	struct jp_ctx;
+
+/** Create an empty parser context
+ *
+ * @return The context, or NULL if it could not be allocated
+ */
+	struct jp_ctx* jp_ctx_new();
+
+/** Free a context and everything it handed out */
+	void jp_ctx_free(struct jp_ctx* ctx);
+
+/** Parse a frame into a context with the default backend
+ *
+ * Records from the previous frame are replaced.
+ *
+ * @return 0 on success, -1 if the frame could not be parsed. The
+ * reason is available from jp_error() and the context is left empty.
+ */
+	int jp_parse(struct jp_ctx* ctx, const char* data);
+
+/** Parse a frame into a context with the given backend, see
+ * jp_parse() */
+	int jp_parse_with(struct jp_ctx* ctx, const char* data,
+			  enum jp_backend backend);
+
+/** Reason the last parse into @p ctx failed, or "" */
+	const char* jp_error(const struct jp_ctx* ctx);
+
+/** Number of fields parsed for sensor @p i */
+	int jp_num_fields(const struct jp_ctx* ctx, size_t i);
+
+/** Number of sensors in the parsed frame */
+	size_t jp_num_sensors(const struct jp_ctx* ctx);
+
+/** Number of times the context had to grow its record storage */
+	size_t jp_allocations(const struct jp_ctx* ctx);
+
+/** Forget the parsed frame, keeping storage for the next one */
+	void jp_clear(struct jp_ctx* ctx);
+
+/** Parsed records, one array of jp_num_fields() entries per sensor
+ *
+ * @return Array of jp_num_sensors() pointers owned by the context and
+ * valid until the next parse or jp_clear()
+ */
+	struct datafield** jp_dump(struct jp_ctx* ctx);
+
+/* The functions below work on a default context shared by the whole
+ * process and abort on parse errors */
+
 	void initializeData(const char* data);
 
+	void initializeDataWith(const char* data, enum jp_backend backend);
+
 	int numDataFields(size_t i);
 
 	size_t numSensors();
 
+	size_t numAllocations();
+
 	void clearData();
 
 	struct datafield** getDataDump(struct datafield**);
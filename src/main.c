@@ -1,5 +1,14 @@
 #include "display-driver.h"
 #include "data-ops.h"
+#include "sources.h"
+#include "relay.h"
+#include "shmsnap.h"
+#include "history.h"
+#include "rollstats.h"
+#include "sketch.h"
+#include "rollup.h"
+#include "capture.h"
+#include "batch.h"
 
 #include <string.h>
 #include <assert.h>
@@ -10,15 +19,17 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netdb.h>
-#include <netinet/in.h>
+#include <locale.h>
 
 #ifndef APP_BUFFERSIZE
 #define APP_BUFFERSIZE 128
 #endif /* #ifndef APP_BUFFERSIZE */
 
+/* Sketch files -q can merge */
+#ifndef APP_MAX_QUANTILE_FILES
+#define APP_MAX_QUANTILE_FILES 32
+#endif /* #ifndef APP_MAX_QUANTILE_FILES */
+
 #ifndef VM_VERSION
 #define VM_VERSION "Unknown"
 #endif /* #ifndef VM_VERSION */
@@ -26,19 +37,41 @@
 extern char* optarg;
 extern int optind, opterr, optopt;
 
-static char filebuffer[APP_BUFFERSIZE];
-static char ipbuffer[APP_BUFFERSIZE];
-static char portbuffer[APP_BUFFERSIZE];
-static int fd;
-static speed_t baud = B9600;
-
-enum AppMode {
-	AM_STDIN = 0x00,
-	AM_TTY = 0x01,
-	AM_FILE = 0x02,
-	AM_UDP = 0x04,
-	AM_TCP = 0x08
-} appmode = AM_STDIN;
+static struct source sources[DATA_OPS_MAX_SOURCES];
+static int nsources = 0;
+static struct source mcastout = { .fd = -1 };
+static struct source *lastsource = NULL;
+static const char *listens[RELAY_MAX_LISTENERS];
+static int nlistens = 0;
+static const char *shmname = NULL;
+static struct shmsnap *shm = NULL;
+static const char *historyfile = NULL;
+static struct history history;
+static bool historyopen = false;
+static unsigned statswindow = 0;
+static struct rollstats stats;
+static const char *sketchfile = NULL;
+static struct sketchset sketches;
+static struct rollup rollups;
+static bool rollupsopen = false;
+static bool sketchesopen = false;
+static const char *capturefile = NULL;
+static struct capture capture;
+static bool captureopen = false;
+static const char *quantilefiles[APP_MAX_QUANTILE_FILES];
+static int nquantilefiles = 0;
+static const char *columndir = NULL;
+static struct tsstore columns;
+static bool columnsopen = false;
+static const char *batchout = NULL;
+static int batchthreads = 0;
+static char defaultport[SOURCE_PATH_LEN];
+static speed_t defaultbaud = B9600;
+static double defaultspeed = 1;
+static bool coalesce = false;
+static bool threaded = false;
+static struct termios termmodes;
+static bool termsaved = false;
 
 void printUsage(int argc, char* const argv[])
 {
@@ -47,8 +80,23 @@ void printUsage(int argc, char* const argv[])
 	printf("Usage:\n"
 	       "%1$s\n"
 	       "%1$s -f <filename>\n"
-	       "%1$s -u <host> | -t <host> -p <port>\n"
+	       "%1$s -u <host> | -t <host> | -m <group> -p <port>\n"
 	       "%1$s -s <serial> [-b <baud>]\n"
+	       "%1$s -r <filename> [-x <speed>]\n"
+	       "%1$s -t <host> -p <port> -t <host> -p <port> -s <serial> ...\n"
+	       "%1$s ... -d [<name>=]<digits>\n"
+	       "%1$s ... -c\n"
+	       "%1$s ... -T\n"
+	       "%1$s ... -M <group> -p <port>\n"
+	       "%1$s ... -l [<host>:]<port> | -l <socket path>\n"
+	       "%1$s ... -S /<name>\n"
+	       "%1$s ... -H <filename>\n"
+	       "%1$s ... -W <updates>\n"
+	       "%1$s ... -Q <filename>\n"
+	       "%1$s ... -w <filename>\n"
+	       "%1$s ... -C <directory>\n"
+	       "%1$s -q <filename> [-q <filename> ...]\n"
+	       "%1$s -B <output> [-j <workers>] -f <filename> [-f <filename> ...]\n"
 	       "%1$s -h\n"
 	       "%1$s -V\n"
 	       "\n"
@@ -56,97 +104,327 @@ void printUsage(int argc, char* const argv[])
 	       "can be supplied to read from a file or from a UDP socket. To read from a\n"
 	       "serial port, specify the port with -s and the speed with -b.\n"
 	       "\n"
+	       "To share one sender between many displays, have it send to a multicast\n"
+	       "group and join the group with -m. -M relays the frames of any other\n"
+	       "source onto a group for that purpose.\n"
+	       "\n"
+	       "With -l nothing is displayed. Instead every frame read is served to any\n"
+	       "number of clients connecting over TCP or a Unix socket, so the sensor\n"
+	       "only ever has one connection. A client that falls behind loses its\n"
+	       "oldest frames rather than holding up the others.\n"
+	       "\n"
+	       "-S publishes the latest readings to a POSIX shared memory segment that\n"
+	       "other local programs read with libenvsnap (see shmsnap.h), without\n"
+	       "connecting to the sensor themselves.\n"
+	       "\n"
+	       "-f, -u, -t, -m and -s may be given more than once, and mixed, to display\n"
+	       "several sources at the same time. Each metric name is then prefixed\n"
+	       "with its source's label, which is the host or file name unless given\n"
+	       "as <label>=<host> or <label>=<filename>.\n"
+	       "\n"
+	       "Next to each value the display draws a sparkline of the latest values\n"
+	       "and the lowest and highest value seen over the recent history. -H keeps\n"
+	       "that history in a file so it survives a restart.\n"
+	       "\n"
+	       "The display also sketches the distribution of every metric since it\n"
+	       "started, in constant memory, for quantiles within 1%% of the true value.\n"
+	       "-Q keeps the sketches in a file and adds to them on every run, and -q\n"
+	       "prints the quantiles of such files, merging the same metric across them.\n"
+	       "\n"
+	       "-r replays a file of frames, either one recorded with -w or one JSON frame\n"
+	       "per line, at the pace of the time each frame was received or sent, so\n"
+	       "bursts and gaps play out as they happened. -x speeds the replay up or\n"
+	       "slows it down. A display that cannot keep up holds up the replay, and\n"
+	       "on exit the replay reports how late its frames went out.\n"
+	       "\n"
+	       "-w records every frame received from any source, as it arrived and with\n"
+	       "the time it arrived, to a file that only ever grows. A second file named\n"
+	       "after it with .idx appended indexes it by time.\n"
+	       "\n"
+	       "-C stores every reading in a directory of compressed columns, one file\n"
+	       "per metric, a few bytes per reading, for years of history. Read them\n"
+	       "back with env-query.\n"
+	       "\n"
+	       "-B converts files of JSON frames, one per line, to CSV without a\n"
+	       "display. The files are split up and parsed on every processor, and the\n"
+	       "rows written in the order of the frames. An output naming a directory,\n"
+	       "or ending in /, gets one file per metric instead of a single file.\n"
+	       "\n"
+	       "While the display runs, press q to quit, Ctrl-L to redraw or s to switch\n"
+	       "between the readings, their mean, standard deviation, lowest, highest\n"
+	       "and exponentially smoothed value over the last updates, and their\n"
+	       "quantiles. r switches the readings to their means per second, minute\n"
+	       "or hour of device time, kept for two minutes, a day and two months.\n"
+	       "\n"
 	       "Options:\n"
 	       "-f <filename>	A filename to read json env data from\n"
-	       "-u <host>	A hostname or ip address to connect to via UDP. Cannot\n"
-	       "		be used with the -f option\n"
-	       "-t <host>	A hostname or ip address to connect to via TCP. Cannot\n"
-	       "		be used with the -f option\n"
-	       "-p <port>	A port number to connect to on the remote port. Must be\n"
-	       "		used with the -u or -t option\n"
+	       "		Regular files are followed as they grow, and opened\n"
+	       "		again when rotated\n"
+	       "-u <host>	A hostname or ip address to connect to via UDP\n"
+	       "		Every datagram is one frame, with or without a\n"
+	       "		trailing newline\n"
+	       "-t <host>	A hostname or ip address to connect to via TCP\n"
+	       "-m <group>[@<sender>][%%<interface>]\n"
+	       "		A multicast group to join, only accepting frames from\n"
+	       "		<sender> if given, on <interface> if given\n"
+	       "-M <group>[%%<interface>]\n"
+	       "		A multicast group to relay every frame read onto\n"
+	       "-l [<host>:]<port> | <socket path>\n"
+	       "		Run headless, relaying frames to clients of this TCP\n"
+	       "		port or Unix socket. May be given more than once\n"
+	       "-S /<name>	Publish the displayed metrics to this shared memory\n"
+	       "		segment on every update\n"
+	       "-H <filename>	Keep the metric history in this file, continuing from\n"
+	       "		what it holds\n"
+	       "-W <updates>	Number of updates the statistics cover (default: %2$d)\n"
+	       "-Q <filename>	Keep the quantile sketches in this file, adding to\n"
+	       "		what it holds. Saved every %3$d seconds and on exit\n"
+	       "-w <filename>	Append every frame received to this capture log,\n"
+	       "		written in batches off the display thread\n"
+	       "-C <directory>	Append every reading to the columns in this directory,\n"
+	       "		created if need be\n"
+	       "-q <filename>	Print the p50, p95 and p99 of every metric sketched in\n"
+	       "		this file, then exit. May be given more than once\n"
+	       "-B <output>	Convert the -f files to CSV in this file or directory,\n"
+	       "		then exit\n"
+	       "-j <workers>	Number of workers -B parses with (default: one per\n"
+	       "		processor)\n"
+	       "-p <port>	A port number to connect to on the remote port. Applies\n"
+	       "		to the -u, -t, -m or -M option before it, or to every\n"
+	       "		one without a port if given first\n"
+	       "-r <filename>[#<n>]\n"
+	       "		A file of frames to replay, recorded with -w or of\n"
+	       "		JSON lines. From a capture of several sources, #<n>\n"
+	       "		picks the source, counting from 0\n"
+	       "-x <speed>	Multiple of the recorded pace to replay at, or 0 for\n"
+	       "		as fast as possible (default: 1). Applies like -p, to\n"
+	       "		the -r option before it\n"
 	       "-s <serial>	Special file path for a serial device\n"
-	       "-b <baud>	Baud rate for serial connection (default: 9600)\n"
+	       "-b <baud>	Baud rate for serial connection (default: 9600).\n"
+	       "		Applies like -p, to the -s option before it\n"
+	       "-d [<name>=]<digits>\n"
+	       "		Decimal places to show for the named metric, or for\n"
+	       "		all other metrics if no name is given (default: 2).\n"
+	       "		May be given more than once\n"
+	       "-c		Coalesce bursts: only display the newest of the frames\n"
+	       "		waiting to be read, skipping the others\n"
+	       "-T		Read and parse on a separate ingest thread so slow\n"
+	       "		screen updates never hold up the input\n"
 	       "-h		Print usage message, then exit\n"
 	       "-V		Print version information, then exit\n",
-	       argv[0]);
+	       argv[0], ROLLSTATS_DEFAULT_WINDOW, DATA_OPS_SKETCH_SAVE_SEC);
+}
+
+int setPrecisionOption(const char *arg)
+{
+	char name[APP_BUFFERSIZE];
+	const char *digits = strrchr(arg, '=');
+	char *end;
+	long d;
+
+	name[0] = '\0';
+
+	/* Optional metric name before the last '=' */
+	if (digits) {
+		size_t n = digits - arg;
+
+		if (n == 0 || n >= APP_BUFFERSIZE)
+			return -1;
+
+		memcpy(name, arg, n);
+		name[n] = '\0';
+		++digits;
+	} else {
+		digits = arg;
+	}
+
+	d = strtol(digits, &end, 10);
+
+	if (end == digits || *end != '\0')
+		return -1;
+
+	return ncursesSetPrecision(name, (int) d);
+}
+
+void addSource(enum source_kind kind, const char *arg)
+{
+	struct source *src = &sources[nsources];
+
+	if (nsources >= DATA_OPS_MAX_SOURCES) {
+		fprintf(stderr, "Error: "
+			"At most %d sources are supported\n",
+			DATA_OPS_MAX_SOURCES);
+		exit(1);
+	}
+
+	if (source_parse(src, kind, arg) < 0) {
+		fprintf(stderr, "Error: "
+			"Invalid source %s\n", arg);
+		exit(1);
+	}
+
+	src->baud = defaultbaud;
+	src->speed = defaultspeed;
+	strcpy(src->port, defaultport);
+	lastsource = src;
+	++nsources;
 }
 
 void parseOptions(int argc, char* const argv[])
 {
 	int c;
+	speed_t baud;
+	double speed;
+	char *end;
 
-	while ((c = getopt(argc, argv, "f:u:t:p:s:b:hV")) != -1) {
+	while ((c = getopt(argc, argv, "f:u:t:m:M:l:S:H:W:Q:q:w:C:r:x:B:j:p:s:b:d:cThV")) != -1) {
 		switch(c) {
 
 		case 'f':
-			if (appmode != AM_STDIN) {
+			addSource(SOURCE_FILE, optarg);
+			break;
+
+		case 'u':
+			addSource(SOURCE_UDP, optarg);
+			break;
+
+		case 't':
+			addSource(SOURCE_TCP, optarg);
+			break;
+
+		case 'm':
+			addSource(SOURCE_MCAST, optarg);
+			break;
+
+		case 'M':
+			if (source_parse(&mcastout, SOURCE_MCAST, optarg) < 0) {
 				fprintf(stderr, "Error: "
-					"f cannot be used with u or"
-					" p\n");
+					"Invalid group %s\n", optarg);
 				exit(1);
 			}
 
-			strncpy(filebuffer, optarg, APP_BUFFERSIZE);
-			appmode = AM_FILE;
+			strcpy(mcastout.port, defaultport);
+			lastsource = &mcastout;
 			break;
 
-		case 'u':
-			if (appmode == AM_FILE) {
+		case 'l':
+			if (nlistens >= RELAY_MAX_LISTENERS) {
 				fprintf(stderr, "Error: "
-					"u cannot be used with f\n");
+					"At most %d listeners are supported\n",
+					RELAY_MAX_LISTENERS);
 				exit(1);
 			}
 
-			strncpy(ipbuffer, optarg, APP_BUFFERSIZE);
-			appmode = AM_UDP;
+			listens[nlistens++] = optarg;
 			break;
 
-		case 't':
-			if (appmode == AM_FILE) {
+		case 'S':
+			shmname = optarg;
+			break;
+
+		case 'H':
+			historyfile = optarg;
+			break;
+
+		case 'W':
+			statswindow = strtoul(optarg, &end, 10);
+
+			if (end == optarg || *end != '\0' || statswindow == 0) {
 				fprintf(stderr, "Error: "
-					"t cannot be used with f\n");
+					"Invalid window %s\n", optarg);
 				exit(1);
 			}
 
-			strncpy(ipbuffer, optarg, APP_BUFFERSIZE);
-			appmode = AM_TCP;
 			break;
 
-		case 'p':
-			if (appmode == AM_FILE) {
+		case 'Q':
+			sketchfile = optarg;
+			break;
+
+		case 'q':
+			if (nquantilefiles >= APP_MAX_QUANTILE_FILES) {
 				fprintf(stderr, "Error: "
-					"p cannot be used with f\n");
+					"At most %d sketch files are supported\n",
+					APP_MAX_QUANTILE_FILES);
 				exit(1);
 			}
 
-			strncpy(portbuffer, optarg, APP_BUFFERSIZE);
+			quantilefiles[nquantilefiles++] = optarg;
 			break;
 
-		case 's':
-			/* Can only set TTY mode if no other major
-			 * mode is set */
-			if (appmode & (AM_FILE | AM_UDP)) {
+		case 'w':
+			capturefile = optarg;
+			break;
+
+		case 'C':
+			columndir = optarg;
+			break;
+
+		case 'r':
+			addSource(SOURCE_REPLAY, optarg);
+			break;
+
+		case 'B':
+			batchout = optarg;
+			break;
+
+		case 'j':
+			batchthreads = strtol(optarg, &end, 10);
+
+			if (end == optarg || *end != '\0' || batchthreads < 1) {
 				fprintf(stderr, "Error: "
-					"%c cannot be used with u or "
-					"f\n", c);
+					"Invalid workers %s\n", optarg);
 				exit(1);
 			}
 
-			/* Store the TTY special path in the
-			 * filebuffer */
-			strncpy(filebuffer, optarg, APP_BUFFERSIZE);
-			appmode = AM_TTY;
 			break;
 
-		case 'b':
-			/* Can only set baud in TTY mode */
-			if (appmode & (AM_FILE | AM_UDP)) {
+		case 'x':
+			speed = strtod(optarg, &end);
+
+			if (end == optarg || *end != '\0' || !(speed >= 0)) {
+				fprintf(stderr, "Error: "
+					"Invalid speed %s\n", optarg);
+				exit(1);
+			}
+
+			/* Speed of the last replay, or of all */
+			if (lastsource && lastsource->kind == SOURCE_REPLAY) {
+				lastsource->speed = speed;
+			} else if (!lastsource) {
+				defaultspeed = speed;
+			} else {
+				fprintf(stderr, "Error: "
+					"x must follow r\n");
+				exit(1);
+			}
+
+			break;
+
+		case 'p':
+			if (strlen(optarg) >= SOURCE_PATH_LEN) {
 				fprintf(stderr, "Error: "
-					"%c cannot be used with u or "
-					"f\n", c);
+					"Invalid port %s\n", optarg);
 				exit(1);
 			}
 
+			/* Port of the last remote source, or of all */
+			if (lastsource &&
+			    (lastsource->kind == SOURCE_UDP ||
+			     lastsource->kind == SOURCE_TCP ||
+			     lastsource->kind == SOURCE_MCAST)) {
+				strcpy(lastsource->port, optarg);
+			} else if (!lastsource) {
+				strcpy(defaultport, optarg);
+			} else {
+				fprintf(stderr, "Error: "
+					"p must follow u, t, m or M\n");
+				exit(1);
+			}
+
+			break;
+
+		case 'b':
 			baud = strtoll(optarg, NULL, 10);
 
 			/* Check that baud is non-zero after str to
@@ -157,6 +435,40 @@ void parseOptions(int argc, char* const argv[])
 				exit(1);
 			}
 
+			/* Speed of the last serial source, or of all */
+			if (lastsource && lastsource->kind == SOURCE_TTY) {
+				lastsource->baud = baud;
+			} else if (!lastsource) {
+				defaultbaud = baud;
+			} else {
+				fprintf(stderr, "Error: "
+					"b must follow s\n");
+				exit(1);
+			}
+
+			break;
+
+		case 's':
+			addSource(SOURCE_TTY, optarg);
+			break;
+
+		case 'd':
+			if (setPrecisionOption(optarg) < 0) {
+				fprintf(stderr, "Error: "
+					"Invalid precision %s\n", optarg);
+				exit(1);
+			}
+
+			break;
+
+		case 'c':
+			coalesce = true;
+			setCoalesce(true);
+			break;
+
+		case 'T':
+			threaded = true;
+			setThreaded(true);
 			break;
 
 		case 'h':
@@ -179,249 +491,476 @@ void parseOptions(int argc, char* const argv[])
 	}
 }
 
-int remoteConnect()
+void closeDescriptors()
 {
-	int s; /* Socket */
-	int error;
-
-	struct addrinfo hints = {
-		.ai_flags = AI_PASSIVE,
-		.ai_family = 0,
-		.ai_socktype = SOCK_DGRAM,
-		.ai_protocol = IPPROTO_UDP,
-		.ai_addrlen = 0,
-		.ai_canonname = NULL,
-		.ai_addr = NULL,
-		.ai_next = NULL
-	};
-
-	struct addrinfo* sockai;
-	struct addrinfo* ai_iter;
-
-	if ((error = getaddrinfo(ipbuffer, portbuffer, &hints, &sockai)) != 0) {
-		fprintf(stderr, "Failed to look up address %s:%s with code %d: "
-			"%s", ipbuffer, portbuffer, error, gai_strerror(error));
-		return -1;
+	for (int i = 0; i < nsources; ++i) {
+		source_close(&sources[i]);
 	}
 
-	assert(sockai);
-	ai_iter = sockai;
+	source_close(&mcastout);
+	relay_close();
+	setCapture(NULL);
 
-	do {
-		if ((s = socket(ai_iter->ai_family, ai_iter->ai_socktype,
-				ai_iter->ai_protocol)) < 0) {
-			continue;
-		}
+	if (captureopen && capture_close(&capture) < 0)
+		fprintf(stderr, "Failed to write capture %s: %s\n",
+			capturefile, strerror(errno));
 
-		if (connect(s, ai_iter->ai_addr, ai_iter->ai_addrlen) == 0) {
-			break;
-		}
+	captureopen = false;
+	setPublisher(NULL);
+	shmsnap_close(shm);
+	shm = NULL;
+	setHistory(NULL);
 
-		s = -1;
-	}
-	while ((ai_iter = ai_iter->ai_next) != NULL);
+	if (historyopen)
+		history_free(&history);
+
+	historyopen = false;
+	setStatistics(NULL);
+	rollstats_free(&stats);
+	setRollup(NULL);
+
+	if (rollupsopen)
+		rollup_free(&rollups);
+
+	rollupsopen = false;
+	setSketches(NULL, NULL);
 
-	freeaddrinfo(sockai);
+	if (sketchesopen && sketchfile &&
+	    sketchset_save(&sketches, sketchfile) < 0)
+		fprintf(stderr, "Failed to save sketches to %s: %s\n",
+			sketchfile, strerror(errno));
 
-	return s;
+	if (sketchesopen)
+		sketchset_free(&sketches);
+
+	sketchesopen = false;
+	setColumns(NULL);
+
+	if (columnsopen && tsstore_close(&columns) < 0)
+		fprintf(stderr, "Failed to write columns to %s: %s\n",
+			columndir, strerror(errno));
+
+	columnsopen = false;
 }
 
-int tcpConnect()
+/* Teardown for fatal signals, using only async-signal-safe calls. The
+ * descriptors are closed and the terminal modes put back, but nothing
+ * is flushed, joined or freed: the interrupted thread may hold the
+ * lock that would take. */
+void abortDescriptors()
 {
-	int s; /* Socket */
-	int error;
-
-	struct addrinfo hints = {
-		.ai_flags = AI_PASSIVE,
-		.ai_family = 0,
-		.ai_socktype = SOCK_STREAM,
-		.ai_protocol = IPPROTO_TCP,
-		.ai_addrlen = 0,
-		.ai_canonname = NULL,
-		.ai_addr = NULL,
-		.ai_next = NULL
-	};
-
-	struct addrinfo* sockai;
-	struct addrinfo* ai_iter;
-
-	if ((error = getaddrinfo(ipbuffer, portbuffer, &hints, &sockai)) != 0) {
-		fprintf(stderr, "Failed to look up address %s:%s with code %d: "
-			"%s", ipbuffer, portbuffer, error, gai_strerror(error));
-		return -1;
+	for (int i = 0; i < nsources; ++i) {
+		if (sources[i].fd >= 0)
+			close(sources[i].fd);
 	}
 
-	assert(sockai);
-	ai_iter = sockai;
+	if (mcastout.fd >= 0)
+		close(mcastout.fd);
 
-	do {
-		if ((s = socket(ai_iter->ai_family, ai_iter->ai_socktype,
-				ai_iter->ai_protocol)) < 0) {
-			continue;
-		}
+	relay_close();
 
-		if (connect(s, ai_iter->ai_addr, ai_iter->ai_addrlen) == 0) {
-			break;
-		}
+	if (termsaved)
+		tcsetattr(STDOUT_FILENO, TCSANOW, &termmodes);
+}
 
-		s = -1;
+void signalHandler(int sig)
+{
+	static const char msg[] = "\nReceived signal ";
+	char num[16];
+	char *p = num + sizeof(num);
+	ssize_t n;
+
+	/* If friendly signal, tell ncurses to exit gracefully */
+	if (sig == SIGINT || sig == SIGTERM) {
+		metric_form_exit();
+		relay_stop();
+		return;
 	}
-	while ((ai_iter = ai_iter->ai_next) != NULL);
 
-	freeaddrinfo(sockai);
+	/* For other signals, exit immediately with error condition */
+	abortDescriptors();
+
+	*--p = '\n';
 
-	return s;
+	do {
+		*--p = '0' + sig % 10;
+		sig /= 10;
+	} while (sig > 0);
+
+	/* Nothing more can be done if these fail */
+	n = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+	n = write(STDERR_FILENO, p, num + sizeof(num) - p);
+	(void) n;
+
+	_exit(1);
 }
 
-int ttyConnect()
+int runNcursesInterface()
 {
 	int ret;
-	struct termios ts;
-
-	fd = open(filebuffer, APP_BUFFERSIZE, O_RDWR);
+	int fds[DATA_OPS_MAX_SOURCES];
+	const char *labels[DATA_OPS_MAX_SOURCES];
+	const char *follow[DATA_OPS_MAX_SOURCES];
 
-	if (fd < 0) {
-		perror("ERROR: When opening TTY: ");
+	/* Use ncurses display mode (none others currently
+	 * available */
+	struct metric_form *m;
 
-		return -1;
+	for (int i = 0; i < nsources; ++i) {
+		fds[i] = sources[i].fd;
+		labels[i] = sources[i].label;
+		follow[i] = sources[i].kind == SOURCE_FILE ?
+			sources[i].path : NULL;
 	}
 
-	ret = tcgetattr(fd, &ts);
+	setFollow(follow, nsources);
 
-	if (ret < 0) {
-		perror("ERROR: When getting TTY properties: ");
-	}
+	/* Use default window config */
+	m = ncursesCFGSources(fds, labels, nsources);
 
-	ret = cfsetspeed(&ts, baud);
+	ret = metric_form_init(m);
 
-	if (ret < 0) {
-		perror("ERROR: When setting TTY speed: ");
+	ncursesFreeMetric(); /* The metric data must be freed */
 
-		return ret;
-	}
+	return ret;
+}
 
-	/* Set baud and turn off flow control */
-	ts.c_cflag &= ~CRTSCTS;
-	ts.c_cflag |= CREAD | CLOCAL;
-	ts.c_iflag &= ~(IXON | IXOFF | IXANY);
-	ts.c_iflag &= ~(ICANON | ECHO | ECHOE | ISIG);
-	/* ts.c_iflag |= ICRNL; */
+int runRelay()
+{
+	int ret;
+	int fds[DATA_OPS_MAX_SOURCES];
+	struct relaystats st;
 
-	ret = tcsetattr(fd, TCSANOW, &ts);
+	for (int i = 0; i < nsources; ++i) {
+		fds[i] = sources[i].fd;
+	}
 
-	if (ret < 0) {
-		perror("ERROR: Setting TTY settings: ");
+	ret = relay_run(fds, nsources);
 
-		return ret;
-	}
+	if (ret < 0)
+		perror("Critical Error relaying data: ");
 
-	return 0;
-}
+	relay_get_stats(&st);
+	printf("Relayed %lu frames to %lu clients, dropped %lu\n",
+	       st.frames, st.clients, st.dropped);
 
-void closeDescriptor()
-{
-	close(fd);
+	return ret < 0 ? 1 : 0;
 }
 
-void signalHandler(int sig)
+/* Merge the sketch files of -q and print their quantiles */
+int printQuantiles()
 {
-	/* If friendly signal, tell ncurses to exit gracefully */
-	if (sig == SIGINT || sig == SIGTERM) {
-		metric_form_exit();
-		return;
+	static const double q[] = { 0.5, 0.95, 0.99 };
+	struct sketchset set;
+	double out[3];
+	int ret = 0;
+
+	if (sketchset_init(&set, 0, nquantilefiles * SKETCH_DEFAULT_METRICS) <
+	    0) {
+		perror("Failed to set up quantile sketches: ");
+		return 1;
 	}
 
-	/* For other signals, exit immediately with error condition */
-	ncursesEmergExit();
-	closeDescriptor();
+	for (int i = 0; i < nquantilefiles; ++i) {
+		if (sketchset_load(&set, quantilefiles[i]) >= 0)
+			continue;
+
+		fprintf(stderr, "Failed to load sketches %s: %s\n",
+			quantilefiles[i], strerror(errno));
+		ret = 1;
+	}
+
+	printf("%-32s %12s %12s %12s %12s %12s %12s\n", "metric", "samples",
+	       "min", "p50", "p95", "p99", "max");
+
+	for (unsigned i = 0; i < set.n; ++i) {
+		const struct sketch *sk = &set.sketches[i];
+
+		sketchset_quantiles(&set, i, q, 3, out);
+		printf("%-32s %12llu %12.10g %12.10g %12.10g %12.10g %12.10g\n",
+		       sk->name, (unsigned long long) sk->count, sk->min,
+		       out[0], out[1], out[2], sk->max);
+	}
+
+	sketchset_free(&set);
 
-	
-	printf("Received signal %d: %s\n", sig, strsignal(sig));
-	exit(1);
+	return ret;
 }
 
-int runNcursesInterface(int fd)
+/* Convert the -f files of -B without opening any other source */
+int runBatch()
 {
-	int ret;
+	struct batch b;
+	int ret = 0;
 
-	/* Use ncurses display mode (none others currently
-	 * available */
-	struct metric_form *m;
+	for (int i = 0; i < nsources; ++i) {
+		if (sources[i].kind == SOURCE_FILE)
+			continue;
 
-	m = ncursesCFG(fd); /* Use default window config */
+		fprintf(stderr, "Error: "
+			"B only converts files given with f\n");
+		return 1;
+	}
 
-	ret = metric_form_init(m);
+	if (batch_open(&b, batchout, batchthreads, 0) < 0) {
+		fprintf(stderr, "Failed to create %s: %s\n", batchout,
+			strerror(errno));
+		return 1;
+	}
 
-	ncursesFreeMetric(); /* The metric data must be freed */
+	for (int i = 0; i < nsources; ++i) {
+		if (batch_convert(&b, sources[i].path) >= 0)
+			continue;
+
+		fprintf(stderr, "Failed to convert %s: %s\n",
+			sources[i].path, strerror(errno));
+		ret = 1;
+
+		/* The output is no good once a write failed */
+		if (b.error)
+			break;
+	}
+
+	if (batch_close(&b) < 0) {
+		fprintf(stderr, "Failed to write %s: %s\n", batchout,
+			strerror(errno));
+		ret = 1;
+	}
+
+	printf("Converted %lu frames to %lu rows with %d workers, "
+	       "%lu lines failed\n", b.frames, b.rows, b.threads, b.failed);
 
 	return ret;
 }
 
 int main(int argc, char* const argv[])
 {
+	struct datastats st;
 	int ret;
 
+	/* Terminal modes for the fatal signal handler to put back */
+	termsaved = isatty(STDOUT_FILENO) &&
+		tcgetattr(STDOUT_FILENO, &termmodes) == 0;
+
 	/* Register signal handlers */
 	signal(SIGINT, signalHandler);
 	signal(SIGTERM, signalHandler);
 	signal(SIGABRT, signalHandler);
 	signal(SIGPIPE, signalHandler);
 
+	/* Lets the display tell a UTF-8 terminal */
+	setlocale(LC_CTYPE, "");
+
 	/* Read options */
 	parseOptions(argc, argv);
 
-	/* Open file discriptor */
-	switch (appmode) {
-	case AM_STDIN:
-		if ((fd = open("/dev/stdin", O_RDWR)) < 0) {
-			perror("Failed to open stdin: ");
+	if (batchout) {
+		if (nsources == 0) {
+			fprintf(stderr, "Error: "
+				"B needs at least one file given with f\n");
 			return 1;
 		}
 
-		break;
-	case AM_FILE:
-		if ((fd = open(filebuffer, O_RDWR)) < 0) {
+		return runBatch();
+	}
+
+	if (nsources == 0)
+		addSource(SOURCE_STDIN, NULL);
+
+	source_unique_labels(sources, nsources);
+
+	if (nquantilefiles > 0)
+		return printQuantiles();
+
+	if (nlistens > 0 &&
+	    (mcastout.path[0] || shmname || historyfile || sketchfile ||
+	     capturefile || columndir)) {
+		fprintf(stderr, "Error: "
+			"M, S, H, Q, w and C cannot be combined with l\n");
+		return 1;
+	}
+
+	/* Listen before connecting so a taken port costs the sensor
+	 * nothing */
+	for (int i = 0; i < nlistens; ++i) {
+		if (relay_listen(listens[i]) >= 0)
+			continue;
+
+		fprintf(stderr, "Failed to listen on %s: %s\n", listens[i],
+			strerror(errno));
+		closeDescriptors();
+		return 1;
+	}
+
+	/* Open file discriptors */
+	for (int i = 0; i < nsources; ++i) {
+		struct source *src = &sources[i];
+
+		if (source_open(src) >= 0)
+			continue;
+
+		switch (src->kind) {
+		case SOURCE_STDIN:
+			perror("Failed to open stdin: ");
+			break;
+		case SOURCE_FILE:
+		case SOURCE_REPLAY:
 			fprintf(stderr, "Failed to open %s: %s\n",
-				filebuffer, strerror(errno));
-			return 1;
+				src->path, strerror(errno));
+			break;
+		case SOURCE_UDP:
+		case SOURCE_TCP:
+		case SOURCE_MCAST:
+			fprintf(stderr, "Failed to open %s:%s\n",
+				src->path, src->port);
+			break;
+		case SOURCE_TTY:
+			fprintf(stderr, "Failed to open %s\n",
+				src->path);
+			break;
 		}
 
-		break;
-	case AM_UDP:
-		if ((fd = remoteConnect()) < 0) {
-			fprintf(stderr, "Failed to open %s:%s\n",
-				ipbuffer, portbuffer);
+		closeDescriptors();
+		return 1;
+	}
+
+	/* Relay frames onto a multicast group */
+	if (mcastout.path[0]) {
+		if (source_open_sender(&mcastout) < 0) {
+			fprintf(stderr, "Failed to open group %s:%s: %s\n",
+				mcastout.path, mcastout.port, strerror(errno));
+			closeDescriptors();
 			return 1;
 		}
 
-		/* Attempt to write to remote to start data flow */
-		if (write(fd, "hello\n", 6) < 0) {
-			fprintf(stderr, "Failed to write to address %s:%s:"
-				" %s\n", ipbuffer, portbuffer,
-				strerror(errno));
+		setRelay(mcastout.fd);
+	}
+
+	/* Publish readings to local readers */
+	if (shmname) {
+		if (!(shm = shmsnap_create(shmname, 0))) {
+			fprintf(stderr, "Failed to create shared memory %s: "
+				"%s\n", shmname, strerror(errno));
+			closeDescriptors();
 			return 1;
 		}
-		break;
-	case AM_TCP:
-		if ((fd = tcpConnect()) < 0) {
-			fprintf(stderr, "Failed to open %s:%s\n",
-				ipbuffer, portbuffer);
+
+		setPublisher(shm);
+	}
+
+	/* Record frames before the first one is read */
+	if (capturefile) {
+		if (capture_open(&capture, capturefile, 0) < 0) {
+			fprintf(stderr, "Failed to open capture %s: %s\n",
+				capturefile, strerror(errno));
+			closeDescriptors();
 			return 1;
 		}
-		break;
-	case AM_TTY:
-		if (ttyConnect() < 0) {
-			fprintf(stderr, "Failed to open %s\n",
-				filebuffer);
+
+		captureopen = true;
+		setCapture(&capture);
+	}
+
+	if (nlistens > 0) {
+		ret = runRelay();
+		closeDescriptors();
+		return ret;
+	}
+
+	/* History for the sparklines, in memory unless -H */
+	if (history_init(&history, 0, 0, historyfile) < 0) {
+		fprintf(stderr, "Failed to open history %s: %s\n",
+			historyfile ? historyfile : "in memory",
+			strerror(errno));
+		closeDescriptors();
+		return 1;
+	}
+
+	historyopen = true;
+	setHistory(&history);
+
+	rollstats_init(&stats, statswindow, 0);
+	setStatistics(&stats);
+
+	/* Quantile sketches, continuing those of -Q */
+	if (sketchset_init(&sketches, 0, 0) < 0) {
+		perror("Failed to set up quantile sketches: ");
+		closeDescriptors();
+		return 1;
+	}
+
+	sketchesopen = true;
+
+	if (sketchfile && sketchset_load(&sketches, sketchfile) < 0 &&
+	    errno != ENOENT) {
+		fprintf(stderr, "Failed to load sketches %s: %s\n",
+			sketchfile, strerror(errno));
+
+		/* Leave a file that could not be read as it is */
+		sketchfile = NULL;
+		closeDescriptors();
+		return 1;
+	}
+
+	setSketches(&sketches, sketchfile);
+
+	if (rollup_init(&rollups, 0) < 0) {
+		perror("Failed to set up rollups: ");
+		closeDescriptors();
+		return 1;
+	}
+
+	rollupsopen = true;
+	setRollup(&rollups);
+
+	/* Columns of every reading, appended to those of earlier runs */
+	if (columndir) {
+		if (tsstore_open(&columns, columndir, 0) < 0) {
+			fprintf(stderr, "Failed to open columns %s: %s\n",
+				columndir, strerror(errno));
+			closeDescriptors();
 			return 1;
 		}
 
-		break;
+		columnsopen = true;
+		setColumns(&columns);
 	}
 
 	/* Run UI */
-	ret = runNcursesInterface(fd);
-	closeDescriptor();
+	ret = runNcursesInterface();
+	closeDescriptors();
+	getDataStats(&st);
+
+	if (coalesce || threaded) {
+		printf("Displayed %lu frames, skipped %lu\n",
+		       st.frames, st.skipped);
+	}
+
+	if (st.datagrams > 0) {
+		printf("Received %lu datagrams, %lu truncated, %lu dropped\n",
+		       st.datagrams, st.truncated, st.dropped);
+	}
+
+	if (mcastout.path[0])
+		printf("Relayed %lu frames\n", st.relayed);
+
+	for (int i = 0; i < nsources; ++i) {
+		const struct replay *rp = &sources[i].replay;
+
+		if (sources[i].kind != SOURCE_REPLAY)
+			continue;
+
+		printf("Replayed %lu frames of %s, late by %.3f s at most and "
+		       "%.3f s on average\n", rp->frames, sources[i].path,
+		       rp->maxlate / 1e6,
+		       rp->frames ? rp->late / 1e6 / rp->frames : 0.0);
+	}
+
+	if (capturefile) {
+		printf("Recorded %lu frames to %s, dropped %lu\n",
+		       capture.frames, capturefile,
+		       capture.dropped);
+	}
 
 	return ret;
 }
@@ -0,0 +1,73 @@
+#include "numfmt.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+/* Largest magnitude that still converts to an exact integer */
+#define NUMFMT_EXACT_LIMIT 9007199254740992.0
+
+static const double _pow10[NUMFMT_MAX_PRECISION + 1] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+int numfmt_fixed(char *buf, size_t len, double v, int prec)
+{
+	char tmp[32];
+	char *d = tmp + sizeof(tmp);
+	bool neg = signbit(v);
+	double a = fabs(v);
+
+	if (prec < 0)
+		prec = 0;
+
+	if (prec > NUMFMT_MAX_PRECISION)
+		prec = NUMFMT_MAX_PRECISION;
+
+	double p = _pow10[prec];
+	double scaled = a * p;
+
+	if (!isfinite(v) || scaled >= NUMFMT_EXACT_LIMIT)
+		return snprintf(buf, len, "%.*f", prec, v);
+
+	/* The multiply may have rounded. fma() recovers the exact
+	 * residual so ties and near-ties round the way printf does. */
+	double err = fma(a, p, -scaled);
+	double whole = floor(scaled);
+	double frac = scaled - whole;
+	uint64_t r = (uint64_t) whole;
+
+	if (frac > 0.5 ||
+	    (frac == 0.5 && (err > 0 || (err == 0 && (r & 1)))))
+		++r;
+
+	/* Write digits backwards from the end of tmp */
+	for (int i = 0; i < prec; ++i) {
+		*--d = '0' + r % 10;
+		r /= 10;
+	}
+
+	if (prec > 0)
+		*--d = '.';
+
+	do {
+		*--d = '0' + r % 10;
+		r /= 10;
+	} while (r);
+
+	if (neg)
+		*--d = '-';
+
+	size_t n = tmp + sizeof(tmp) - d;
+
+	if (len > 0) {
+		size_t c = n < len - 1 ? n : len - 1;
+
+		memcpy(buf, d, c);
+		buf[c] = '\0';
+	}
+
+	return (int) n;
+}
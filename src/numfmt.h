@@ -0,0 +1,41 @@
+#ifndef NUMFMT_H
+#define NUMFMT_H
+
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* #ifdef __cplusplus */
+
+#ifndef NUMFMT_MAX_PRECISION
+#define NUMFMT_MAX_PRECISION 9
+#endif /* #ifndef NUMFMT_MAX_PRECISION */
+
+/** Format a double with a fixed number of decimal places
+ *
+ * Produces the same text as snprintf() with "%.*f", including
+ * round-half-to-even on exact ties, without going through the
+ * general printf engine. Values too large for 53-bit fixed point and
+ * non-finite values fall back to snprintf().
+ *
+ * @param buf Destination buffer, always NUL-terminated if @p len is
+ * non-zero
+ *
+ * @param len Length of the destination buffer
+ *
+ * @param v Value to format
+ *
+ * @param prec Number of decimal places, clamped to 0 through
+ * NUMFMT_MAX_PRECISION
+ *
+ * @return Length of the formatted text, not counting the terminator.
+ * As with snprintf(), a result of @p len or more means the text was
+ * truncated.
+ */
+	int numfmt_fixed(char *buf, size_t len, double v, int prec);
+
+#ifdef __cplusplus
+}
+#endif /* #ifdef __cplusplus */
+
+#endif /* #ifndef NUMFMT_H */
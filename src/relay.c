@@ -0,0 +1,646 @@
+#define _GNU_SOURCE /* accept4() */
+
+#include "relay.h"
+#include "framebuf.h"
+#include "dgram.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define RELAY_IOV_MAX 16
+
+/* What an epoll event is for, kept in the upper half of its data */
+enum relay_event {
+	RELAY_EV_STOP = 0,
+	RELAY_EV_LISTENER,
+	RELAY_EV_CLIENT,
+	RELAY_EV_INPUT
+};
+
+/* One frame, shared by every client queue holding it */
+struct relay_frame {
+	unsigned refs;
+	size_t len;
+	char data[];
+};
+
+/* A connected client and the frames not yet sent to it. The oldest
+ * frame is at head and the first sent bytes of it are already out. */
+struct relay_client {
+	int fd;
+	struct relay_frame *queue[RELAY_QUEUE_LEN];
+	unsigned head;
+	unsigned count;
+	size_t sent;
+	bool writing;		/* Waiting for EPOLLOUT */
+};
+
+struct relay_input {
+	int fd;
+	bool dgram;
+	bool pollable;		/* False for files epoll refuses */
+	bool readable;
+	bool ended;
+	struct framebuf fb;
+	struct dgrambuf db;
+};
+
+struct relay_listener {
+	int fd;
+	char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+};
+
+static struct relay_listener _listeners[RELAY_MAX_LISTENERS];
+static int _nlisteners = 0;
+static struct relay_client _clients[RELAY_MAX_CLIENTS];
+static struct relay_input _inputs[RELAY_MAX_INPUTS];
+static int _ninputs = 0;
+static int _epfd = -1;
+static int _stopfd = -1;
+static volatile sig_atomic_t _stopping = 0;
+static struct relaystats _stats;
+
+static int _listenUnix(const char *path);
+static int _listenTCP(const char *spec);
+static int _watch(int fd, uint32_t events, enum relay_event ev, int i);
+static int _openInputs(const int *fds, int n);
+static void _closeAll();
+static int _readInput(struct relay_input *in);
+static void _broadcast(const char *frame, size_t len);
+static void _accept(int lfd);
+static void _enqueue(struct relay_client *c, struct relay_frame *f);
+static void _flush(struct relay_client *c);
+static void _discardInput(struct relay_client *c);
+static void _dropClient(struct relay_client *c);
+static void _release(struct relay_frame *f);
+
+int relay_listen(const char *spec)
+{
+	assert(spec);
+
+	struct relay_listener *l = &_listeners[_nlisteners];
+	int fd;
+
+	if (_nlisteners >= RELAY_MAX_LISTENERS) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	memset(l, 0, sizeof(*l));
+
+	if (strchr(spec, '/')) {
+		if (strlen(spec) >= sizeof(l->path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		fd = _listenUnix(spec);
+
+		if (fd >= 0)
+			strcpy(l->path, spec);
+	} else {
+		fd = _listenTCP(spec);
+	}
+
+	if (fd < 0)
+		return -1;
+
+	l->fd = fd;
+	++_nlisteners;
+
+	return fd;
+}
+
+int relay_run(const int *fds, int n)
+{
+	struct epoll_event ev[RELAY_MAX_INPUTS + RELAY_MAX_CLIENTS];
+	int ret = 0;
+
+	assert(fds);
+	assert(n > 0 && n <= RELAY_MAX_INPUTS);
+
+	for (int i = 0; i < RELAY_MAX_CLIENTS; ++i) {
+		_clients[i].fd = -1;
+	}
+
+	if (_openInputs(fds, n) < 0) {
+		_closeAll();
+		return -1;
+	}
+
+	while (!_stopping) {
+		int timeout = -1;
+		int nev;
+		bool alive = false;
+
+		/* Unpolled files are read on every loop */
+		for (int i = 0; i < _ninputs; ++i) {
+			if (!_inputs[i].pollable && !_inputs[i].ended)
+				timeout = 0;
+		}
+
+		nev = epoll_wait(_epfd, ev, sizeof(ev) / sizeof(ev[0]),
+				 timeout);
+
+		if (nev < 0) {
+			if (errno == EINTR)
+				continue;
+
+			ret = -1;
+			break;
+		}
+
+		for (int i = 0; i < nev; ++i) {
+			int idx = (int) (ev[i].data.u64 & 0xffffffff);
+			struct relay_client *c = &_clients[idx];
+
+			switch ((enum relay_event) (ev[i].data.u64 >> 32)) {
+			case RELAY_EV_STOP:
+				_stopping = 1;
+				break;
+			case RELAY_EV_LISTENER:
+				_accept(_listeners[idx].fd);
+				break;
+			case RELAY_EV_INPUT:
+				_inputs[idx].readable = true;
+				break;
+			case RELAY_EV_CLIENT:
+				if (c->fd < 0)
+					break;
+
+				if (ev[i].events & (EPOLLERR | EPOLLHUP))
+					_dropClient(c);
+				else if (ev[i].events & EPOLLIN)
+					_discardInput(c);
+
+				if (c->fd >= 0 && (ev[i].events & EPOLLOUT))
+					_flush(c);
+
+				break;
+			}
+		}
+
+		for (int i = 0; i < _ninputs && ret == 0; ++i) {
+			struct relay_input *in = &_inputs[i];
+
+			if (in->ended || (!in->readable && in->pollable))
+				continue;
+
+			in->readable = false;
+			ret = _readInput(in);
+		}
+
+		for (int i = 0; i < _ninputs; ++i) {
+			alive = alive || !_inputs[i].ended;
+		}
+
+		if (ret < 0 || !alive)
+			break;
+	}
+
+	_closeAll();
+	_stopping = 0;
+
+	return ret;
+}
+
+void relay_stop()
+{
+	uint64_t one = 1;
+
+	_stopping = 1;
+
+	if (_stopfd >= 0 && write(_stopfd, &one, sizeof(one)) < 0) {
+		/* Nothing to be done in a signal handler */
+	}
+}
+
+void relay_close()
+{
+	for (int i = 0; i < _nlisteners; ++i) {
+		close(_listeners[i].fd);
+
+		if (_listeners[i].path[0])
+			unlink(_listeners[i].path);
+	}
+
+	_nlisteners = 0;
+}
+
+void relay_get_stats(struct relaystats *st)
+{
+	assert(st);
+
+	*st = _stats;
+}
+
+static int _listenUnix(const char *path)
+{
+	struct sockaddr_un sa = {
+		.sun_family = AF_UNIX
+	};
+	struct stat st;
+	int fd;
+
+	/* Only a socket is replaced, never some other file */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	strcpy(sa.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+		return -1;
+
+	if (bind(fd, (struct sockaddr*) &sa, sizeof(sa)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+static int _listenTCP(const char *spec)
+{
+	char host[NI_MAXHOST];
+	const char *port = strrchr(spec, ':');
+	int fd = -1;
+	int on = 1;
+	int error;
+
+	struct addrinfo hints = {
+		.ai_flags = AI_PASSIVE,
+		.ai_family = 0,
+		.ai_socktype = SOCK_STREAM,
+		.ai_protocol = IPPROTO_TCP
+	};
+
+	struct addrinfo *sockai;
+	struct addrinfo *ai_iter;
+
+	host[0] = '\0';
+
+	if (port) {
+		size_t n = port - spec;
+
+		if (n >= sizeof(host)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		memcpy(host, spec, n);
+		host[n] = '\0';
+		++port;
+	} else {
+		port = spec;
+	}
+
+	if ((error = getaddrinfo(host[0] ? host : NULL, port, &hints,
+				 &sockai)) != 0) {
+		fprintf(stderr, "Failed to look up address %s with code %d: "
+			"%s\n", spec, error, gai_strerror(error));
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (ai_iter = sockai; ai_iter; ai_iter = ai_iter->ai_next) {
+		fd = socket(ai_iter->ai_family, ai_iter->ai_socktype |
+			    SOCK_NONBLOCK | SOCK_CLOEXEC, ai_iter->ai_protocol);
+
+		if (fd < 0)
+			continue;
+
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+			       &on, sizeof(on)) == 0 &&
+		    bind(fd, ai_iter->ai_addr, ai_iter->ai_addrlen) == 0 &&
+		    listen(fd, SOMAXCONN) == 0)
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(sockai);
+
+	return fd;
+}
+
+static int _watch(int fd, uint32_t events, enum relay_event ev, int i)
+{
+	struct epoll_event e = {
+		.events = events,
+		.data.u64 = ((uint64_t) ev << 32) | (uint32_t) i
+	};
+
+	return epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &e);
+}
+
+static int _openInputs(const int *fds, int n)
+{
+	_epfd = epoll_create1(EPOLL_CLOEXEC);
+	_stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if (_epfd < 0 || _stopfd < 0 ||
+	    _watch(_stopfd, EPOLLIN, RELAY_EV_STOP, 0) < 0)
+		return -1;
+
+	for (int i = 0; i < _nlisteners; ++i) {
+		if (_watch(_listeners[i].fd, EPOLLIN, RELAY_EV_LISTENER, i) < 0)
+			return -1;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		struct relay_input *in = &_inputs[i];
+
+		memset(in, 0, sizeof(*in));
+		in->fd = fds[i];
+		in->dgram = dgram_is_socket(in->fd);
+		++_ninputs;
+
+		if (in->dgram) {
+			if (dgram_init(&in->db, in->fd, FRAMEBUF_DEFAULT_LEN) < 0)
+				return -1;
+		} else if (framebuf_init(&in->fb, in->fd, 0) < 0) {
+			return -1;
+		}
+
+		/* Regular files are always readable and epoll refuses
+		 * them, so they are read on every loop instead */
+		in->pollable = true;
+
+		if (_watch(in->fd, EPOLLIN, RELAY_EV_INPUT, i) < 0) {
+			if (errno != EPERM)
+				return -1;
+
+			in->pollable = false;
+		}
+	}
+
+	return 0;
+}
+
+static void _closeAll()
+{
+	for (int i = 0; i < RELAY_MAX_CLIENTS; ++i) {
+		if (_clients[i].fd >= 0)
+			_dropClient(&_clients[i]);
+	}
+
+	for (int i = 0; i < _ninputs; ++i) {
+		if (_inputs[i].dgram)
+			dgram_free(&_inputs[i].db);
+		else
+			framebuf_free(&_inputs[i].fb);
+	}
+
+	_ninputs = 0;
+
+	if (_stopfd >= 0)
+		close(_stopfd);
+
+	if (_epfd >= 0)
+		close(_epfd);
+
+	_stopfd = -1;
+	_epfd = -1;
+}
+
+/* Read once and pass on every whole frame. Returns 0, or -1 on a
+ * read error. */
+static int _readInput(struct relay_input *in)
+{
+	char *frame;
+	size_t len;
+
+	if (in->dgram) {
+		if (dgram_fill(&in->db) < 0)
+			return errno == EINTR || errno == EAGAIN ||
+				errno == ECONNREFUSED ? 0 : -1;
+
+		while ((frame = dgram_next(&in->db, &len))) {
+			_broadcast(frame, len);
+		}
+
+		return 0;
+	}
+
+	ssize_t readresult = framebuf_fill(&in->fb);
+
+	if (readresult < 0)
+		return errno == EINTR || errno == EAGAIN ? 0 : -1;
+
+	while ((frame = framebuf_next(&in->fb, &len))) {
+		_broadcast(frame, len);
+	}
+
+	if (in->fb.eof) {
+		if (in->pollable)
+			epoll_ctl(_epfd, EPOLL_CTL_DEL, in->fd, NULL);
+
+		in->ended = true;
+	}
+
+	return 0;
+}
+
+/* Queue one copy of the frame, with its newline back, for every
+ * client */
+static void _broadcast(const char *frame, size_t len)
+{
+	struct relay_frame *f = NULL;
+
+	++_stats.frames;
+
+	for (int i = 0; i < RELAY_MAX_CLIENTS; ++i) {
+		struct relay_client *c = &_clients[i];
+
+		if (c->fd < 0)
+			continue;
+
+		if (!f) {
+			f = (struct relay_frame*) malloc(sizeof(*f) + len + 1);
+
+			if (!f) {
+				++_stats.dropped;
+				return;
+			}
+
+			f->refs = 1; /* Held until every client has it */
+			f->len = len + 1;
+			memcpy(f->data, frame, len);
+			f->data[len] = '\n';
+		}
+
+		_enqueue(c, f);
+	}
+
+	if (f)
+		_release(f);
+}
+
+static void _accept(int lfd)
+{
+	struct relay_client *c = NULL;
+	int sndbuf = RELAY_SNDBUF;
+	int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+	if (fd < 0)
+		return;
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+	for (int i = 0; i < RELAY_MAX_CLIENTS && !c; ++i) {
+		if (_clients[i].fd < 0)
+			c = &_clients[i];
+	}
+
+	if (!c || _watch(fd, EPOLLIN, RELAY_EV_CLIENT, c - _clients) < 0) {
+		++_stats.refused;
+		close(fd);
+		return;
+	}
+
+	memset(c, 0, sizeof(*c));
+	c->fd = fd;
+	++_stats.clients;
+}
+
+static void _enqueue(struct relay_client *c, struct relay_frame *f)
+{
+	/* Full: drop the oldest frame not already partly sent, since
+	 * the client would otherwise get half a line */
+	if (c->count == RELAY_QUEUE_LEN) {
+		unsigned victim = c->sent > 0 ? (c->head + 1) % RELAY_QUEUE_LEN :
+			c->head;
+
+		_release(c->queue[victim]);
+
+		if (victim != c->head)
+			c->queue[victim] = c->queue[c->head];
+
+		c->head = (c->head + 1) % RELAY_QUEUE_LEN;
+		--c->count;
+		++_stats.dropped;
+	}
+
+	++f->refs;
+	c->queue[(c->head + c->count) % RELAY_QUEUE_LEN] = f;
+	++c->count;
+
+	if (!c->writing)
+		_flush(c);
+}
+
+/* Send as much of the queue as the socket takes, then wait for
+ * EPOLLOUT if anything is left */
+static void _flush(struct relay_client *c)
+{
+	while (c->count > 0) {
+		struct iovec iov[RELAY_IOV_MAX];
+		struct msghdr msg = {
+			.msg_iov = iov
+		};
+		ssize_t n;
+
+		for (unsigned i = 0; i < c->count && i < RELAY_IOV_MAX; ++i) {
+			struct relay_frame *f =
+				c->queue[(c->head + i) % RELAY_QUEUE_LEN];
+			size_t skip = i == 0 ? c->sent : 0;
+
+			iov[i].iov_base = f->data + skip;
+			iov[i].iov_len = f->len - skip;
+			++msg.msg_iovlen;
+		}
+
+		n = sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				_dropClient(c);
+				return;
+			}
+
+			break;
+		}
+
+		/* Retire every frame sent in full */
+		while (n > 0) {
+			struct relay_frame *f = c->queue[c->head];
+			size_t left = f->len - c->sent;
+
+			if ((size_t) n < left) {
+				c->sent += n;
+				break;
+			}
+
+			n -= left;
+			c->sent = 0;
+			c->head = (c->head + 1) % RELAY_QUEUE_LEN;
+			--c->count;
+			_release(f);
+		}
+	}
+
+	bool writing = c->count > 0;
+
+	if (writing != c->writing) {
+		struct epoll_event e = {
+			.events = EPOLLIN | (writing ? EPOLLOUT : 0),
+			.data.u64 = ((uint64_t) RELAY_EV_CLIENT << 32) |
+				(uint32_t) (c - _clients)
+		};
+
+		epoll_ctl(_epfd, EPOLL_CTL_MOD, c->fd, &e);
+		c->writing = writing;
+	}
+}
+
+/* Clients have nothing to say, but reading notices them leaving */
+static void _discardInput(struct relay_client *c)
+{
+	char buf[256];
+	ssize_t n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+		_dropClient(c);
+}
+
+static void _dropClient(struct relay_client *c)
+{
+	while (c->count > 0) {
+		_release(c->queue[c->head]);
+		c->head = (c->head + 1) % RELAY_QUEUE_LEN;
+		--c->count;
+	}
+
+	close(c->fd);
+	c->fd = -1;
+	c->sent = 0;
+	c->writing = false;
+}
+
+static void _release(struct relay_frame *f)
+{
+	if (--f->refs == 0)
+		free(f);
+}
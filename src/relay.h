@@ -0,0 +1,94 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* #ifdef __cplusplus */
+
+#ifndef RELAY_MAX_LISTENERS
+#define RELAY_MAX_LISTENERS 8
+#endif /* #ifndef RELAY_MAX_LISTENERS */
+
+#ifndef RELAY_MAX_CLIENTS
+#define RELAY_MAX_CLIENTS 64
+#endif /* #ifndef RELAY_MAX_CLIENTS */
+
+#ifndef RELAY_MAX_INPUTS
+#define RELAY_MAX_INPUTS 32
+#endif /* #ifndef RELAY_MAX_INPUTS */
+
+#ifndef RELAY_QUEUE_LEN
+#define RELAY_QUEUE_LEN 64
+#endif /* #ifndef RELAY_QUEUE_LEN */
+
+#ifndef RELAY_SNDBUF
+#define RELAY_SNDBUF 16384
+#endif /* #ifndef RELAY_SNDBUF */
+
+/** Counters kept by the relay
+ *
+ * @param frames Frames read from the inputs
+ *
+ * @param clients Clients accepted, including ones since gone
+ *
+ * @param refused Clients turned away because RELAY_MAX_CLIENTS were
+ * connected
+ *
+ * @param dropped Frames dropped from client queues because the
+ * client did not keep up
+ */
+	struct relaystats {
+		unsigned long frames;
+		unsigned long clients;
+		unsigned long refused;
+		unsigned long dropped;
+	};
+
+/** Listen for relay clients
+ *
+ * @param spec A Unix socket path if it contains a '/', otherwise
+ * "[<host>:]<port>" to listen on TCP. Without a host every address
+ * is listened on. A stale Unix socket left at the path is replaced.
+ *
+ * @return The listening descriptor, or -1 on failure with errno set
+ */
+	int relay_listen(const char *spec);
+
+/** Serve every frame read from the inputs to every client
+ *
+ * Runs headless until relay_stop() is called or every input has
+ * ended. Frames are not parsed, only framed, by line or by datagram
+ * for datagram sockets, and sent on as lines. Every client has its
+ * own queue of RELAY_QUEUE_LEN frames. A client that does not keep
+ * up loses its oldest queued frames, so it never holds up the inputs
+ * or the other clients. Client send buffers are limited to about
+ * RELAY_SNDBUF bytes so a backlog builds up in that queue, where old
+ * frames can be dropped, rather than in the kernel.
+ *
+ * @param fds Input descriptors
+ *
+ * @param n Number of inputs, at most RELAY_MAX_INPUTS
+ *
+ * @return 0 once stopped or out of input, -1 on a read error
+ */
+	int relay_run(const int *fds, int n);
+
+/** Make relay_run() return
+ *
+ * Safe to call from a signal handler or another thread.
+ */
+	void relay_stop();
+
+/** Close the listeners, removing their Unix socket paths */
+	void relay_close();
+
+	void relay_get_stats(struct relaystats *st);
+
+#ifdef __cplusplus
+}
+#endif /* #ifdef __cplusplus */
+
+#endif /* #ifndef RELAY_H */
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE /* pipe2(), ppoll(), F_SETPIPE_SZ */
+#include "replay.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+static void *_replayMain(void *arg);
+static int _next(struct replay *rp, const char **frame, size_t *len,
+		 int64_t *time, bool *timed);
+static bool _frameTime(const char *frame, int64_t *time);
+static bool _findMillis(const char *frame, const char *key,
+			int64_t *millis);
+static bool _sleepUntil(struct replay *rp, int64_t until);
+static int _writeFrame(int fd, const char *frame, size_t len);
+static int64_t _now();
+
+int replay_start(struct replay *rp, const char *path, int stream,
+		 double speed)
+{
+	int p[2];
+	int fd;
+	int err;
+
+	assert(rp);
+	assert(path);
+	assert(speed >= 0);
+
+	memset(rp, 0, sizeof(*rp));
+	rp->fd = -1;
+	rp->stopfd = -1;
+	rp->reader.fd = -1;
+	rp->fb.fd = -1;
+	rp->stream = stream;
+	rp->speed = speed;
+
+	/* A capture log if it says so, JSON frames otherwise */
+	if (capture_reader_open(&rp->reader, path) == 0) {
+		rp->binary = true;
+	} else if (errno != EINVAL) {
+		return -1;
+	} else if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		return -1;
+	} else if (framebuf_init(&rp->fb, fd, 0) < 0) {
+		close(fd);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	rp->stopfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if (rp->stopfd < 0 || pipe2(p, O_CLOEXEC) < 0) {
+		err = errno;
+		replay_stop(rp);
+		errno = err;
+		return -1;
+	}
+
+	/* Only a hint, the default size works too */
+	fcntl(p[1], F_SETPIPE_SZ, REPLAY_PIPE_LEN);
+	rp->fd = p[1];
+
+	if ((err = pthread_create(&rp->thread, NULL, _replayMain, rp)) != 0) {
+		close(p[0]);
+		close(p[1]);
+		rp->fd = -1;
+		replay_stop(rp);
+		errno = err;
+		return -1;
+	}
+
+	rp->running = true;
+
+	return p[0];
+}
+
+void replay_stop(struct replay *rp)
+{
+	assert(rp);
+
+	if (rp->running) {
+		uint64_t one = 1;
+
+		if (write(rp->stopfd, &one, sizeof(one)) < 0)
+			perror("Error stopping replay: ");
+
+		pthread_join(rp->thread, NULL);
+		rp->running = false;
+	}
+
+	if (rp->stopfd >= 0)
+		close(rp->stopfd);
+
+	rp->stopfd = -1;
+
+	if (rp->binary) {
+		capture_reader_close(&rp->reader);
+	} else if (rp->fb.buf) {
+		close(rp->fb.fd);
+		framebuf_free(&rp->fb);
+	}
+
+	rp->binary = false;
+}
+
+/*
+**********************************************************************
+***************** LOCAL FUNCTION IMPLEMENTATION **********************
+**********************************************************************
+*/
+
+/* Write every frame at the time its recorded time comes up, scaled by
+ * the speed, then end the pipe */
+static void *_replayMain(void *arg)
+{
+	struct replay *rp = (struct replay*) arg;
+	int64_t start = _now();
+	int64_t elapsed = 0;	/* Recorded time since the first frame */
+	int64_t prev = 0;
+	bool started = false;
+	const char *frame;
+	size_t len;
+	int64_t time;
+	bool timed;
+	sigset_t mask;
+
+	/* A display that went away shows up as EPIPE, and terminal and
+	 * exit signals belong to the display thread */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGWINCH);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	while (_next(rp, &frame, &len, &time, &timed) > 0) {
+		int64_t due = start;
+		int64_t late;
+
+		if (timed && started) {
+			int64_t gap = time - prev;
+
+			if (gap > (int64_t) REPLAY_MAX_GAP_MS * 1000)
+				gap = (int64_t) REPLAY_MAX_GAP_MS * 1000;
+
+			elapsed += gap > 0 ? gap : 0;
+		}
+
+		if (timed) {
+			prev = time;
+			started = true;
+		}
+
+		/* Records of other sources only move the time on */
+		if (!frame)
+			continue;
+
+		if (rp->speed > 0) {
+			due = start + (int64_t) (elapsed / rp->speed);
+
+			if (!_sleepUntil(rp, due))
+				break;
+		}
+
+		if (_writeFrame(rp->fd, frame, len) < 0)
+			break;
+
+		late = rp->speed > 0 ? _now() - due : 0;
+		late = late > 0 ? late : 0;
+		++rp->frames;
+		rp->late += late;
+		rp->maxlate = late > rp->maxlate ? late : rp->maxlate;
+	}
+
+	close(rp->fd);
+	rp->fd = -1;
+
+	return NULL;
+}
+
+/* Next frame and its recorded time in microseconds. A record of a
+ * capture log that belongs to another source comes with a NULL frame.
+ * Returns 1 if there was one, 0 at the end, -1 on a read error. */
+static int _next(struct replay *rp, const char **frame, size_t *len,
+		 int64_t *time, bool *timed)
+{
+	if (rp->binary) {
+		struct capture_record rec;
+		int ret = capture_next(&rp->reader, &rec, frame);
+
+		if (ret <= 0)
+			return ret;
+
+		if (rec.source != (uint32_t) rp->stream)
+			*frame = NULL;
+
+		*len = rec.len;
+		*time = rec.time;
+		*timed = true;
+
+		return 1;
+	}
+
+	char *line = framebuf_next(&rp->fb, len);
+
+	while (!line) {
+		ssize_t readresult = framebuf_fill(&rp->fb);
+
+		if (readresult < 0 && errno != EINTR)
+			return -1;
+
+		line = framebuf_next(&rp->fb, len);
+
+		if (!line && readresult == 0)
+			return 0;
+	}
+
+	*frame = line;
+	*timed = _frameTime(line, time);
+
+	return 1;
+}
+
+/* Time the device sent a JSON frame, or the time of its newest
+ * reading, in microseconds */
+static bool _frameTime(const char *frame, int64_t *time)
+{
+	int64_t millis = 0;
+	bool found = false;
+
+	if (_findMillis(frame, "\"sentmillis\"", &millis)) {
+		*time = millis * 1000;
+		return true;
+	}
+
+	for (const char *p = frame; (p = strstr(p, "\"timemillis\"")); ++p) {
+		int64_t t;
+
+		if (!_findMillis(p, "\"timemillis\"", &t))
+			continue;
+
+		millis = found && millis > t ? millis : t;
+		found = true;
+	}
+
+	*time = millis * 1000;
+
+	return found;
+}
+
+/* Number after the first occurrence of a key */
+static bool _findMillis(const char *frame, const char *key,
+			int64_t *millis)
+{
+	const char *p = strstr(frame, key);
+	char *end;
+
+	if (!p)
+		return false;
+
+	p += strlen(key);
+	p += strspn(p, " \t");
+
+	if (*p++ != ':')
+		return false;
+
+	*millis = strtoll(p, &end, 10);
+
+	return end != p;
+}
+
+/* Returns false if told to stop before the time came */
+static bool _sleepUntil(struct replay *rp, int64_t until)
+{
+	struct pollfd pfd = {
+		.fd = rp->stopfd,
+		.events = POLLIN
+	};
+
+	for (;;) {
+		int64_t left = until - _now();
+		struct timespec ts = { 0, 0 };
+
+		if (left > 0) {
+			ts.tv_sec = left / 1000000;
+			ts.tv_nsec = left % 1000000 * 1000;
+		}
+
+		int ret = ppoll(&pfd, 1, &ts, NULL);
+
+		if (ret > 0)
+			return false;
+
+		if (left <= 0)
+			return true;
+
+		if (ret < 0 && errno != EINTR)
+			return true;
+	}
+}
+
+static int _writeFrame(int fd, const char *frame, size_t len)
+{
+	struct iovec iov[2] = {
+		{ .iov_base = (void*) frame, .iov_len = len },
+		{ .iov_base = "\n", .iov_len = 1 }
+	};
+	int i = 0;
+
+	while (i < 2) {
+		ssize_t n = writev(fd, iov + i, 2 - i);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		for (; i < 2 && (size_t) n >= iov[i].iov_len; ++i) {
+			n -= iov[i].iov_len;
+		}
+
+		if (i < 2) {
+			iov[i].iov_base = (char*) iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+static int64_t _now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
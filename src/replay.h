@@ -0,0 +1,108 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "capture.h"
+#include "framebuf.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* #ifdef __cplusplus */
+
+/* Longest pause replayed between two frames. A device restarting or a
+ * night without frames is cut short to it. */
+#ifndef REPLAY_MAX_GAP_MS
+#define REPLAY_MAX_GAP_MS 60000
+#endif /* #ifndef REPLAY_MAX_GAP_MS */
+
+/* Bytes the pipe to the display holds. Kept small so a display that
+ * falls behind holds up the replay, which then shows how far behind
+ * it is. */
+#ifndef REPLAY_PIPE_LEN
+#define REPLAY_PIPE_LEN 4096
+#endif /* #ifndef REPLAY_PIPE_LEN */
+
+/** Recorded frames written to a pipe at the pace they were recorded
+ *
+ * A thread of the replay's own reads a capture log (see capture.h) or
+ * a file of newline-delimited JSON frames and writes the frames to a
+ * pipe, which is read like any other source. Frames of a capture log
+ * are paced by the time they were received. Other frames are paced by
+ * their "sentmillis", or else their newest "timemillis", and frames
+ * without either follow the one before them at once.
+ *
+ * The pace is kept against the start of the replay, so a frame written
+ * late does not delay the frames after it. Once the pipe is full the
+ * replay waits for the reader, and the frames are written late by as
+ * long as the reader lags.
+ *
+ * @param fd Write end of the pipe, owned by the thread
+ *
+ * @param stopfd Wakes the thread up to stop
+ *
+ * @param stream Source whose frames are replayed from a capture log
+ * of several sources
+ *
+ * @param speed Multiple of the recorded pace, 0 for as fast as the
+ * reader takes the frames
+ *
+ * @param binary True if reading a capture log, false for JSON frames
+ *
+ * @param running True while the thread has to be stopped
+ *
+ * @param reader Capture log being read, if @p binary
+ *
+ * @param fb JSON frames being read, unless @p binary
+ *
+ * @param frames Frames written
+ *
+ * @param late Microseconds the frames were written late, added up
+ *
+ * @param maxlate Microseconds the latest frame was written late
+ */
+	struct replay {
+		int fd;
+		int stopfd;
+		int stream;
+		double speed;
+		bool binary;
+		bool running;
+		struct capture_reader reader;
+		struct framebuf fb;
+		pthread_t thread;
+		unsigned long frames;
+		int64_t late;
+		int64_t maxlate;
+	};
+
+/** Start replaying a file
+ *
+ * @param path Capture log or file of JSON frames
+ *
+ * @param stream Recorded source to replay from a capture log, 0 for
+ * the first
+ *
+ * @param speed Multiple of the recorded pace, 0 for as fast as possible
+ *
+ * @return Read end of the pipe the frames are written to, which ends
+ * after the last frame, or -1 on failure with errno set
+ */
+	int replay_start(struct replay *rp, const char *path, int stream,
+			 double speed);
+
+/** Stop the replay if it runs and release what it holds
+ *
+ * Close the read end of the pipe first, so a thread waiting to write
+ * gives up. @p frames, @p late and @p maxlate stay readable.
+ */
+	void replay_stop(struct replay *rp);
+
+#ifdef __cplusplus
+}
+#endif /* #ifdef __cplusplus */
+
+#endif /* #ifndef REPLAY_H */
@@ -0,0 +1,100 @@
+/* Cost of rollstats_update() for growing numbers of metrics
+ *
+ * Prints one line per metric count with the time per update and per
+ * metric. The time per metric should stay about the same from a few
+ * metrics to thousands, and not depend on the window.
+ */
+
+#include "rollstats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef BENCH_SAMPLES
+#define BENCH_SAMPLES 20000000
+#endif /* #ifndef BENCH_SAMPLES */
+
+#define BENCH_ROWS 64
+
+static double _now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int _run(unsigned n, unsigned window)
+{
+	struct rollstats st;
+	double *rows = (double*) malloc((size_t) BENCH_ROWS * n *
+					sizeof(double));
+	unsigned frames = BENCH_SAMPLES / n;
+	double start;
+	double ns;
+
+	if (!rows || rollstats_init(&st, window, 0) < 0 ||
+	    rollstats_resize(&st, n) < 0) {
+		perror("Failed to set up benchmark: ");
+		free(rows);
+		return -1;
+	}
+
+	/* Readings that wander like sensors do */
+	for (unsigned i = 0; i < n; ++i) {
+		double v = rand() % 1000;
+
+		for (unsigned r = 0; r < BENCH_ROWS; ++r) {
+			v += (rand() % 201 - 100) / 100.0;
+			rows[(size_t) r * n + i] = v;
+		}
+	}
+
+	/* Fill the window before timing */
+	for (unsigned f = 0; f < window; ++f) {
+		memcpy(st.input, rows + (size_t) (f % BENCH_ROWS) * n,
+		       n * sizeof(double));
+		rollstats_update(&st);
+	}
+
+	start = _now();
+
+	for (unsigned f = 0; f < frames; ++f) {
+		memcpy(st.input, rows + (size_t) (f % BENCH_ROWS) * n,
+		       n * sizeof(double));
+		rollstats_update(&st);
+	}
+
+	ns = (_now() - start) / frames;
+
+	printf("%8u %8u %12.1f %10.2f %12.4f\n", n, window, ns, ns / n,
+	       rollstats_mean(&st, n - 1));
+
+	rollstats_free(&st);
+	free(rows);
+
+	return 0;
+}
+
+int main()
+{
+	unsigned counts[] = { 4, 16, 64, 256, 1024, 4096, 8192 };
+	unsigned windows[] = { 10, 60, 600 };
+
+	srand(1);
+	printf("%8s %8s %12s %10s %12s\n", "metrics", "window", "ns/update",
+	       "ns/metric", "last mean");
+
+	for (unsigned w = 0; w < sizeof(windows) / sizeof(windows[0]); ++w) {
+		for (unsigned c = 0; c < sizeof(counts) / sizeof(counts[0]);
+		     ++c) {
+			if (_run(counts[c], windows[w]) < 0)
+				return 1;
+		}
+	}
+
+	return 0;
+}
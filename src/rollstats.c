@@ -0,0 +1,316 @@
+#include "rollstats.h"
+
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <assert.h>
+
+/* Generic vectors, so one expression updates ROLLSTATS_LANES metrics
+ * with whatever instructions the target has. Comparisons give masks
+ * of all ones or all zeros per lane. */
+typedef double rs_vec __attribute__((vector_size(ROLLSTATS_LANES *
+						 sizeof(double))));
+typedef long long rs_mask __attribute__((vector_size(ROLLSTATS_LANES *
+						     sizeof(long long))));
+
+#define ROLLSTATS_ALIGN (ROLLSTATS_LANES * sizeof(double))
+
+/* Lanes of a where the mask is set, of b elsewhere. A macro, since
+ * passing vectors wider than the target's registers by value is not
+ * portable between compilers. */
+#define SELECT(m, a, b) \
+	((rs_vec) (((m) & (rs_mask) (a)) | (~(m) & (rs_mask) (b))))
+
+static int _grow(struct rollstats *st, unsigned cap);
+static void _finishBlock(struct rollstats *st, unsigned cols);
+
+int rollstats_init(struct rollstats *st, unsigned window, double alpha)
+{
+	assert(st);
+
+	if (window == 0)
+		window = ROLLSTATS_DEFAULT_WINDOW;
+
+	if (alpha == 0.0)
+		alpha = 2.0 / (window + 1);
+
+	if (!(alpha > 0.0 && alpha <= 1.0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(st, 0, sizeof(*st));
+	st->window = window;
+	st->alpha = alpha;
+
+	return 0;
+}
+
+void rollstats_free(struct rollstats *st)
+{
+	assert(st);
+
+	free(st->input);
+	free(st->count);
+	free(st->mean);
+	free(st->m2);
+	free(st->ewma);
+	free(st->pmin);
+	free(st->pmax);
+	free(st->ring);
+	free(st->smin);
+	free(st->smax);
+	memset(st, 0, sizeof(*st));
+}
+
+int rollstats_resize(struct rollstats *st, unsigned n)
+{
+	assert(st);
+
+	unsigned cap = (n + ROLLSTATS_LANES - 1) / ROLLSTATS_LANES *
+		ROLLSTATS_LANES;
+
+	if (cap > st->cap && _grow(st, cap) < 0)
+		return -1;
+
+	/* Dropped metrics come back empty */
+	for (unsigned i = n; i < st->n; ++i) {
+		rollstats_reset(st, i);
+	}
+
+	st->n = n;
+
+	return 0;
+}
+
+void rollstats_reset(struct rollstats *st, unsigned i)
+{
+	assert(st);
+	assert(i < st->cap);
+
+	st->input[i] = NAN;
+	st->count[i] = 0.0;
+	st->mean[i] = 0.0;
+	st->m2[i] = 0.0;
+	st->ewma[i] = 0.0;
+	st->pmin[i] = INFINITY;
+	st->pmax[i] = -INFINITY;
+
+	/* NaN drops out of the block extremes, and the metric has no
+	 * previous sample to repeat */
+	for (unsigned k = 0; k < st->window; ++k) {
+		st->ring[(size_t) k * st->cap + i] = NAN;
+	}
+
+	for (unsigned k = 0; k <= st->window; ++k) {
+		st->smin[(size_t) k * st->cap + i] = INFINITY;
+		st->smax[(size_t) k * st->cap + i] = -INFINITY;
+	}
+}
+
+void rollstats_update(struct rollstats *st)
+{
+	assert(st);
+
+	unsigned p = st->pos;
+	unsigned w = st->window;
+	unsigned cols = (st->n + ROLLSTATS_LANES - 1) / ROLLSTATS_LANES *
+		ROLLSTATS_LANES;
+	double *row = st->ring + (size_t) p * st->cap;
+	const double *last = st->ring + (size_t) ((p + w - 1) % w) * st->cap;
+
+	/* The previous block is complete once the window wraps */
+	if (p == 0 && st->started)
+		_finishBlock(st, cols);
+
+	const rs_vec zero = {0};
+	const double inv = 1.0 / w;
+
+	for (unsigned i = 0; i < cols; i += ROLLSTATS_LANES) {
+		rs_vec x = *(const rs_vec*) (st->input + i);
+		rs_vec prev = *(const rs_vec*) (last + i);
+		rs_vec old = *(const rs_vec*) (row + i);
+		rs_vec count = *(rs_vec*) (st->count + i);
+		rs_vec mean = *(rs_vec*) (st->mean + i);
+		rs_vec m2 = *(rs_vec*) (st->m2 + i);
+		rs_vec ewma = *(rs_vec*) (st->ewma + i);
+		rs_vec pmin = *(rs_vec*) (st->pmin + i);
+		rs_vec pmax = *(rs_vec*) (st->pmax + i);
+
+		/* A missing sample repeats the previous one, if any */
+		x = SELECT((rs_mask) (x == x), x, prev);
+
+		rs_mask valid = (rs_mask) (x == x);
+		rs_mask full = (rs_mask) (count >= (double) w);
+		rs_mask first = (rs_mask) (count == 0.0);
+
+		/* Welford: add the sample while the window fills up,
+		 * afterwards swap it for the one leaving */
+		rs_vec n1 = SELECT(full, count, count + 1.0);
+		rs_vec delta = x - mean;
+		rs_vec addmean = mean + delta / n1;
+		rs_vec addm2 = m2 + delta * (x - addmean);
+		rs_vec repmean = mean + (x - old) * inv;
+		rs_vec repm2 = m2 + (x - old) * (x - repmean + old - mean);
+		rs_vec newmean = SELECT(full, repmean, addmean);
+		rs_vec newm2 = SELECT(full, repm2, addm2);
+
+		/* Rounding must not make the variance negative */
+		newm2 = SELECT((rs_mask) (newm2 < 0.0), zero, newm2);
+
+		rs_vec newewma = SELECT(first, x,
+					 ewma + (x - ewma) * st->alpha);
+
+		*(rs_vec*) (st->count + i) = SELECT(valid, n1, count);
+		*(rs_vec*) (st->mean + i) = SELECT(valid, newmean, mean);
+		*(rs_vec*) (st->m2 + i) = SELECT(valid, newm2, m2);
+		*(rs_vec*) (st->ewma + i) = SELECT(valid, newewma, ewma);
+		*(rs_vec*) (st->pmin + i) = SELECT((rs_mask) (x < pmin),
+						    x, pmin);
+		*(rs_vec*) (st->pmax + i) = SELECT((rs_mask) (x > pmax),
+						    x, pmax);
+		*(rs_vec*) (row + i) = x;
+	}
+
+	st->pos = (p + 1) % w;
+	st->started = true;
+}
+
+unsigned rollstats_count(const struct rollstats *st, unsigned i)
+{
+	assert(st);
+
+	return i < st->n ? (unsigned) st->count[i] : 0;
+}
+
+double rollstats_mean(const struct rollstats *st, unsigned i)
+{
+	return rollstats_count(st, i) ? st->mean[i] : NAN;
+}
+
+double rollstats_stddev(const struct rollstats *st, unsigned i)
+{
+	unsigned count = rollstats_count(st, i);
+
+	if (count == 0)
+		return NAN;
+
+	return count > 1 ? sqrt(st->m2[i] / (count - 1)) : 0.0;
+}
+
+/* The window is the current block so far and the rest of the
+ * previous one, which starts at the next position */
+double rollstats_min(const struct rollstats *st, unsigned i)
+{
+	if (!rollstats_count(st, i))
+		return NAN;
+
+	double rest = st->smin[(size_t) (st->pos ? st->pos : st->window) *
+			       st->cap + i];
+
+	return rest < st->pmin[i] ? rest : st->pmin[i];
+}
+
+double rollstats_max(const struct rollstats *st, unsigned i)
+{
+	if (!rollstats_count(st, i))
+		return NAN;
+
+	double rest = st->smax[(size_t) (st->pos ? st->pos : st->window) *
+			       st->cap + i];
+
+	return rest > st->pmax[i] ? rest : st->pmax[i];
+}
+
+double rollstats_ewma(const struct rollstats *st, unsigned i)
+{
+	return rollstats_count(st, i) ? st->ewma[i] : NAN;
+}
+
+/* Move every array to a wider allocation, keeping the columns in use.
+ * Nothing changes unless all of them could be allocated. */
+static int _grow(struct rollstats *st, unsigned cap)
+{
+	struct {
+		double **array;
+		unsigned rows;
+	} arrays[] = {
+		{ &st->input, 1 },
+		{ &st->count, 1 },
+		{ &st->mean, 1 },
+		{ &st->m2, 1 },
+		{ &st->ewma, 1 },
+		{ &st->pmin, 1 },
+		{ &st->pmax, 1 },
+		{ &st->ring, st->window },
+		{ &st->smin, st->window + 1 },
+		{ &st->smax, st->window + 1 }
+	};
+	const int narrays = sizeof(arrays) / sizeof(arrays[0]);
+	double *grown[sizeof(arrays) / sizeof(arrays[0])];
+	unsigned oldcap = st->cap;
+
+	for (int a = 0; a < narrays; ++a) {
+		grown[a] = (double*) aligned_alloc(ROLLSTATS_ALIGN,
+						   (size_t) arrays[a].rows *
+						   cap * sizeof(double));
+
+		if (grown[a])
+			continue;
+
+		while (a-- > 0)
+			free(grown[a]);
+
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (int a = 0; a < narrays; ++a) {
+		for (unsigned r = 0; r < arrays[a].rows && oldcap; ++r) {
+			memcpy(grown[a] + (size_t) r * cap,
+			       *arrays[a].array + (size_t) r * oldcap,
+			       oldcap * sizeof(double));
+		}
+
+		free(*arrays[a].array);
+		*arrays[a].array = grown[a];
+	}
+
+	st->cap = cap;
+
+	for (unsigned i = oldcap; i < cap; ++i) {
+		rollstats_reset(st, i);
+	}
+
+	return 0;
+}
+
+/* Extremes from every position to the end of the block just
+ * completed, then start the running extremes of the next block */
+static void _finishBlock(struct rollstats *st, unsigned cols)
+{
+	for (unsigned k = st->window; k-- > 0;) {
+		const double *ring = st->ring + (size_t) k * st->cap;
+		double *smin = st->smin + (size_t) k * st->cap;
+		double *smax = st->smax + (size_t) k * st->cap;
+		const double *nmin = smin + st->cap;
+		const double *nmax = smax + st->cap;
+
+		for (unsigned i = 0; i < cols; i += ROLLSTATS_LANES) {
+			rs_vec x = *(const rs_vec*) (ring + i);
+			rs_vec lo = *(const rs_vec*) (nmin + i);
+			rs_vec hi = *(const rs_vec*) (nmax + i);
+
+			*(rs_vec*) (smin + i) = SELECT((rs_mask) (x < lo),
+							x, lo);
+			*(rs_vec*) (smax + i) = SELECT((rs_mask) (x > hi),
+							x, hi);
+		}
+	}
+
+	for (unsigned i = 0; i < cols; ++i) {
+		st->pmin[i] = INFINITY;
+		st->pmax[i] = -INFINITY;
+	}
+}
+
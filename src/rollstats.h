@@ -0,0 +1,148 @@
+#ifndef ROLLSTATS_H
+#define ROLLSTATS_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* #ifdef __cplusplus */
+
+/* Metrics updated together by one vector operation. Wider than the
+ * target's vector registers is much slower, not faster. */
+#ifndef ROLLSTATS_LANES
+#if defined(__AVX512F__)
+#define ROLLSTATS_LANES 8
+#elif defined(__AVX__)
+#define ROLLSTATS_LANES 4
+#else
+#define ROLLSTATS_LANES 2
+#endif /* #if defined(__AVX512F__) */
+#endif /* #ifndef ROLLSTATS_LANES */
+
+#ifndef ROLLSTATS_DEFAULT_WINDOW
+#define ROLLSTATS_DEFAULT_WINDOW 60
+#endif /* #ifndef ROLLSTATS_DEFAULT_WINDOW */
+
+/** Rolling statistics of many metrics over a window of updates
+ *
+ * Every update takes one new sample for each metric, and every
+ * statistic covers the last @p window updates. All state is kept as
+ * one array per quantity with a column per metric, so an update is a
+ * handful of passes over contiguous memory that the compiler turns
+ * into vector instructions, and costs the same per metric no matter
+ * how long the window is:
+ *
+ * - Mean and variance follow Welford's method, adjusted for the
+ *   sample leaving the window.
+ *
+ * - Minimum and maximum are split at window sized blocks: the running
+ *   extreme of the current block is combined with the extreme of the
+ *   part of the previous block still in the window. The latter is
+ *   computed once per block, for every position at once.
+ *
+ * - The EWMA weighs each new sample by @p alpha.
+ *
+ * A NaN sample repeats the metric's previous sample.
+ *
+ * @param window Number of updates covered
+ *
+ * @param alpha Weight of a new sample in the EWMA
+ *
+ * @param n Number of metrics in use
+ *
+ * @param cap Number of metric columns allocated, a multiple of
+ * ROLLSTATS_LANES
+ *
+ * @param pos Position of the next sample in the window
+ *
+ * @param started False until the first update
+ *
+ * @param input Next sample of each metric, filled in by the caller
+ * before rollstats_update()
+ *
+ * @param count Samples in the window, per metric
+ *
+ * @param mean Mean of the samples in the window
+ *
+ * @param m2 Sum of squared differences from the mean
+ *
+ * @param ewma Exponentially weighted moving average
+ *
+ * @param pmin Smallest sample of the current block
+ *
+ * @param pmax Largest sample of the current block
+ *
+ * @param ring The last @p window samples, one row per position
+ *
+ * @param smin Smallest sample from each position to the end of the
+ * previous block, one row per position and a last row of +inf
+ *
+ * @param smax As @p smin, for the largest sample
+ */
+	struct rollstats {
+		unsigned window;
+		double alpha;
+		unsigned n;
+		unsigned cap;
+		unsigned pos;
+		bool started;
+		double *input;
+		double *count;
+		double *mean;
+		double *m2;
+		double *ewma;
+		double *pmin;
+		double *pmax;
+		double *ring;
+		double *smin;
+		double *smax;
+	};
+
+/** Set up rolling statistics without any metrics
+ *
+ * @param window Updates covered, ROLLSTATS_DEFAULT_WINDOW if 0
+ *
+ * @param alpha EWMA weight between 0 and 1, or 0 for 2 / (window + 1)
+ *
+ * @return 0 on success, -1 with errno set to EINVAL for a bad alpha
+ */
+	int rollstats_init(struct rollstats *st, unsigned window, double alpha);
+
+	void rollstats_free(struct rollstats *st);
+
+/** Set the number of metrics
+ *
+ * Metrics that were already tracked keep their statistics. New ones
+ * start empty.
+ *
+ * @return 0 on success, -1 if the storage could not be grown
+ */
+	int rollstats_resize(struct rollstats *st, unsigned n);
+
+/** Forget the statistics of one metric, for when another metric
+ * takes its place */
+	void rollstats_reset(struct rollstats *st, unsigned i);
+
+/** Take the samples in @p input as the next update of every metric */
+	void rollstats_update(struct rollstats *st);
+
+/** Number of samples metric @p i has in the window, 0 if none */
+	unsigned rollstats_count(const struct rollstats *st, unsigned i);
+
+	double rollstats_mean(const struct rollstats *st, unsigned i);
+
+/** Sample standard deviation, 0 with fewer than two samples */
+	double rollstats_stddev(const struct rollstats *st, unsigned i);
+
+	double rollstats_min(const struct rollstats *st, unsigned i);
+
+	double rollstats_max(const struct rollstats *st, unsigned i);
+
+	double rollstats_ewma(const struct rollstats *st, unsigned i);
+
+#ifdef __cplusplus
+}
+#endif /* #ifdef __cplusplus */
+
+#endif /* #ifndef ROLLSTATS_H */
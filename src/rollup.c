@@ -0,0 +1,215 @@
+#include "rollup.h"
+
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+/* Length of a period and number of buckets of each tier */
+static const int64_t _width[ROLLUP_TIERS] = { 1000, 60000, 3600000 };
+static const uint32_t _len[ROLLUP_TIERS] = {
+	ROLLUP_SECOND_BUCKETS,
+	ROLLUP_MINUTE_BUCKETS,
+	ROLLUP_HOUR_BUCKETS
+};
+
+#define ROLLUP_SERIES_BUCKETS (ROLLUP_SECOND_BUCKETS + \
+			       ROLLUP_MINUTE_BUCKETS + ROLLUP_HOUR_BUCKETS)
+
+static struct rollup_bucket *_tier(const struct rollup *r, int s,
+				   int tier);
+static int64_t _period(int64_t t, int tier);
+static void _put(struct rollup *r, int s, int tier,
+		 const struct rollup_bucket *b);
+static void _merge(struct rollup_bucket *dst,
+		   const struct rollup_bucket *src);
+
+int rollup_init(struct rollup *r, unsigned nseries)
+{
+	assert(r);
+
+	if (nseries == 0)
+		nseries = ROLLUP_DEFAULT_SERIES;
+
+	memset(r, 0, sizeof(*r));
+
+	/* Buckets of series never claimed are never touched */
+	r->series = (struct rollup_series*) calloc(nseries,
+						   sizeof(*r->series));
+	r->buckets = (struct rollup_bucket*)
+		calloc((size_t) nseries * ROLLUP_SERIES_BUCKETS,
+		       sizeof(*r->buckets));
+
+	if (!r->series || !r->buckets) {
+		rollup_free(r);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	r->nseries = nseries;
+
+	return 0;
+}
+
+void rollup_free(struct rollup *r)
+{
+	assert(r);
+
+	free(r->series);
+	free(r->buckets);
+	memset(r, 0, sizeof(*r));
+}
+
+int rollup_find(struct rollup *r, const char *name)
+{
+	assert(r);
+	assert(name);
+
+	int unused = -1;
+
+	for (unsigned i = 0; i < r->nseries; ++i) {
+		if (r->series[i].name[0] == '\0') {
+			unused = unused < 0 ? (int) i : unused;
+			continue;
+		}
+
+		if (strncmp(r->series[i].name, name,
+			    sizeof(r->series[i].name) - 1) == 0)
+			return i;
+	}
+
+	if (unused >= 0)
+		strncpy(r->series[unused].name, name,
+			sizeof(r->series[unused].name) - 1);
+
+	return unused;
+}
+
+void rollup_add(struct rollup *r, int s, int64_t timemillis, double value)
+{
+	assert(r);
+	assert(s >= 0 && (unsigned) s < r->nseries);
+
+	struct rollup_bucket b = { timemillis, 1, value, value, value };
+
+	if (value != value)
+		return;
+
+	_put(r, s, ROLLUP_SECONDS, &b);
+}
+
+unsigned rollup_last(const struct rollup *r, int s, int tier,
+		     struct rollup_bucket *out, unsigned n)
+{
+	assert(r);
+	assert(s >= 0 && (unsigned) s < r->nseries);
+	assert(tier >= 0 && tier < ROLLUP_TIERS);
+
+	const struct rollup_series *se = &r->series[s];
+	const struct rollup_bucket *ring = _tier(r, s, tier);
+	uint32_t held = se->count[tier];
+	unsigned got = 0;
+
+	unsigned want = held < n ? held : n;
+
+	if (n == 0)
+		return 0;
+
+	for (unsigned k = 0; k < want; ++k) {
+		uint32_t i = (se->head[tier] + _len[tier] - (want - 1 - k)) %
+			_len[tier];
+
+		out[got++] = ring[i];
+	}
+
+	/* Open buckets of finer tiers, coarsest first, belong to the
+	 * newest period or to a later one */
+	for (int f = tier - 1; f >= 0; --f) {
+		struct rollup_bucket b;
+
+		if (se->count[f] == 0)
+			continue;
+
+		b = _tier(r, s, f)[se->head[f]];
+		b.start = _period(b.start, tier);
+
+		if (got > 0 && b.start <= out[got - 1].start) {
+			_merge(&out[got - 1], &b);
+			continue;
+		}
+
+		if (got == n) {
+			memmove(out, out + 1, (n - 1) * sizeof(*out));
+			--got;
+		}
+
+		out[got++] = b;
+	}
+
+	return got;
+}
+
+static struct rollup_bucket *_tier(const struct rollup *r, int s,
+				   int tier)
+{
+	struct rollup_bucket *b = r->buckets +
+		(size_t) s * ROLLUP_SERIES_BUCKETS;
+
+	for (int t = 0; t < tier; ++t) {
+		b += _len[t];
+	}
+
+	return b;
+}
+
+/* Start of the period of a tier a time falls in, also for times
+ * before 1970 */
+static int64_t _period(int64_t t, int tier)
+{
+	int64_t w = _width[tier];
+	int64_t q = t / w;
+
+	if (t % w < 0)
+		--q;
+
+	return q * w;
+}
+
+/* Count a bucket in a tier. Once it starts a later period, the open
+ * bucket of the tier is closed and folded into the next tier. */
+static void _put(struct rollup *r, int s, int tier,
+		 const struct rollup_bucket *b)
+{
+	struct rollup_series *se = &r->series[s];
+	struct rollup_bucket *ring = _tier(r, s, tier);
+	struct rollup_bucket *open = &ring[se->head[tier]];
+	int64_t start = _period(b->start, tier);
+
+	if (se->count[tier] == 0) {
+		se->count[tier] = 1;
+	} else if (start > open->start) {
+		if (tier + 1 < ROLLUP_TIERS)
+			_put(r, s, tier + 1, open);
+
+		se->head[tier] = (se->head[tier] + 1) % _len[tier];
+
+		if (se->count[tier] < _len[tier])
+			++se->count[tier];
+
+		open = &ring[se->head[tier]];
+	} else {
+		_merge(open, b);
+		return;
+	}
+
+	*open = *b;
+	open->start = start;
+}
+
+static void _merge(struct rollup_bucket *dst,
+		   const struct rollup_bucket *src)
+{
+	dst->count += src->count;
+	dst->sum += src->sum;
+	dst->min = src->min < dst->min ? src->min : dst->min;
+	dst->max = src->max > dst->max ? src->max : dst->max;
+}
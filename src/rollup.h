@@ -0,0 +1,133 @@
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* #ifdef __cplusplus */
+
+/* Tiers of buckets, finest first */
+#define ROLLUP_SECONDS 0
+#define ROLLUP_MINUTES 1
+#define ROLLUP_HOURS 2
+#define ROLLUP_TIERS 3
+
+/* Buckets kept per tier and metric: two minutes of seconds, a day of
+ * minutes and two months of hours */
+#ifndef ROLLUP_SECOND_BUCKETS
+#define ROLLUP_SECOND_BUCKETS 120
+#endif /* #ifndef ROLLUP_SECOND_BUCKETS */
+
+#ifndef ROLLUP_MINUTE_BUCKETS
+#define ROLLUP_MINUTE_BUCKETS 1440
+#endif /* #ifndef ROLLUP_MINUTE_BUCKETS */
+
+#ifndef ROLLUP_HOUR_BUCKETS
+#define ROLLUP_HOUR_BUCKETS 1488
+#endif /* #ifndef ROLLUP_HOUR_BUCKETS */
+
+#ifndef ROLLUP_DEFAULT_SERIES
+#define ROLLUP_DEFAULT_SERIES 32
+#endif /* #ifndef ROLLUP_DEFAULT_SERIES */
+
+/** Aggregate of the values in one period
+ *
+ * @param start Device time the period starts at, in milliseconds
+ *
+ * @param count Values in the period
+ *
+ * @param sum Sum of the values
+ *
+ * @param min Smallest value
+ *
+ * @param max Largest value
+ */
+	struct rollup_bucket {
+		int64_t start;
+		uint64_t count;
+		double sum;
+		double min;
+		double max;
+	};
+
+/** Identity and fill level of one series
+ *
+ * @param name Metric name the series belongs to, empty if unused
+ *
+ * @param head Open bucket of each tier
+ *
+ * @param count Buckets held by each tier, the open one included
+ */
+	struct rollup_series {
+		char name[48];
+		uint32_t head[ROLLUP_TIERS];
+		uint32_t count[ROLLUP_TIERS];
+	};
+
+/** Values of a set of metrics, aggregated over seconds, minutes and
+ * hours of device time
+ *
+ * Each value goes into the bucket of its second. Once a value for a
+ * later second arrives, that bucket is closed and folded into the
+ * bucket of its minute, which is folded into the bucket of its hour
+ * the same way. Every tier is a ring of a fixed number of buckets per
+ * series, so memory use is fixed when the rollup is set up, however
+ * long it runs. Periods without values take no buckets.
+ *
+ * A value older than the open bucket of its series, as after the
+ * device clock was set back, is counted in the open bucket.
+ *
+ * @param series Per-series identity, @p nseries of them
+ *
+ * @param buckets Buckets of every series, each series' tiers one
+ * after the other
+ *
+ * @param nseries Number of series
+ */
+	struct rollup {
+		struct rollup_series *series;
+		struct rollup_bucket *buckets;
+		unsigned nseries;
+	};
+
+/** Set up a rollup
+ *
+ * @param nseries Most metrics tracked, ROLLUP_DEFAULT_SERIES if 0
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+	int rollup_init(struct rollup *r, unsigned nseries);
+
+	void rollup_free(struct rollup *r);
+
+/** Find the series of a metric, claiming a free one if it has none
+ *
+ * @return Index of the series, or -1 if every series is taken
+ */
+	int rollup_find(struct rollup *r, const char *name);
+
+/** Count a value at a device time. NaN values are left out. */
+	void rollup_add(struct rollup *r, int s, int64_t timemillis,
+			double value);
+
+/** Copy the newest buckets of one tier of a series, oldest first
+ *
+ * The newest bucket includes the values that finer tiers have not
+ * folded into it yet, so it is up to date with the last value added.
+ *
+ * @param tier ROLLUP_SECONDS, ROLLUP_MINUTES or ROLLUP_HOURS
+ *
+ * @param out Receives up to @p n buckets
+ *
+ * @return Number of buckets copied
+ */
+	unsigned rollup_last(const struct rollup *r, int s, int tier,
+			     struct rollup_bucket *out, unsigned n);
+
+#ifdef __cplusplus
+}
+#endif /* #ifdef __cplusplus */
+
+#endif /* #ifndef ROLLUP_H */
@@ -0,0 +1,237 @@
+#include "shmsnap.h"
+
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct shmsnap {
+	struct shmsnap_header *hdr;
+	size_t size;
+	bool owner;
+	char name[NAME_MAX];
+};
+
+static struct shmsnap *_map(const char *name, int fd, size_t size,
+			    bool owner);
+
+struct shmsnap *shmsnap_create(const char *name, unsigned capacity)
+{
+	struct shmsnap *s;
+	size_t size;
+	int fd;
+
+	assert(name);
+
+	if (capacity == 0)
+		capacity = SHMSNAP_CAPACITY;
+
+	size = sizeof(struct shmsnap_header) +
+		capacity * sizeof(struct shmsnap_metric);
+
+	if (strlen(name) >= NAME_MAX) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+	if (fd < 0)
+		return NULL;
+
+	if (ftruncate(fd, size) < 0) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	if (!(s = _map(name, fd, size, true)))
+		return NULL;
+
+	/* Readers check the magic last, so it goes in last */
+	s->hdr->version = SHMSNAP_VERSION;
+	s->hdr->capacity = capacity;
+	s->hdr->count = 0;
+	__atomic_store_n(&s->hdr->seq, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->hdr->magic, SHMSNAP_MAGIC, __ATOMIC_RELEASE);
+
+	return s;
+}
+
+struct shmsnap *shmsnap_open(const char *name)
+{
+	struct shmsnap *s;
+	struct stat st;
+	int fd;
+
+	assert(name);
+
+	if (strlen(name) >= NAME_MAX) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	if ((size_t) st.st_size < sizeof(struct shmsnap_header)) {
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	if (!(s = _map(name, fd, st.st_size, false)))
+		return NULL;
+
+	if (__atomic_load_n(&s->hdr->magic, __ATOMIC_ACQUIRE) != SHMSNAP_MAGIC ||
+	    s->hdr->version != SHMSNAP_VERSION ||
+	    sizeof(struct shmsnap_header) + s->hdr->capacity *
+	    sizeof(struct shmsnap_metric) > s->size) {
+		shmsnap_close(s);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	return s;
+}
+
+void shmsnap_close(struct shmsnap *s)
+{
+	if (!s)
+		return;
+
+	munmap(s->hdr, s->size);
+
+	if (s->owner)
+		shm_unlink(s->name);
+
+	free(s);
+}
+
+struct shmsnap_metric *shmsnap_begin(struct shmsnap *s)
+{
+	assert(s && s->owner);
+
+	uint32_t seq = __atomic_load_n(&s->hdr->seq, __ATOMIC_RELAXED);
+
+	/* Odd tells readers a write is under way. The fence keeps the
+	 * metric stores from being seen before it. */
+	__atomic_store_n(&s->hdr->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	return s->hdr->metrics;
+}
+
+void shmsnap_end(struct shmsnap *s, unsigned count)
+{
+	struct timespec ts;
+
+	assert(s && s->owner);
+	assert(count <= s->hdr->capacity);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	s->hdr->count = count;
+	s->hdr->published = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	uint32_t seq = __atomic_load_n(&s->hdr->seq, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&s->hdr->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+unsigned shmsnap_capacity(const struct shmsnap *s)
+{
+	assert(s);
+
+	return s->hdr->capacity;
+}
+
+int shmsnap_read(struct shmsnap *s, struct shmsnap_metric *out,
+		 unsigned max, uint32_t *seq)
+{
+	assert(s);
+	assert(out || max == 0);
+
+	for (int i = 0; i < SHMSNAP_READ_TRIES; ++i) {
+		uint32_t before = __atomic_load_n(&s->hdr->seq,
+						  __ATOMIC_ACQUIRE);
+		unsigned count;
+
+		if (before & 1)
+			continue;
+
+		count = s->hdr->count;
+
+		if (count > s->hdr->capacity)
+			continue;
+
+		memcpy(out, s->hdr->metrics,
+		       (count < max ? count : max) *
+		       sizeof(struct shmsnap_metric));
+
+		/* Keep the copy from being moved past the check */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&s->hdr->seq, __ATOMIC_RELAXED) != before)
+			continue;
+
+		if (seq)
+			*seq = before;
+
+		return (int) count;
+	}
+
+	errno = EAGAIN;
+
+	return -1;
+}
+
+static struct shmsnap *_map(const char *name, int fd, size_t size,
+			    bool owner)
+{
+	struct shmsnap *s = (struct shmsnap*) calloc(1, sizeof(*s));
+	int prot = owner ? PROT_READ | PROT_WRITE : PROT_READ;
+	int err;
+
+	if (!s) {
+		close(fd);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	s->hdr = (struct shmsnap_header*) mmap(NULL, size, prot, MAP_SHARED,
+					       fd, 0);
+	err = errno;
+
+	/* The mapping keeps the segment, the descriptor is not needed */
+	close(fd);
+
+	if (s->hdr == MAP_FAILED) {
+		free(s);
+		errno = err;
+		return NULL;
+	}
+
+	s->size = size;
+	s->owner = owner;
+	strcpy(s->name, name);
+
+	return s;
+}
@@ -0,0 +1,145 @@
+#ifndef SHMSNAP_H
+#define SHMSNAP_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* #ifdef __cplusplus */
+
+#define SHMSNAP_MAGIC 0x454e5653 /* "ENVS" */
+#define SHMSNAP_VERSION 1
+
+#ifndef SHMSNAP_CAPACITY
+#define SHMSNAP_CAPACITY 256
+#endif /* #ifndef SHMSNAP_CAPACITY */
+
+#ifndef SHMSNAP_READ_TRIES
+#define SHMSNAP_READ_TRIES 1000
+#endif /* #ifndef SHMSNAP_READ_TRIES */
+
+/** One published reading
+ *
+ * @param name Name of the metric, "<source>:<name>" when the
+ * publisher displays several sources
+ *
+ * @param unit Unit of the value
+ *
+ * @param value The value
+ *
+ * @param timemillis Device time stamp of the value in milliseconds
+ *
+ * @param precision Number of decimal places the value is displayed
+ * with
+ */
+	struct shmsnap_metric {
+		char name[48];
+		char unit[36];
+		int32_t precision;
+		double value;
+		int64_t timemillis;
+	};
+
+/** Layout of the shared memory segment
+ *
+ * The segment is sized for @p capacity metrics once and never grows,
+ * so readers map it once. The writer guards the metrics with a
+ * seqlock: @p seq is odd while a snapshot is being written and
+ * advances by two with every snapshot. A reader copies the metrics
+ * and keeps the copy only if @p seq was even and unchanged across
+ * the copy. Neither side ever waits on the other.
+ *
+ * @param magic SHMSNAP_MAGIC
+ *
+ * @param version SHMSNAP_VERSION
+ *
+ * @param capacity Number of metric slots in the segment
+ *
+ * @param seq Seqlock sequence number
+ *
+ * @param count Number of metrics in the current snapshot
+ *
+ * @param published Wall clock time of the current snapshot in
+ * milliseconds
+ *
+ * @param metrics The current snapshot
+ */
+	struct shmsnap_header {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t capacity;
+		uint32_t seq;
+		uint32_t count;
+		uint32_t pad;
+		int64_t published;
+		struct shmsnap_metric metrics[];
+	};
+
+/** Handle to a mapped segment, for either side */
+	struct shmsnap;
+
+/** Create a segment and map it for publishing
+ *
+ * There must be one publisher per segment. An existing segment of the
+ * same name is taken over.
+ *
+ * @param name POSIX shared memory name, "/<name>"
+ *
+ * @param capacity Most metrics a snapshot holds, SHMSNAP_CAPACITY if 0
+ *
+ * @return The handle, or NULL on failure with errno set
+ */
+	struct shmsnap *shmsnap_create(const char *name, unsigned capacity);
+
+/** Map an existing segment for reading
+ *
+ * @return The handle, or NULL on failure with errno set. EPROTO
+ * means the segment is not a snapshot segment of this version.
+ */
+	struct shmsnap *shmsnap_open(const char *name);
+
+/** Unmap the segment, removing it if created with shmsnap_create() */
+	void shmsnap_close(struct shmsnap *s);
+
+/** Start writing a snapshot
+ *
+ * Readers retry until shmsnap_end() is called.
+ *
+ * @return The metric slots to write to, shmsnap_capacity() of them
+ */
+	struct shmsnap_metric *shmsnap_begin(struct shmsnap *s);
+
+/** Finish writing a snapshot of @p count metrics */
+	void shmsnap_end(struct shmsnap *s, unsigned count);
+
+/** Number of metric slots in the segment */
+	unsigned shmsnap_capacity(const struct shmsnap *s);
+
+/** Copy a consistent snapshot out of the segment
+ *
+ * No system calls are made and nothing is locked; a copy that
+ * overlapped a write is simply made again.
+ *
+ * @param s Handle from shmsnap_open()
+ *
+ * @param out Receives up to @p max metrics
+ *
+ * @param max Length of @p out
+ *
+ * @param seq If not NULL, receives the snapshot's sequence number,
+ * which only changes with a new snapshot
+ *
+ * @return Number of metrics in the snapshot, which may be more than
+ * @p max, or -1 with errno set to EAGAIN if no consistent copy could
+ * be made in SHMSNAP_READ_TRIES tries
+ */
+	int shmsnap_read(struct shmsnap *s, struct shmsnap_metric *out,
+			 unsigned max, uint32_t *seq);
+
+#ifdef __cplusplus
+}
+#endif /* #ifdef __cplusplus */
+
+#endif /* #ifndef SHMSNAP_H */
@@ -0,0 +1,530 @@
+#include "sketch.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+
+/* Start of a sketch file, followed by one record per sketch */
+struct sketch_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nsketches;
+	uint32_t reserved;
+	double accuracy;
+};
+
+/* One saved sketch, followed by the counts of its positive buckets,
+ * then of its negative ones, each from the lowest key on */
+struct sketch_record {
+	char name[48];
+	uint64_t zero;
+	double min;
+	double max;
+	int32_t lo[2];
+	uint32_t nbins[2];
+};
+
+static void _clear(struct sketch *sk);
+static void _add(const struct sketchset *set, struct sketch *sk,
+		 double value);
+static void _merge(struct sketch *dst, const struct sketch *src);
+static void _storeAdd(struct sketch_store *s, int32_t key, uint64_t count);
+static void _storeRebase(struct sketch_store *s, int32_t base);
+static double _keyValue(const struct sketchset *set, int32_t key);
+static int _emit(const struct sketch *sk, const double *q, int n, int j,
+		 double seen, double value, double *out);
+static int _readStore(FILE *f, struct sketch_store *s, int32_t lo,
+		      uint32_t nbins);
+
+int sketchset_init(struct sketchset *set, double accuracy, unsigned cap)
+{
+	assert(set);
+
+	if (accuracy == 0.0)
+		accuracy = SKETCH_DEFAULT_ACCURACY;
+
+	if (cap == 0)
+		cap = SKETCH_DEFAULT_METRICS;
+
+	memset(set, 0, sizeof(*set));
+
+	if (!(accuracy > 0.0 && accuracy < 1.0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Pages of sketches never claimed are never touched */
+	set->sketches = (struct sketch*) calloc(cap, sizeof(struct sketch));
+
+	if (!set->sketches) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	set->accuracy = accuracy;
+	set->gamma = (1.0 + accuracy) / (1.0 - accuracy);
+	set->multiplier = 1.0 / log(set->gamma);
+	set->cap = cap;
+
+	return 0;
+}
+
+void sketchset_free(struct sketchset *set)
+{
+	assert(set);
+
+	free(set->sketches);
+	memset(set, 0, sizeof(*set));
+}
+
+int sketchset_find(struct sketchset *set, const char *name)
+{
+	assert(set);
+	assert(name);
+
+	for (unsigned i = 0; i < set->n; ++i) {
+		if (strncmp(set->sketches[i].name, name,
+			    sizeof(set->sketches[i].name) - 1) == 0)
+			return i;
+	}
+
+	if (set->n >= set->cap)
+		return -1;
+
+	struct sketch *sk = &set->sketches[set->n];
+
+	_clear(sk);
+	strncpy(sk->name, name, sizeof(sk->name) - 1);
+
+	return set->n++;
+}
+
+void sketchset_add(struct sketchset *set, int i, double value)
+{
+	assert(set);
+	assert(i >= 0 && (unsigned) i < set->n);
+
+	_add(set, &set->sketches[i], value);
+}
+
+uint64_t sketchset_count(const struct sketchset *set, int i)
+{
+	assert(set);
+
+	return i >= 0 && (unsigned) i < set->n ? set->sketches[i].count : 0;
+}
+
+/* Buckets in value order: negative ones from the largest magnitude,
+ * the zero bucket, then positive ones from the smallest. Each quantile
+ * is the first bucket whose values reach past its rank. */
+void sketchset_quantiles(const struct sketchset *set, int i,
+			 const double *q, int n, double *out)
+{
+	assert(set);
+
+	const struct sketch *sk = i >= 0 && (unsigned) i < set->n ?
+		&set->sketches[i] : NULL;
+	double seen = 0;
+	int j = 0;
+
+	if (!sk || sk->count == 0) {
+		for (j = 0; j < n; ++j) {
+			out[j] = NAN;
+		}
+
+		return;
+	}
+
+	if (sk->neg.count) {
+		for (int32_t k = sk->neg.hi; k >= sk->neg.lo && j < n; --k) {
+			seen += sk->neg.bins[k - sk->neg.base];
+
+			if (seen > q[j] * (sk->count - 1))
+				j = _emit(sk, q, n, j, seen,
+					  -_keyValue(set, k), out);
+		}
+	}
+
+	seen += sk->zero;
+	j = _emit(sk, q, n, j, seen, 0.0, out);
+
+	if (sk->pos.count) {
+		for (int32_t k = sk->pos.lo; k <= sk->pos.hi && j < n; ++k) {
+			seen += sk->pos.bins[k - sk->pos.base];
+
+			if (seen > q[j] * (sk->count - 1))
+				j = _emit(sk, q, n, j, seen,
+					  _keyValue(set, k), out);
+		}
+	}
+
+	/* Only rounding leaves any */
+	for (; j < n; ++j) {
+		out[j] = sk->max;
+	}
+
+	/* The ends are known exactly */
+	for (j = 0; j < n; ++j) {
+		out[j] = q[j] <= 0.0 ? sk->min : q[j] >= 1.0 ? sk->max : out[j];
+	}
+}
+
+int sketchset_merge(struct sketchset *dst, const struct sketchset *src)
+{
+	assert(dst);
+	assert(src);
+
+	bool full = false;
+
+	if (dst->accuracy != src->accuracy) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (unsigned i = 0; i < src->n; ++i) {
+		int d = sketchset_find(dst, src->sketches[i].name);
+
+		if (d < 0) {
+			full = true;
+			continue;
+		}
+
+		_merge(&dst->sketches[d], &src->sketches[i]);
+	}
+
+	if (full) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	return 0;
+}
+
+int sketchset_load(struct sketchset *set, const char *path)
+{
+	assert(set);
+	assert(path);
+
+	struct sketch_file_header hdr;
+	struct sketch *sk;
+	FILE *f = fopen(path, "rb");
+	bool full = false;
+	int err = EINVAL;
+
+	if (!f)
+		return -1;
+
+	/* Read into a scratch sketch, merged once it is complete */
+	sk = (struct sketch*) malloc(sizeof(*sk));
+
+	if (!sk) {
+		fclose(f);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    hdr.magic != SKETCH_MAGIC || hdr.version != SKETCH_VERSION ||
+	    hdr.accuracy != set->accuracy)
+		goto fail;
+
+	for (uint32_t r = 0; r < hdr.nsketches; ++r) {
+		struct sketch_record rec;
+		int d;
+
+		if (fread(&rec, sizeof(rec), 1, f) != 1)
+			goto fail;
+
+		_clear(sk);
+		memcpy(sk->name, rec.name, sizeof(sk->name) - 1);
+		sk->zero = rec.zero;
+		sk->count = rec.zero;
+		sk->min = rec.min;
+		sk->max = rec.max;
+
+		if (_readStore(f, &sk->pos, rec.lo[0], rec.nbins[0]) < 0 ||
+		    _readStore(f, &sk->neg, rec.lo[1], rec.nbins[1]) < 0)
+			goto fail;
+
+		sk->count += sk->pos.count + sk->neg.count;
+
+		if (sk->count == 0)
+			continue;
+
+		if ((d = sketchset_find(set, sk->name)) < 0) {
+			full = true;
+			continue;
+		}
+
+		_merge(&set->sketches[d], sk);
+	}
+
+	free(sk);
+	fclose(f);
+
+	if (full) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	return 0;
+
+fail:
+	if (ferror(f))
+		err = errno;
+
+	free(sk);
+	fclose(f);
+	errno = err;
+	return -1;
+}
+
+int sketchset_save(const struct sketchset *set, const char *path)
+{
+	assert(set);
+	assert(path);
+
+	struct sketch_file_header hdr;
+	size_t len = strlen(path) + 5;
+	char *tmp = (char*) malloc(len);
+	FILE *f;
+	int err;
+
+	if (!tmp) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	snprintf(tmp, len, "%s.tmp", path);
+
+	if (!(f = fopen(tmp, "wb"))) {
+		err = errno;
+		free(tmp);
+		errno = err;
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SKETCH_MAGIC;
+	hdr.version = SKETCH_VERSION;
+	hdr.nsketches = set->n;
+	hdr.accuracy = set->accuracy;
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	for (unsigned i = 0; i < set->n; ++i) {
+		const struct sketch *sk = &set->sketches[i];
+		const struct sketch_store *stores[2] = { &sk->pos, &sk->neg };
+		struct sketch_record rec;
+
+		memset(&rec, 0, sizeof(rec));
+		memcpy(rec.name, sk->name, sizeof(rec.name));
+		rec.zero = sk->zero;
+		rec.min = sk->min;
+		rec.max = sk->max;
+
+		for (int s = 0; s < 2; ++s) {
+			if (!stores[s]->count)
+				continue;
+
+			rec.lo[s] = stores[s]->lo;
+			rec.nbins[s] = stores[s]->hi - stores[s]->lo + 1;
+		}
+
+		fwrite(&rec, sizeof(rec), 1, f);
+
+		for (int s = 0; s < 2; ++s) {
+			if (rec.nbins[s])
+				fwrite(stores[s]->bins +
+				       (rec.lo[s] - stores[s]->base),
+				       sizeof(uint32_t), rec.nbins[s], f);
+		}
+	}
+
+	/* Only replace the old file with a complete new one */
+	if (fflush(f) != 0 || ferror(f) || fsync(fileno(f)) < 0) {
+		err = errno;
+		fclose(f);
+		unlink(tmp);
+		free(tmp);
+		errno = err;
+		return -1;
+	}
+
+	if (fclose(f) != 0 || rename(tmp, path) < 0) {
+		err = errno;
+		unlink(tmp);
+		free(tmp);
+		errno = err;
+		return -1;
+	}
+
+	free(tmp);
+
+	return 0;
+}
+
+static void _clear(struct sketch *sk)
+{
+	memset(sk->name, 0, sizeof(sk->name));
+	sk->count = 0;
+	sk->zero = 0;
+	sk->min = INFINITY;
+	sk->max = -INFINITY;
+	sk->pos.count = 0;
+	sk->neg.count = 0;
+	memset(sk->pos.bins, 0, sizeof(sk->pos.bins));
+	memset(sk->neg.bins, 0, sizeof(sk->neg.bins));
+}
+
+static void _add(const struct sketchset *set, struct sketch *sk,
+		 double value)
+{
+	double mag = fabs(value);
+
+	if (!isfinite(value))
+		return;
+
+	if (mag < SKETCH_MIN_VALUE)
+		++sk->zero;
+	else
+		_storeAdd(value > 0 ? &sk->pos : &sk->neg,
+			  (int32_t) ceil(log(mag) * set->multiplier), 1);
+
+	sk->min = value < sk->min ? value : sk->min;
+	sk->max = value > sk->max ? value : sk->max;
+	++sk->count;
+}
+
+static void _merge(struct sketch *dst, const struct sketch *src)
+{
+	const struct sketch_store *from[2] = { &src->pos, &src->neg };
+	struct sketch_store *to[2] = { &dst->pos, &dst->neg };
+
+	for (int s = 0; s < 2; ++s) {
+		if (!from[s]->count)
+			continue;
+
+		for (int32_t k = from[s]->lo; k <= from[s]->hi; ++k) {
+			uint32_t c = from[s]->bins[k - from[s]->base];
+
+			if (c)
+				_storeAdd(to[s], k, c);
+		}
+	}
+
+	dst->zero += src->zero;
+	dst->count += src->count;
+	dst->min = src->min < dst->min ? src->min : dst->min;
+	dst->max = src->max > dst->max ? src->max : dst->max;
+}
+
+/* Count a key, moving the window of buckets to cover it. A key that
+ * cannot be covered without losing the highest keys goes to the lowest
+ * bucket instead. */
+static void _storeAdd(struct sketch_store *s, int32_t key, uint64_t count)
+{
+	if (s->count == 0) {
+		/* Leave room either way */
+		s->base = key - SKETCH_BINS / 2;
+		s->lo = key;
+		s->hi = key;
+	} else if (key < s->base) {
+		int32_t base = s->hi - SKETCH_BINS + 1;
+
+		_storeRebase(s, base);
+		key = key < base ? base : key;
+	} else if (key >= s->base + SKETCH_BINS) {
+		int32_t base = key - SKETCH_BINS + 1;
+
+		/* As much room above as the lowest key allows */
+		_storeRebase(s, s->lo > base ? s->lo : base);
+	}
+
+	s->bins[key - s->base] += (uint32_t) count;
+	s->lo = key < s->lo ? key : s->lo;
+	s->hi = key > s->hi ? key : s->hi;
+	s->count += count;
+}
+
+/* Move the window to start at another key. Keys below the new start
+ * are merged into its bucket. The highest key must stay covered. */
+static void _storeRebase(struct sketch_store *s, int32_t base)
+{
+	assert(s->hi < base + SKETCH_BINS);
+
+	if (base > s->base) {
+		int32_t shift = base - s->base;
+		int32_t gone = shift < SKETCH_BINS ? shift : SKETCH_BINS;
+		uint64_t merged = 0;
+
+		for (int32_t i = 0; i < gone; ++i) {
+			merged += s->bins[i];
+		}
+
+		memmove(s->bins, s->bins + gone,
+			(SKETCH_BINS - gone) * sizeof(s->bins[0]));
+		memset(s->bins + SKETCH_BINS - gone, 0,
+		       gone * sizeof(s->bins[0]));
+		s->bins[0] += (uint32_t) merged;
+
+		if (s->lo < base)
+			s->lo = base;
+
+		if (s->hi < base)
+			s->hi = base;
+	} else if (base < s->base) {
+		int32_t shift = s->base - base;
+
+		memmove(s->bins + shift, s->bins,
+			(SKETCH_BINS - shift) * sizeof(s->bins[0]));
+		memset(s->bins, 0, shift * sizeof(s->bins[0]));
+	}
+
+	s->base = base;
+}
+
+/* Middle of a bucket in relative terms, so both of its bounds are
+ * within the accuracy */
+static double _keyValue(const struct sketchset *set, int32_t key)
+{
+	return 2.0 * pow(set->gamma, key) / (set->gamma + 1.0);
+}
+
+/* Give every quantile whose rank the values seen so far reach past
+ * the value of the current bucket, kept within the exact extremes
+ *
+ * @return Index of the first quantile not reached
+ */
+static int _emit(const struct sketch *sk, const double *q, int n, int j,
+		 double seen, double value, double *out)
+{
+	value = value < sk->min ? sk->min : value;
+	value = value > sk->max ? sk->max : value;
+
+	for (; j < n && seen > q[j] * (sk->count - 1); ++j) {
+		out[j] = value;
+	}
+
+	return j;
+}
+
+static int _readStore(FILE *f, struct sketch_store *s, int32_t lo,
+		      uint32_t nbins)
+{
+	uint32_t bins[SKETCH_BINS];
+
+	if (nbins > SKETCH_BINS || fread(bins, sizeof(bins[0]), nbins, f) !=
+	    nbins)
+		return -1;
+
+	for (uint32_t i = 0; i < nbins; ++i) {
+		if (bins[i])
+			_storeAdd(s, lo + (int32_t) i, bins[i]);
+	}
+
+	return 0;
+}
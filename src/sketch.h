@@ -0,0 +1,175 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* #ifdef __cplusplus */
+
+#define SKETCH_MAGIC 0x454e5651 /* "ENVQ" */
+#define SKETCH_VERSION 1
+
+/* Buckets per sign. At the default accuracy they cover about nine
+ * orders of magnitude before the smallest values are merged. */
+#ifndef SKETCH_BINS
+#define SKETCH_BINS 1024
+#endif /* #ifndef SKETCH_BINS */
+
+#ifndef SKETCH_DEFAULT_ACCURACY
+#define SKETCH_DEFAULT_ACCURACY 0.01
+#endif /* #ifndef SKETCH_DEFAULT_ACCURACY */
+
+#ifndef SKETCH_DEFAULT_METRICS
+#define SKETCH_DEFAULT_METRICS 64
+#endif /* #ifndef SKETCH_DEFAULT_METRICS */
+
+/* Magnitudes below this count as zero */
+#ifndef SKETCH_MIN_VALUE
+#define SKETCH_MIN_VALUE 1e-9
+#endif /* #ifndef SKETCH_MIN_VALUE */
+
+/** Buckets of one sign, for a window of SKETCH_BINS consecutive keys
+ *
+ * @param base Key of the first bucket
+ *
+ * @param lo Lowest key with a count, if @p count is not 0
+ *
+ * @param hi Highest key with a count, if @p count is not 0
+ *
+ * @param count Values in all buckets
+ *
+ * @param bins Values per key, starting at @p base
+ */
+	struct sketch_store {
+		int32_t base;
+		int32_t lo;
+		int32_t hi;
+		uint64_t count;
+		uint32_t bins[SKETCH_BINS];
+	};
+
+/** Quantile sketch of one metric
+ *
+ * A value v is counted in the bucket of key ceil(log(|v|) / log(g)),
+ * where g = (1 + a) / (1 - a) for an accuracy a, so every quantile is
+ * answered within a relative error of a, however many values were
+ * counted. Should the keys of one sign span more than SKETCH_BINS, the
+ * smallest magnitudes share a bucket and lose that guarantee.
+ *
+ * @param name Metric name, empty if unused
+ *
+ * @param count Values counted
+ *
+ * @param zero Values of a magnitude below SKETCH_MIN_VALUE
+ *
+ * @param min Smallest value counted, exact
+ *
+ * @param max Largest value counted, exact
+ *
+ * @param pos Buckets of the positive values
+ *
+ * @param neg Buckets of the negative values, by magnitude
+ */
+	struct sketch {
+		char name[48];
+		uint64_t count;
+		uint64_t zero;
+		double min;
+		double max;
+		struct sketch_store pos;
+		struct sketch_store neg;
+	};
+
+/** Fixed number of sketches, one per metric name
+ *
+ * Memory is allocated once and never grows, so it stays the same
+ * however long values are added.
+ *
+ * @param accuracy Relative error of the quantiles
+ *
+ * @param multiplier 1 / log(g), turning a logarithm into a key
+ *
+ * @param gamma g, the ratio between the bounds of a bucket
+ *
+ * @param n Sketches claimed
+ *
+ * @param cap Sketches allocated
+ *
+ * @param sketches The sketches, claimed ones first
+ */
+	struct sketchset {
+		double accuracy;
+		double multiplier;
+		double gamma;
+		unsigned n;
+		unsigned cap;
+		struct sketch *sketches;
+	};
+
+/** Set up sketches without any metrics
+ *
+ * @param accuracy Relative error between 0 and 1, or 0 for
+ * SKETCH_DEFAULT_ACCURACY
+ *
+ * @param cap Most metrics sketched, SKETCH_DEFAULT_METRICS if 0
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+	int sketchset_init(struct sketchset *set, double accuracy,
+			   unsigned cap);
+
+	void sketchset_free(struct sketchset *set);
+
+/** Find the sketch of a metric, claiming a free one if it has none
+ *
+ * @return Index of the sketch, or -1 if every sketch is taken
+ */
+	int sketchset_find(struct sketchset *set, const char *name);
+
+/** Count a value. NaN and infinite values are left out. */
+	void sketchset_add(struct sketchset *set, int i, double value);
+
+/** Values counted by a sketch */
+	uint64_t sketchset_count(const struct sketchset *set, int i);
+
+/** Estimate several quantiles of a sketch in one pass
+ *
+ * @param q Quantiles between 0 and 1, in ascending order
+ *
+ * @param out Receives @p n estimates, NaN if the sketch is empty
+ */
+	void sketchset_quantiles(const struct sketchset *set, int i,
+				 const double *q, int n, double *out);
+
+/** Add every sketch of @p src to the sketch of the same name in @p dst
+ *
+ * @return 0 on success, -1 with errno set to EINVAL if the accuracies
+ * differ, or to ENOSPC if some metrics found no free sketch. The
+ * others are still merged.
+ */
+	int sketchset_merge(struct sketchset *dst,
+			    const struct sketchset *src);
+
+/** Merge the sketches saved in a file
+ *
+ * @return 0 on success, -1 with errno set. EINVAL means the file holds
+ * no sketches or sketches of another accuracy.
+ */
+	int sketchset_load(struct sketchset *set, const char *path);
+
+/** Save every claimed sketch to a file, replacing it
+ *
+ * The file is written under another name and renamed over @p path, so
+ * it holds either the old or the new sketches should writing fail.
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+	int sketchset_save(const struct sketchset *set, const char *path);
+
+#ifdef __cplusplus
+}
+#endif /* #ifdef __cplusplus */
+
+#endif /* #ifndef SKETCH_H */
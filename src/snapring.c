@@ -0,0 +1,100 @@
+#include "snapring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+void snapring_init(struct snapring *r)
+{
+	assert(r);
+
+	memset(r, 0, sizeof(*r));
+}
+
+void snapring_free(struct snapring *r)
+{
+	assert(r);
+
+	for (int i = 0; i < SNAPRING_LEN; ++i) {
+		free(r->slots[i].fields);
+	}
+
+	memset(r, 0, sizeof(*r));
+}
+
+struct snapshot *snapring_claim(struct snapring *r)
+{
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+	if (tail - head >= SNAPRING_LEN)
+		return NULL;
+
+	return &r->slots[tail % SNAPRING_LEN];
+}
+
+void snapring_publish(struct snapring *r)
+{
+	unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+int snapshot_reserve(struct snapshot *snap, int n)
+{
+	assert(snap);
+
+	if (n <= snap->cap)
+		return 0;
+
+	struct datafield *f = (struct datafield*)
+		realloc(snap->fields, n * sizeof(struct datafield));
+
+	if (!f)
+		return -1;
+
+	snap->fields = f;
+	snap->cap = n;
+
+	return 0;
+}
+
+struct snapshot *snapring_newest(struct snapring *r,
+				 unsigned long *skipped)
+{
+	unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+	if (head == tail)
+		return NULL;
+
+	struct snapshot *newest = &r->slots[(tail - 1) % SNAPRING_LEN];
+
+	/* Hand everything but the newest back to the producer, which
+	 * leaves them alone until then */
+	if (tail - head > 1) {
+		for (unsigned int i = head; i != tail - 1; ++i) {
+			const struct snapshot *old = &r->slots[i % SNAPRING_LEN];
+
+			for (int k = 0; k < old->nsegments &&
+				     k < newest->nsegments; ++k) {
+				newest->updated[k] = newest->updated[k] ||
+					old->updated[k];
+			}
+		}
+
+		if (skipped)
+			*skipped += tail - head - 1;
+
+		__atomic_store_n(&r->head, tail - 1, __ATOMIC_RELEASE);
+	}
+
+	return newest;
+}
+
+void snapring_release(struct snapring *r)
+{
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
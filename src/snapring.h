@@ -0,0 +1,110 @@
+#ifndef SNAPRING_H
+#define SNAPRING_H
+
+#include "jsonparse.h"
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* #ifdef __cplusplus */
+
+#ifndef SNAPRING_LEN
+#define SNAPRING_LEN 4
+#endif /* #ifndef SNAPRING_LEN */
+
+#ifndef SNAPSHOT_MAX_SEGMENTS
+#define SNAPSHOT_MAX_SEGMENTS 32
+#endif /* #ifndef SNAPSHOT_MAX_SEGMENTS */
+
+/** One parsed frame handed from the ingest thread to the display
+ *
+ * @param fields Flat array of every field in the frame, sensor after
+ * sensor
+ *
+ * @param nfields Number of valid entries in @p fields, or -1 if the
+ * producer hit an unrecoverable ingest error
+ *
+ * @param cap Number of entries allocated in @p fields
+ *
+ * @param segments Number of fields taken from each input stream, in
+ * stream order. The counts add up to @p nfields.
+ *
+ * @param updated True for the streams that sent a frame since the
+ * previous snapshot. The others carry their last frame again.
+ *
+ * @param nsegments Number of entries used in @p segments
+ */
+	struct snapshot {
+		struct datafield *fields;
+		int nfields;
+		int cap;
+		int segments[SNAPSHOT_MAX_SEGMENTS];
+		bool updated[SNAPSHOT_MAX_SEGMENTS];
+		int nsegments;
+	};
+
+/** Lock-free single-producer/single-consumer ring of snapshots
+ *
+ * The producer fills the slot returned by snapring_claim() and makes
+ * it visible with snapring_publish(). The consumer only ever wants
+ * the newest snapshot: snapring_newest() hands it out and returns the
+ * older ones to the producer unread. Slot storage stays with the
+ * ring and is reused, so the steady state does not allocate.
+ *
+ * @param head Count of slots the consumer has released
+ *
+ * @param tail Count of slots the producer has published
+ */
+	struct snapring {
+		struct snapshot slots[SNAPRING_LEN];
+		unsigned int head;
+		unsigned int tail;
+	};
+
+/** Zero the ring and its slots */
+	void snapring_init(struct snapring *r);
+
+/** Free slot storage. Neither side may be using the ring. */
+	void snapring_free(struct snapring *r);
+
+/** Producer: get the next slot to fill
+ *
+ * @return The slot, or NULL if the consumer still holds every slot
+ */
+	struct snapshot *snapring_claim(struct snapring *r);
+
+/** Producer: make the claimed slot visible to the consumer */
+	void snapring_publish(struct snapring *r);
+
+/** Producer: make sure a slot can hold @p n fields
+ *
+ * @return 0 on success, -1 if the storage could not be grown
+ */
+	int snapshot_reserve(struct snapshot *snap, int n);
+
+/** Consumer: take the newest published snapshot
+ *
+ * Older published snapshots are dropped, their @p updated flags
+ * carried over into the newest so no stream's update goes unseen. The
+ * returned slot belongs to the consumer until snapring_release() is
+ * called.
+ *
+ * @param r Ring to read from
+ *
+ * @param skipped If not NULL, incremented by the number of snapshots
+ * dropped unread
+ *
+ * @return The newest snapshot, or NULL if nothing new was published
+ */
+	struct snapshot *snapring_newest(struct snapring *r,
+					 unsigned long *skipped);
+
+/** Consumer: give the slot from snapring_newest() back */
+	void snapring_release(struct snapring *r);
+
+#ifdef __cplusplus
+}
+#endif /* #ifdef __cplusplus */
+
+#endif /* #ifndef SNAPRING_H */
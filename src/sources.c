@@ -0,0 +1,458 @@
+#include "sources.h"
+
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <net/if.h>
+
+static int _remoteConnect(struct source *src, int socktype, int protocol);
+static int _ttyConnect(struct source *src);
+static int _mcastJoin(struct source *src);
+static int _mcastSubscribe(int s, const struct addrinfo *group,
+			   const struct addrinfo *sender,
+			   unsigned int ifindex);
+static int _mcastLookup(struct source *src, const char *host,
+			struct addrinfo **ai);
+static int _splitGroup(struct source *src);
+static int _splitStream(struct source *src);
+static void _copyLabel(char *dst, const char *src, size_t n);
+
+int source_parse(struct source *src, enum source_kind kind,
+		 const char *arg)
+{
+	assert(src);
+
+	const char *eq = arg ? strchr(arg, '=') : NULL;
+	const char *path = eq ? eq + 1 : arg;
+
+	memset(src, 0, sizeof(*src));
+	src->kind = kind;
+	src->baud = B9600;
+	src->speed = 1;
+	src->fd = -1;
+
+	if (!arg) {
+		_copyLabel(src->label, "stdin", strlen("stdin"));
+		return 0;
+	}
+
+	if (strlen(path) == 0 || strlen(path) >= sizeof(src->path))
+		return -1;
+
+	strcpy(src->path, path);
+
+	if (kind == SOURCE_MCAST && _splitGroup(src) < 0)
+		return -1;
+
+	if (kind == SOURCE_REPLAY && _splitStream(src) < 0)
+		return -1;
+
+	/* An explicit label, otherwise the host or file name */
+	if (eq) {
+		if (eq == arg)
+			return -1;
+
+		_copyLabel(src->label, arg, eq - arg);
+	} else if (kind == SOURCE_UDP || kind == SOURCE_TCP ||
+		   kind == SOURCE_MCAST) {
+		_copyLabel(src->label, src->path, strlen(src->path));
+	} else {
+		const char *base = strrchr(path, '/');
+
+		base = base && base[1] ? base + 1 : path;
+		_copyLabel(src->label, base, strlen(base));
+	}
+
+	return 0;
+}
+
+void source_unique_labels(struct source *srcs, int n)
+{
+	for (int i = 1; i < n; ++i) {
+		for (int j = 0; j < i; ++j) {
+			char suffix[16];
+			size_t keep;
+
+			if (strcmp(srcs[i].label, srcs[j].label) != 0)
+				continue;
+
+			/* Number repeats by position, trimming the
+			 * label to make room */
+			snprintf(suffix, sizeof(suffix), "#%d", i + 1);
+			keep = sizeof(srcs[i].label) - 1 - strlen(suffix);
+
+			if (strlen(srcs[i].label) > keep)
+				srcs[i].label[keep] = '\0';
+
+			strcat(srcs[i].label, suffix);
+			break;
+		}
+	}
+}
+
+int source_open(struct source *src)
+{
+	assert(src);
+
+	switch (src->kind) {
+	case SOURCE_STDIN:
+		src->fd = open("/dev/stdin", O_RDWR);
+		break;
+	case SOURCE_FILE:
+		src->fd = open(src->path, O_RDWR);
+		break;
+	case SOURCE_TTY:
+		src->fd = _ttyConnect(src);
+		break;
+	case SOURCE_UDP:
+		src->fd = _remoteConnect(src, SOCK_DGRAM, IPPROTO_UDP);
+
+		/* Attempt to write to remote to start data flow */
+		if (src->fd >= 0 && write(src->fd, "hello\n", 6) < 0) {
+			fprintf(stderr, "Failed to write to address %s:%s:"
+				" %s\n", src->path, src->port,
+				strerror(errno));
+			source_close(src);
+		}
+
+		break;
+	case SOURCE_TCP:
+		src->fd = _remoteConnect(src, SOCK_STREAM, IPPROTO_TCP);
+		break;
+	case SOURCE_MCAST:
+		src->fd = _mcastJoin(src);
+		break;
+	case SOURCE_REPLAY:
+		src->fd = replay_start(&src->replay, src->path, src->stream,
+				       src->speed);
+		break;
+	}
+
+	return src->fd;
+}
+
+int source_open_sender(struct source *dst)
+{
+	struct addrinfo *ai;
+	unsigned int ifindex = 0;
+	int s;
+
+	assert(dst);
+	assert(dst->kind == SOURCE_MCAST);
+
+	if (dst->iface[0] && (ifindex = if_nametoindex(dst->iface)) == 0)
+		return -1;
+
+	if (_mcastLookup(dst, dst->path, &ai) < 0)
+		return -1;
+
+	s = socket(ai->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+
+	if (s < 0) {
+		freeaddrinfo(ai);
+		return -1;
+	}
+
+	/* Send on the named interface instead of the routed one */
+	if (ifindex != 0) {
+		struct ip_mreqn mr = {
+			.imr_ifindex = ifindex
+		};
+		int ret;
+
+		if (ai->ai_family == AF_INET6)
+			ret = setsockopt(s, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+					 &ifindex, sizeof(ifindex));
+		else
+			ret = setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF,
+					 &mr, sizeof(mr));
+
+		if (ret < 0) {
+			close(s);
+			s = -1;
+		}
+	}
+
+	if (s >= 0 && connect(s, ai->ai_addr, ai->ai_addrlen) < 0) {
+		close(s);
+		s = -1;
+	}
+
+	freeaddrinfo(ai);
+	dst->fd = s;
+
+	return s;
+}
+
+void source_close(struct source *src)
+{
+	bool replaying = src->kind == SOURCE_REPLAY && src->fd >= 0;
+
+	if (src->fd >= 0)
+		close(src->fd);
+
+	src->fd = -1;
+
+	/* With the pipe closed the replay cannot be stuck writing */
+	if (replaying)
+		replay_stop(&src->replay);
+}
+
+static int _remoteConnect(struct source *src, int socktype, int protocol)
+{
+	int s = -1; /* Socket */
+	int error;
+
+	struct addrinfo hints = {
+		.ai_flags = AI_PASSIVE,
+		.ai_family = 0,
+		.ai_socktype = socktype,
+		.ai_protocol = protocol,
+		.ai_addrlen = 0,
+		.ai_canonname = NULL,
+		.ai_addr = NULL,
+		.ai_next = NULL
+	};
+
+	struct addrinfo* sockai;
+	struct addrinfo* ai_iter;
+
+	if ((error = getaddrinfo(src->path, src->port, &hints, &sockai)) != 0) {
+		fprintf(stderr, "Failed to look up address %s:%s with code %d: "
+			"%s\n", src->path, src->port, error,
+			gai_strerror(error));
+		return -1;
+	}
+
+	assert(sockai);
+	ai_iter = sockai;
+
+	do {
+		if ((s = socket(ai_iter->ai_family, ai_iter->ai_socktype,
+				ai_iter->ai_protocol)) < 0) {
+			continue;
+		}
+
+		if (connect(s, ai_iter->ai_addr, ai_iter->ai_addrlen) == 0) {
+			break;
+		}
+
+		close(s);
+		s = -1;
+	}
+	while ((ai_iter = ai_iter->ai_next) != NULL);
+
+	freeaddrinfo(sockai);
+
+	return s;
+}
+
+static int _ttyConnect(struct source *src)
+{
+	int fd;
+	int ret;
+	struct termios ts;
+
+	fd = open(src->path, O_RDWR | O_NOCTTY);
+
+	if (fd < 0) {
+		perror("ERROR: When opening TTY: ");
+
+		return -1;
+	}
+
+	ret = tcgetattr(fd, &ts);
+
+	if (ret < 0) {
+		perror("ERROR: When getting TTY properties: ");
+	}
+
+	ret = cfsetspeed(&ts, src->baud);
+
+	if (ret < 0) {
+		perror("ERROR: When setting TTY speed: ");
+		close(fd);
+
+		return ret;
+	}
+
+	/* Set baud and turn off flow control */
+	ts.c_cflag &= ~CRTSCTS;
+	ts.c_cflag |= CREAD | CLOCAL;
+	ts.c_iflag &= ~(IXON | IXOFF | IXANY);
+	ts.c_iflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+	/* ts.c_iflag |= ICRNL; */
+
+	ret = tcsetattr(fd, TCSANOW, &ts);
+
+	if (ret < 0) {
+		perror("ERROR: Setting TTY settings: ");
+		close(fd);
+
+		return ret;
+	}
+
+	return fd;
+}
+
+/* Bind to the group's port and join it, for one sender only if
+ * filter is set */
+static int _mcastJoin(struct source *src)
+{
+	struct addrinfo *group;
+	struct addrinfo *sender = NULL;
+	unsigned int ifindex = 0;
+	int on = 1;
+	int s;
+
+	if (src->iface[0] && (ifindex = if_nametoindex(src->iface)) == 0) {
+		fprintf(stderr, "No interface %s: %s\n", src->iface,
+			strerror(errno));
+		return -1;
+	}
+
+	if (_mcastLookup(src, src->path, &group) < 0)
+		return -1;
+
+	if (src->filter[0] && _mcastLookup(src, src->filter, &sender) < 0) {
+		freeaddrinfo(group);
+		return -1;
+	}
+
+	s = socket(group->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+
+	/* Several displays on one host share the port. Binding to the
+	 * group rather than any address keeps out unicast to the port
+	 * and other groups. */
+	if (s < 0 ||
+	    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+	    bind(s, group->ai_addr, group->ai_addrlen) < 0 ||
+	    _mcastSubscribe(s, group, sender, ifindex) < 0) {
+		fprintf(stderr, "Failed to join group %s: %s\n", src->path,
+			strerror(errno));
+
+		if (s >= 0)
+			close(s);
+
+		s = -1;
+	}
+
+	freeaddrinfo(group);
+
+	if (sender)
+		freeaddrinfo(sender);
+
+	return s;
+}
+
+static int _mcastSubscribe(int s, const struct addrinfo *group,
+			   const struct addrinfo *sender,
+			   unsigned int ifindex)
+{
+	int level = group->ai_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+
+	if (sender) {
+		struct group_source_req gsr = {
+			.gsr_interface = ifindex
+		};
+
+		memcpy(&gsr.gsr_group, group->ai_addr, group->ai_addrlen);
+		memcpy(&gsr.gsr_source, sender->ai_addr, sender->ai_addrlen);
+
+		return setsockopt(s, level, MCAST_JOIN_SOURCE_GROUP,
+				  &gsr, sizeof(gsr));
+	}
+
+	struct group_req gr = {
+		.gr_interface = ifindex
+	};
+
+	memcpy(&gr.gr_group, group->ai_addr, group->ai_addrlen);
+
+	return setsockopt(s, level, MCAST_JOIN_GROUP, &gr, sizeof(gr));
+}
+
+/* Resolve a group or sender address in the source's address family
+ * and port */
+static int _mcastLookup(struct source *src, const char *host,
+			struct addrinfo **ai)
+{
+	int error;
+
+	struct addrinfo hints = {
+		.ai_flags = AI_NUMERICSERV,
+		.ai_family = 0,
+		.ai_socktype = SOCK_DGRAM,
+		.ai_protocol = IPPROTO_UDP
+	};
+
+	if ((error = getaddrinfo(host, src->port, &hints, ai)) != 0) {
+		fprintf(stderr, "Failed to look up address %s:%s with code %d: "
+			"%s\n", host, src->port, error, gai_strerror(error));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Move "@<sender>" and "%<interface>" off the end of a group path */
+static int _splitGroup(struct source *src)
+{
+	char *pct = strrchr(src->path, '%');
+	char *at;
+
+	if (pct) {
+		if (pct[1] == '\0' || strlen(pct + 1) >= sizeof(src->iface))
+			return -1;
+
+		strcpy(src->iface, pct + 1);
+		*pct = '\0';
+	}
+
+	if ((at = strchr(src->path, '@'))) {
+		if (at[1] == '\0')
+			return -1;
+
+		strcpy(src->filter, at + 1);
+		*at = '\0';
+	}
+
+	return src->path[0] ? 0 : -1;
+}
+
+/* Move "#<n>" off the end of a replayed file */
+static int _splitStream(struct source *src)
+{
+	char *hash = strrchr(src->path, '#');
+	char *end;
+	long n;
+
+	if (!hash)
+		return 0;
+
+	n = strtol(hash + 1, &end, 10);
+
+	if (end == hash + 1 || *end != '\0' || n < 0)
+		return -1;
+
+	src->stream = (int) n;
+	*hash = '\0';
+
+	return src->path[0] ? 0 : -1;
+}
+
+static void _copyLabel(char *dst, const char *src, size_t n)
+{
+	if (n > SOURCE_LABEL_LEN - 1)
+		n = SOURCE_LABEL_LEN - 1;
+
+	memcpy(dst, src, n);
+	dst[n] = '\0';
+}
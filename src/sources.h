@@ -0,0 +1,132 @@
+#ifndef SOURCES_H
+#define SOURCES_H
+
+#include "replay.h"
+
+#include <stdlib.h>
+#include <termios.h>
+#include <net/if.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* #ifdef __cplusplus */
+
+#ifndef SOURCE_LABEL_LEN
+#define SOURCE_LABEL_LEN 16
+#endif /* #ifndef SOURCE_LABEL_LEN */
+
+#ifndef SOURCE_PATH_LEN
+#define SOURCE_PATH_LEN 128
+#endif /* #ifndef SOURCE_PATH_LEN */
+
+	enum source_kind {
+		SOURCE_STDIN = 0,
+		SOURCE_TTY,
+		SOURCE_FILE,
+		SOURCE_UDP,
+		SOURCE_TCP,
+		SOURCE_MCAST,
+		SOURCE_REPLAY
+	};
+
+/** An input stream of JSON frames
+ *
+ * @param kind Where the frames come from
+ *
+ * @param label Short name the stream's metrics are prefixed with when
+ * more than one stream is displayed
+ *
+ * @param path File or serial device path, host name for network
+ * streams, group address for multicast streams, or the file replayed
+ *
+ * @param port Remote port for network streams, or the group's port
+ *
+ * @param filter Multicast only: address of the one sender to accept
+ * (source-specific multicast), empty to accept any sender
+ *
+ * @param iface Multicast only: name of the interface to join the
+ * group on, empty to let the routing table pick
+ *
+ * @param baud Line speed for serial streams
+ *
+ * @param stream Replay only: recorded source to replay from a capture
+ * log of several sources
+ *
+ * @param speed Replay only: multiple of the recorded pace, 0 for as
+ * fast as possible
+ *
+ * @param replay Replay only: the replay writing the frames once opened
+ *
+ * @param fd Descriptor once opened, -1 otherwise
+ */
+	struct source {
+		enum source_kind kind;
+		char label[SOURCE_LABEL_LEN];
+		char path[SOURCE_PATH_LEN];
+		char port[SOURCE_PATH_LEN];
+		char filter[SOURCE_PATH_LEN];
+		char iface[IF_NAMESIZE];
+		speed_t baud;
+		int stream;
+		double speed;
+		struct replay replay;
+		int fd;
+	};
+
+/** Fill in a source from a command line argument
+ *
+ * The argument is a path or host, optionally preceded by a label and
+ * '='. Without a label the host name or the last path component is
+ * used. Multicast groups may be followed by "@<sender>" to only accept
+ * one sender, and by "%<interface>" to join on a given interface.
+ * Replayed files may be followed by "#<n>" to replay the n-th source
+ * recorded in a capture log, counting from 0.
+ *
+ * @param src Source to fill in
+ *
+ * @param kind Kind of source
+ *
+ * @param arg "[<label>=]<path or host>", or NULL for stdin
+ *
+ * @return 0 on success, -1 if the argument does not fit
+ */
+	int source_parse(struct source *src, enum source_kind kind,
+			 const char *arg);
+
+/** Make every label in the array unique by numbering repeats */
+	void source_unique_labels(struct source *srcs, int n);
+
+/** Open the source's descriptor
+ *
+ * UDP sources are sent a greeting so the remote end starts sending.
+ * Multicast sources join their group instead and send nothing, so any
+ * number of them can share one sender. Replayed sources start their
+ * replay and read the pipe it writes to.
+ *
+ * @return The descriptor, or -1 on failure
+ */
+	int source_open(struct source *src);
+
+/** Open a multicast source for sending rather than receiving
+ *
+ * The descriptor is a datagram socket connected to the group, so
+ * every send() is one datagram to every member. Frames are sent with
+ * the default time to live of 1 and loop back to the local host, so
+ * they stay on the local network and displays on the same host see
+ * them too.
+ *
+ * @param dst Multicast source naming the group, port and optionally
+ * the interface to send on
+ *
+ * @return The descriptor, or -1 on failure
+ */
+	int source_open_sender(struct source *dst);
+
+/** Close the source's descriptor if open, stopping its replay */
+	void source_close(struct source *src);
+
+#ifdef __cplusplus
+}
+#endif /* #ifdef __cplusplus */
+
+#endif /* #ifndef SOURCES_H */
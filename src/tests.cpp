@@ -1,16 +1,71 @@
 #include "jsonparse.h"
 #include "display-driver.h"
 #include "data-ops.h"
+#include "framebuf.h"
+#include "numfmt.h"
+#include "snapring.h"
+#include "sources.h"
+#include "dgram.h"
+#include "relay.h"
+#include "shmsnap.h"
+#include "history.h"
+#include "rollstats.h"
+#include "sketch.h"
+#include "rollup.h"
+#include "capture.h"
+#include "replay.h"
+#include "batch.h"
+#include "tsstore.h"
 
 #include <iostream>
 #include <cstring>
 #include <cstdio>
+#include <cmath>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <csignal>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <new>
+#include <thread>
+#include <chrono>
 
 extern "C" void popFields(int pdfd);
 
 #define BOOST_TEST_MODULE env_display_test
 #include <boost/test/included/unit_test.hpp>
 
+// Count heap allocations made through operator new
+static size_t newcount = 0;
+
+void* operator new(std::size_t n)
+{
+  void* p = malloc(n ? n : 1);
+
+  ++newcount;
+
+  if (!p)
+    throw std::bad_alloc();
+
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+  free(p);
+}
+
 // Sample data string
 const char* infile = "{\"status\": {\"isWarmedUp\": false, \"CCS811\": \"ok\", "
   "\"localIP\": \"192.168.1.211\", \"sentmillis\": 1602543}, \"data\": "
@@ -42,20 +97,387 @@ BOOST_AUTO_TEST_CASE(jsonparse_test)
 
   // Check that data content is correct
   BOOST_WARN(strcmp(df[0][0].name, "ammonia") == 0);
-  BOOST_WARN(strcmp(df[0][0].value, "423") == 0);
-  BOOST_WARN(strcmp(df[0][0].time, "1602546") == 0);
+  BOOST_WARN(df[0][0].value == 423);
+  BOOST_WARN(df[0][0].timemillis == 1602546);
   BOOST_WARN(strcmp(df[0][0].unit, "counts") == 0);
   BOOST_WARN(strcmp(df[0][1].name, "temp") == 0);
-  BOOST_WARN(strcmp(df[0][1].value, "23.18") == 0);
-  BOOST_WARN(strcmp(df[0][1].time, "1602551") == 0);
+  BOOST_WARN(df[0][1].value == 23.18);
+  BOOST_WARN(df[0][1].timemillis == 1602551);
   BOOST_WARN(strcmp(df[0][1].unit, "degC") == 0);
 
   // Check clearing of data
   BOOST_CHECK_NO_THROW(clearData());
 }
 
+// Multi-sensor sample with members the display does not use
+const char* outfile = "{\"output\": [{\"sensor\": \"bme680\", \"data\": "
+  "[{\"name\": \"temperature\", \"value\": -4.5e1, \"timemillis\": 77, "
+  "\"unit\": \"deg\\u00b0C\", \"extra\": [1, {\"a\": null}, true]}, "
+  "{\"name\": \"gas \\\"resistance\\\"\", \"value\": 12946861, "
+  "\"unit\": \"ohm\"}]}, {\"data\": []}, "
+  "{\"data\": [{\"name\": \"PM2.5 Std\", \"value\": 2, "
+  "\"timemillis\": 78, \"unit\": \"ug/m^3\"}]}], \"data\": 5}";
+
+static std::vector<std::string> parseWith(const char* data,
+					  enum jp_backend backend)
+{
+  std::vector<std::string> result;
+  struct datafield** df = NULL;
+
+  initializeDataWith(data, backend);
+  df = getDataDump(df);
+
+  for (size_t i = 0; i < numSensors(); ++i) {
+    result.push_back("sensor");
+
+    for (int j = 0; j < numDataFields(i); ++j) {
+      char value[32];
+
+      snprintf(value, sizeof(value), "%.17g", df[i][j].value);
+
+      result.push_back(df[i][j].name);
+      result.push_back(value);
+      result.push_back(std::to_string(df[i][j].timemillis));
+      result.push_back(df[i][j].unit);
+    }
+  }
+
+  clearData();
+
+  return result;
+}
+
+BOOST_AUTO_TEST_CASE(jsonparse_backend_test)
+{
+  std::vector<std::string> jc;
+  std::vector<std::string> is;
+
+  // Both backends must agree on the single-sensor format
+  jc = parseWith(infile, JP_BACKEND_JSONCPP);
+  is = parseWith(infile, JP_BACKEND_INSITU);
+  BOOST_TEST(jc.size() == 21u);
+  BOOST_TEST(jc == is, boost::test_tools::per_element());
+
+  // And on the multi-sensor format with escapes and skipped members
+  jc = parseWith(outfile, JP_BACKEND_JSONCPP);
+  is = parseWith(outfile, JP_BACKEND_INSITU);
+  BOOST_TEST(jc.size() == 15u);
+  BOOST_TEST(jc == is, boost::test_tools::per_element());
+  BOOST_TEST(is[1] == "temperature");
+  BOOST_TEST(is[2] == "-45");
+  BOOST_TEST(is[3] == "77");
+  BOOST_TEST(is[7] == "0");
+  BOOST_TEST(is[4] == "deg\u00b0C");
+  BOOST_TEST(is[5] == "gas \"resistance\"");
+}
+
+BOOST_AUTO_TEST_CASE(jsonparse_ctx_test)
+{
+  struct jp_ctx* a = jp_ctx_new();
+  struct jp_ctx* b = jp_ctx_new();
+
+  BOOST_REQUIRE(a);
+  BOOST_REQUIRE(b);
+
+  // Contexts keep their own frames, and the default one is untouched
+  BOOST_REQUIRE(jp_parse(a, infile) == 0);
+  BOOST_REQUIRE(jp_parse_with(b, outfile, JP_BACKEND_INSITU) == 0);
+  BOOST_TEST(numSensors() == 0u);
+  BOOST_TEST(jp_num_sensors(a) == 1u);
+  BOOST_TEST(jp_num_fields(a, 0) == 5);
+  BOOST_TEST(jp_num_sensors(b) == 3u);
+  BOOST_TEST(jp_dump(a)[0][1].value == 23.18);
+  BOOST_TEST(std::string(jp_dump(b)[2][0].name) == "PM2.5 Std");
+
+  // Errors are reported instead of aborting
+  BOOST_TEST(jp_parse(b, "{\"data\": [") == -1);
+  BOOST_TEST(std::string(jp_error(b)) != "");
+  BOOST_TEST(jp_num_sensors(b) == 0u);
+  BOOST_TEST(jp_parse(b, "{\"status\": {}}") == -1);
+  BOOST_TEST(std::string(jp_error(b)) == "Unknown data format");
+  BOOST_TEST(jp_num_fields(a, 0) == 5);
+
+  jp_clear(a);
+  BOOST_TEST(jp_num_sensors(a) == 0u);
+
+  // Separate contexts parse on separate threads without locking
+  bool same[2] = { true, true };
+  auto worker = [&](struct jp_ctx* ctx, const char* data, bool* ok) {
+    for (int i = 0; i < 200; ++i) {
+      size_t nsensors = 0;
+
+      if (jp_parse_with(ctx, data, JP_BACKEND_INSITU) == 0)
+	nsensors = jp_num_sensors(ctx);
+
+      *ok = *ok && nsensors == (data == infile ? 1u : 3u);
+      jp_clear(ctx);
+    }
+  };
+  std::thread ta(worker, a, infile, &same[0]);
+  std::thread tb(worker, b, outfile, &same[1]);
+
+  ta.join();
+  tb.join();
+  BOOST_TEST(same[0]);
+  BOOST_TEST(same[1]);
+
+  jp_ctx_free(a);
+  jp_ctx_free(b);
+}
+
+BOOST_AUTO_TEST_CASE(steady_state_alloc_test)
+{
+  int p[2];
+  struct framebuf fb;
+  struct datafield** df = NULL;
+  std::string frame = std::string(infile) + "\n";
+  size_t allocs;
+  size_t news;
+
+  BOOST_REQUIRE(pipe(p) == 0);
+  BOOST_REQUIRE(framebuf_init(&fb, p[0], 0) == 0);
+
+  // First frame sizes the pools
+  BOOST_REQUIRE(write(p[1], frame.data(), frame.size()) == (ssize_t) frame.size());
+  BOOST_REQUIRE(framebuf_fill(&fb) > 0);
+  initializeDataWith(framebuf_next(&fb, NULL), JP_BACKEND_INSITU);
+  df = getDataDump(df);
+  clearData();
+
+  allocs = numAllocations();
+  news = newcount;
+
+  // Later frames of the same shape reuse the storage
+  for (int i = 0; i < 100; ++i) {
+    char* f;
+
+    BOOST_REQUIRE(write(p[1], frame.data(), frame.size()) == (ssize_t) frame.size());
+    BOOST_REQUIRE(framebuf_fill(&fb) > 0);
+    f = framebuf_next(&fb, NULL);
+    BOOST_REQUIRE(f);
+    initializeDataWith(f, JP_BACKEND_INSITU);
+    df = getDataDump(df);
+    clearData();
+  }
+
+  BOOST_TEST(numAllocations() == allocs);
+  BOOST_TEST(newcount == news);
+  BOOST_TEST(strcmp(df[0][4].name, "rh") == 0);
+
+  framebuf_free(&fb);
+  close(p[0]);
+  close(p[1]);
+}
+
+// Number formatting module unit
+
+BOOST_AUTO_TEST_CASE(numfmt_test)
+{
+  const double samples[] = {
+    0.0, -0.0, 0.125, 0.375, 1.005, 2.675, -0.001, 23.18, 99492.27,
+    12946861.0, 0.5, 1.5, 2.5, -2.5, 1e15, 123456789.987654321,
+    1e300, -1e-300, 9007199254740993.0
+  };
+  char expect[64];
+  char got[64];
+
+  for (double v : samples) {
+    for (int prec = 0; prec <= 9; ++prec) {
+      int n = numfmt_fixed(got, sizeof(got), v, prec);
+      int e = snprintf(expect, sizeof(expect), "%.*f", prec, v);
+
+      BOOST_TEST(std::string(got) == std::string(expect));
+      BOOST_TEST(n == e);
+    }
+  }
+
+  // Random values must match printf exactly, including ties
+  srand(1);
+
+  for (int i = 0; i < 100000; ++i) {
+    double v = (rand() - RAND_MAX / 2) / 64.0 / (1 + rand() % 1000);
+    int prec = rand() % 5;
+
+    numfmt_fixed(got, sizeof(got), v, prec);
+    snprintf(expect, sizeof(expect), "%.*f", prec, v);
+
+    if (strcmp(got, expect) != 0) {
+      BOOST_TEST(std::string(got) == std::string(expect));
+      break;
+    }
+  }
+
+  // Truncation reports the full length like snprintf
+  BOOST_TEST(numfmt_fixed(got, 4, 12345.678, 2) == 8);
+  BOOST_TEST(std::string(got) == "123");
+}
+
+// Frame buffer module unit
+
+BOOST_AUTO_TEST_CASE(framebuf_test)
+{
+  int p[2];
+  struct framebuf fb;
+  char* frame;
+  size_t len = 0;
+
+  BOOST_REQUIRE(pipe(p) == 0);
+  BOOST_REQUIRE(framebuf_init(&fb, p[0], 32) == 0);
+
+  // Partial line is held back until its newline arrives
+  BOOST_REQUIRE(write(p[1], "{\"a\": 1}\n{\"b\"", 13) == 13);
+  BOOST_TEST(framebuf_fill(&fb) == 13);
+  BOOST_TEST(framebuf_ready(&fb));
+  frame = framebuf_next(&fb, &len);
+  BOOST_REQUIRE(frame);
+  BOOST_TEST(strcmp(frame, "{\"a\": 1}") == 0);
+  BOOST_TEST(len == 8);
+  BOOST_TEST(!framebuf_ready(&fb));
+  BOOST_TEST(!framebuf_next(&fb, NULL));
+
+  BOOST_REQUIRE(write(p[1], ": 2}\r\n", 6) == 6);
+  BOOST_TEST(framebuf_fill(&fb) == 6);
+  frame = framebuf_next(&fb, NULL);
+  BOOST_REQUIRE(frame);
+  BOOST_TEST(strcmp(frame, "{\"b\": 2}") == 0);
+
+  // Oversized line is dropped and the framer resyncs after it
+  std::string big(40, 'x');
+  big += "\nok\n";
+  BOOST_REQUIRE(write(p[1], big.data(), big.size()) == (ssize_t) big.size());
+  BOOST_TEST(framebuf_fill(&fb) == 31);
+  BOOST_TEST(!framebuf_next(&fb, NULL));
+  BOOST_TEST(framebuf_fill(&fb) == 13);
+  frame = framebuf_next(&fb, NULL);
+  BOOST_REQUIRE(frame);
+  BOOST_TEST(strcmp(frame, "ok") == 0);
+  BOOST_TEST(fb.oversized == 1);
+
+  // Trailing line without a newline is handed out at EOF
+  BOOST_REQUIRE(write(p[1], "tail", 4) == 4);
+  close(p[1]);
+  BOOST_TEST(framebuf_fill(&fb) == 4);
+  BOOST_TEST(!framebuf_next(&fb, NULL));
+  BOOST_TEST(framebuf_fill(&fb) == 0);
+  frame = framebuf_next(&fb, NULL);
+  BOOST_REQUIRE(frame);
+  BOOST_TEST(strcmp(frame, "tail") == 0);
+  BOOST_TEST(fb.frames == 4);
+
+  framebuf_free(&fb);
+  close(p[0]);
+}
+
+BOOST_AUTO_TEST_CASE(framebuf_skip_test)
+{
+  int p[2];
+  struct framebuf fb;
+  const char* data = "one\ntwo\r\n\nthree\n\npart";
+  char* frame;
+
+  BOOST_REQUIRE(pipe(p) == 0);
+  BOOST_REQUIRE(framebuf_init(&fb, p[0], 64) == 0);
+
+  // Only the newest complete frame survives, the partial is kept
+  BOOST_REQUIRE(write(p[1], data, strlen(data)) == (ssize_t) strlen(data));
+  BOOST_TEST(framebuf_fill(&fb) == (ssize_t) strlen(data));
+  BOOST_TEST(framebuf_skip(&fb) == 2u);
+  frame = framebuf_next(&fb, NULL);
+  BOOST_REQUIRE(frame);
+  BOOST_TEST(strcmp(frame, "three") == 0);
+  BOOST_TEST(!framebuf_next(&fb, NULL));
+
+  // At EOF the unterminated remainder is the newest frame
+  BOOST_REQUIRE(write(p[1], "\nfour\nfive", 10) == 10);
+  close(p[1]);
+  BOOST_TEST(framebuf_fill(&fb) == 10);
+  BOOST_TEST(framebuf_fill(&fb) == 0);
+  BOOST_TEST(framebuf_skip(&fb) == 2u);
+  frame = framebuf_next(&fb, NULL);
+  BOOST_REQUIRE(frame);
+  BOOST_TEST(strcmp(frame, "five") == 0);
+
+  framebuf_free(&fb);
+  close(p[0]);
+}
+
 // Forms module unit
 
+static int form_frames = 0;
+
+// Counts the frames the form loop takes in, stopping it after the last
+static int formLoopPoll(long mstimeout)
+{
+  int ret = ncursesPollCB(mstimeout);
+
+  if (ret == 0 && ++form_frames >= 5)
+    metric_form_exit();
+
+  return ret;
+}
+
+BOOST_AUTO_TEST_CASE(forms_loop_test)
+{
+  const char* tempfile = "/tmp/env-display_loop_test.json";
+  struct metric_form *mf = NULL;
+  std::string frames;
+  std::string frame;
+  bool done = false;
+  int fd;
+  int out;
+  int null;
+
+  // The first frame is taken in before the loop, four more by it
+  for (int i = 0; i < 5; ++i) {
+    frame = infile;
+    frame.replace(frame.find("23.18"), 5, std::to_string(30 + i) + ".00");
+    frames += frame + "\n";
+  }
+
+  fd = open(tempfile, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  BOOST_REQUIRE(fd >= 0);
+  BOOST_REQUIRE(write(fd, frames.data(), frames.size()) == (ssize_t) frames.size());
+  BOOST_REQUIRE(lseek(fd, 0, SEEK_SET) == 0);
+
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFG(fd));
+  BOOST_REQUIRE(mf);
+  mf->polldata_cb = formLoopPoll;
+  form_frames = 1;
+
+  // Stop a loop stuck waiting on a file epoll never reports
+  std::thread watchdog([&done]() {
+    for (int i = 0; i < 30 && !done; ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    metric_form_exit();
+  });
+
+  // Keep the screen out of the test log
+  fflush(stdout);
+  out = dup(STDOUT_FILENO);
+  null = open("/dev/null", O_WRONLY);
+  BOOST_REQUIRE(null >= 0);
+  dup2(null, STDOUT_FILENO);
+  close(null);
+
+  int ret = metric_form_init(mf);
+
+  fflush(stdout);
+  dup2(out, STDOUT_FILENO);
+  close(out);
+
+  done = true;
+  watchdog.join();
+
+  BOOST_TEST(ret == 0);
+  BOOST_TEST(form_frames == 5);
+  BOOST_TEST(mf->metrics[1].value == 34);
+
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  close(fd);
+  unlink(tempfile);
+}
+
 BOOST_AUTO_TEST_CASE(forms_display_test)
 {
   FILE* fptr;
@@ -97,6 +519,1651 @@ BOOST_AUTO_TEST_CASE(forms_display_test)
   fclose(fptr);
 }
 
+BOOST_AUTO_TEST_CASE(dirty_tracking_test)
+{
+  int p[2];
+  struct metric_form *mf = NULL;
+  std::string frame = std::string(infile) + "\n";
+  std::string changed = frame;
+
+  changed.replace(changed.find("23.18"), 5, "23.50");
+
+  BOOST_REQUIRE(pipe(p) == 0);
+  BOOST_REQUIRE(write(p[1], frame.data(), frame.size()) == (ssize_t) frame.size());
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFG(p[0]));
+  BOOST_REQUIRE(mf);
+  BOOST_TEST(mf->relayout);
+
+  // Pretend the form driver drew everything
+  mf->relayout = false;
+
+  for (int i = 0; !metric_is_empty(&mf->metrics[i]); ++i)
+    mf->metrics[i].dirty = false;
+
+  // An identical frame marks nothing
+  BOOST_REQUIRE(write(p[1], frame.data(), frame.size()) == (ssize_t) frame.size());
+  BOOST_TEST(mf->polldata_cb(100) == 0);
+  BOOST_TEST(!mf->relayout);
+
+  for (int i = 0; !metric_is_empty(&mf->metrics[i]); ++i)
+    BOOST_TEST(!mf->metrics[i].dirty);
+
+  // Only the changed value is marked
+  BOOST_REQUIRE(write(p[1], changed.data(), changed.size()) == (ssize_t) changed.size());
+  BOOST_TEST(mf->polldata_cb(100) == 0);
+  BOOST_TEST(!mf->relayout);
+
+  for (int i = 0; !metric_is_empty(&mf->metrics[i]); ++i)
+    BOOST_TEST(mf->metrics[i].dirty == (i == 1));
+
+  BOOST_TEST(mf->metrics[1].value == 23.5);
+
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  close(p[0]);
+  close(p[1]);
+}
+
+BOOST_AUTO_TEST_CASE(coalesce_test)
+{
+  int p[2];
+  struct metric_form *mf = NULL;
+  struct datastats before;
+  struct datastats after;
+  std::string frame = std::string(infile) + "\n";
+  std::string burst;
+
+  // Five frames in one burst, the newest one last
+  for (int i = 0; i < 5; ++i) {
+    std::string f = frame;
+
+    f.replace(f.find("23.18"), 5, "20.0" + std::to_string(i));
+    burst += f;
+  }
+
+  BOOST_REQUIRE(pipe(p) == 0);
+  BOOST_REQUIRE(write(p[1], frame.data(), frame.size()) == (ssize_t) frame.size());
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFG(p[0]));
+  BOOST_REQUIRE(mf);
+
+  setCoalesce(true);
+  getDataStats(&before);
+
+  BOOST_REQUIRE(write(p[1], burst.data(), burst.size()) == (ssize_t) burst.size());
+  BOOST_TEST(mf->polldata_cb(100) == 0);
+  BOOST_TEST(mf->metrics[1].value == 20.04);
+
+  // Nothing else is left buffered
+  BOOST_TEST(mf->polldata_cb(10) == 1);
+
+  getDataStats(&after);
+  BOOST_TEST(after.frames - before.frames == 1u);
+  BOOST_TEST(after.skipped - before.skipped == 4u);
+
+  // A backlog of several buffers is taken in a buffer at a time
+  double last = 0;
+  int polls = 0;
+
+  burst.clear();
+
+  for (int i = 0; burst.size() < 3 * FRAMEBUF_DEFAULT_LEN; ++i) {
+    std::string f = frame;
+
+    last = 1000 + i;
+    f.replace(f.find("23.18"), 5, std::to_string(1000 + i));
+    burst += f;
+  }
+
+  BOOST_REQUIRE(write(p[1], burst.data(), burst.size()) == (ssize_t) burst.size());
+
+  while (mf->polldata_cb(100) == 0)
+    ++polls;
+
+  BOOST_TEST(polls >= 3);
+  BOOST_TEST(mf->metrics[1].value == last);
+
+  setCoalesce(false);
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  close(p[0]);
+  close(p[1]);
+}
+
+BOOST_AUTO_TEST_CASE(snapring_test)
+{
+  struct snapring r;
+  struct snapshot *s;
+  unsigned long skipped = 0;
+
+  snapring_init(&r);
+  BOOST_TEST(snapring_newest(&r, &skipped) == (struct snapshot*) NULL);
+
+  // The producer can run SNAPRING_LEN slots ahead, then must wait
+  for (int i = 0; i < SNAPRING_LEN; ++i) {
+    BOOST_REQUIRE((s = snapring_claim(&r)));
+    BOOST_REQUIRE(snapshot_reserve(s, i + 1) == 0);
+    s->nfields = i + 1;
+    snapring_publish(&r);
+  }
+
+  BOOST_TEST(snapring_claim(&r) == (struct snapshot*) NULL);
+
+  // Only the newest is handed out, the rest go back unread
+  BOOST_REQUIRE((s = snapring_newest(&r, &skipped)));
+  BOOST_TEST(s->nfields == SNAPRING_LEN);
+  BOOST_TEST(skipped == (unsigned long) SNAPRING_LEN - 1);
+  BOOST_TEST(snapring_claim(&r) != (struct snapshot*) NULL);
+  snapring_release(&r);
+  BOOST_TEST(snapring_newest(&r, &skipped) == (struct snapshot*) NULL);
+
+  // Slot storage is kept for reuse
+  BOOST_REQUIRE((s = snapring_claim(&r)));
+  BOOST_TEST(s->cap >= 1);
+
+  snapring_free(&r);
+}
+
+BOOST_AUTO_TEST_CASE(threaded_ingest_test)
+{
+  int p[2];
+  struct metric_form *mf = NULL;
+  std::string frame = std::string(infile) + "\n";
+  int ret = 1;
+
+  BOOST_REQUIRE(pipe(p) == 0);
+  BOOST_REQUIRE(write(p[1], frame.data(), frame.size()) == (ssize_t) frame.size());
+
+  setThreaded(true);
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFG(p[0]));
+  BOOST_REQUIRE(mf);
+  BOOST_TEST(mf->metrics[1].value == 23.18);
+
+  frame.replace(frame.find("23.18"), 5, "21.50");
+  BOOST_REQUIRE(write(p[1], frame.data(), frame.size()) == (ssize_t) frame.size());
+
+  // The display only ever sees whole snapshots from the ingest thread
+  for (int i = 0; i < 10 && ret == 1; ++i)
+    ret = mf->polldata_cb(100);
+
+  BOOST_TEST(ret == 0);
+  BOOST_TEST(mf->metrics[1].value == 21.5);
+  BOOST_TEST(std::string(mf->metrics[4].name) == "rh");
+
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  setThreaded(false);
+  close(p[0]);
+  close(p[1]);
+}
+
+BOOST_AUTO_TEST_CASE(threaded_sources_test)
+{
+  int a[2];
+  int b[2];
+  struct sketchset set;
+  struct metric_form *mf = NULL;
+  std::string fa = "{\"data\": [{\"name\": \"temp\", \"value\": 20}]}\n";
+  std::string fb = "{\"data\": [{\"name\": \"temp\", \"value\": 30}]}\n";
+  const char *labels[] = { "a", "b" };
+  double q[] = { 0.5 };
+  double out[1];
+  auto poll = [&mf]() {
+    int ret = 1;
+
+    for (int i = 0; i < 20 && ret == 1; ++i)
+      ret = mf->polldata_cb(100);
+
+    return ret;
+  };
+
+  BOOST_REQUIRE(pipe(a) == 0);
+  BOOST_REQUIRE(pipe(b) == 0);
+
+  int fds[] = { a[0], b[0] };
+
+  BOOST_REQUIRE(sketchset_init(&set, 0, 0) == 0);
+  setSketches(&set, NULL);
+  setThreaded(true);
+  BOOST_REQUIRE(write(a[1], fa.data(), fa.size()) == (ssize_t) fa.size());
+  BOOST_REQUIRE(write(b[1], fb.data(), fb.size()) == (ssize_t) fb.size());
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFGSources(fds, labels, 2));
+  BOOST_REQUIRE(mf);
+
+  // Whichever source the first load missed comes in a snapshot
+  if (metric_is_empty(&mf->metrics[1]))
+    BOOST_TEST(poll() == 0);
+
+  BOOST_REQUIRE(std::string(mf->metrics[1].name) == "b:temp");
+
+  // Frames from one source leave the other's samples alone
+  for (int i = 0; i < 4; ++i) {
+    BOOST_REQUIRE(write(a[1], fa.data(), fa.size()) == (ssize_t) fa.size());
+    BOOST_TEST(poll() == 0);
+  }
+
+  BOOST_TEST(mf->quantiles_cb(0, q, 1, out) == 5u);
+  BOOST_TEST(mf->quantiles_cb(1, q, 1, out) == 1u);
+  BOOST_TEST(out[0] == 30);
+
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  setThreaded(false);
+  setSketches(NULL, NULL);
+  sketchset_free(&set);
+
+  for (int fd : { a[0], a[1], b[0], b[1] })
+    close(fd);
+}
+
+BOOST_AUTO_TEST_CASE(source_label_test)
+{
+  struct source src[4];
+
+  BOOST_REQUIRE(source_parse(&src[0], SOURCE_TCP, "10.0.0.5") == 0);
+  BOOST_REQUIRE(source_parse(&src[1], SOURCE_TCP, "lab=10.0.0.6") == 0);
+  BOOST_REQUIRE(source_parse(&src[2], SOURCE_TTY, "/dev/ttyUSB0") == 0);
+  BOOST_REQUIRE(source_parse(&src[3], SOURCE_FILE, "/tmp/ttyUSB0") == 0);
+  BOOST_TEST(source_parse(&src[3], SOURCE_FILE, "=/tmp/x") == -1);
+  BOOST_REQUIRE(source_parse(&src[3], SOURCE_FILE, "/tmp/ttyUSB0") == 0);
+
+  BOOST_TEST(std::string(src[0].label) == "10.0.0.5");
+  BOOST_TEST(std::string(src[1].label) == "lab");
+  BOOST_TEST(std::string(src[1].path) == "10.0.0.6");
+  BOOST_TEST(std::string(src[2].label) == "ttyUSB0");
+  BOOST_TEST(src[2].fd == -1);
+
+  // Repeated labels are numbered
+  source_unique_labels(src, 4);
+  BOOST_TEST(std::string(src[2].label) == "ttyUSB0");
+  BOOST_TEST(std::string(src[3].label) == "ttyUSB0#4");
+}
+
+BOOST_AUTO_TEST_CASE(multi_source_test)
+{
+  int a[2];
+  int b[2];
+  int silent[2];
+  struct metric_form *mf = NULL;
+  std::string fa = "{\"data\": [{\"name\": \"temp\", \"value\": 20.5}]}\n";
+  std::string fb = "{\"data\": [{\"name\": \"temp\", \"value\": 30.25}, "
+    "{\"name\": \"rh\", \"value\": 40}]}\n";
+  const char *labels[] = { "a", "b", "quiet" };
+
+  BOOST_REQUIRE(pipe(a) == 0);
+  BOOST_REQUIRE(pipe(b) == 0);
+  BOOST_REQUIRE(pipe(silent) == 0);
+
+  int fds[] = { a[0], b[0], silent[0] };
+
+  BOOST_REQUIRE(ncursesSetPrecision("temp", 1) == 0);
+
+  // The first frame from any source is enough to start
+  BOOST_REQUIRE(write(b[1], fb.data(), fb.size()) == (ssize_t) fb.size());
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFGSources(fds, labels, 3));
+  BOOST_REQUIRE(mf);
+  BOOST_TEST(std::string(mf->metrics[0].name) == "b:temp");
+  BOOST_TEST(mf->metrics[0].precision == 1);
+  BOOST_TEST(std::string(mf->metrics[1].name) == "b:rh");
+  BOOST_TEST(metric_is_empty(&mf->metrics[2]));
+
+  // A source showing up late is put in its place
+  BOOST_REQUIRE(write(a[1], fa.data(), fa.size()) == (ssize_t) fa.size());
+  BOOST_TEST(mf->polldata_cb(100) == 0);
+  BOOST_TEST(std::string(mf->metrics[0].name) == "a:temp");
+  BOOST_TEST(mf->metrics[0].value == 20.5);
+  BOOST_TEST(std::string(mf->metrics[1].name) == "b:temp");
+  BOOST_TEST(mf->metrics[1].value == 30.25);
+  BOOST_TEST(metric_is_empty(&mf->metrics[3]));
+
+  // Same shape only touches that source's metrics
+  mf->relayout = false;
+  fb.replace(fb.find("30.25"), 5, "31.75");
+  BOOST_REQUIRE(write(b[1], fb.data(), fb.size()) == (ssize_t) fb.size());
+  BOOST_TEST(mf->polldata_cb(100) == 0);
+  BOOST_TEST(mf->metrics[1].value == 31.75);
+  BOOST_TEST(!mf->relayout);
+
+  // Nothing pending anywhere
+  BOOST_TEST(mf->polldata_cb(10) == 1);
+
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  BOOST_REQUIRE(ncursesSetPrecision("temp", 2) == 0);
+
+  for (int fd : { a[0], a[1], b[0], b[1], silent[0], silent[1] })
+    close(fd);
+}
+
+BOOST_AUTO_TEST_CASE(datagram_test)
+{
+  int sv[2];
+  struct metric_form *mf = NULL;
+  struct datastats before;
+  struct datastats after;
+  std::string frame = "{\"data\": [{\"name\": \"temp\", \"value\": 20.5}]}";
+  std::string big(FRAMEBUF_DEFAULT_LEN + 16, ' ');
+
+  BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == 0);
+
+  // Each datagram is a frame, with or without a line ending
+  BOOST_REQUIRE(send(sv[1], frame.data(), frame.size(), 0) == (ssize_t) frame.size());
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFG(sv[0]));
+  BOOST_REQUIRE(mf);
+  BOOST_TEST(mf->metrics[0].value == 20.5);
+
+  getDataStats(&before);
+
+  // Too long and empty datagrams are skipped, not parsed in pieces
+  frame.replace(frame.find("20.5"), 4, "21.5");
+  BOOST_REQUIRE(send(sv[1], big.data(), big.size(), 0) == (ssize_t) big.size());
+  BOOST_REQUIRE(send(sv[1], "\r\n", 2, 0) == 2);
+  BOOST_REQUIRE(send(sv[1], (frame + "\r\n").data(), frame.size() + 2, 0) == (ssize_t) frame.size() + 2);
+  BOOST_TEST(mf->polldata_cb(100) == 0);
+  BOOST_TEST(mf->metrics[0].value == 21.5);
+  BOOST_TEST(mf->polldata_cb(10) == 1);
+
+  getDataStats(&after);
+  BOOST_TEST(after.frames - before.frames == 1u);
+  BOOST_TEST(after.datagrams - before.datagrams == 3u);
+  BOOST_TEST(after.truncated - before.truncated == 1u);
+
+  // Coalescing keeps only the newest of a burst
+  setCoalesce(true);
+
+  for (int i = 0; i < 3; ++i) {
+    std::string f = frame;
+
+    f.replace(f.find("21.5"), 4, "22.0" + std::to_string(i));
+    BOOST_REQUIRE(send(sv[1], f.data(), f.size(), 0) == (ssize_t) f.size());
+  }
+
+  BOOST_TEST(mf->polldata_cb(100) == 0);
+  BOOST_TEST(mf->metrics[0].value == 22.02);
+  BOOST_TEST(mf->polldata_cb(10) == 1);
+
+  // A valid frame ending a batch is kept when only an empty datagram
+  // follows it
+  for (int i = 0; i < DGRAM_BATCH; ++i) {
+    std::string f = frame;
+
+    f.replace(f.find("21.5"), 4, std::to_string(30 + i));
+    BOOST_REQUIRE(send(sv[1], f.data(), f.size(), 0) == (ssize_t) f.size());
+  }
+
+  BOOST_REQUIRE(send(sv[1], "\n", 1, 0) == 1);
+  getDataStats(&before);
+  BOOST_TEST(mf->polldata_cb(100) == 0);
+  BOOST_TEST(mf->metrics[0].value == 30 + DGRAM_BATCH - 1);
+  BOOST_TEST(mf->polldata_cb(10) == 1);
+  BOOST_TEST(mf->metrics[0].value == 30 + DGRAM_BATCH - 1);
+
+  getDataStats(&after);
+  BOOST_TEST(after.frames - before.frames == 1u);
+  BOOST_TEST(after.skipped - before.skipped == (unsigned long) DGRAM_BATCH - 1);
+
+  setCoalesce(false);
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  close(sv[0]);
+  close(sv[1]);
+}
+
+BOOST_AUTO_TEST_CASE(multicast_relay_test)
+{
+  int p[2];
+  struct source rx;
+  struct source other;
+  struct source tx;
+  struct metric_form *mf = NULL;
+  struct datastats before;
+  struct datastats after;
+  std::string frame = "{\"data\": [{\"name\": \"temp\", \"value\": 20.5}]}\n";
+  char buf[256];
+  char addr[INET_ADDRSTRLEN];
+  struct sockaddr_in sa;
+  socklen_t salen = sizeof(sa);
+
+  BOOST_REQUIRE(source_parse(&tx, SOURCE_MCAST, "239.255.77.1%lo") == 0);
+  strcpy(tx.port, "9913");
+  BOOST_REQUIRE(source_open_sender(&tx) >= 0);
+
+  // Loopback only, accepting the local sender, or some other one
+  BOOST_REQUIRE(getsockname(tx.fd, (struct sockaddr*) &sa, &salen) == 0);
+  BOOST_REQUIRE(inet_ntop(AF_INET, &sa.sin_addr, addr, sizeof(addr)));
+  BOOST_REQUIRE(source_parse(&rx, SOURCE_MCAST, ("239.255.77.1@" + std::string(addr) + "%lo").c_str()) == 0);
+  BOOST_REQUIRE(source_parse(&other, SOURCE_MCAST, "239.255.77.1@192.0.2.254%lo") == 0);
+  BOOST_TEST(std::string(rx.label) == "239.255.77.1");
+  BOOST_TEST(std::string(rx.filter) == addr);
+  BOOST_TEST(std::string(rx.iface) == "lo");
+  strcpy(rx.port, "9913");
+  strcpy(other.port, "9913");
+
+  BOOST_REQUIRE(source_open(&rx) >= 0);
+  BOOST_REQUIRE(source_open(&other) >= 0);
+
+  // Every frame read is passed on before it is parsed
+  BOOST_REQUIRE(pipe(p) == 0);
+  BOOST_REQUIRE(write(p[1], frame.data(), frame.size()) == (ssize_t) frame.size());
+  setRelay(tx.fd);
+  getDataStats(&before);
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFG(p[0]));
+  BOOST_REQUIRE(mf);
+  getDataStats(&after);
+  BOOST_TEST(after.relayed - before.relayed == 1u);
+
+  ssize_t n = recv(rx.fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+  BOOST_REQUIRE(n == (ssize_t) frame.size());
+  BOOST_TEST(std::string(buf, n) == frame);
+  BOOST_TEST(recv(other.fd, buf, sizeof(buf), MSG_DONTWAIT) < 0);
+
+  setRelay(-1);
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  source_close(&rx);
+  source_close(&other);
+  source_close(&tx);
+  close(p[0]);
+  close(p[1]);
+}
+
+// Read lines from a socket until one equals last, returning them all
+static std::vector<std::string> readLinesUntil(int fd, const std::string &last)
+{
+  std::vector<std::string> lines;
+  std::string partial;
+  char buf[4096];
+
+  while (lines.empty() || lines.back() != last) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+
+    if (n <= 0)
+      break;
+
+    partial.append(buf, n);
+
+    for (size_t eol; (eol = partial.find('\n')) != std::string::npos; ) {
+      lines.push_back(partial.substr(0, eol));
+      partial.erase(0, eol + 1);
+    }
+  }
+
+  return lines;
+}
+
+BOOST_AUTO_TEST_CASE(relay_test)
+{
+  const char *path = "/tmp/env-display-relay-test.sock";
+  const int nframes = 2000;
+  int p[2];
+  int tcpfd;
+  int ret = -1;
+  int small = 4096;
+  struct sockaddr_in sa;
+  struct sockaddr_un su = {};
+  socklen_t salen = sizeof(sa);
+  struct relaystats st;
+  auto frame = [](int i) {
+    return "{\"data\": [{\"name\": \"temp\", \"value\": " + std::to_string(i) + "}]}";
+  };
+
+  BOOST_REQUIRE(pipe(p) == 0);
+  BOOST_REQUIRE(relay_listen(path) >= 0);
+  BOOST_REQUIRE((tcpfd = relay_listen("127.0.0.1:0")) >= 0);
+  BOOST_REQUIRE(getsockname(tcpfd, (struct sockaddr*) &sa, &salen) == 0);
+
+  std::thread relay([&]() { ret = relay_run(&p[0], 1); });
+
+  // A client that keeps up and one that never reads until the end
+  int fast = socket(AF_UNIX, SOCK_STREAM, 0);
+  int slow = socket(AF_INET, SOCK_STREAM, 0);
+
+  su.sun_family = AF_UNIX;
+  strcpy(su.sun_path, path);
+  BOOST_REQUIRE(setsockopt(slow, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small)) == 0);
+  BOOST_REQUIRE(connect(fast, (struct sockaddr*) &su, sizeof(su)) == 0);
+  BOOST_REQUIRE(connect(slow, (struct sockaddr*) &sa, salen) == 0);
+
+  for (int i = 0; i < 200; ++i) {
+    relay_get_stats(&st);
+
+    if (st.clients == 2)
+      break;
+
+    usleep(10000);
+  }
+
+  BOOST_REQUIRE(st.clients == 2u);
+
+  std::thread writer([&]() {
+    for (int i = 0; i < nframes; ++i) {
+      std::string f = frame(i) + "\n";
+
+      if (write(p[1], f.data(), f.size()) != (ssize_t) f.size())
+        break;
+
+      // Bursts no longer than a client queue
+      if (i % 16 == 15)
+        usleep(1000);
+    }
+  });
+
+  // The slow client never held up the fast one
+  std::vector<std::string> lines = readLinesUntil(fast, frame(nframes - 1));
+
+  writer.join();
+  BOOST_TEST(lines.size() == (size_t) nframes);
+
+  for (int i = 0; i < (int) lines.size(); ++i)
+    BOOST_TEST(lines[i] == frame(i));
+
+  // The slow one lost its oldest frames, but only whole lines
+  lines = readLinesUntil(slow, frame(nframes - 1));
+  BOOST_TEST(lines.size() < (size_t) nframes);
+  BOOST_TEST(lines.back() == frame(nframes - 1));
+
+  for (const std::string &l : lines)
+    BOOST_TEST(l.rfind("{\"data\": [{\"name\": \"temp\", \"value\": ", 0) == 0);
+
+  relay_get_stats(&st);
+  BOOST_TEST(st.frames == (unsigned long) nframes);
+  BOOST_TEST(st.dropped > 0u);
+
+  // Out of input ends the relay and disconnects the clients
+  close(p[1]);
+  relay.join();
+  BOOST_TEST(ret == 0);
+  BOOST_TEST(readLinesUntil(fast, "").empty());
+
+  relay_close();
+  BOOST_TEST(access(path, F_OK) != 0);
+  close(fast);
+  close(slow);
+  close(p[0]);
+}
+
+BOOST_AUTO_TEST_CASE(shmsnap_test)
+{
+  std::string name = "/env-display-test-" + std::to_string(getpid());
+  struct shmsnap *w = shmsnap_create(name.c_str(), 4);
+  struct shmsnap *r;
+  struct shmsnap_metric got[4];
+  uint32_t seq;
+  uint32_t seq2;
+  int p[2];
+  struct metric_form *mf = NULL;
+  std::string frame = "{\"data\": [{\"name\": \"temp\", \"value\": 20.5, \"unit\": \"C\"}, "
+    "{\"name\": \"rh\", \"value\": 40}]}\n";
+
+  BOOST_REQUIRE(w);
+  BOOST_REQUIRE((r = shmsnap_open(name.c_str())));
+  BOOST_TEST(shmsnap_capacity(r) == 4u);
+  BOOST_TEST(shmsnap_read(r, got, 4, &seq) == 0);
+
+  // Every metrics update is published
+  BOOST_REQUIRE(pipe(p) == 0);
+  BOOST_REQUIRE(write(p[1], frame.data(), frame.size()) == (ssize_t) frame.size());
+  setPublisher(w);
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFG(p[0]));
+  BOOST_REQUIRE(mf);
+  BOOST_TEST(shmsnap_read(r, got, 4, &seq2) == 2);
+  BOOST_TEST(seq2 != seq);
+  BOOST_TEST(std::string(got[0].name) == "temp");
+  BOOST_TEST(std::string(got[0].unit) == "C");
+  BOOST_TEST(got[0].value == 20.5);
+  BOOST_TEST(got[1].value == 40);
+
+  setPublisher(NULL);
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  close(p[0]);
+  close(p[1]);
+
+  // A reader never sees half of a snapshot
+  bool stop = false;
+  std::thread writer([&]() {
+    for (int i = 0; !__atomic_load_n(&stop, __ATOMIC_RELAXED); ++i) {
+      struct shmsnap_metric *m = shmsnap_begin(w);
+
+      for (int j = 0; j < 4; ++j)
+        m[j].value = i;
+
+      shmsnap_end(w, 4);
+    }
+  });
+
+  bool torn = false;
+
+  for (int k = 0; k < 100000 && !torn; ++k) {
+    if (shmsnap_read(r, got, 4, NULL) != 4)
+      continue;
+
+    for (int j = 1; j < 4; ++j)
+      torn = torn || got[j].value != got[0].value;
+  }
+
+  __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+  writer.join();
+  BOOST_TEST(!torn);
+
+  // Only the creator removes the segment
+  shmsnap_close(r);
+  shmsnap_close(w);
+  BOOST_TEST(!shmsnap_open(name.c_str()));
+}
+
+BOOST_AUTO_TEST_CASE(history_test)
+{
+  struct history h;
+  std::string path = "/tmp/env-display-history-" + std::to_string(getpid());
+  size_t budget = sizeof(struct history_header) +
+    2 * (sizeof(struct history_series) + sizeof(struct history_window)) +
+    2 * 5 * 32;
+  double last[8];
+  double min;
+  double max;
+
+  BOOST_TEST(history_init(&h, 16, 2, NULL) == -1);
+  BOOST_REQUIRE(history_init(&h, budget, 2, NULL) == 0);
+  BOOST_TEST(h.len == 5u);
+
+  // Series are claimed by name until none are left
+  BOOST_TEST(history_find(&h, "temp") == 0);
+  BOOST_TEST(history_find(&h, "rh") == 1);
+  BOOST_TEST(history_find(&h, "temp") == 0);
+  BOOST_TEST(history_find(&h, "co2") == -1);
+  BOOST_TEST(!history_range(&h, 0, &min, &max));
+
+  // The range follows the window as old samples fall out of it
+  srand(7);
+  std::vector<double> all;
+
+  for (int i = 0; i < 200; ++i) {
+    double v = rand() % 50 - 25;
+
+    all.push_back(v);
+    history_append(&h, 0, i, v);
+
+    double lo = v;
+    double hi = v;
+
+    for (size_t k = all.size() > 5 ? all.size() - 5 : 0; k < all.size(); ++k) {
+      lo = all[k] < lo ? all[k] : lo;
+      hi = all[k] > hi ? all[k] : hi;
+    }
+
+    BOOST_REQUIRE(history_range(&h, 0, &min, &max));
+    BOOST_TEST(min == lo);
+    BOOST_TEST(max == hi);
+  }
+
+  BOOST_TEST(history_count(&h, 0) == 5u);
+  BOOST_TEST(history_last(&h, 0, last, 8) == 5u);
+  BOOST_TEST(last[0] == all[195]);
+  BOOST_TEST(last[4] == all[199]);
+  BOOST_TEST(h.times[199 % 5] == 199);
+
+  // NaN is not a sample
+  history_append(&h, 1, 0, 0.0 / 0.0);
+  BOOST_TEST(history_count(&h, 1) == 0u);
+  history_free(&h);
+
+  // A file keeps the samples and the range across a restart
+  unlink(path.c_str());
+  BOOST_REQUIRE(history_init(&h, budget, 2, path.c_str()) == 0);
+  BOOST_TEST(history_find(&h, "temp") == 0);
+
+  for (int i = 0; i < 7; ++i)
+    history_append(&h, 0, i, i);
+
+  history_free(&h);
+  BOOST_REQUIRE(history_init(&h, budget, 2, path.c_str()) == 0);
+  BOOST_TEST(history_find(&h, "rh") == 1);
+  BOOST_TEST(history_find(&h, "temp") == 0);
+  BOOST_TEST(history_count(&h, 0) == 5u);
+  BOOST_REQUIRE(history_range(&h, 0, &min, &max));
+  BOOST_TEST(min == 2);
+  BOOST_TEST(max == 6);
+  history_free(&h);
+
+  // A different shape starts over
+  BOOST_REQUIRE(history_init(&h, budget, 1, path.c_str()) == 0);
+  BOOST_TEST(history_find(&h, "rh") == 0);
+  BOOST_TEST(history_count(&h, 0) == 0u);
+  history_free(&h);
+  unlink(path.c_str());
+
+  // Loaded metrics carry their trend and range
+  int p[2];
+  struct metric_form *mf = NULL;
+  std::string a = "{\"data\": [{\"name\": \"temp\", \"value\": 20, \"unit\": \"C\"}]}\n";
+  std::string b = "{\"data\": [{\"name\": \"temp\", \"value\": 23, \"unit\": \"C\"}]}\n";
+
+  BOOST_REQUIRE(history_init(&h, 0, 0, NULL) == 0);
+  setHistory(&h);
+  BOOST_REQUIRE(pipe(p) == 0);
+  BOOST_REQUIRE(write(p[1], a.data(), a.size()) == (ssize_t) a.size());
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFG(p[0]));
+  BOOST_REQUIRE(mf);
+  BOOST_TEST(mf->metrics[0].ntrend == 1);
+  mf->metrics[0].dirty = false;
+
+  // Repeating a value still moves the trend along
+  BOOST_REQUIRE(write(p[1], b.data(), b.size()) == (ssize_t) b.size());
+  BOOST_TEST(mf->polldata_cb(100) == 0);
+  BOOST_REQUIRE(write(p[1], b.data(), b.size()) == (ssize_t) b.size());
+  BOOST_TEST(mf->polldata_cb(100) == 0);
+  BOOST_TEST(mf->metrics[0].dirty);
+  BOOST_TEST(mf->metrics[0].ntrend == 3);
+  BOOST_TEST(mf->metrics[0].trend[0] == 20);
+  BOOST_TEST(mf->metrics[0].trend[2] == 23);
+  BOOST_TEST(mf->metrics[0].min == 20);
+  BOOST_TEST(mf->metrics[0].max == 23);
+
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  setHistory(NULL);
+  history_free(&h);
+  close(p[0]);
+  close(p[1]);
+}
+
+BOOST_AUTO_TEST_CASE(rollstats_test)
+{
+  struct rollstats st;
+  const unsigned w = 7;
+  std::vector<double> all[5];
+
+  BOOST_TEST(rollstats_init(&st, w, 1.5) == -1);
+  BOOST_REQUIRE(rollstats_init(&st, w, 0.5) == 0);
+  BOOST_REQUIRE(rollstats_resize(&st, 3) == 0);
+  BOOST_TEST(st.cap % ROLLSTATS_LANES == 0u);
+  BOOST_TEST(rollstats_count(&st, 0) == 0u);
+  BOOST_TEST(std::isnan(rollstats_mean(&st, 0)));
+
+  // Every statistic matches the window recomputed from scratch, for
+  // metrics added on the way and a metric replaced by another
+  srand(11);
+  double ewma = 0;
+
+  for (int t = 0; t < 100; ++t) {
+    if (t == 30) {
+      BOOST_REQUIRE(rollstats_resize(&st, 5) == 0);
+    }
+
+    if (t == 60) {
+      rollstats_reset(&st, 1);
+      all[1].clear();
+    }
+
+    for (unsigned i = 0; i < st.n; ++i) {
+      double v = rand() % 1000 / 10.0 - 50;
+
+      st.input[i] = v;
+      all[i].push_back(v);
+    }
+
+    // A missing sample repeats the last one
+    if (t % 9 == 4) {
+      st.input[2] = NAN;
+      all[2].back() = all[2][all[2].size() - 2];
+    }
+
+    rollstats_update(&st);
+    ewma = t == 0 ? all[0][0] : ewma + (all[0].back() - ewma) * 0.5;
+
+    for (unsigned i = 0; i < st.n; ++i) {
+      size_t n = all[i].size() < w ? all[i].size() : w;
+      double lo = INFINITY, hi = -INFINITY, sum = 0, sq = 0;
+
+      for (size_t k = all[i].size() - n; k < all[i].size(); ++k) {
+        lo = std::fmin(lo, all[i][k]);
+        hi = std::fmax(hi, all[i][k]);
+        sum += all[i][k];
+      }
+
+      for (size_t k = all[i].size() - n; k < all[i].size(); ++k)
+        sq += (all[i][k] - sum / n) * (all[i][k] - sum / n);
+
+      BOOST_REQUIRE(rollstats_count(&st, i) == n);
+      BOOST_TEST(rollstats_min(&st, i) == lo);
+      BOOST_TEST(rollstats_max(&st, i) == hi);
+      BOOST_TEST(std::fabs(rollstats_mean(&st, i) - sum / n) < 1e-9);
+      BOOST_TEST(std::fabs(rollstats_stddev(&st, i) -
+                           (n > 1 ? std::sqrt(sq / (n - 1)) : 0)) < 1e-9);
+    }
+
+    BOOST_TEST(std::fabs(rollstats_ewma(&st, 0) - ewma) < 1e-9);
+  }
+
+  rollstats_free(&st);
+
+  // The form gets the statistics of the loaded metrics
+  int p[2];
+  struct metric_form *mf = NULL;
+  std::string a = "{\"data\": [{\"name\": \"temp\", \"value\": 20, \"unit\": \"C\"}]}\n";
+  std::string b = "{\"data\": [{\"name\": \"temp\", \"value\": 24, \"unit\": \"C\"}]}\n";
+
+  BOOST_REQUIRE(rollstats_init(&st, 0, 0) == 0);
+  setStatistics(&st);
+  BOOST_REQUIRE(pipe(p) == 0);
+  BOOST_REQUIRE(write(p[1], a.data(), a.size()) == (ssize_t) a.size());
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFG(p[0]));
+  BOOST_REQUIRE(mf);
+  BOOST_TEST(mf->stats == &st);
+  BOOST_REQUIRE(write(p[1], b.data(), b.size()) == (ssize_t) b.size());
+  BOOST_TEST(mf->polldata_cb(100) == 0);
+  BOOST_TEST(rollstats_count(&st, 0) == 2u);
+  BOOST_TEST(rollstats_mean(&st, 0) == 22);
+  BOOST_TEST(rollstats_min(&st, 0) == 20);
+  BOOST_TEST(rollstats_max(&st, 0) == 24);
+
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  setStatistics(NULL);
+  rollstats_free(&st);
+  close(p[0]);
+  close(p[1]);
+}
+
+BOOST_AUTO_TEST_CASE(sketch_test)
+{
+  struct sketchset a;
+  struct sketchset b;
+  struct sketchset c;
+  std::string path = "/tmp/env-display-sketch-" + std::to_string(getpid());
+  const double q[] = { 0.0, 0.5, 0.95, 0.99, 1.0 };
+  double out[5];
+  std::vector<double> all;
+
+  BOOST_TEST(sketchset_init(&a, 1.5, 0) == -1);
+  BOOST_REQUIRE(sketchset_init(&a, 0, 2) == 0);
+  BOOST_REQUIRE(sketchset_init(&b, 0, 2) == 0);
+
+  // Sketches are claimed by name until none are left
+  BOOST_TEST(sketchset_find(&a, "pm2_5") == 0);
+  BOOST_TEST(sketchset_find(&a, "gas") == 1);
+  BOOST_TEST(sketchset_find(&a, "pm2_5") == 0);
+  BOOST_TEST(sketchset_find(&a, "co2") == -1);
+  BOOST_TEST(sketchset_find(&b, "pm2_5") == 0);
+  sketchset_quantiles(&a, 0, q, 1, out);
+  BOOST_TEST(std::isnan(out[0]));
+
+  // Values spread over several orders of magnitude and both signs,
+  // split over two sketches that are merged
+  srand(5);
+
+  for (int i = 0; i < 20000; ++i) {
+    double v = std::exp(rand() % 1000 / 100.0) - 2;
+
+    all.push_back(v);
+    sketchset_add(i % 2 ? &a : &b, 0, v);
+  }
+
+  sketchset_add(&a, 0, NAN);
+  BOOST_TEST(sketchset_merge(&a, &b) == 0);
+  BOOST_TEST(sketchset_count(&a, 0) == 20000u);
+  std::sort(all.begin(), all.end());
+
+  // Within the accuracy of the value of the same rank, and exact at
+  // the ends
+  sketchset_quantiles(&a, 0, q, 5, out);
+  BOOST_TEST(out[0] == all.front());
+  BOOST_TEST(out[4] == all.back());
+
+  for (int j = 1; j < 4; ++j) {
+    double exact = all[(size_t) (q[j] * (all.size() - 1))];
+
+    BOOST_TEST(std::fabs(out[j] - exact) <=
+               SKETCH_DEFAULT_ACCURACY * std::fabs(exact));
+  }
+
+  // A saved sketch merges back in unchanged, leaving out empty ones
+  unlink(path.c_str());
+  BOOST_REQUIRE(sketchset_save(&a, path.c_str()) == 0);
+  BOOST_REQUIRE(sketchset_init(&c, 0, 0) == 0);
+  BOOST_REQUIRE(sketchset_load(&c, path.c_str()) == 0);
+  BOOST_TEST(c.n == 1u);
+  BOOST_TEST(sketchset_count(&c, 0) == 20000u);
+
+  double back[5];
+
+  sketchset_quantiles(&c, 0, q, 5, back);
+
+  for (int j = 0; j < 5; ++j) {
+    BOOST_TEST(back[j] == out[j]);
+  }
+
+  // Loading again counts the values twice
+  BOOST_REQUIRE(sketchset_load(&c, path.c_str()) == 0);
+  BOOST_TEST(sketchset_count(&c, 0) == 40000u);
+  sketchset_free(&c);
+
+  // Sketches of another accuracy do not mix
+  BOOST_REQUIRE(sketchset_init(&c, 0.05, 0) == 0);
+  BOOST_TEST(sketchset_load(&c, path.c_str()) == -1);
+  BOOST_TEST(errno == EINVAL);
+  BOOST_TEST(sketchset_merge(&c, &a) == -1);
+  sketchset_free(&c);
+
+  // Keys beyond the buckets fold into the smallest ones, keeping
+  // the upper quantiles
+  BOOST_REQUIRE(sketchset_init(&c, 0, 1) == 0);
+  BOOST_REQUIRE(sketchset_find(&c, "wide") == 0);
+
+  for (int e = -8; e <= 12; ++e) {
+    sketchset_add(&c, 0, std::pow(10.0, e));
+  }
+
+  double p99 = 0.99;
+
+  sketchset_quantiles(&c, 0, &p99, 1, out);
+  BOOST_TEST(std::fabs(out[0] - 1e11) <= SKETCH_DEFAULT_ACCURACY * 1e11);
+  BOOST_TEST(c.sketches[0].pos.hi - c.sketches[0].pos.lo < SKETCH_BINS);
+  sketchset_free(&c);
+
+  sketchset_free(&a);
+  sketchset_free(&b);
+  unlink(path.c_str());
+
+  // The form gets the quantiles of the loaded metrics
+  int p[2];
+  struct metric_form *mf = NULL;
+  std::string f1 = "{\"data\": [{\"name\": \"pm\", \"value\": 10, \"unit\": \"ug\"}]}\n";
+  std::string f2 = "{\"data\": [{\"name\": \"pm\", \"value\": 30, \"unit\": \"ug\"}]}\n";
+
+  BOOST_REQUIRE(sketchset_init(&a, 0, 0) == 0);
+  setSketches(&a, NULL);
+  BOOST_REQUIRE(pipe(p) == 0);
+  BOOST_REQUIRE(write(p[1], f1.data(), f1.size()) == (ssize_t) f1.size());
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFG(p[0]));
+  BOOST_REQUIRE(mf);
+  BOOST_TEST(mf->quantiles_cb == ncursesQuantiles);
+  BOOST_REQUIRE(write(p[1], f2.data(), f2.size()) == (ssize_t) f2.size());
+  BOOST_TEST(mf->polldata_cb(100) == 0);
+  BOOST_TEST(mf->quantiles_cb(0, q, 5, out) == 2u);
+  BOOST_TEST(out[0] == 10);
+  BOOST_TEST(out[4] == 30);
+  BOOST_TEST(mf->quantiles_cb(1, q, 1, out) == 0u);
+
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  setSketches(NULL, NULL);
+  sketchset_free(&a);
+  close(p[0]);
+  close(p[1]);
+}
+
+BOOST_AUTO_TEST_CASE(rollup_test)
+{
+  struct rollup r;
+  struct rollup_bucket b[4];
+  std::vector<std::pair<int64_t, double>> all;
+
+  BOOST_REQUIRE(rollup_init(&r, 2) == 0);
+  BOOST_TEST(rollup_find(&r, "temp") == 0);
+  BOOST_TEST(rollup_find(&r, "rh") == 1);
+  BOOST_TEST(rollup_find(&r, "temp") == 0);
+  BOOST_TEST(rollup_find(&r, "co2") == -1);
+  BOOST_TEST(rollup_last(&r, 0, ROLLUP_HOURS, b, 4) == 0u);
+
+  // A value every 700 ms for three hours. The newest bucket of every
+  // tier matches the values of its period, whether or not the finer
+  // tiers have folded them in yet.
+  const int64_t t0 = 1700000000000LL;
+  const int64_t widths[ROLLUP_TIERS] = { 1000, 60000, 3600000 };
+
+  srand(9);
+
+  for (int64_t t = t0; t < t0 + 3 * 3600000LL; t += 700) {
+    double v = rand() % 1000 / 10.0;
+
+    all.emplace_back(t, v);
+    rollup_add(&r, 0, t, v);
+
+    if (rand() % 500 != 0)
+      continue;
+
+    for (int tier = 0; tier < ROLLUP_TIERS; ++tier) {
+      int64_t start = t / widths[tier] * widths[tier];
+      unsigned n = rollup_last(&r, 0, tier, b, 4);
+      uint64_t count = 0;
+      double sum = 0, lo = INFINITY, hi = -INFINITY;
+
+      for (auto &s : all) {
+        if (s.first < start)
+          continue;
+
+        ++count;
+        sum += s.second;
+        lo = std::fmin(lo, s.second);
+        hi = std::fmax(hi, s.second);
+      }
+
+      BOOST_REQUIRE(n > 0u);
+      BOOST_TEST(b[n - 1].start == start);
+      BOOST_TEST(b[n - 1].count == count);
+      BOOST_TEST(std::fabs(b[n - 1].sum - sum) < 1e-6);
+      BOOST_TEST(b[n - 1].min == lo);
+      BOOST_TEST(b[n - 1].max == hi);
+
+      if (n > 1)
+        BOOST_TEST(b[n - 2].start == start - widths[tier]);
+    }
+  }
+
+  // Closed hours hold every value of the hour
+  BOOST_TEST(rollup_last(&r, 0, ROLLUP_HOURS, b, 4) == 4u);
+  BOOST_TEST(b[1].count == 3600000u / 700 + 1);
+  BOOST_TEST(b[0].count + b[1].count + b[2].count + b[3].count ==
+             all.size());
+
+  // Rings keep their newest buckets once full, and skip periods
+  // without values
+  for (int i = 0; i < ROLLUP_SECOND_BUCKETS + 10; ++i) {
+    rollup_add(&r, 1, t0 + i * 2000LL, i);
+  }
+
+  BOOST_TEST(r.series[1].count[ROLLUP_SECONDS] ==
+             (uint32_t) ROLLUP_SECOND_BUCKETS);
+  BOOST_TEST(rollup_last(&r, 1, ROLLUP_SECONDS, b, 2) == 2u);
+  BOOST_TEST(b[0].start == t0 + (ROLLUP_SECOND_BUCKETS + 8) * 2000LL);
+  BOOST_TEST(b[1].sum == ROLLUP_SECOND_BUCKETS + 9);
+
+  // Late values and NaN
+  rollup_add(&r, 1, t0, 1000);
+  rollup_add(&r, 1, t0 + 10000000, NAN);
+  BOOST_TEST(rollup_last(&r, 1, ROLLUP_SECONDS, b, 1) == 1u);
+  BOOST_TEST(b[0].count == 2u);
+  BOOST_TEST(b[0].max == 1000);
+
+  rollup_free(&r);
+
+  // The form gets the rollups of the loaded metrics at device time
+  int p[2];
+  struct metric_form *mf = NULL;
+  std::string f1 = "{\"data\": [{\"name\": \"co2\", \"value\": 400, \"timemillis\": 61000, \"unit\": \"ppm\"}]}\n";
+  std::string f2 = "{\"data\": [{\"name\": \"co2\", \"value\": 500, \"timemillis\": 62500, \"unit\": \"ppm\"}]}\n";
+
+  BOOST_REQUIRE(rollup_init(&r, 0) == 0);
+  setRollup(&r);
+  BOOST_REQUIRE(pipe(p) == 0);
+  BOOST_REQUIRE(write(p[1], f1.data(), f1.size()) == (ssize_t) f1.size());
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFG(p[0]));
+  BOOST_REQUIRE(mf);
+  BOOST_TEST(mf->rollup_cb == ncursesRollup);
+  BOOST_REQUIRE(write(p[1], f2.data(), f2.size()) == (ssize_t) f2.size());
+  BOOST_TEST(mf->polldata_cb(100) == 0);
+  BOOST_TEST(mf->rollup_cb(0, ROLLUP_SECONDS, b, 4) == 2u);
+  BOOST_TEST(b[0].start == 61000);
+  BOOST_TEST(b[1].start == 62000);
+  BOOST_TEST(mf->rollup_cb(0, ROLLUP_MINUTES, b, 4) == 1u);
+  BOOST_TEST(b[0].start == 60000);
+  BOOST_TEST(b[0].sum / b[0].count == 450);
+  BOOST_TEST(mf->rollup_cb(1, ROLLUP_MINUTES, b, 4) == 0u);
+
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  setRollup(NULL);
+  rollup_free(&r);
+  close(p[0]);
+  close(p[1]);
+}
+
+BOOST_AUTO_TEST_CASE(capture_test)
+{
+  struct capture c;
+  struct capture_reader r;
+  struct capture_record rec;
+  const char *frame;
+  std::string path = "/tmp/env-display-capture-" + std::to_string(getpid());
+  std::string idx = path + ".idx";
+  std::vector<int64_t> times;
+  int fd;
+
+  unlink(path.c_str());
+  unlink(idx.c_str());
+
+  // An index entry every fourth frame, each frame a little later
+  BOOST_REQUIRE(capture_open(&c, path.c_str(), 4) == 0);
+
+  for (int i = 0; i < 10; ++i) {
+    std::string f = "{\"n\":" + std::to_string(i) + "}";
+
+    BOOST_TEST(capture_write(&c, i % 3, f.data(), f.size()) == 0);
+    usleep(2000);
+  }
+
+  BOOST_TEST(capture_close(&c) == 0);
+  BOOST_TEST(c.frames == 10u);
+  BOOST_TEST(c.dropped == 0u);
+
+  BOOST_REQUIRE(capture_reader_open(&r, path.c_str()) == 0);
+
+  for (int i = 0; i < 10; ++i) {
+    BOOST_REQUIRE(capture_next(&r, &rec, &frame) == 1);
+    BOOST_TEST(std::string(frame) == "{\"n\":" + std::to_string(i) + "}");
+    BOOST_TEST(rec.source == (uint32_t) (i % 3));
+    times.push_back(rec.time);
+  }
+
+  BOOST_TEST(capture_next(&r, &rec, &frame) == 0);
+  BOOST_TEST(std::is_sorted(times.begin(), times.end()));
+
+  // Seeking lands on the first frame at or after the time
+  BOOST_TEST(capture_seek(&r, times[6]) == 0);
+  BOOST_REQUIRE(capture_next(&r, &rec, &frame) == 1);
+  BOOST_TEST(std::string(frame) == "{\"n\":6}");
+  BOOST_TEST(capture_seek(&r, times[9] + 1) == 0);
+  BOOST_TEST(capture_next(&r, &rec, &frame) == 0);
+  BOOST_TEST(capture_seek(&r, 0) == 0);
+  BOOST_REQUIRE(capture_next(&r, &rec, &frame) == 1);
+  BOOST_TEST(std::string(frame) == "{\"n\":0}");
+  capture_reader_close(&r);
+
+  // A half written record and a lost index entry, as after a crash,
+  // are cleaned up on the next open
+  struct capture_record cut = { 100, 0, 0 };
+
+  BOOST_REQUIRE((fd = open(path.c_str(), O_WRONLY | O_APPEND)) >= 0);
+  BOOST_REQUIRE(write(fd, &cut, sizeof(cut)) == (ssize_t) sizeof(cut));
+  BOOST_REQUIRE(write(fd, "{\"n\":", 5) == 5);
+  close(fd);
+  BOOST_REQUIRE(truncate(idx.c_str(), sizeof(struct capture_header) +
+                         2 * sizeof(struct capture_index)) == 0);
+
+  BOOST_REQUIRE(capture_open(&c, path.c_str(), 4) == 0);
+  BOOST_TEST(capture_write(&c, 0, "{\"n\":10}", 8) == 0);
+  BOOST_TEST(capture_close(&c) == 0);
+
+  BOOST_REQUIRE(capture_reader_open(&r, path.c_str()) == 0);
+  BOOST_TEST(capture_seek(&r, times[8]) == 0);
+  BOOST_REQUIRE(capture_next(&r, &rec, &frame) == 1);
+  BOOST_TEST(std::string(frame) == "{\"n\":8}");
+  BOOST_REQUIRE(capture_next(&r, &rec, &frame) == 1);
+  BOOST_REQUIRE(capture_next(&r, &rec, &frame) == 1);
+  BOOST_TEST(std::string(frame) == "{\"n\":10}");
+  BOOST_TEST(capture_next(&r, &rec, &frame) == 0);
+  capture_reader_close(&r);
+
+  // Entries for frames 0, 4 and 8, then the first of the second run
+  BOOST_REQUIRE((fd = open(idx.c_str(), O_RDONLY)) >= 0);
+  BOOST_TEST(lseek(fd, 0, SEEK_END) ==
+             (off_t) (sizeof(struct capture_header) +
+                      4 * sizeof(struct capture_index)));
+  close(fd);
+
+  // Every frame of a coalesced burst is recorded, not only the one
+  // displayed
+  int p[2];
+  struct metric_form *mf = NULL;
+  std::string first = std::string(infile) + "\n";
+  std::string burst;
+
+  for (int i = 0; i < 5; ++i) {
+    std::string f = first;
+
+    f.replace(f.find("23.18"), 5, "20.0" + std::to_string(i));
+    burst += f;
+  }
+
+  unlink(path.c_str());
+  unlink(idx.c_str());
+  BOOST_REQUIRE(capture_open(&c, path.c_str(), 0) == 0);
+  BOOST_REQUIRE(pipe(p) == 0);
+  BOOST_REQUIRE(write(p[1], first.data(), first.size()) == (ssize_t) first.size());
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFG(p[0]));
+  BOOST_REQUIRE(mf);
+
+  setCapture(&c);
+  setCoalesce(true);
+  BOOST_REQUIRE(write(p[1], burst.data(), burst.size()) == (ssize_t) burst.size());
+  BOOST_TEST(mf->polldata_cb(100) == 0);
+  BOOST_TEST(mf->metrics[1].value == 20.04);
+  setCoalesce(false);
+  setCapture(NULL);
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  close(p[0]);
+  close(p[1]);
+
+  BOOST_TEST(capture_close(&c) == 0);
+  BOOST_TEST(c.frames == 5u);
+  BOOST_REQUIRE(capture_reader_open(&r, path.c_str()) == 0);
+
+  for (size_t at = 0, i = 0; i < 5; ++i) {
+    size_t eol = burst.find('\n', at);
+
+    BOOST_REQUIRE(capture_next(&r, &rec, &frame) == 1);
+    BOOST_TEST(std::string(frame) == burst.substr(at, eol - at));
+    at = eol + 1;
+  }
+
+  capture_reader_close(&r);
+
+  // Anything else is refused
+  BOOST_REQUIRE((fd = open(path.c_str(), O_WRONLY | O_TRUNC)) >= 0);
+  BOOST_REQUIRE(write(fd, "{\"n\":0}\n", 8) == 8);
+  close(fd);
+  BOOST_TEST(capture_open(&c, path.c_str(), 0) == -1);
+  BOOST_TEST(errno == EINVAL);
+  BOOST_TEST(capture_reader_open(&r, path.c_str()) == -1);
+  BOOST_TEST(errno == EINVAL);
+
+  unlink(path.c_str());
+  unlink(idx.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(replay_test)
+{
+  struct replay rp;
+  struct capture c;
+  struct source src;
+  struct metric_form *mf = NULL;
+  std::string path = "/tmp/env-display-replay-" + std::to_string(getpid());
+  std::string lines;
+  std::string got;
+  char buf[256];
+  ssize_t n;
+  int fd;
+
+  // JSON lines sent 100 and 200 ms apart, replayed ten times faster
+  for (int t : { 1000, 1100, 1300 }) {
+    lines += "{\"status\": {\"sentmillis\": " + std::to_string(t) +
+      "}, \"data\": [{\"name\": \"temp\", \"value\": " +
+      std::to_string(t / 100) + ", \"timemillis\": 2, \"unit\": \"degC\"}]}\n";
+  }
+
+  BOOST_REQUIRE((fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0);
+  BOOST_REQUIRE(write(fd, lines.data(), lines.size()) == (ssize_t) lines.size());
+  close(fd);
+
+  auto start = std::chrono::steady_clock::now();
+
+  BOOST_REQUIRE((fd = replay_start(&rp, path.c_str(), 0, 10)) >= 0);
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    got.append(buf, n);
+  }
+
+  long took = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - start).count();
+
+  BOOST_TEST(got == lines);
+  BOOST_TEST(took >= 25);
+  BOOST_TEST(took < 1000);
+  close(fd);
+  replay_stop(&rp);
+  BOOST_TEST(rp.frames == 3u);
+
+  // One source of a capture of two, as fast as possible, through the
+  // same path as any other source
+  unlink(path.c_str());
+  unlink((path + ".idx").c_str());
+  BOOST_REQUIRE(capture_open(&c, path.c_str(), 0) == 0);
+
+  for (int i = 1; i <= 4; ++i) {
+    std::string f = "{\"data\": [{\"name\": \"temp\", \"value\": " +
+      std::to_string(i) + ", \"timemillis\": 2, \"unit\": \"degC\"}]}";
+
+    BOOST_TEST(capture_write(&c, (i + 1) % 2, f.data(), f.size()) == 0);
+  }
+
+  BOOST_REQUIRE(capture_close(&c) == 0);
+  BOOST_REQUIRE(source_parse(&src, SOURCE_REPLAY, (path + "#1").c_str()) == 0);
+  BOOST_TEST(src.stream == 1);
+  BOOST_TEST(std::string(src.path) == path);
+  src.speed = 0;
+  BOOST_REQUIRE(source_open(&src) >= 0);
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFG(src.fd));
+  BOOST_REQUIRE(mf);
+  BOOST_TEST(mf->metrics[0].value == 2);
+  BOOST_TEST(mf->polldata_cb(1000) == 0);
+  BOOST_TEST(mf->metrics[0].value == 4);
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  source_close(&src);
+  BOOST_TEST(src.replay.frames == 2u);
+
+  BOOST_TEST(source_parse(&src, SOURCE_REPLAY, "/tmp/x#") == -1);
+  unlink(path.c_str());
+  unlink((path + ".idx").c_str());
+}
+
+BOOST_AUTO_TEST_CASE(follow_test)
+{
+  struct metric_form *mf = NULL;
+  std::string path = "/tmp/env-display-follow-" + std::to_string(getpid());
+  std::string rotated = path + ".1";
+  const char *paths[] = { path.c_str() };
+  auto frame = [](const std::string &value) {
+    return "{\"data\": [{\"name\": \"temp\", \"value\": " + value + "}]}\n";
+  };
+  auto append = [](const std::string &file, const std::string &text,
+                   int flags) {
+    int fd = open(file.c_str(), O_WRONLY | O_CREAT | flags, 0644);
+
+    BOOST_REQUIRE(fd >= 0);
+    BOOST_REQUIRE(write(fd, text.data(), text.size()) == (ssize_t) text.size());
+    close(fd);
+  };
+  std::string half = frame("21");
+  int fd;
+
+  // A frame and half of the next one, still being written
+  append(path, frame("20.5") + half.substr(0, 20), O_TRUNC);
+  BOOST_REQUIRE((fd = open(path.c_str(), O_RDONLY)) >= 0);
+  setFollow(paths, 1);
+  BOOST_REQUIRE_NO_THROW(mf = ncursesCFGSources(&fd, NULL, 1));
+  BOOST_REQUIRE(mf);
+  BOOST_TEST(mf->metrics[0].value == 20.5);
+
+  // At the end of the file the poll waits rather than spins, and the
+  // half frame is held back
+  BOOST_TEST(mf->polldata_cb(50) == 1);
+
+  auto start = std::chrono::steady_clock::now();
+
+  BOOST_TEST(mf->polldata_cb(50) == 1);
+
+  long took = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - start).count();
+
+  BOOST_TEST(took >= 40);
+  BOOST_TEST(mf->metrics[0].value == 20.5);
+
+  append(path, half.substr(20), O_APPEND);
+  BOOST_TEST(mf->polldata_cb(1000) == 0);
+  BOOST_TEST(mf->metrics[0].value == 21);
+
+  // Rotated away, the old file is read to its end before the new one
+  BOOST_REQUIRE(rename(path.c_str(), rotated.c_str()) == 0);
+  append(rotated, frame("21.5"), O_APPEND);
+  BOOST_TEST(mf->polldata_cb(1000) == 0);
+  BOOST_TEST(mf->metrics[0].value == 21.5);
+  BOOST_TEST(mf->polldata_cb(50) == 1);
+  append(path, frame("22"), O_TRUNC);
+  BOOST_TEST(mf->polldata_cb(1000) == 0);
+  BOOST_TEST(mf->metrics[0].value == 22);
+
+  // Truncated in place, it is read again from its start
+  append(path, "{\"data\":[{\"name\":\"temp\",\"value\":23}]}\n", O_TRUNC);
+  BOOST_TEST(mf->polldata_cb(1000) == 0);
+  BOOST_TEST(mf->metrics[0].value == 23);
+
+  // Idle at its end, then appended to and rotated before the next
+  // poll, the last frame of the old file is still read
+  BOOST_TEST(mf->polldata_cb(50) == 1);
+  append(path, frame("24"), O_APPEND);
+  BOOST_REQUIRE(rename(path.c_str(), rotated.c_str()) == 0);
+  append(path, frame("30"), O_TRUNC);
+  BOOST_TEST(mf->polldata_cb(1000) == 0);
+  BOOST_TEST(mf->metrics[0].value == 24);
+  BOOST_TEST(mf->polldata_cb(1000) == 0);
+  BOOST_TEST(mf->metrics[0].value == 30);
+
+  BOOST_CHECK_NO_THROW(ncursesFreeMetric());
+  setFollow(NULL, 0);
+  close(fd);
+  unlink(path.c_str());
+  unlink(rotated.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(batch_test)
+{
+  struct batch b;
+  std::string in = "/tmp/env-display-batch-" + std::to_string(getpid());
+  std::string out = in + ".csv";
+  std::string dir = in + ".d";
+  std::string lines;
+  std::string expect = "timemillis,name,value,unit\n";
+  auto slurp = [](const std::string &file) {
+    std::string text;
+    char buf[4096];
+    ssize_t n;
+    int fd = open(file.c_str(), O_RDONLY);
+
+    BOOST_REQUIRE(fd >= 0);
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+      text.append(buf, n);
+    }
+
+    close(fd);
+    return text;
+  };
+  int fd;
+
+  // Frames of varying length with a broken and a blank line among them
+  // and no newline after the last
+  for (int i = 0; i < 200; ++i) {
+    std::string t = std::to_string(1000 + i);
+
+    if (i == 57) {
+      lines += "{\"data\": [\r\n\n";
+      continue;
+    }
+
+    lines += "{\"data\": [{\"name\": \"temp\", \"value\": " +
+      std::to_string(i) + ".5, \"timemillis\": " + t +
+      ", \"unit\": \"degC\"}, {\"name\": \"gas, ox\", \"value\": " +
+      std::to_string(i * i) + ", \"timemillis\": " + t + "}]}";
+    lines += i < 199 ? "\n" : "";
+    expect += t + ",temp," + std::to_string(i) + ".5,degC\n" +
+      t + ",\"gas, ox\"," + std::to_string(i * i) + ",\n";
+  }
+
+  BOOST_REQUIRE((fd = open(in.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0);
+  BOOST_REQUIRE(write(fd, lines.data(), lines.size()) == (ssize_t) lines.size());
+  close(fd);
+
+  // Chunks far shorter than a line still split at line boundaries, and
+  // the rows come out in order whatever the number of workers
+  for (size_t chunk : { (size_t) 7, (size_t) 1000, (size_t) 0 }) {
+    for (int threads : { 1, 4 }) {
+      BOOST_REQUIRE(batch_open(&b, out.c_str(), threads, chunk) == 0);
+      BOOST_TEST(batch_convert(&b, in.c_str()) == 0);
+      BOOST_TEST(batch_close(&b) == 0);
+      BOOST_TEST(b.frames == 199u);
+      BOOST_TEST(b.failed == 1u);
+      BOOST_TEST(b.rows == 398u);
+      BOOST_TEST(slurp(out) == expect);
+    }
+  }
+
+  // One file per metric in a directory
+  BOOST_REQUIRE(batch_open(&b, (dir + "/").c_str(), 3, 64) == 0);
+  BOOST_TEST(b.format == BATCH_COLUMNS);
+  BOOST_TEST(batch_convert(&b, in.c_str()) == 0);
+  BOOST_TEST(batch_close(&b) == 0);
+
+  std::string temp = slurp(dir + "/temp.csv");
+  std::string gas = slurp(dir + "/gas__ox.csv");
+
+  BOOST_TEST(temp.substr(0, temp.find('\n')) == "timemillis,temp (degC)");
+  BOOST_TEST(gas.substr(0, gas.find('\n')) == "timemillis,\"gas, ox\"");
+  BOOST_TEST(std::count(temp.begin(), temp.end(), '\n') == 200);
+  BOOST_TEST(gas.substr(gas.rfind('\n', gas.size() - 2) + 1) ==
+             "1199,39601\n");
+
+  // Names that make the same file name keep files of their own
+  std::string clash = in + ".clash";
+
+  BOOST_REQUIRE((fd = open(clash.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0);
+  lines = "{\"data\": [{\"name\": \"PM2.5 Std\", \"value\": 1, \"timemillis\": 5}, "
+    "{\"name\": \"PM2.5_Std\", \"value\": 2, \"timemillis\": 5}]}\n";
+  BOOST_REQUIRE(write(fd, lines.data(), lines.size()) == (ssize_t) lines.size());
+  close(fd);
+
+  BOOST_REQUIRE(batch_open(&b, dir.c_str(), 1, 0) == 0);
+  BOOST_TEST(batch_convert(&b, clash.c_str()) == 0);
+  BOOST_TEST(batch_close(&b) == 0);
+  BOOST_TEST(slurp(dir + "/PM2.5_Std.csv") == "timemillis,PM2.5 Std\n5,1\n");
+  BOOST_TEST(slurp(dir + "/PM2.5_Std~1.csv") == "timemillis,PM2.5_Std\n5,2\n");
+
+  unlink((dir + "/PM2.5_Std.csv").c_str());
+  unlink((dir + "/PM2.5_Std~1.csv").c_str());
+  unlink(clash.c_str());
+
+  BOOST_REQUIRE(batch_open(&b, out.c_str(), 1, 0) == 0);
+  BOOST_TEST(batch_convert(&b, "/nonexistent/batch") == -1);
+  BOOST_TEST(errno == ENOENT);
+  BOOST_TEST(batch_close(&b) == 0);
+
+  unlink((dir + "/temp.csv").c_str());
+  unlink((dir + "/gas__ox.csv").c_str());
+  rmdir(dir.c_str());
+  unlink(out.c_str());
+  unlink(in.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(tsstore_test)
+{
+  struct tsstore ts;
+  struct tsstore_reader r;
+  std::string dir = "/tmp/env-display-tsstore-" + std::to_string(getpid());
+  char path[512];
+  std::vector<int64_t> times;
+  std::vector<double> values;
+  int64_t t = 1000;
+  int64_t got_t[TSSTORE_BLOCK_SAMPLES];
+  double got_v[TSSTORE_BLOCK_SAMPLES];
+  int a, b;
+
+  // Steady readings with jitter, long gaps, a clock set back, and
+  // values that repeat, wander, jump and go NaN
+  for (int i = 0; i < 2 * TSSTORE_BLOCK_SAMPLES + 100; ++i) {
+    static const int64_t steps[] = { 1000, 1000, 1001, 998, 1250, 3000,
+                                     -50000, 1000, 1LL << 40, 1000 };
+    double v = i % 7 == 0 ? 21.5 : 20 + (i % 13) * 0.01;
+
+    t += steps[i % 10];
+    times.push_back(t);
+    values.push_back(i == 300 ? NAN : i == 301 ? -1e300 : v);
+  }
+
+  BOOST_REQUIRE(tsstore_open(&ts, dir.c_str(), 2) == 0);
+  BOOST_REQUIRE((a = tsstore_find(&ts, "gas ox")) == 0);
+  BOOST_REQUIRE((b = tsstore_find(&ts, "gas:ox")) == 1);
+  BOOST_TEST(tsstore_find(&ts, "gas ox") == a);
+  BOOST_TEST(tsstore_find(&ts, "third") == -1);
+
+  for (size_t i = 0; i < times.size(); ++i) {
+    BOOST_TEST(tsstore_add(&ts, a, times[i], values[i]) == 0);
+  }
+
+  BOOST_TEST(ts.blocks == 2u);
+  BOOST_TEST(tsstore_add(&ts, b, 5, 1.0) == 0);
+  BOOST_TEST(tsstore_close(&ts) == 0);
+  BOOST_TEST(ts.blocks == 4u);
+
+  // Both names map to the same file name, the second gets another
+  BOOST_REQUIRE(tsstore_path(path, sizeof(path), dir.c_str(), "gas ox", 0) == 0);
+  BOOST_TEST(std::string(path) == dir + "/gas_ox.ts");
+  BOOST_REQUIRE(tsstore_reader_open(&r, path) == 0);
+  BOOST_TEST(std::string(r.name) == "gas ox");
+
+  size_t k = 0;
+  int ret;
+
+  while ((ret = tsstore_reader_next(&r, INT64_MIN, INT64_MAX)) > 0) {
+    int n = tsstore_reader_decode(&r, got_t, got_v);
+
+    BOOST_REQUIRE(n == (int) r.hdr.count);
+
+    for (int i = 0; i < n; ++i, ++k) {
+      BOOST_TEST(got_t[i] == times[k]);
+      BOOST_TEST(memcmp(&got_v[i], &values[k], sizeof(double)) == 0);
+    }
+  }
+
+  BOOST_TEST(ret == 0);
+  BOOST_TEST(k == times.size());
+  BOOST_TEST(r.hdr.count == 100u);
+  BOOST_TEST(r.hdr.vmin == 20);
+  BOOST_TEST(r.hdr.vmax == 21.5);
+  tsstore_reader_close(&r);
+
+  // Only the block holding the range is found
+  BOOST_REQUIRE(tsstore_reader_open(&r, path) == 0);
+  BOOST_TEST(tsstore_reader_next(&r, times[TSSTORE_BLOCK_SAMPLES + 5],
+                                 times[TSSTORE_BLOCK_SAMPLES + 5]) == 1);
+  BOOST_TEST(tsstore_reader_decode(&r, got_t, got_v) ==
+             TSSTORE_BLOCK_SAMPLES);
+  BOOST_TEST(got_t[5] == times[TSSTORE_BLOCK_SAMPLES + 5]);
+  BOOST_TEST(tsstore_reader_next(&r, times[TSSTORE_BLOCK_SAMPLES + 5],
+                                 times[TSSTORE_BLOCK_SAMPLES + 5]) == 0);
+  tsstore_reader_close(&r);
+
+  BOOST_REQUIRE(tsstore_path(path, sizeof(path), dir.c_str(), "gas:ox", 1) == 0);
+  BOOST_TEST(std::string(path) == dir + "/gas_ox~1.ts");
+  BOOST_REQUIRE(tsstore_reader_open(&r, path) == 0);
+  BOOST_TEST(std::string(r.name) == "gas:ox");
+  BOOST_TEST(tsstore_reader_next(&r, INT64_MIN, INT64_MAX) == 1);
+  BOOST_TEST(tsstore_reader_decode(&r, got_t, got_v) == 1);
+  BOOST_TEST(got_t[0] == 5);
+  BOOST_TEST(got_v[0] == 1.0);
+  tsstore_reader_close(&r);
+
+  // A block cut off by a crash is dropped when the column is opened
+  // again, and new blocks follow the ones that survived
+  struct stat st;
+  int fd;
+
+  BOOST_REQUIRE(stat(path, &st) == 0);
+  BOOST_REQUIRE((fd = open(path, O_WRONLY | O_APPEND)) >= 0);
+  BOOST_REQUIRE(write(fd, "ENVB\x05\0\0", 7) == 7);
+  close(fd);
+  BOOST_REQUIRE(tsstore_open(&ts, dir.c_str(), 0) == 0);
+  BOOST_REQUIRE(tsstore_find(&ts, "gas ox") >= 0);
+  BOOST_REQUIRE((b = tsstore_find(&ts, "gas:ox")) >= 0);
+  BOOST_TEST(tsstore_add(&ts, b, 6, 2.0) == 0);
+  BOOST_TEST(tsstore_close(&ts) == 0);
+  BOOST_REQUIRE(tsstore_reader_open(&r, path) == 0);
+  BOOST_TEST(tsstore_reader_next(&r, INT64_MIN, INT64_MAX) == 1);
+  BOOST_TEST(tsstore_reader_next(&r, INT64_MIN, INT64_MAX) == 1);
+  BOOST_TEST(tsstore_reader_decode(&r, got_t, got_v) == 1);
+  BOOST_TEST(got_v[0] == 2.0);
+  BOOST_TEST(tsstore_reader_next(&r, INT64_MIN, INT64_MAX) == 0);
+  tsstore_reader_close(&r);
+
+  BOOST_TEST(tsstore_reader_open(&r, "/dev/null") == -1);
+  BOOST_TEST(errno == EINVAL);
+
+  unlink((dir + "/gas_ox.ts").c_str());
+  unlink((dir + "/gas_ox~1.ts").c_str());
+  rmdir(dir.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(form_loop_signal_test)
+{
+  int p[2];
+  int status = 0;
+  pid_t child;
+  pid_t done = 0;
+  std::string frame = std::string(infile) + "\n";
+
+  BOOST_REQUIRE(pipe(p) == 0);
+  BOOST_REQUIRE(write(p[1], frame.data(), frame.size()) == (ssize_t) frame.size());
+
+  // Run the form in a child with the screen going nowhere
+  if ((child = fork()) == 0) {
+    int null = open("/dev/null", O_RDWR);
+
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDIN_FILENO);
+    setenv("TERM", "xterm", 1);
+    _exit(metric_form_init(ncursesCFG(p[0])));
+  }
+
+  BOOST_REQUIRE(child > 0);
+  usleep(300000);
+
+  // The idle loop sleeps with no timeout, so only the signal wakes it
+  BOOST_REQUIRE(kill(child, SIGTERM) == 0);
+
+  for (int i = 0; i < 200 && (done = waitpid(child, &status, WNOHANG)) == 0; ++i)
+    usleep(10000);
+
+  BOOST_TEST(done == child);
+  BOOST_TEST(WIFEXITED(status));
+  BOOST_TEST(WEXITSTATUS(status) == 0);
+
+  if (done != child) {
+    kill(child, SIGKILL);
+    waitpid(child, &status, 0);
+  }
+
+  close(p[0]);
+  close(p[1]);
+}
+
 BOOST_AUTO_TEST_CASE(forms_emerg_exit)
 {
   FILE* fptr;
@@ -0,0 +1,679 @@
+#include "tsstore.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Bytes past the end of a reader's buffer, enough for the longest
+ * sample, so decoding a damaged block never reads out of bounds */
+#define TSSTORE_SLACK 24
+
+static int _openColumn(struct tsstore *ts, struct tsstore_series *s);
+static int _recover(int fd);
+static void _startBlock(struct tsstore_series *s);
+static int _writeBlock(struct tsstore *ts, struct tsstore_series *s);
+static void _putBits(struct tsstore_series *s, uint64_t v, int n);
+static uint64_t _getBits(const uint8_t *buf, uint64_t *at, int n);
+static int _writeAll(int fd, const void *buf, size_t len);
+static ssize_t _readAt(int fd, void *buf, size_t len, uint64_t off);
+
+int tsstore_open(struct tsstore *ts, const char *dir, unsigned nseries)
+{
+	size_t len;
+
+	assert(ts);
+	assert(dir);
+
+	memset(ts, 0, sizeof(*ts));
+	len = strlen(dir);
+
+	while (len > 1 && dir[len - 1] == '/')
+		--len;
+
+	if (len >= sizeof(ts->dir)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memcpy(ts->dir, dir, len);
+	ts->dir[len] = '\0';
+
+	if (mkdir(ts->dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	ts->nseries = nseries ? nseries : TSSTORE_DEFAULT_SERIES;
+	ts->series = (struct tsstore_series*)
+		calloc(ts->nseries, sizeof(*ts->series));
+
+	if (!ts->series) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (unsigned i = 0; i < ts->nseries; ++i) {
+		ts->series[i].fd = -1;
+	}
+
+	return 0;
+}
+
+int tsstore_close(struct tsstore *ts)
+{
+	int err;
+
+	assert(ts);
+
+	tsstore_flush(ts);
+	err = ts->error;
+
+	for (unsigned i = 0; i < ts->nseries; ++i) {
+		struct tsstore_series *s = &ts->series[i];
+
+		if (s->fd >= 0 && close(s->fd) < 0 && !err)
+			err = errno;
+
+		free(s->buf);
+	}
+
+	free(ts->series);
+	ts->series = NULL;
+	ts->nseries = 0;
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+int tsstore_find(struct tsstore *ts, const char *name)
+{
+	assert(ts);
+	assert(name);
+
+	int unused = -1;
+
+	for (unsigned i = 0; i < ts->nseries; ++i) {
+		if (ts->series[i].name[0] == '\0') {
+			unused = unused < 0 ? (int) i : unused;
+			continue;
+		}
+
+		if (strncmp(ts->series[i].name, name,
+			    sizeof(ts->series[i].name) - 1) == 0)
+			return i;
+	}
+
+	if (unused < 0) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	struct tsstore_series *s = &ts->series[unused];
+
+	strncpy(s->name, name, sizeof(s->name) - 1);
+
+	if (_openColumn(ts, s) < 0) {
+		int err = errno;
+
+		memset(s->name, 0, sizeof(s->name));
+		errno = err;
+		return -1;
+	}
+
+	return unused;
+}
+
+int tsstore_add(struct tsstore *ts, int s, int64_t timemillis,
+		double value)
+{
+	assert(ts);
+	assert(s >= 0 && (unsigned) s < ts->nseries);
+
+	struct tsstore_series *se = &ts->series[s];
+	struct tsstore_block *hdr = &se->hdr;
+	uint64_t bits;
+
+	memcpy(&bits, &value, sizeof(bits));
+
+	if (hdr->count == 0) {
+		_putBits(se, (uint64_t) timemillis, 64);
+		_putBits(se, bits, 64);
+		se->delta = 0;
+		se->lead = -1;
+	} else {
+		/* Wrapping arithmetic keeps any jump of the clock exact */
+		uint64_t delta = (uint64_t) timemillis - (uint64_t) se->time;
+		int64_t dod = (int64_t) (delta - (uint64_t) se->delta);
+		uint64_t x = bits ^ se->value;
+
+		if (dod == 0) {
+			_putBits(se, 0, 1);
+		} else if (dod >= -63 && dod <= 64) {
+			_putBits(se, 2, 2);
+			_putBits(se, dod + 63, 7);
+		} else if (dod >= -255 && dod <= 256) {
+			_putBits(se, 6, 3);
+			_putBits(se, dod + 255, 9);
+		} else if (dod >= -2047 && dod <= 2048) {
+			_putBits(se, 14, 4);
+			_putBits(se, dod + 2047, 12);
+		} else {
+			_putBits(se, 15, 4);
+			_putBits(se, (uint64_t) dod, 64);
+		}
+
+		se->delta = (int64_t) delta;
+
+		if (x == 0) {
+			_putBits(se, 0, 1);
+		} else {
+			int lead = __builtin_clzll(x);
+			int trail = __builtin_ctzll(x);
+
+			/* Five bits hold the leading zeros */
+			if (lead > 31)
+				lead = 31;
+
+			if (se->lead >= 0 && lead >= se->lead &&
+			    trail >= se->trail) {
+				/* Within the previous window */
+				_putBits(se, 2, 2);
+				_putBits(se, x >> se->trail,
+					 64 - se->lead - se->trail);
+			} else {
+				int sig = 64 - lead - trail;
+
+				_putBits(se, 3, 2);
+				_putBits(se, lead, 5);
+				_putBits(se, sig - 1, 6);
+				_putBits(se, x >> trail, sig);
+				se->lead = lead;
+				se->trail = trail;
+			}
+		}
+	}
+
+	se->time = timemillis;
+	se->value = bits;
+	++hdr->count;
+
+	if (timemillis < hdr->tmin)
+		hdr->tmin = timemillis;
+
+	if (timemillis > hdr->tmax)
+		hdr->tmax = timemillis;
+
+	if (value < hdr->vmin)
+		hdr->vmin = value;
+
+	if (value > hdr->vmax)
+		hdr->vmax = value;
+
+	if (hdr->count < TSSTORE_BLOCK_SAMPLES)
+		return 0;
+
+	return _writeBlock(ts, se);
+}
+
+int tsstore_flush(struct tsstore *ts)
+{
+	int ret = 0;
+
+	assert(ts);
+
+	for (unsigned i = 0; i < ts->nseries; ++i) {
+		struct tsstore_series *s = &ts->series[i];
+
+		if (s->fd >= 0 && s->hdr.count > 0 && _writeBlock(ts, s) < 0)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+int tsstore_path(char *path, size_t len, const char *dir,
+		 const char *name, int alt)
+{
+	size_t n;
+	int m;
+
+	assert(path);
+	assert(dir);
+	assert(name);
+
+	m = snprintf(path, len, "%s/", dir);
+
+	if (m < 0 || (size_t) m >= len)
+		return -1;
+
+	n = m;
+
+	/* Names come from the data, keep them to one file in dir */
+	for (const char *s = name; *s; ++s) {
+		bool plain = (*s >= 'a' && *s <= 'z') ||
+			(*s >= 'A' && *s <= 'Z') ||
+			(*s >= '0' && *s <= '9') || *s == '-' || *s == '_' ||
+			(*s == '.' && s != name);
+
+		if (n + 1 >= len)
+			return -1;
+
+		path[n++] = plain ? *s : '_';
+	}
+
+	m = alt > 0 ? snprintf(path + n, len - n, "~%d.ts", alt) :
+		snprintf(path + n, len - n, ".ts");
+
+	return m < 0 || (size_t) m >= len - n ? -1 : 0;
+}
+
+int tsstore_reader_open(struct tsstore_reader *r, const char *path)
+{
+	struct tsstore_header hdr;
+	ssize_t n;
+	int err;
+
+	assert(r);
+	assert(path);
+
+	memset(r, 0, sizeof(*r));
+	r->fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (r->fd < 0)
+		return -1;
+
+	n = _readAt(r->fd, &hdr, sizeof(hdr), 0);
+
+	if (n >= 0 && ((size_t) n != sizeof(hdr) ||
+		       hdr.magic != TSSTORE_MAGIC ||
+		       hdr.version != TSSTORE_VERSION)) {
+		n = -1;
+		errno = EINVAL;
+	}
+
+	if (n >= 0 && !(r->buf = (uint8_t*)
+			calloc(1, TSSTORE_BLOCK_BYTES + TSSTORE_SLACK))) {
+		n = -1;
+		errno = ENOMEM;
+	}
+
+	if (n < 0) {
+		err = errno;
+		tsstore_reader_close(r);
+		errno = err;
+		return -1;
+	}
+
+	memcpy(r->name, hdr.name, sizeof(r->name));
+	r->name[sizeof(r->name) - 1] = '\0';
+	r->offset = sizeof(hdr);
+
+	return 0;
+}
+
+void tsstore_reader_close(struct tsstore_reader *r)
+{
+	assert(r);
+
+	if (r->fd >= 0)
+		close(r->fd);
+
+	free(r->buf);
+	r->fd = -1;
+	r->buf = NULL;
+}
+
+int tsstore_reader_next(struct tsstore_reader *r, int64_t from, int64_t to)
+{
+	assert(r);
+
+	for (;;) {
+		ssize_t n = _readAt(r->fd, &r->hdr, sizeof(r->hdr),
+				    r->offset);
+
+		if (n < 0)
+			return -1;
+
+		if (n == 0)
+			return 0;
+
+		if ((size_t) n < sizeof(r->hdr) ||
+		    r->hdr.magic != TSSTORE_BLOCK_MAGIC ||
+		    r->hdr.count == 0 ||
+		    r->hdr.count > TSSTORE_BLOCK_SAMPLES ||
+		    r->hdr.len > TSSTORE_BLOCK_BYTES) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		r->loaded = false;
+		r->offset += sizeof(r->hdr) + r->hdr.len;
+
+		if (r->hdr.tmax >= from && r->hdr.tmin <= to)
+			return 1;
+	}
+}
+
+int tsstore_reader_decode(struct tsstore_reader *r, int64_t *times,
+			  double *values)
+{
+	const struct tsstore_block *hdr = &r->hdr;
+	uint64_t at = 0;
+	uint64_t end = (uint64_t) hdr->len * 8;
+	uint64_t time = 0;
+	uint64_t delta = 0;
+	uint64_t value = 0;
+	int lead = 0;
+	int trail = 0;
+
+	assert(r);
+	assert(times);
+	assert(values);
+
+	if (!r->loaded) {
+		ssize_t n = _readAt(r->fd, r->buf, hdr->len,
+				    r->offset - hdr->len);
+
+		if (n < 0)
+			return -1;
+
+		if ((size_t) n < hdr->len) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		r->loaded = true;
+	}
+
+	/* A damaged block may claim more samples than it holds. Reading
+	 * stops once past its end, which the slack after the buffer
+	 * leaves room for. */
+	for (uint32_t i = 0; i < hdr->count; ++i) {
+		if (i == 0) {
+			time = _getBits(r->buf, &at, 64);
+			value = _getBits(r->buf, &at, 64);
+		} else {
+			int64_t dod;
+
+			if (_getBits(r->buf, &at, 1) == 0)
+				dod = 0;
+			else if (_getBits(r->buf, &at, 1) == 0)
+				dod = (int64_t) _getBits(r->buf, &at, 7) - 63;
+			else if (_getBits(r->buf, &at, 1) == 0)
+				dod = (int64_t) _getBits(r->buf, &at, 9) - 255;
+			else if (_getBits(r->buf, &at, 1) == 0)
+				dod = (int64_t) _getBits(r->buf, &at, 12) -
+					2047;
+			else
+				dod = (int64_t) _getBits(r->buf, &at, 64);
+
+			delta += (uint64_t) dod;
+			time += delta;
+
+			if (_getBits(r->buf, &at, 1) != 0) {
+				if (_getBits(r->buf, &at, 1) != 0) {
+					lead = (int) _getBits(r->buf, &at, 5);
+					trail = 64 - lead -
+						((int) _getBits(r->buf, &at,
+								6) + 1);
+
+					if (trail < 0) {
+						errno = EINVAL;
+						return -1;
+					}
+				}
+
+				value ^= _getBits(r->buf, &at,
+						  64 - lead - trail) << trail;
+			}
+		}
+
+		if (at > end) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		times[i] = (int64_t) time;
+		memcpy(&values[i], &value, sizeof(value));
+	}
+
+	return hdr->count;
+}
+
+/*
+**********************************************************************
+***************** LOCAL FUNCTION IMPLEMENTATION **********************
+**********************************************************************
+*/
+
+/* Open the column of a series under the first name not taken by
+ * another metric, creating it if there is none */
+static int _openColumn(struct tsstore *ts, struct tsstore_series *s)
+{
+	char path[sizeof(ts->dir) + 3 * sizeof(s->name) + 16];
+	struct tsstore_header hdr;
+	struct stat st;
+	int err = EEXIST;
+
+	if (!s->buf && !(s->buf = (uint8_t*)
+			 malloc(sizeof(struct tsstore_block) +
+				TSSTORE_BLOCK_BYTES))) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (int alt = 0; alt <= TSSTORE_MAX_ALT; ++alt) {
+		if (tsstore_path(path, sizeof(path), ts->dir, s->name,
+				 alt) < 0) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		s->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+			     0644);
+
+		if (s->fd < 0) {
+			err = errno;
+			break;
+		}
+
+		if (fstat(s->fd, &st) < 0)
+			goto failed;
+
+		if (st.st_size == 0) {
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.magic = TSSTORE_MAGIC;
+			hdr.version = TSSTORE_VERSION;
+			memcpy(hdr.name, s->name, sizeof(hdr.name));
+
+			if (_writeAll(s->fd, &hdr, sizeof(hdr)) < 0)
+				goto failed;
+
+			_startBlock(s);
+			return 0;
+		}
+
+		if (_readAt(s->fd, &hdr, sizeof(hdr), 0) !=
+		    (ssize_t) sizeof(hdr) || hdr.magic != TSSTORE_MAGIC ||
+		    hdr.version != TSSTORE_VERSION) {
+			errno = EINVAL;
+			goto failed;
+		}
+
+		if (strncmp(hdr.name, s->name, sizeof(hdr.name)) == 0) {
+			if (_recover(s->fd) < 0)
+				goto failed;
+
+			_startBlock(s);
+			return 0;
+		}
+
+		/* Another metric's column under the same file name */
+		close(s->fd);
+		s->fd = -1;
+	}
+
+	errno = err;
+	return -1;
+
+failed:
+	err = errno;
+	close(s->fd);
+	s->fd = -1;
+	errno = err;
+	return -1;
+}
+
+/* Cut a block a crash left half written off the end of a column. Only
+ * block headers are read. */
+static int _recover(int fd)
+{
+	struct tsstore_block hdr;
+	struct stat st;
+	uint64_t off = sizeof(struct tsstore_header);
+	ssize_t n;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+
+	while ((n = _readAt(fd, &hdr, sizeof(hdr), off)) ==
+	       (ssize_t) sizeof(hdr) && hdr.magic == TSSTORE_BLOCK_MAGIC &&
+	       hdr.len <= TSSTORE_BLOCK_BYTES &&
+	       off + sizeof(hdr) + hdr.len <= (uint64_t) st.st_size) {
+		off += sizeof(hdr) + hdr.len;
+	}
+
+	if (n < 0)
+		return -1;
+
+	if (off < (uint64_t) st.st_size && ftruncate(fd, off) < 0)
+		return -1;
+
+	return 0;
+}
+
+static void _startBlock(struct tsstore_series *s)
+{
+	memset(&s->hdr, 0, sizeof(s->hdr));
+	s->hdr.magic = TSSTORE_BLOCK_MAGIC;
+	s->hdr.tmin = INT64_MAX;
+	s->hdr.tmax = INT64_MIN;
+	s->hdr.vmin = INFINITY;
+	s->hdr.vmax = -INFINITY;
+	s->bits = 0;
+	memset(s->buf + sizeof(s->hdr), 0, TSSTORE_BLOCK_BYTES);
+}
+
+/* Append the open block to its column and start the next. A block that
+ * could not be written is dropped rather than grown without bound. */
+static int _writeBlock(struct tsstore *ts, struct tsstore_series *s)
+{
+	int ret;
+
+	s->hdr.len = (uint32_t) ((s->bits + 7) / 8);
+
+	/* All NaN leaves the range empty */
+	if (s->hdr.vmin > s->hdr.vmax)
+		s->hdr.vmin = s->hdr.vmax = NAN;
+
+	memcpy(s->buf, &s->hdr, sizeof(s->hdr));
+	ret = _writeAll(s->fd, s->buf, sizeof(s->hdr) + s->hdr.len);
+
+	if (ret < 0 && !ts->error)
+		ts->error = errno;
+
+	if (ret == 0)
+		++ts->blocks;
+
+	_startBlock(s);
+
+	return ret;
+}
+
+/* Append the low n bits of v, most significant first */
+static void _putBits(struct tsstore_series *s, uint64_t v, int n)
+{
+	uint8_t *buf = s->buf + sizeof(struct tsstore_block);
+
+	while (n > 0) {
+		int avail = 8 - (int) (s->bits % 8);
+		int take = n < avail ? n : avail;
+		uint64_t chunk = (v >> (n - take)) & ((1u << take) - 1);
+
+		buf[s->bits / 8] |= (uint8_t) (chunk << (avail - take));
+		s->bits += take;
+		n -= take;
+	}
+}
+
+static uint64_t _getBits(const uint8_t *buf, uint64_t *at, int n)
+{
+	uint64_t v = 0;
+
+	while (n > 0) {
+		int avail = 8 - (int) (*at % 8);
+		int take = n < avail ? n : avail;
+		uint8_t byte = buf[*at / 8];
+
+		v = (v << take) |
+			((byte >> (avail - take)) & ((1u << take) - 1));
+		*at += take;
+		n -= take;
+	}
+
+	return v;
+}
+
+static int _writeAll(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char*) buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Read up to len bytes at an offset, fewer only at the end of the
+ * file */
+static ssize_t _readAt(int fd, void *buf, size_t len, uint64_t off)
+{
+	char *p = (char*) buf;
+	size_t got = 0;
+
+	while (got < len) {
+		ssize_t n = pread(fd, p + got, len - got, off + got);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		if (n == 0)
+			break;
+
+		got += n;
+	}
+
+	return got;
+}
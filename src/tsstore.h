@@ -0,0 +1,259 @@
+#ifndef TSSTORE_H
+#define TSSTORE_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* #ifdef __cplusplus */
+
+#define TSSTORE_MAGIC 0x454e5654 /* "ENVT" */
+#define TSSTORE_BLOCK_MAGIC 0x454e5642 /* "ENVB" */
+#define TSSTORE_VERSION 1
+
+/* Samples a block holds before it is written out */
+#ifndef TSSTORE_BLOCK_SAMPLES
+#define TSSTORE_BLOCK_SAMPLES 1024
+#endif /* #ifndef TSSTORE_BLOCK_SAMPLES */
+
+#ifndef TSSTORE_DEFAULT_SERIES
+#define TSSTORE_DEFAULT_SERIES 64
+#endif /* #ifndef TSSTORE_DEFAULT_SERIES */
+
+/* Other file names tried for a column whose first choice is taken by
+ * another metric */
+#define TSSTORE_MAX_ALT 8
+
+/* Bytes of encoded samples a block can take at most: a time stamp of
+ * 4 + 64 bits and a value of 2 + 5 + 6 + 64 bits per sample */
+#define TSSTORE_BLOCK_BYTES (TSSTORE_BLOCK_SAMPLES * 19 + 8)
+
+/** Start of every column file
+ *
+ * @param name Metric the column holds
+ */
+	struct tsstore_header {
+		uint32_t magic;
+		uint32_t version;
+		char name[48];
+	};
+
+/** Header of one block of a column, followed by @p len bytes of
+ * encoded samples
+ *
+ * A reader skips a block whose time range or value range is of no
+ * interest without reading its samples.
+ *
+ * @param count Samples in the block
+ *
+ * @param len Bytes of encoded samples
+ *
+ * @param tmin Earliest device time in the block, in milliseconds
+ *
+ * @param tmax Latest device time in the block
+ *
+ * @param vmin Smallest value in the block, NaN values left out
+ *
+ * @param vmax Largest value in the block
+ */
+	struct tsstore_block {
+		uint32_t magic;
+		uint32_t count;
+		uint32_t len;
+		uint32_t reserved;
+		int64_t tmin;
+		int64_t tmax;
+		double vmin;
+		double vmax;
+	};
+
+/** Block of one metric being filled
+ *
+ * @param name Metric name, empty if unused
+ *
+ * @param fd Column file, -1 if unused
+ *
+ * @param hdr Header of the open block
+ *
+ * @param buf Room for the header of the open block followed by its
+ * encoded samples, so the block is written in one go
+ *
+ * @param bits Bits used in @p buf
+ *
+ * @param time Time stamp of the previous sample
+ *
+ * @param delta Difference of the previous two time stamps
+ *
+ * @param value Bits of the previous value
+ *
+ * @param lead Leading zero bits of the previous value's XOR window
+ *
+ * @param trail Trailing zero bits of the previous value's XOR window
+ */
+	struct tsstore_series {
+		char name[48];
+		int fd;
+		struct tsstore_block hdr;
+		uint8_t *buf;
+		uint64_t bits;
+		int64_t time;
+		int64_t delta;
+		uint64_t value;
+		int lead;
+		int trail;
+	};
+
+/** Columnar store of metric history, one file per metric
+ *
+ * Every metric is a column of its own, so reading one metric never
+ * decompresses another. A column is a sequence of blocks of up to
+ * TSSTORE_BLOCK_SAMPLES samples. Within a block time stamps are
+ * encoded as the difference of their differences and values as the
+ * XOR of their bits with the previous value's, as in Facebook's
+ * Gorilla. Readings taken at a steady rate that change slowly, as
+ * sensors give, take a few bits per sample rather than the hundreds of
+ * bytes of the JSON they came in.
+ *
+ * Samples are gathered in memory and a block is appended to its file
+ * in one write once full, or once tsstore_flush() is called. A crash
+ * loses the open blocks only; a block cut off part way is removed when
+ * the column is opened again.
+ *
+ * @param dir Directory of the column files
+ *
+ * @param series Per-metric state, @p nseries of them
+ *
+ * @param nseries Number of series
+ *
+ * @param blocks Blocks written
+ *
+ * @param error errno of the first failed write, 0 if none
+ */
+	struct tsstore {
+		char dir[256];
+		struct tsstore_series *series;
+		unsigned nseries;
+		unsigned long blocks;
+		int error;
+	};
+
+/** Reader of one column file
+ *
+ * @param fd Column file
+ *
+ * @param name Metric the column holds
+ *
+ * @param hdr Header of the current block
+ *
+ * @param offset Position of the next block header
+ *
+ * @param buf Encoded samples of the current block, TSSTORE_BLOCK_BYTES
+ *
+ * @param loaded True once the current block's samples are in @p buf
+ */
+	struct tsstore_reader {
+		int fd;
+		char name[48];
+		struct tsstore_block hdr;
+		uint64_t offset;
+		uint8_t *buf;
+		bool loaded;
+	};
+
+/** Open a store for appending, creating the directory if need be
+ *
+ * @param nseries Most metrics stored, TSSTORE_DEFAULT_SERIES if 0
+ *
+ * @return 0 on success, -1 on failure with errno set
+ */
+	int tsstore_open(struct tsstore *ts, const char *dir,
+			 unsigned nseries);
+
+/** Write the open blocks and close every column
+ *
+ * @return 0 if every block was written, -1 with errno set otherwise
+ */
+	int tsstore_close(struct tsstore *ts);
+
+/** Find the series of a metric, claiming a free one if it has none
+ *
+ * The column file is opened, or created, when the series is claimed,
+ * and new blocks are appended to what it holds.
+ *
+ * @return Index of the series, or -1 if every series is taken or the
+ * column could not be opened, with errno set
+ */
+	int tsstore_find(struct tsstore *ts, const char *name);
+
+/** Append a sample to a series, writing its block out once full
+ *
+ * @param timemillis Device time of the sample
+ *
+ * @return 0 on success, -1 if a block could not be written, with
+ * errno set
+ */
+	int tsstore_add(struct tsstore *ts, int s, int64_t timemillis,
+			double value);
+
+/** Write every open block out, however few samples it holds
+ *
+ * @return 0 on success, -1 with errno set if a write failed
+ */
+	int tsstore_flush(struct tsstore *ts);
+
+/** Path of the column file of a metric in a store's directory
+ *
+ * Characters that do not belong in a file name are replaced. The
+ * header of the file tells columns whose names replace alike apart.
+ *
+ * @param alt Number of the alternative name, 0 for the first choice
+ * and up to TSSTORE_MAX_ALT
+ *
+ * @return 0 on success, -1 if the path does not fit
+ */
+	int tsstore_path(char *path, size_t len, const char *dir,
+			 const char *name, int alt);
+
+/** Open a column file for reading, from its first block
+ *
+ * @return 0 on success, -1 on failure with errno set. EINVAL means
+ * the file is not a column.
+ */
+	int tsstore_reader_open(struct tsstore_reader *r, const char *path);
+
+	void tsstore_reader_close(struct tsstore_reader *r);
+
+/** Move to the next block that overlaps a time range
+ *
+ * Only block headers are read; the samples of blocks outside the
+ * range are skipped over.
+ *
+ * @param from Earliest device time of interest, INT64_MIN for all
+ *
+ * @param to Latest device time of interest, INT64_MAX for all
+ *
+ * @return 1 if a block was found, its header in @p r->hdr, 0 at the
+ * end of the column, or -1 with errno set. EINVAL means the column is
+ * damaged at this point.
+ */
+	int tsstore_reader_next(struct tsstore_reader *r, int64_t from,
+				int64_t to);
+
+/** Decode the samples of the current block
+ *
+ * @param times Receives @p r->hdr.count time stamps
+ *
+ * @param values Receives @p r->hdr.count values
+ *
+ * @return Number of samples decoded, or -1 with errno set
+ */
+	int tsstore_reader_decode(struct tsstore_reader *r, int64_t *times,
+				  double *values);
+
+#ifdef __cplusplus
+}
+#endif /* #ifdef __cplusplus */
+
+#endif /* #ifndef TSSTORE_H */